@@ -0,0 +1,738 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_cluster.cpp
+// Clusters of nav areas for hierarchical path finding
+
+#include "cbase.h"
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+#include "nav_cluster.h"
+
+// NOTE: This has to be the last file included!
+#include "tier0/memdbgon.h"
+
+
+ConVar nav_cluster_size( "nav_cluster_size", "512", FCVAR_GAMEDLL | FCVAR_CHEAT, "Largest extent of a cluster of nav areas, used when the clusters are built." );
+ConVar nav_cluster_max_areas( "nav_cluster_max_areas", "64", FCVAR_GAMEDLL | FCVAR_CHEAT, "Most nav areas in one cluster, used when the clusters are built." );
+ConVar nav_cluster_path_bound( "nav_cluster_path_bound", "1", FCVAR_GAMEDLL | FCVAR_CHEAT, "Paths found through the nav area clusters cost at most this many times the shortest path. Larger values search fewer portals." );
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * One way out of an area - across the floor, up or down a ladder, or on an elevator
+ */
+struct NavClusterStep
+{
+	CNavArea *area;
+	const CNavLadder *ladder;
+	float length;
+};
+
+typedef CUtlVectorFixedGrowable< NavClusterStep, 32 > NavClusterStepVector;
+
+
+//--------------------------------------------------------------------------------------------------------------
+static void AddStep( NavClusterStepVector *steps, CNavArea *area, const CNavLadder *ladder, float length )
+{
+	NavClusterStep &step = steps->Element( steps->AddToTail() );
+	step.area = area;
+	step.ladder = ladder;
+	step.length = length;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect the areas a path search can go to from 'area', the same ones NavAreaBuildPath() looks at
+ */
+static void CollectSteps( CNavArea *area, NavClusterStepVector *steps )
+{
+	steps->RemoveAll();
+
+	for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+	{
+		const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+		FOR_EACH_VEC( (*floorList), it )
+		{
+			const NavConnect &connect = floorList->Element( it );
+			if ( connect.area != area )
+			{
+				AddStep( steps, connect.area, NULL, connect.length );
+			}
+		}
+	}
+
+	// do not use the BEHIND connection, as its very hard to get to when going up a ladder
+	const NavLadderConnectVector *ladderList = area->GetLadders( CNavLadder::LADDER_UP );
+	FOR_EACH_VEC( (*ladderList), lit )
+	{
+		const CNavLadder *ladder = ladderList->Element( lit ).ladder;
+		if ( ladder->m_topForwardArea )
+			AddStep( steps, ladder->m_topForwardArea, ladder, -1.0f );
+		if ( ladder->m_topLeftArea )
+			AddStep( steps, ladder->m_topLeftArea, ladder, -1.0f );
+		if ( ladder->m_topRightArea )
+			AddStep( steps, ladder->m_topRightArea, ladder, -1.0f );
+	}
+
+	ladderList = area->GetLadders( CNavLadder::LADDER_DOWN );
+	FOR_EACH_VEC( (*ladderList), lit )
+	{
+		const CNavLadder *ladder = ladderList->Element( lit ).ladder;
+		if ( ladder->m_bottomArea )
+			AddStep( steps, ladder->m_bottomArea, ladder, -1.0f );
+	}
+
+	if ( area->GetElevator() )
+	{
+		const NavConnectVector &elevatorAreas = area->GetElevatorAreas();
+		FOR_EACH_VEC( elevatorAreas, eit )
+		{
+			if ( elevatorAreas[ eit ].area != area )
+			{
+				AddStep( steps, elevatorAreas[ eit ].area, NULL, -1.0f );
+			}
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if a path search can still go straight from 'fromArea' to 'toArea'
+ */
+static bool IsStep( CNavArea *fromArea, CNavArea *toArea )
+{
+	NavClusterStepVector steps;
+	CollectSteps( fromArea, &steps );
+
+	FOR_EACH_VEC( steps, it )
+	{
+		if ( steps[ it ].area == toArea )
+			return true;
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Lower the cost of reaching 'area' in a search, if 'cost' is better than what the search has
+ */
+static void RelaxArea( CNavPathSearch &search, CNavArea *area, CNavArea *parent, float cost, float costRemaining )
+{
+	if ( ( search.IsOpen( area ) || search.IsClosed( area ) ) && search.GetCostSoFar( area ) <= cost )
+		return;
+
+	search.SetCostSoFar( area, cost );
+	search.SetTotalCost( area, cost + costRemaining );
+	search.SetParent( area, parent );
+
+	if ( search.IsClosed( area ) )
+	{
+		search.RemoveFromClosedList( area );
+	}
+
+	if ( search.IsOpen( area ) )
+	{
+		search.UpdateOnOpenList( area );
+	}
+	else
+	{
+		search.AddToOpenList( area );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavClusterGraph::CNavClusterGraph( void )
+{
+	m_clusterCount = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::Reset( void )
+{
+	m_clusterCount = 0;
+	m_clusterAreas.Purge();
+	m_clusterFirstArea.Purge();
+	m_portals.Purge();
+	m_clusterFirstPortal.Purge();
+	m_edges.Purge();
+	m_areaCluster.Purge();
+	m_areaPortal.Purge();
+	m_isClusterBlocked.Purge();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavClusterGraph::GetCluster( const CNavArea *area ) const
+{
+	unsigned int id = area->GetID();
+	if ( id >= (unsigned int)m_areaCluster.Count() )
+		return -1;
+
+	return m_areaCluster[ id ];
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Search outwards from 'fromArea' without leaving its cluster, until 'toArea' is reached.
+ * If 'toArea' is NULL, find the cheapest way to every area of the cluster.
+ */
+void CNavClusterGraph::SearchCluster( CNavPathSearch &search, CNavArea *fromArea, CNavArea *toArea, bool useBlocking, int teamID, bool ignoreNavBlockers ) const
+{
+	int cluster = GetCluster( fromArea );
+
+	search.Reset();
+	search.SetParent( fromArea, NULL );
+	search.SetCostSoFar( fromArea, 0.0f );
+	search.SetTotalCost( fromArea, 0.0f );
+	search.AddToOpenList( fromArea );
+
+	NavClusterStepVector steps;
+	while( !search.IsOpenListEmpty() )
+	{
+		CNavArea *area = search.PopOpenList();
+		search.AddToClosedList( area );
+
+		if ( area == toArea )
+			return;
+
+		float costSoFar = search.GetCostSoFar( area );
+
+		CollectSteps( area, &steps );
+		FOR_EACH_VEC( steps, it )
+		{
+			const NavClusterStep &step = steps[ it ];
+			CNavArea *newArea = step.area;
+
+			if ( newArea == search.GetParent( area ) )
+				continue;
+
+			if ( GetCluster( newArea ) != cluster )
+				continue;
+
+			if ( useBlocking && newArea->IsBlocked( teamID, ignoreNavBlockers ) )
+				continue;
+
+			float newCostSoFar = ShortestPathCost::ComputeCost( newArea, area, step.ladder, step.length, costSoFar );
+			float newCostRemaining = ( toArea ) ? ( newArea->GetCenter() - toArea->GetCenter() ).Length() : 0.0f;
+			RelaxArea( search, newArea, area, newCostSoFar, newCostRemaining );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Append the areas from 'fromArea' to 'toArea', both in the same cluster, to the path.
+ * The path must already end with 'fromArea'.
+ */
+bool CNavClusterGraph::AppendClusterPath( CNavPathSearch &search, CNavArea *fromArea, CNavArea *toArea, CUtlVector< CNavArea * > *path, int teamID, bool ignoreNavBlockers ) const
+{
+	if ( fromArea == toArea )
+		return true;
+
+	SearchCluster( search, fromArea, toArea, true, teamID, ignoreNavBlockers );
+
+	CUtlVector< CNavArea * > segment;
+	if ( !search.IsClosed( toArea ) || !search.BuildAreaPath( toArea, &segment ) )
+		return false;
+
+	for( int i=1; i<segment.Count(); ++i )
+	{
+		path->AddToTail( segment[i] );
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Group the areas into clusters by flood filling across the floor from a seed area, up to
+ * nav_cluster_size across and nav_cluster_max_areas areas. Then find the portals and the
+ * cheapest way between every two portals of each cluster.
+ */
+void CNavClusterGraph::Build( void )
+{
+	Reset();
+
+	const float halfSize = 0.5f * nav_cluster_size.GetFloat();
+	const int maxAreas = MAX( 1, nav_cluster_max_areas.GetInt() );
+
+	int idCount = CNavArea::GetNextID();
+	m_areaCluster.SetCount( idCount );
+	for( int i=0; i<idCount; ++i )
+	{
+		m_areaCluster[i] = -1;
+	}
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *seed = TheNavAreas[ it ];
+		if ( m_areaCluster[ seed->GetID() ] >= 0 )
+			continue;
+
+		int cluster = m_clusterCount++;
+		int first = m_clusterAreas.Count();
+		m_clusterFirstArea.AddToTail( first );
+
+		m_areaCluster[ seed->GetID() ] = cluster;
+		m_clusterAreas.AddToTail( seed );
+
+		// the tail of the cluster's areas is the flood fill queue
+		for( int i=first; i<m_clusterAreas.Count() && m_clusterAreas.Count() - first < maxAreas; ++i )
+		{
+			CNavArea *area = m_clusterAreas[i];
+
+			for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+			{
+				const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+				FOR_EACH_VEC( (*floorList), fit )
+				{
+					if ( m_clusterAreas.Count() - first >= maxAreas )
+						break;
+
+					CNavArea *adjArea = floorList->Element( fit ).area;
+					if ( m_areaCluster[ adjArea->GetID() ] >= 0 )
+						continue;
+
+					Vector delta = adjArea->GetCenter() - seed->GetCenter();
+					if ( fabs( delta.x ) > halfSize || fabs( delta.y ) > halfSize || fabs( delta.z ) > halfSize )
+						continue;
+
+					m_areaCluster[ adjArea->GetID() ] = cluster;
+					m_clusterAreas.AddToTail( adjArea );
+				}
+			}
+		}
+	}
+	m_clusterFirstArea.AddToTail( m_clusterAreas.Count() );
+
+	// an area is a portal if a step leads out of its cluster, or into it from another one
+	CUtlVector< bool > isPortal;
+	isPortal.SetCount( idCount );
+	for( int i=0; i<idCount; ++i )
+	{
+		isPortal[i] = false;
+	}
+
+	NavClusterStepVector steps;
+	FOR_EACH_VEC( m_clusterAreas, ait )
+	{
+		CNavArea *area = m_clusterAreas[ ait ];
+		CollectSteps( area, &steps );
+		FOR_EACH_VEC( steps, sit )
+		{
+			if ( GetCluster( steps[ sit ].area ) != GetCluster( area ) )
+			{
+				isPortal[ area->GetID() ] = true;
+				isPortal[ steps[ sit ].area->GetID() ] = true;
+			}
+		}
+	}
+
+	m_areaPortal.SetCount( idCount );
+	for( int i=0; i<idCount; ++i )
+	{
+		m_areaPortal[i] = -1;
+	}
+
+	for( int c=0; c<m_clusterCount; ++c )
+	{
+		m_clusterFirstPortal.AddToTail( m_portals.Count() );
+		for( int i=m_clusterFirstArea[c]; i<m_clusterFirstArea[c+1]; ++i )
+		{
+			CNavArea *area = m_clusterAreas[i];
+			if ( isPortal[ area->GetID() ] )
+			{
+				int p = m_portals.AddToTail();
+				m_portals[p].m_area = area;
+				m_areaPortal[ area->GetID() ] = p;
+			}
+		}
+	}
+	m_clusterFirstPortal.AddToTail( m_portals.Count() );
+
+	// link every portal to the others of its cluster, and across to the next cluster
+	CNavPathSearch search;
+	FOR_EACH_VEC( m_portals, p )
+	{
+		Portal &portal = m_portals[p];
+		portal.m_firstEdge = m_edges.Count();
+
+		int cluster = GetCluster( portal.m_area );
+		SearchCluster( search, portal.m_area, NULL, false, TEAM_ANY, false );
+		for( int q=m_clusterFirstPortal[ cluster ]; q<m_clusterFirstPortal[ cluster+1 ]; ++q )
+		{
+			if ( q == p || !search.IsClosed( m_portals[q].m_area ) )
+				continue;
+
+			Edge &edge = m_edges[ m_edges.AddToTail() ];
+			edge.m_toPortal = q;
+			edge.m_cost = search.GetCostSoFar( m_portals[q].m_area );
+			edge.m_isCrossing = false;
+		}
+
+		CollectSteps( portal.m_area, &steps );
+		FOR_EACH_VEC( steps, sit )
+		{
+			const NavClusterStep &step = steps[ sit ];
+			if ( GetCluster( step.area ) == cluster )
+				continue;
+
+			Edge &edge = m_edges[ m_edges.AddToTail() ];
+			edge.m_toPortal = m_areaPortal[ step.area->GetID() ];
+			edge.m_cost = ShortestPathCost::ComputeCost( step.area, portal.m_area, step.ladder, step.length, 0.0f );
+			edge.m_isCrossing = true;
+		}
+
+		portal.m_edgeCount = m_edges.Count() - portal.m_firstEdge;
+	}
+
+	m_isClusterBlocked.SetCount( m_clusterCount );
+	for( int c=0; c<m_clusterCount; ++c )
+	{
+		m_isClusterBlocked[c] = false;
+		for( int i=m_clusterFirstArea[c]; i<m_clusterFirstArea[c+1]; ++i )
+		{
+			if ( m_clusterAreas[i]->IsBlocked( TEAM_ANY ) )
+			{
+				m_isClusterBlocked[c] = true;
+				break;
+			}
+		}
+	}
+
+	DevMsg( "Nav mesh clusters: %d areas in %d clusters, %d portals, %d portal links\n", m_clusterAreas.Count(), m_clusterCount, m_portals.Count(), m_edges.Count() );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::Save( CUtlBuffer &fileBuffer ) const
+{
+	fileBuffer.PutUnsignedInt( m_clusterCount );
+
+	for( int c=0; c<m_clusterCount; ++c )
+	{
+		fileBuffer.PutUnsignedInt( m_clusterFirstArea[c+1] - m_clusterFirstArea[c] );
+		for( int i=m_clusterFirstArea[c]; i<m_clusterFirstArea[c+1]; ++i )
+		{
+			fileBuffer.PutUnsignedInt( m_clusterAreas[i]->GetID() );
+		}
+	}
+
+	fileBuffer.PutUnsignedInt( m_portals.Count() );
+	FOR_EACH_VEC( m_portals, p )
+	{
+		const Portal &portal = m_portals[p];
+		fileBuffer.PutUnsignedInt( portal.m_area->GetID() );
+		fileBuffer.PutUnsignedInt( portal.m_edgeCount );
+		for( int e=portal.m_firstEdge; e<portal.m_firstEdge + portal.m_edgeCount; ++e )
+		{
+			fileBuffer.PutUnsignedInt( m_edges[e].m_toPortal );
+			fileBuffer.PutFloat( m_edges[e].m_cost );
+			fileBuffer.PutUnsignedChar( m_edges[e].m_isCrossing );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the clusters saved with the mesh. Invoked after the areas have been loaded.
+ * If the data doesn't match the areas, it is dropped and the clusters get built again.
+ */
+void CNavClusterGraph::Load( CUtlBuffer &fileBuffer, unsigned int version )
+{
+	Reset();
+
+	bool isValid = true;
+
+	unsigned int clusterCount = fileBuffer.GetUnsignedInt();
+	for( unsigned int c=0; c<clusterCount && fileBuffer.IsValid(); ++c )
+	{
+		m_clusterFirstArea.AddToTail( m_clusterAreas.Count() );
+
+		unsigned int count = fileBuffer.GetUnsignedInt();
+		for( unsigned int i=0; i<count && fileBuffer.IsValid(); ++i )
+		{
+			CNavArea *area = TheNavMesh->GetNavAreaByID( fileBuffer.GetUnsignedInt() );
+			if ( area )
+			{
+				m_clusterAreas.AddToTail( area );
+			}
+			else
+			{
+				isValid = false;
+			}
+		}
+	}
+	m_clusterFirstArea.AddToTail( m_clusterAreas.Count() );
+	m_clusterCount = clusterCount;
+
+	unsigned int portalCount = fileBuffer.GetUnsignedInt();
+	for( unsigned int p=0; p<portalCount && fileBuffer.IsValid(); ++p )
+	{
+		Portal &portal = m_portals[ m_portals.AddToTail() ];
+		portal.m_area = TheNavMesh->GetNavAreaByID( fileBuffer.GetUnsignedInt() );
+		portal.m_firstEdge = m_edges.Count();
+		portal.m_edgeCount = fileBuffer.GetUnsignedInt();
+		if ( portal.m_area == NULL )
+		{
+			isValid = false;
+		}
+
+		for( int e=0; e<portal.m_edgeCount && fileBuffer.IsValid(); ++e )
+		{
+			Edge &edge = m_edges[ m_edges.AddToTail() ];
+			edge.m_toPortal = fileBuffer.GetUnsignedInt();
+			edge.m_cost = fileBuffer.GetFloat();
+			edge.m_isCrossing = fileBuffer.GetUnsignedChar() != 0;
+			if ( edge.m_toPortal < 0 || edge.m_toPortal >= (int)portalCount )
+			{
+				isValid = false;
+			}
+		}
+	}
+
+	if ( !fileBuffer.IsValid() || !isValid || m_clusterAreas.Count() != TheNavAreas.Count() )
+	{
+		Reset();
+		return;
+	}
+
+	BindClusters();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::BindClusters( void )
+{
+	int idCount = CNavArea::GetNextID();
+	m_areaCluster.SetCount( idCount );
+	m_areaPortal.SetCount( idCount );
+	for( int i=0; i<idCount; ++i )
+	{
+		m_areaCluster[i] = -1;
+		m_areaPortal[i] = -1;
+	}
+
+	m_isClusterBlocked.SetCount( m_clusterCount );
+	for( int c=0; c<m_clusterCount; ++c )
+	{
+		m_isClusterBlocked[c] = false;
+		for( int i=m_clusterFirstArea[c]; i<m_clusterFirstArea[c+1]; ++i )
+		{
+			m_areaCluster[ m_clusterAreas[i]->GetID() ] = c;
+			if ( m_clusterAreas[i]->IsBlocked( TEAM_ANY ) )
+			{
+				m_isClusterBlocked[c] = true;
+			}
+		}
+	}
+
+	// portals are stored one cluster after another
+	m_clusterFirstPortal.SetCount( m_clusterCount + 1 );
+	int p = 0;
+	for( int c=0; c<m_clusterCount; ++c )
+	{
+		m_clusterFirstPortal[c] = p;
+		while( p < m_portals.Count() && GetCluster( m_portals[p].m_area ) == c )
+		{
+			m_areaPortal[ m_portals[p].m_area->GetID() ] = p;
+			++p;
+		}
+	}
+	m_clusterFirstPortal[ m_clusterCount ] = p;
+
+	if ( p != m_portals.Count() )
+	{
+		Reset();
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::OnAreaBlocked( CNavArea *area )
+{
+	int cluster = GetCluster( area );
+	if ( cluster >= 0 )
+	{
+		m_isClusterBlocked[ cluster ] = true;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::OnAreaUnblocked( CNavArea *area )
+{
+	int cluster = GetCluster( area );
+	if ( cluster < 0 || !m_isClusterBlocked[ cluster ] )
+		return;
+
+	for( int i=m_clusterFirstArea[ cluster ]; i<m_clusterFirstArea[ cluster+1 ]; ++i )
+	{
+		if ( m_clusterAreas[i]->IsBlocked( TEAM_ANY ) )
+			return;
+	}
+
+	// the precomputed portal costs are good again
+	m_isClusterBlocked[ cluster ] = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavClusterGraph::BuildPath( CNavPathSearch &portalSearch, CNavPathSearch &areaSearch, CNavArea *startArea, CNavArea *goalArea,
+								  CUtlVector< CNavArea * > *path, int teamID, bool ignoreNavBlockers ) const
+{
+	VPROF_BUDGET( "CNavClusterGraph::BuildPath", "NextBotSpiky" );
+
+	path->RemoveAll();
+
+	if ( startArea == NULL || goalArea == NULL )
+		return false;
+
+	int startCluster = GetCluster( startArea );
+	int goalCluster = GetCluster( goalArea );
+	if ( startCluster < 0 || goalCluster < 0 || startCluster == goalCluster )
+		return false;
+
+	if ( goalArea->IsBlocked( teamID, ignoreNavBlockers ) )
+		return false;
+
+	// weighting the estimate by the bound keeps the path within the bound of the shortest one
+	const float bound = MAX( 1.0f, nav_cluster_path_bound.GetFloat() );
+	const Vector &goalPos = goalArea->GetCenter();
+
+	// start from the portals of the start cluster, at their actual cost from the start area
+	portalSearch.Reset();
+	SearchCluster( areaSearch, startArea, NULL, true, teamID, ignoreNavBlockers );
+	for( int p=m_clusterFirstPortal[ startCluster ]; p<m_clusterFirstPortal[ startCluster+1 ]; ++p )
+	{
+		CNavArea *area = m_portals[p].m_area;
+		if ( areaSearch.IsClosed( area ) )
+		{
+			RelaxArea( portalSearch, area, NULL, areaSearch.GetCostSoFar( area ), bound * ( area->GetCenter() - goalPos ).Length() );
+		}
+	}
+
+	bool isGoalReached = false;
+	while( !portalSearch.IsOpenListEmpty() )
+	{
+		CNavArea *area = portalSearch.PopOpenList();
+		portalSearch.AddToClosedList( area );
+
+		if ( area == goalArea )
+		{
+			isGoalReached = true;
+			break;
+		}
+
+		int cluster = GetCluster( area );
+		float costSoFar = portalSearch.GetCostSoFar( area );
+
+		// portals of the goal cluster lead to the goal area itself
+		if ( cluster == goalCluster )
+		{
+			SearchCluster( areaSearch, area, goalArea, true, teamID, ignoreNavBlockers );
+			if ( areaSearch.IsClosed( goalArea ) )
+			{
+				RelaxArea( portalSearch, goalArea, area, costSoFar + areaSearch.GetCostSoFar( goalArea ), 0.0f );
+			}
+		}
+
+		int p = m_areaPortal[ area->GetID() ];
+		if ( p < 0 )
+			continue;
+
+		// the precomputed costs across a cluster only hold while nothing in it is blocked
+		bool isBlocked = m_isClusterBlocked[ cluster ];
+		if ( isBlocked )
+		{
+			SearchCluster( areaSearch, area, NULL, true, teamID, ignoreNavBlockers );
+			for( int q=m_clusterFirstPortal[ cluster ]; q<m_clusterFirstPortal[ cluster+1 ]; ++q )
+			{
+				CNavArea *toArea = m_portals[q].m_area;
+				if ( q != p && areaSearch.IsClosed( toArea ) )
+				{
+					RelaxArea( portalSearch, toArea, area, costSoFar + areaSearch.GetCostSoFar( toArea ), bound * ( toArea->GetCenter() - goalPos ).Length() );
+				}
+			}
+		}
+
+		const Portal &portal = m_portals[p];
+		for( int e=portal.m_firstEdge; e<portal.m_firstEdge + portal.m_edgeCount; ++e )
+		{
+			const Edge &edge = m_edges[e];
+			if ( isBlocked && !edge.m_isCrossing )
+				continue;
+
+			CNavArea *toArea = m_portals[ edge.m_toPortal ].m_area;
+			if ( edge.m_isCrossing && toArea->IsBlocked( teamID, ignoreNavBlockers ) )
+				continue;
+
+			RelaxArea( portalSearch, toArea, area, costSoFar + edge.m_cost, bound * ( toArea->GetCenter() - goalPos ).Length() );
+		}
+	}
+
+	if ( !isGoalReached )
+		return false;
+
+	// walk back over the portals, then fill in the areas between them
+	CUtlVectorFixedGrowable< CNavArea *, 64 > route;
+	for( CNavArea *area = goalArea; area && route.Count() <= m_portals.Count(); area = portalSearch.GetParent( area ) )
+	{
+		route.AddToHead( area );
+	}
+
+	path->AddToTail( startArea );
+	CNavArea *fromArea = startArea;
+	FOR_EACH_VEC( route, rit )
+	{
+		CNavArea *toArea = route[ rit ];
+		if ( GetCluster( toArea ) != GetCluster( fromArea ) )
+		{
+			// a direct connection into the next cluster, unless it was removed since the clusters were built
+			if ( !IsStep( fromArea, toArea ) )
+			{
+				path->RemoveAll();
+				return false;
+			}
+
+			path->AddToTail( toArea );
+		}
+		else if ( !AppendClusterPath( areaSearch, fromArea, toArea, path, teamID, ignoreNavBlockers ) )
+		{
+			// the mesh changed under the clusters
+			path->RemoveAll();
+			return false;
+		}
+
+		fromArea = toArea;
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavBuildClusters( void )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavMesh->BuildClusters();
+	Msg( "Built %d nav area clusters.\n", TheNavMesh->GetClusterGraph().GetClusterCount() );
+}
+static ConCommand nav_build_clusters( "nav_build_clusters", CommandNavBuildClusters, "Groups the nav areas into clusters for hierarchical path finding. The clusters are saved with the mesh.", FCVAR_GAMEDLL | FCVAR_CHEAT );
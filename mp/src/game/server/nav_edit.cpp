@@ -581,6 +581,7 @@ void CNavMesh::CommandNavBuildLadder( void )
 	bottom.z = bottomEdge.z;
 
 	CreateLadder( topEdge, bottomEdge, leftEdge.DistTo( rightEdge ), m_ladderNormal.AsVector2D(), 0.0f );
+	OnEditConnectNotify();
 }
 
 
@@ -2506,6 +2507,9 @@ void CNavMesh::CommandNavMakeSniperSpots( void )
 		player->EmitSound( "EDIT_SPLIT.NoMarkedArea" );
 	}
 
+	// the split areas are disconnected from each other
+	OnEditConnectNotify();
+
 	StripNavigationAreas();
 
 	SetMarkedArea( NULL );			// unmark the mark area
@@ -3005,6 +3009,8 @@ void CNavMesh::CommandNavConnect( void )
 		}
 	}
 
+	OnEditConnectNotify();
+
 	SetMarkedArea( NULL );			// unmark the mark area
 	m_markedCorner = NUM_CORNERS;	// clear the corner selection
 	ClearSelectedSet();
@@ -3102,6 +3108,8 @@ void CNavMesh::CommandNavDisconnect( void )
 		}
 	}
 
+	OnEditConnectNotify();
+
 	ClearSelectedSet();
 	SetMarkedArea( NULL );			// unmark the mark area
 	m_markedCorner = NUM_CORNERS;	// clear the corner selection
@@ -3149,6 +3157,8 @@ void CNavMesh::CommandNavDisconnectOutgoingOneWays( void )
 			}
 		}
 	}
+
+	OnEditConnectNotify();
 	player->EmitSound( "EDIT_DISCONNECT.MarkedArea" );
 
 	ClearSelectedSet();
@@ -3252,6 +3262,8 @@ void CNavMesh::CommandNavToggleAttribute( NavAttributeType attribute )
 		ClearSelectedSet();		
 	}
 
+	OnEditConnectNotify();
+
 	SetMarkedArea( NULL );			// unmark the mark area
 	m_markedCorner = NUM_CORNERS;	// clear the corner selection
 }
@@ -3719,6 +3731,8 @@ void CNavMesh::CommandNavLadderFlip( void )
 		area = m_selectedLadder->m_topRightArea;
 		m_selectedLadder->m_topRightArea = m_selectedLadder->m_topLeftArea;
 		m_selectedLadder->m_topLeftArea = area;
+
+		OnEditConnectNotify();
 	}
 
 	SetMarkedArea( NULL );			// unmark the mark area
@@ -3916,6 +3930,10 @@ bool CNavMesh::IsInSelectedSet( const CNavArea *area ) const
  */
 void CNavMesh::OnEditCreateNotify( CNavArea *newArea )
 {
+	// the clusters and cached paths no longer match the mesh
+	m_clusters.Reset();
+	TheNavPathCache.Clear();
+
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
 		TheNavAreas[ it ]->OnEditCreateNotify( newArea );
@@ -3939,6 +3957,8 @@ void CNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
 
 	m_avoidanceObstacleAreas.FindAndRemove( deadArea );
 	m_blockedAreas.FindAndRemove( deadArea );
+	m_clusters.Reset();
+	TheNavPathCache.Clear();
 
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
@@ -3957,6 +3977,19 @@ void CNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
  */
 void CNavMesh::OnEditDestroyNotify( CNavLadder *deadLadder )
 {
+	OnEditConnectNotify();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Invoked when area connections, IDs, or attributes that path costs depend on have just been changed in edit mode
+ */
+void CNavMesh::OnEditConnectNotify( void )
+{
+	// the clusters and cached paths were built from the old connections
+	m_clusters.Reset();
+	TheNavPathCache.Clear();
 }
 
 
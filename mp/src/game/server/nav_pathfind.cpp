@@ -0,0 +1,522 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_pathfind.cpp
+// Path searches that can run alongside each other
+
+#include "cbase.h"
+#include "tier0/tslist.h"
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+#include "nav_cluster.h"
+
+// NOTE: This has to be the last file included!
+#include "tier0/memdbgon.h"
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::CNavPathSearch( void )
+{
+	m_marker = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Forget the last search. Its per-area state is dropped just by moving to a new marker.
+ */
+void CNavPathSearch::Reset( void )
+{
+	int count = CNavArea::GetNextID();
+	if ( m_state.Count() < count )
+	{
+		int oldCount = m_state.Count();
+		m_state.AddMultipleToTail( count - oldCount );
+		for( int i=oldCount; i<count; ++i )
+		{
+			m_state[i].m_marker = 0;
+		}
+	}
+
+	++m_marker;
+	if ( m_marker == 0 )
+	{
+		// wrapped around - old markers could look current again
+		for( int i=0; i<m_state.Count(); ++i )
+		{
+			m_state[i].m_marker = 0;
+		}
+		m_marker = 1;
+	}
+
+	m_openList.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SwapOpen( int i, int j )
+{
+	CNavArea *area = m_openList[i];
+	m_openList[i] = m_openList[j];
+	m_openList[j] = area;
+
+	m_state[ m_openList[i]->GetID() ].m_openIndex = i;
+	m_state[ m_openList[j]->GetID() ].m_openIndex = j;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SiftUp( int i )
+{
+	while( i > 0 )
+	{
+		int parent = ( i - 1 ) / 2;
+		if ( !IsCheaper( i, parent ) )
+			break;
+
+		SwapOpen( i, parent );
+		i = parent;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SiftDown( int i )
+{
+	int count = m_openList.Count();
+	while( true )
+	{
+		int child = 2 * i + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && IsCheaper( child + 1, child ) )
+			++child;
+
+		if ( !IsCheaper( child, i ) )
+			break;
+
+		SwapOpen( i, child );
+		i = child;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::AddToOpenList( CNavArea *area )
+{
+	AreaState &state = Visit( area );
+	Assert( state.m_openIndex < 0 );
+
+	state.m_openIndex = m_openList.AddToTail( area );
+	SiftUp( state.m_openIndex );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::UpdateOnOpenList( CNavArea *area )
+{
+	// costs only ever go down while on the open list
+	const AreaState *state = FindState( area );
+	Assert( state && state->m_openIndex >= 0 );
+	if ( state && state->m_openIndex >= 0 )
+	{
+		SiftUp( state->m_openIndex );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavArea *CNavPathSearch::PopOpenList( void )
+{
+	if ( m_openList.Count() == 0 )
+		return NULL;
+
+	CNavArea *area = m_openList[0];
+
+	int last = m_openList.Count() - 1;
+	if ( last > 0 )
+	{
+		SwapOpen( 0, last );
+	}
+	m_openList.FastRemove( last );
+	if ( last > 0 )
+	{
+		SiftDown( 0 );
+	}
+
+	m_state[ area->GetID() ].m_openIndex = -1;
+	return area;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect the areas along the path the last search found, from its start area to 'goalArea'.
+ * Returns false if the search never reached 'goalArea'.
+ */
+bool CNavPathSearch::BuildAreaPath( CNavArea *goalArea, CUtlVector< CNavArea * > *path ) const
+{
+	path->RemoveAll();
+
+	if ( goalArea == NULL || !IsVisited( goalArea ) )
+		return false;
+
+	// parents can't form a loop, but don't trust that blindly
+	for( CNavArea *area = goalArea; area && path->Count() <= m_state.Count(); area = GetParent( area ) )
+	{
+		path->AddToTail( area );
+	}
+
+	// reverse into start-to-goal order
+	for( int i=0, j=path->Count()-1; i<j; ++i, --j )
+	{
+		CNavArea *area = path->Element( i );
+		path->Element( i ) = path->Element( j );
+		path->Element( j ) = area;
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+// Searches are pooled so the per-area arrays only get allocated once per thread
+static CTSPool< CNavPathSearch > s_navPathSearchPool;
+
+ConVar nav_path_cache( "nav_path_cache", "1", FCVAR_GAMEDLL | FCVAR_CHEAT, "Path searches between two areas reuse the paths already found with the same cost functor." );
+ConVar nav_path_cache_size( "nav_path_cache_size", "1024", FCVAR_GAMEDLL | FCVAR_CHEAT, "Most paths kept in the nav path cache." );
+ConVar nav_cluster_paths( "nav_cluster_paths", "1", FCVAR_GAMEDLL | FCVAR_CHEAT, "Path searches between areas in different clusters go over the cluster portals first." );
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find a path from 'startArea' to 'goalArea' over the cluster portals, then through the areas
+ * of each cluster along the way. Returns false if there is no path, or if the clusters can't
+ * answer (turned off, not built, same cluster, or the mesh was edited since).
+ */
+bool NavAreaBuildClusterPath( CNavArea *startArea, CNavArea *goalArea, CUtlVector< CNavArea * > *path, int teamID, bool ignoreNavBlockers )
+{
+	const CNavClusterGraph &clusters = TheNavMesh->GetClusterGraph();
+	if ( !nav_cluster_paths.GetBool() || !clusters.IsBuilt() || startArea == NULL || goalArea == NULL )
+		return false;
+
+	CNavPathSearch *portalSearch = s_navPathSearchPool.GetObject();
+	CNavPathSearch *areaSearch = s_navPathSearchPool.GetObject();
+
+	bool isPathFound = clusters.BuildPath( *portalSearch, *areaSearch, startArea, goalArea, path, teamID, ignoreNavBlockers );
+
+	s_navPathSearchPool.PutObject( areaSearch );
+	s_navPathSearchPool.PutObject( portalSearch );
+
+	return isPathFound;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find how a search would go from 'fromArea' straight to 'toArea', trying the same connections
+ * in the same order as NavAreaBuildPathInternal()
+ */
+bool NavAreaFindStep( CNavArea *fromArea, CNavArea *toArea, NavPathStep *step )
+{
+	step->ladder = NULL;
+	step->elevator = NULL;
+	step->length = -1.0f;
+
+	for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+	{
+		const NavConnectVector *floorList = fromArea->GetAdjacentAreas( (NavDirType)dir );
+		FOR_EACH_VEC( (*floorList), it )
+		{
+			if ( floorList->Element( it ).area == toArea )
+			{
+				step->how = (NavTraverseType)dir;
+				step->length = floorList->Element( it ).length;
+				return true;
+			}
+		}
+	}
+
+	const NavLadderConnectVector *ladderList = fromArea->GetLadders( CNavLadder::LADDER_UP );
+	FOR_EACH_VEC( (*ladderList), lit )
+	{
+		const CNavLadder *ladder = ladderList->Element( lit ).ladder;
+		if ( ladder->m_topForwardArea == toArea || ladder->m_topLeftArea == toArea || ladder->m_topRightArea == toArea )
+		{
+			step->how = GO_LADDER_UP;
+			step->ladder = ladder;
+			return true;
+		}
+	}
+
+	ladderList = fromArea->GetLadders( CNavLadder::LADDER_DOWN );
+	FOR_EACH_VEC( (*ladderList), lit )
+	{
+		const CNavLadder *ladder = ladderList->Element( lit ).ladder;
+		if ( ladder->m_bottomArea == toArea )
+		{
+			step->how = GO_LADDER_DOWN;
+			step->ladder = ladder;
+			return true;
+		}
+	}
+
+	if ( fromArea->GetElevator() )
+	{
+		const NavConnectVector &elevatorAreas = fromArea->GetElevatorAreas();
+		FOR_EACH_VEC( elevatorAreas, eit )
+		{
+			if ( elevatorAreas[ eit ].area == toArea )
+			{
+				step->how = ( toArea->GetCenter().z > fromArea->GetCenter().z ) ? GO_ELEVATOR_UP : GO_ELEVATOR_DOWN;
+				step->elevator = fromArea->GetElevator();
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Cache the path from the start of the last area search to 'endArea'
+ */
+void NavAreaStorePath( const NavPathCacheKey &key, CNavArea *endArea, bool isPathFound )
+{
+	CUtlVector< CNavArea * > path;
+
+	// parents can't form a loop, but don't trust that blindly
+	for( CNavArea *area = endArea; area && path.Count() <= TheNavAreas.Count(); area = area->GetParent() )
+	{
+		path.AddToHead( area );
+	}
+
+	// nothing changes blocking during a search, so this tells if it had to go around anything
+	TheNavPathCache.Store( key, path, isPathFound, TheNavMesh->HasBlockedOrObstructedAreas() );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathCache TheNavPathCache;
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathCache::CNavPathCache( void ) : m_entries( KeyLessFunc )
+{
+	m_useCount = 0;
+	ResetStats();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathCache::~CNavPathCache()
+{
+	Clear();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavPathCache::KeyLessFunc( const NavPathCacheKey &lhs, const NavPathCacheKey &rhs )
+{
+	if ( lhs.m_startArea != rhs.m_startArea )
+		return lhs.m_startArea < rhs.m_startArea;
+
+	if ( lhs.m_goalArea != rhs.m_goalArea )
+		return lhs.m_goalArea < rhs.m_goalArea;
+
+	if ( lhs.m_costClass != rhs.m_costClass )
+		return lhs.m_costClass < rhs.m_costClass;
+
+	if ( lhs.m_teamID != rhs.m_teamID )
+		return lhs.m_teamID < rhs.m_teamID;
+
+	return lhs.m_ignoreNavBlockers < rhs.m_ignoreNavBlockers;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavPathCache::Find( const NavPathCacheKey &key, CUtlVector< CNavArea * > *path, bool *isPathFound )
+{
+	if ( !nav_path_cache.GetBool() )
+		return false;
+
+	AUTO_LOCK( m_mutex );
+
+	unsigned short index = m_entries.Find( key );
+	if ( index == m_entries.InvalidIndex() )
+	{
+		++m_missCount;
+		return false;
+	}
+
+	Entry *entry = m_entries[ index ];
+	entry->m_lastUsed = ++m_useCount;
+
+	path->CopyArray( entry->m_path.Base(), entry->m_path.Count() );
+	*isPathFound = entry->m_isPathFound;
+
+	++m_hitCount;
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathCache::Store( const NavPathCacheKey &key, const CUtlVector< CNavArea * > &path, bool isPathFound, bool isDetour )
+{
+	if ( !nav_path_cache.GetBool() )
+		return;
+
+	AUTO_LOCK( m_mutex );
+
+	unsigned short index = m_entries.Find( key );
+	if ( index == m_entries.InvalidIndex() )
+	{
+		// make room by dropping the path that went unused the longest
+		int maxCount = clamp( nav_path_cache_size.GetInt(), 0, (int)m_entries.InvalidIndex() - 1 );
+		while( m_entries.Count() > 0 && m_entries.Count() >= maxCount )
+		{
+			unsigned short oldest = m_entries.InvalidIndex();
+			for( unsigned short i=0; i<m_entries.MaxElement(); ++i )
+			{
+				if ( m_entries.IsValidIndex( i ) && ( oldest == m_entries.InvalidIndex() || m_entries[i]->m_lastUsed < m_entries[ oldest ]->m_lastUsed ) )
+				{
+					oldest = i;
+				}
+			}
+
+			RemoveEntry( oldest );
+			++m_evictCount;
+		}
+
+		if ( maxCount <= 0 )
+			return;
+
+		index = m_entries.Insert( key, new Entry );
+	}
+
+	Entry *entry = m_entries[ index ];
+	entry->m_path.CopyArray( path.Base(), path.Count() );
+	entry->m_isPathFound = isPathFound;
+	entry->m_isDetour = isDetour;
+	entry->m_lastUsed = ++m_useCount;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathCache::RemoveEntry( int index )
+{
+	delete m_entries[ index ];
+	m_entries.RemoveAt( index );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathCache::Clear( void )
+{
+	AUTO_LOCK( m_mutex );
+
+	for( unsigned short i=0; i<m_entries.MaxElement(); ++i )
+	{
+		if ( m_entries.IsValidIndex( i ) )
+		{
+			delete m_entries[i];
+		}
+	}
+	m_entries.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Drop every path that goes through the area, or ends at it
+ */
+void CNavPathCache::OnAreaBlocked( CNavArea *area )
+{
+	AUTO_LOCK( m_mutex );
+
+	for( unsigned short i=0; i<m_entries.MaxElement(); ++i )
+	{
+		if ( m_entries.IsValidIndex( i ) && ( m_entries.Key( i ).m_goalArea == area || m_entries[i]->m_path.HasElement( area ) ) )
+		{
+			RemoveEntry( i );
+			++m_invalidateCount;
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A path that had to avoid something might be shorter now, and a goal that couldn't be
+ * reached might be reachable. Paths found with nothing in the way can't get any better.
+ */
+void CNavPathCache::OnAreaUnblocked( CNavArea *area )
+{
+	AUTO_LOCK( m_mutex );
+
+	for( unsigned short i=0; i<m_entries.MaxElement(); ++i )
+	{
+		if ( m_entries.IsValidIndex( i ) && m_entries[i]->m_isDetour )
+		{
+			RemoveEntry( i );
+			++m_invalidateCount;
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathCache::PrintStats( void )
+{
+	AUTO_LOCK( m_mutex );
+
+	unsigned int queryCount = m_hitCount + m_missCount;
+	Msg( "Nav path cache: %d paths (max %d)\n", m_entries.Count(), nav_path_cache_size.GetInt() );
+	Msg( "  %u queries, %u hits, %u misses (%.1f%% hit rate)\n", queryCount, m_hitCount, m_missCount, ( queryCount ) ? 100.0f * m_hitCount / queryCount : 0.0f );
+	Msg( "  %u paths invalidated by blocking changes, %u evicted\n", m_invalidateCount, m_evictCount );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathCache::ResetStats( void )
+{
+	m_hitCount = 0;
+	m_missCount = 0;
+	m_invalidateCount = 0;
+	m_evictCount = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavPathCacheStats( const CCommand &args )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavPathCache.PrintStats();
+
+	if ( args.ArgC() > 1 && FStrEq( args[1], "reset" ) )
+	{
+		TheNavPathCache.ResetStats();
+		Msg( "Nav path cache counters reset.\n" );
+	}
+}
+static ConCommand nav_path_cache_stats( "nav_path_cache_stats", CommandNavPathCacheStats, "Print the nav path cache hit and miss counts. 'nav_path_cache_stats reset' also zeroes the counters.", FCVAR_GAMEDLL | FCVAR_CHEAT );
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavPathCacheClear( void )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavPathCache.Clear();
+}
+static ConCommand nav_path_cache_clear( "nav_path_cache_clear", CommandNavPathCacheClear, "Drop every path in the nav path cache.", FCVAR_GAMEDLL | FCVAR_CHEAT );
@@ -14,6 +14,8 @@
 
 #include "tier0/vprof.h"
 #include "mathlib/ssemath.h"
+#include "tier0/threadtools.h"
+#include "utlmap.h"
 #include "nav_area.h"
 
 extern int g_DebugPathfindCounter;
@@ -32,6 +34,209 @@ enum RouteType
 };
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Search state kept in the areas themselves, in CNavArea's static open list and markers.
+ * Only one search of this kind can run at a time.
+ */
+class CNavAreaSearchState
+{
+public:
+	void Reset( void )											{ CNavArea::ClearSearchLists(); }
+
+	bool IsOpen( const CNavArea *area ) const					{ return area->IsOpen(); }
+	void AddToOpenList( CNavArea *area )						{ area->AddToOpenList(); }
+	void UpdateOnOpenList( CNavArea *area )						{ area->UpdateOnOpenList(); }
+	bool IsOpenListEmpty( void ) const							{ return CNavArea::IsOpenListEmpty(); }
+	CNavArea *PopOpenList( void )								{ return CNavArea::PopOpenList(); }
+
+	bool IsClosed( const CNavArea *area ) const					{ return area->IsClosed(); }
+	void AddToClosedList( CNavArea *area )						{ area->AddToClosedList(); }
+	void RemoveFromClosedList( CNavArea *area )					{ area->RemoveFromClosedList(); }
+
+	void SetParent( CNavArea *area, CNavArea *parent, NavTraverseType how = NUM_TRAVERSE_TYPES )	{ area->SetParent( parent, how ); }
+	CNavArea *GetParent( const CNavArea *area ) const			{ return area->GetParent(); }
+
+	void SetTotalCost( CNavArea *area, float value )			{ area->SetTotalCost( value ); }
+	float GetTotalCost( const CNavArea *area ) const			{ return area->GetTotalCost(); }
+	void SetCostSoFar( CNavArea *area, float value )			{ area->SetCostSoFar( value ); }
+	float GetCostSoFar( const CNavArea *area ) const			{ return area->GetCostSoFar(); }
+	void SetPathLengthSoFar( CNavArea *area, float value )		{ area->SetPathLengthSoFar( value ); }
+	float GetPathLengthSoFar( const CNavArea *area ) const		{ return area->GetPathLengthSoFar(); }
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The state of a single path search, kept apart from the areas so that any number of
+ * searches can run at once, each on its own thread. Per-area state lives in an array
+ * indexed by area ID and is invalidated all at once by bumping a marker; the open list
+ * is a binary heap on total cost.
+ * A search can be reused for as many queries as wanted, one at a time.
+ */
+class CNavPathSearch
+{
+public:
+	CNavPathSearch( void );
+
+	void Reset( void );											// forget the last search and size for the current mesh
+
+	bool IsVisited( const CNavArea *area ) const;				// true if this search has touched the area
+
+	bool IsOpen( const CNavArea *area ) const;
+	void AddToOpenList( CNavArea *area );
+	void UpdateOnOpenList( CNavArea *area );					// a smaller total cost has been found, update the area on the open list
+	bool IsOpenListEmpty( void ) const							{ return m_openList.Count() == 0; }
+	CNavArea *PopOpenList( void );								// remove and return the area with the smallest total cost
+
+	bool IsClosed( const CNavArea *area ) const;
+	void AddToClosedList( CNavArea *area )						{ Visit( area ).m_isClosed = true; }
+	void RemoveFromClosedList( CNavArea *area )					{ Visit( area ).m_isClosed = false; }
+
+	void SetParent( CNavArea *area, CNavArea *parent, NavTraverseType how = NUM_TRAVERSE_TYPES );
+	CNavArea *GetParent( const CNavArea *area ) const;
+	NavTraverseType GetParentHow( const CNavArea *area ) const;
+
+	void SetTotalCost( CNavArea *area, float value )			{ Assert( value >= 0.0 && !IS_NAN(value) ); Visit( area ).m_totalCost = value; }
+	float GetTotalCost( const CNavArea *area ) const;
+	void SetCostSoFar( CNavArea *area, float value )			{ Assert( value >= 0.0 && !IS_NAN(value) ); Visit( area ).m_costSoFar = value; }
+	float GetCostSoFar( const CNavArea *area ) const;
+	void SetPathLengthSoFar( CNavArea *area, float value )		{ Assert( value >= 0.0 && !IS_NAN(value) ); Visit( area ).m_pathLengthSoFar = value; }
+	float GetPathLengthSoFar( const CNavArea *area ) const;
+
+	bool BuildAreaPath( CNavArea *goalArea, CUtlVector< CNavArea * > *path ) const;	// follow parents back from goalArea, and return the areas from the start of the search to it
+
+private:
+	struct AreaState
+	{
+		unsigned int m_marker;									// the area is visited if this equals the search's marker
+		int m_openIndex;										// position in the open list heap, or -1
+		bool m_isClosed;
+		float m_totalCost;
+		float m_costSoFar;
+		float m_pathLengthSoFar;
+		CNavArea *m_parent;
+		NavTraverseType m_parentHow;
+	};
+
+	AreaState &Visit( const CNavArea *area );					// return the area's state, cleared if this search hasn't touched it yet
+	const AreaState *FindState( const CNavArea *area ) const;	// return the area's state, or NULL if this search hasn't touched it
+
+	bool IsCheaper( int i, int j ) const						{ return FindState( m_openList[i] )->m_totalCost < FindState( m_openList[j] )->m_totalCost; }
+	void SwapOpen( int i, int j );
+	void SiftUp( int i );
+	void SiftDown( int i );
+
+	CUtlVector< AreaState > m_state;							// indexed by area ID
+	CUtlVector< CNavArea * > m_openList;
+	unsigned int m_marker;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavPathSearch::AreaState &CNavPathSearch::Visit( const CNavArea *area )
+{
+	unsigned int id = area->GetID();
+	if ( id >= (unsigned int)m_state.Count() )
+	{
+		// areas created since the last Reset()
+		int oldCount = m_state.Count();
+		m_state.AddMultipleToTail( id + 1 - oldCount );
+		for( int i=oldCount; i<m_state.Count(); ++i )
+		{
+			m_state[i].m_marker = 0;
+		}
+	}
+
+	AreaState &state = m_state[ id ];
+	if ( state.m_marker != m_marker )
+	{
+		state.m_marker = m_marker;
+		state.m_openIndex = -1;
+		state.m_isClosed = false;
+		state.m_totalCost = 0.0f;
+		state.m_costSoFar = 0.0f;
+		state.m_pathLengthSoFar = 0.0f;
+		state.m_parent = NULL;
+		state.m_parentHow = NUM_TRAVERSE_TYPES;
+	}
+	return state;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline const CNavPathSearch::AreaState *CNavPathSearch::FindState( const CNavArea *area ) const
+{
+	unsigned int id = area->GetID();
+	if ( id >= (unsigned int)m_state.Count() || m_state[ id ].m_marker != m_marker )
+		return NULL;
+
+	return &m_state[ id ];
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline bool CNavPathSearch::IsVisited( const CNavArea *area ) const
+{
+	return FindState( area ) != NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline bool CNavPathSearch::IsOpen( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state && state->m_openIndex >= 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline bool CNavPathSearch::IsClosed( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state && state->m_isClosed;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline void CNavPathSearch::SetParent( CNavArea *area, CNavArea *parent, NavTraverseType how )
+{
+	AreaState &state = Visit( area );
+	state.m_parent = parent;
+	state.m_parentHow = how;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavArea *CNavPathSearch::GetParent( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->m_parent : NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline NavTraverseType CNavPathSearch::GetParentHow( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->m_parentHow : NUM_TRAVERSE_TYPES;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavPathSearch::GetTotalCost( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->m_totalCost : 0.0f;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavPathSearch::GetCostSoFar( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->m_costSoFar : 0.0f;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavPathSearch::GetPathLengthSoFar( const CNavArea *area ) const
+{
+	const AreaState *state = FindState( area );
+	return state ? state->m_pathLengthSoFar : 0.0f;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Functor used with NavAreaBuildPath()
@@ -48,43 +253,77 @@ public:
 		}
 		else
 		{
-			// compute distance traveled along path so far
-			float dist;
+			return ComputeCost( area, fromArea, ladder, length, fromArea->GetCostSoFar() );
+		}
+	}
 
-			if ( ladder )
-			{
-				dist = ladder->m_length;
-			}
-			else if ( length > 0.0 )
-			{
-				dist = length;
-			}
-			else
-			{
-				dist = ( area->GetCenter() - fromArea->GetCenter() ).Length();
-			}
+	// cost of reaching 'area' from 'fromArea', which cost 'fromCostSoFar' to reach
+	static float ComputeCost( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, float length, float fromCostSoFar )
+	{
+		// compute distance traveled along path so far
+		float dist;
 
-			float cost = dist + fromArea->GetCostSoFar();
+		if ( ladder )
+		{
+			dist = ladder->m_length;
+		}
+		else if ( length > 0.0 )
+		{
+			dist = length;
+		}
+		else
+		{
+			dist = ( area->GetCenter() - fromArea->GetCenter() ).Length();
+		}
 
-			// if this is a "crouch" area, add penalty
-			if ( area->GetAttributes() & NAV_MESH_CROUCH )
-			{
-				const float crouchPenalty = 20.0f;		// 10
-				cost += crouchPenalty * dist;
-			}
+		float cost = dist + fromCostSoFar;
 
-			// if this is a "jump" area, add penalty
-			if ( area->GetAttributes() & NAV_MESH_JUMP )
-			{
-				const float jumpPenalty = 5.0f;
-				cost += jumpPenalty * dist;
-			}
+		// if this is a "crouch" area, add penalty
+		if ( area->GetAttributes() & NAV_MESH_CROUCH )
+		{
+			const float crouchPenalty = 20.0f;		// 10
+			cost += crouchPenalty * dist;
+		}
+
+		// if this is a "jump" area, add penalty
+		if ( area->GetAttributes() & NAV_MESH_JUMP )
+		{
+			const float jumpPenalty = 5.0f;
+			cost += jumpPenalty * dist;
+		}
 
-			return cost;
+		return cost;
+	}
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * ShortestPathCost for searches that keep their state in a CNavPathSearch
+ */
+class SearchShortestPathCost
+{
+public:
+	SearchShortestPathCost( const CNavPathSearch &search ) : m_search( search )
+	{
+	}
+
+	float operator() ( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length )
+	{
+		if ( fromArea == NULL )
+		{
+			// first area in path, no cost
+			return 0.0f;
 		}
+
+		return ShortestPathCost::ComputeCost( area, fromArea, ladder, length, m_search.GetCostSoFar( fromArea ) );
 	}
+
+private:
+	const CNavPathSearch &m_search;
 };
 
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Find path from startArea to goalArea via an A* search, using supplied cost heuristic.
@@ -95,25 +334,25 @@ public:
  * If 'goalArea' is NULL, will compute a path as close as possible to 'goalPos'.
  * If 'goalPos' is NULL, will use the center of 'goalArea' as the goal position.
  * If 'maxPathLength' is nonzero, path building will stop when this length is reached.
+ * 'search' holds the open list and the per-area costs: a CNavAreaSearchState or a CNavPathSearch.
  * Returns true if a path exists.
  */
 #define IGNORE_NAV_BLOCKERS true
-template< typename CostFunctor >
-bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+template< typename SearchState, typename CostFunctor >
+bool NavAreaBuildPathInternal( SearchState &search, CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers, bool isDebug )
 {
-	VPROF_BUDGET( "NavAreaBuildPath", "NextBotSpiky" );
-
 	if ( closestArea )
 	{
 		*closestArea = startArea;
 	}
 
-	bool isDebug = ( g_DebugPathfindCounter-- > 0 );
-
 	if (startArea == NULL)
 		return false;
 
-	startArea->SetParent( NULL );
+	// start search
+	search.Reset();
+
+	search.SetParent( startArea, NULL );
 
 	if (goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ))
 		goalArea = NULL;
@@ -130,29 +369,26 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 	// determine actual goal position
 	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
 
-	// start search
-	CNavArea::ClearSearchLists();
-
 	// compute estimate of path length
 	/// @todo Cost might work as "manhattan distance"
-	startArea->SetTotalCost( (startArea->GetCenter() - actualGoalPos).Length() );
+	search.SetTotalCost( startArea, (startArea->GetCenter() - actualGoalPos).Length() );
 
 	float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );	
 	if (initCost < 0.0f)
 		return false;
-	startArea->SetCostSoFar( initCost );
-	startArea->SetPathLengthSoFar( 0.0 );
+	search.SetCostSoFar( startArea, initCost );
+	search.SetPathLengthSoFar( startArea, 0.0 );
 
-	startArea->AddToOpenList();
+	search.AddToOpenList( startArea );
 
 	// keep track of the area we visit that is closest to the goal
-	float closestAreaDist = startArea->GetTotalCost();
+	float closestAreaDist = search.GetTotalCost( startArea );
 
 	// do A* search
-	while( !CNavArea::IsOpenListEmpty() )
+	while( !search.IsOpenListEmpty() )
 	{
 		// get next area to check
-		CNavArea *area = CNavArea::PopOpenList();
+		CNavArea *area = search.PopOpenList();
 
 		if ( isDebug )
 		{
@@ -329,7 +565,7 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 
 			// don't backtrack
 			Assert( newArea );
-			if ( newArea == area->GetParent() )
+			if ( newArea == search.GetParent( area ) )
 				continue;
 			if ( newArea == area ) // self neighbor?
 				continue;
@@ -346,13 +582,13 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 
 			// Safety check against a bogus functor.  The cost of the path
 			// A...B, C should always be at least as big as the path A...B.
-			Assert( newCostSoFar >= area->GetCostSoFar() );
+			Assert( newCostSoFar >= search.GetCostSoFar( area ) );
 
 			// And now that we've asserted, let's be a bit more defensive.
 			// Make sure that any jump to a new area incurs some pathfinsing
 			// cost, to avoid us spinning our wheels over insignificant cost
 			// benefit, floating point precision bug, or busted cost functor.
-			float minNewCostSoFar = area->GetCostSoFar() * 1.00001 + 0.00001;
+			float minNewCostSoFar = search.GetCostSoFar( area ) * 1.00001 + 0.00001;
 			newCostSoFar = Max( newCostSoFar, minNewCostSoFar );
 				
 			// stop if path length limit reached
@@ -360,14 +596,14 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 			{
 				// keep track of path length so far
 				float deltaLength = ( newArea->GetCenter() - area->GetCenter() ).Length();
-				float newLengthSoFar = area->GetPathLengthSoFar() + deltaLength;
+				float newLengthSoFar = search.GetPathLengthSoFar( area ) + deltaLength;
 				if ( newLengthSoFar > maxPathLength )
 					continue;
 				
-				newArea->SetPathLengthSoFar( newLengthSoFar );
+				search.SetPathLengthSoFar( newArea, newLengthSoFar );
 			}
 
-			if ( ( newArea->IsOpen() || newArea->IsClosed() ) && newArea->GetCostSoFar() <= newCostSoFar )
+			if ( ( search.IsOpen( newArea ) || search.IsClosed( newArea ) ) && search.GetCostSoFar( newArea ) <= newCostSoFar )
 			{
 				// this is a worse path - skip it
 				continue;
@@ -385,36 +621,249 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 					closestAreaDist = newCostRemaining;
 				}
 				
-				newArea->SetCostSoFar( newCostSoFar );
-				newArea->SetTotalCost( newCostSoFar + newCostRemaining );
+				search.SetCostSoFar( newArea, newCostSoFar );
+				search.SetTotalCost( newArea, newCostSoFar + newCostRemaining );
 
-				if ( newArea->IsClosed() )
+				if ( search.IsClosed( newArea ) )
 				{
-					newArea->RemoveFromClosedList();
+					search.RemoveFromClosedList( newArea );
 				}
 
-				if ( newArea->IsOpen() )
+				if ( search.IsOpen( newArea ) )
 				{
 					// area already on open list, update the list order to keep costs sorted
-					newArea->UpdateOnOpenList();
+					search.UpdateOnOpenList( newArea );
 				}
 				else
 				{
-					newArea->AddToOpenList();
+					search.AddToOpenList( newArea );
 				}
 
-				newArea->SetParent( area, how );
+				search.SetParent( newArea, area, how );
 			}
 		}
 
 		// we have searched this area
-		area->AddToClosedList();
+		search.AddToClosedList( area );
 	}
 
 	return false;
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A unique value for each cost functor class, so paths found with different costs are kept apart
+ */
+template< typename CostFunctor >
+inline const void *NavPathCostClass( void )
+{
+	static char costClass;
+	return &costClass;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------
+/**
+ * What a cached path was searched for
+ */
+struct NavPathCacheKey
+{
+	const CNavArea *m_startArea;
+	const CNavArea *m_goalArea;
+	const void *m_costClass;									// from NavPathCostClass()
+	int m_teamID;
+	bool m_ignoreNavBlockers;
+};
+
+
+//----------------------------------------------------------------------------------------------------------------
+/**
+ * Paths already found between two areas, shared by everyone searching with the same cost
+ * functor class. A path found by a functor of the same class that will not go along it (a
+ * dead end for it) is searched again.
+ * A path is dropped when an area along it becomes blocked or obstructed. A path that had to
+ * go around blocked or obstructed areas is dropped when any area becomes clear again, since
+ * a shorter way may have opened up.
+ * Safe to use from any thread.
+ */
+class CNavPathCache
+{
+public:
+	CNavPathCache( void );
+	~CNavPathCache();
+
+	bool Find( const NavPathCacheKey &key, CUtlVector< CNavArea * > *path, bool *isPathFound );	// return true and fill in the path if it is cached
+	void Store( const NavPathCacheKey &key, const CUtlVector< CNavArea * > &path, bool isPathFound, bool isDetour );
+	void Clear( void );
+
+	void OnAreaBlocked( CNavArea *area );						// drop the paths through this area
+	void OnAreaUnblocked( CNavArea *area );						// drop the paths that went around something
+
+	void PrintStats( void );
+	void ResetStats( void );
+
+private:
+	struct Entry
+	{
+		CUtlVector< CNavArea * > m_path;
+		bool m_isPathFound;
+		bool m_isDetour;										// found while some areas were blocked or obstructed
+		unsigned int m_lastUsed;
+	};
+
+	static bool KeyLessFunc( const NavPathCacheKey &lhs, const NavPathCacheKey &rhs );
+	void RemoveEntry( int index );
+
+	CThreadFastMutex m_mutex;
+	CUtlMap< NavPathCacheKey, Entry * > m_entries;
+	unsigned int m_useCount;
+
+	unsigned int m_hitCount;
+	unsigned int m_missCount;
+	unsigned int m_invalidateCount;
+	unsigned int m_evictCount;
+};
+
+extern CNavPathCache TheNavPathCache;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * How a path gets from one area to the next
+ */
+struct NavPathStep
+{
+	NavTraverseType how;
+	const CNavLadder *ladder;
+	const CFuncElevator *elevator;
+	float length;
+};
+
+extern bool NavAreaFindStep( CNavArea *fromArea, CNavArea *toArea, NavPathStep *step );	// return false if 'toArea' can't be reached straight from 'fromArea'
+extern void NavAreaStorePath( const NavPathCacheKey &key, CNavArea *endArea, bool isPathFound );	// cache the path a search left in the areas' parents
+extern bool NavAreaBuildClusterPath( CNavArea *startArea, CNavArea *goalArea, CUtlVector< CNavArea * > *path, int teamID, bool ignoreNavBlockers );	// search over the cluster portals, false if the clusters can't tell
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Set the parents and costs of the areas along 'path', from its start area on, as a search
+ * with 'costFunc' would have. Returns false if 'costFunc' won't go along the path.
+ */
+template< typename CostFunctor >
+bool NavAreaSetPath( const CUtlVector< CNavArea * > &path, CostFunctor &costFunc )
+{
+	FOR_EACH_VEC( path, it )
+	{
+		CNavArea *area = path[ it ];
+		CNavArea *parent = ( it > 0 ) ? path[ it-1 ] : NULL;
+
+		NavPathStep step;
+		step.how = NUM_TRAVERSE_TYPES;
+		step.ladder = NULL;
+		step.elevator = NULL;
+		step.length = -1.0f;
+		if ( parent && !NavAreaFindStep( parent, area, &step ) )
+			return false;
+
+		area->SetParent( parent, step.how );
+
+		float cost = costFunc( area, parent, step.ladder, step.elevator, step.length );
+		if ( cost < 0.0f )
+			return false;
+
+		area->SetCostSoFar( cost );
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find path from startArea to goalArea via an A* search, using supplied cost heuristic.
+ * See NavAreaBuildPathInternal() for the details.
+ * The search state is kept in the areas themselves, so only one of these can run at a
+ * time, on the main thread.
+ * Area-to-area searches with no length limit are kept in TheNavPathCache. A path taken from
+ * the cache sets the areas' parents and costs as the search would have.
+ * Those searches between areas in different clusters go over the cluster portals first. That
+ * route is the shortest path within nav_cluster_path_bound - 'costFunc' can only turn it down,
+ * and the full search runs then.
+ */
+template< typename CostFunctor >
+bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+{
+	VPROF_BUDGET( "NavAreaBuildPath", "NextBotSpiky" );
+
+	bool isDebug = ( g_DebugPathfindCounter-- > 0 );
+
+	// area-to-area searches with no length limit reuse the paths already found with this cost
+	bool isCacheable = !isDebug && startArea && goalArea && goalPos == NULL && maxPathLength == 0.0f;
+
+	NavPathCacheKey key;
+	key.m_startArea = startArea;
+	key.m_goalArea = goalArea;
+	key.m_costClass = NavPathCostClass< CostFunctor >();
+	key.m_teamID = teamID;
+	key.m_ignoreNavBlockers = ignoreNavBlockers;
+
+	if ( isCacheable )
+	{
+		CUtlVector< CNavArea * > path;
+		bool isPathFound;
+		if ( TheNavPathCache.Find( key, &path, &isPathFound ) && NavAreaSetPath( path, costFunc ) )
+		{
+			if ( closestArea )
+			{
+				*closestArea = ( path.Count() ) ? path.Tail() : startArea;
+			}
+			return isPathFound;
+		}
+
+		if ( NavAreaBuildClusterPath( startArea, goalArea, &path, teamID, ignoreNavBlockers ) && NavAreaSetPath( path, costFunc ) )
+		{
+			if ( closestArea )
+			{
+				*closestArea = goalArea;
+			}
+			NavAreaStorePath( key, goalArea, true );
+			return true;
+		}
+	}
+
+	CNavArea *endArea = NULL;
+	CNavAreaSearchState search;
+	bool isPathFound = NavAreaBuildPathInternal( search, startArea, goalArea, goalPos, costFunc, &endArea, maxPathLength, teamID, ignoreNavBlockers, isDebug );
+
+	if ( closestArea )
+	{
+		*closestArea = endArea;
+	}
+
+	if ( isCacheable )
+	{
+		NavAreaStorePath( key, ( isPathFound ) ? goalArea : endArea, isPathFound );
+	}
+
+	return isPathFound;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Same as above, but the search state is kept in 'search', so any number of these can run
+ * at once on any thread, as long as nothing changes the mesh meanwhile.
+ * The path is defined by following search.GetParent() back from the goal area, and the
+ * cost functor must take the cost so far from the search (see SearchShortestPathCost).
+ */
+template< typename CostFunctor >
+bool NavAreaBuildPath( CNavPathSearch &search, CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+{
+	return NavAreaBuildPathInternal( search, startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers, false );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Compute distance between two areas. Return -1 if can't reach 'endArea' from 'startArea'.
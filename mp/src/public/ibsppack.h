@@ -26,6 +26,9 @@ public:
 	virtual void AddFileToPack( const char *relativename, const char *fullpath ) = 0;
 	virtual void AddBufferToPack( const char *relativename, void *data, int length, bool bTextMode ) = 0;
 	virtual void SetHDRMode( bool bHDR ) = 0;
+
+	// pCompressFunc is called from several threads at once, one lump or pak file entry each, so it
+	// must not touch shared state without locking it.
 	virtual bool SwapBSPFile( IFileSystem *pFileSystem, const char *filename, const char *swapFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc ) = 0;
 
 	// used to get/set the pak file from a BSP
@@ -599,14 +599,12 @@ void CZipFile::ParseFromBuffer( void *buffer, int bufferlength )
 	// Throw away old data
 	Reset();
 
-	// Initialize a buffer
-	CUtlBuffer buf( 0, bufferlength +1  );					// +1 for null termination
+	// Read straight out of the caller's buffer, every file gets copied out below anyway
+	CUtlBuffer buf( buffer, bufferlength, CUtlBuffer::READ_ONLY );
 
 	// need to swap bytes, so set the buffer opposite the machine's endian
 	buf.ActivateByteSwapping( m_Swap.IsSwappingBytes() );
 
-	buf.Put( buffer, bufferlength );
-
 	buf.SeekGet( CUtlBuffer::SEEK_TAIL, 0 );
 	unsigned int fileLen = buf.TellGet();
 
@@ -5,6 +5,7 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include <tier0/threadtools.h>
 
 static bool SameSign(float a, float b)
 {
@@ -595,18 +596,6 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
-int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
-{
-	CacheOptimizedKDNode ret;
-	ret.Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-	ret.SetNumberOfTrianglesInLeafNode(1+(last_tri-first_tri));
-	for(int tnum=first_tri;tnum<=last_tri;tnum++)
-		TriangleIndexList.AddToTail(tnum);
-	OptimizedKDTree.AddToTail(ret);
-	return OptimizedKDTree.Count()-1;
-}
-
-
 void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int ntris,
 														Vector &minout, Vector &maxout)
 {
@@ -625,12 +614,12 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 }
 
 
-// Both the "quick" and regular kd tree building algorithms here use the "surface area heuristic":
-// the relative probability of hitting the "left" subvolume (Vl) from a split is equal to that
-// subvolume's surface area divided by its parent's surface area (Vp) : P(Vl | V)=SA(Vl)/SA(Vp).
-// The same holds for the right subvolume, Vp. Nl is the number of triangles in the left volume,
-// and Nr in the right volume. if Ct is the cost of traversing one tree node, and Ci is the cost of
-// intersection with the primitive, than the cost of splitting is estimated as:
+// The tree is built with the "surface area heuristic": the relative probability of hitting the
+// "left" subvolume (Vl) from a split is equal to that subvolume's surface area divided by its
+// parent's surface area (Vp) : P(Vl | V)=SA(Vl)/SA(Vp). The same holds for the right subvolume,
+// Vp. Nl is the number of triangles in the left volume, and Nr in the right volume. if Ct is the
+// cost of traversing one tree node, and Ci is the cost of intersection with the primitive, than
+// the cost of splitting is estimated as:
 //
 //    Ct+Ci*((SA(Vl)/SA(V))*Nl+(SA(Vr)/SA(V)*Nr)).
 // and the cost of not splitting is
@@ -639,250 +628,454 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 //  This both provides a metric to minimize when computing how and where to split, and also a
 //  termination criterion.
 //
-// the "quick" method just splits down the middle, while the slow method splits at the best
-// discontinuity of the cost formula. The quick method splits along the longest axis ; the 
-// regular algorithm tries all 3 to find which one results in the minimum cost
-// 
-// both methods use the additional optimization of "growing" empty nodes - if the split results in
-// one side being devoid of triangles, the empty side is "grown" as much as possible.
+// Rather than evaluating the cost at every triangle vertex, each node bins the triangle extents
+// along all 3 axes into KDBUILD_SAH_BINS buckets and evaluates the cost at every bucket boundary
+// from prefix sums, so finding a split is linear in the number of triangles. The winning plane is
+// then classified exactly.
+//
+// The builder also uses the additional optimization of "growing" empty nodes - if the split
+// results in one side being devoid of triangles, the empty side is "grown" as much as possible.
 //
+// Large subtrees are handed out as jobs to a pool of threads. Each job builds into its own
+// temporary nodes, which are flattened into OptimizedKDTree once everything is done.
 
 #define COST_OF_TRAVERSAL 75								// approximate #operations
 #define COST_OF_INTERSECTION 167							// approximate #operations
 
+#define KDBUILD_SAH_BINS 32
+#define KDBUILD_MIN_JOB_TRIS 2048							// smaller subtrees stay on the thread
+															// that found them
+#define KDBUILD_MAX_THREADS 64
 
-float RayTracingEnvironment::CalculateCostsOfSplit(
-	int split_plane,int32 const *tri_list,int ntris,
-	Vector MinBound,Vector MaxBound, float &split_value,
-	int &nleft, int &nright, int &nboth)
+#define NEVER_SPLIT 0
+
+struct KDBuildNode_t
 {
-	// determine the costs of splitting on a given axis, and label triangles with respect to
-	// that axis by storing the value in coordselect0. It will also return the number of
-	// tris in the left, right, and nboth groups, in order to facilitate memory
-	nleft=nboth=nright=0;
-	
-	// now, label each triangle. Since we have not converted the triangles into
-	// intersection fromat yet, we can use the CoordSelect0 field of each as a temp.
-	nleft=0;
-	nright=0;
-	nboth=0;
-	float min_coord=1.0e23,max_coord=-1.0e23;
-
-	for(int t=0;t<ntris;t++)
+	int m_nType;											// KDNODE_STATE_xxx
+	float m_flSplitValue;
+	KDBuildNode_t *m_pChildren[2];
+	int32 *m_pTris;											// leaf triangles
+	int m_nTris;
+#ifdef DEBUG_RAYTRACE
+	Vector m_Mins;
+	Vector m_Maxs;
+#endif
+};
+
+struct KDBuildJob_t
+{
+	KDBuildNode_t *m_pNode;
+	int32 *m_pTris;											// owned by the job
+	int m_nTris;
+	Vector m_Mins;
+	Vector m_Maxs;
+	int m_nDepth;
+};
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( RayTracingEnvironment *pEnv, int nThreads );
+
+	KDBuildNode_t *Build( int32 *pTris, int nTris, Vector const &mins, Vector const &maxs );
+
+	// copy the temporary tree into the environment's node and triangle index lists, and free it
+	void Flatten( KDBuildNode_t *pRoot );
+
+private:
+	static unsigned WorkerThread( void *pParam );
+	void WorkerLoop( void );
+
+	void PushJob( KDBuildJob_t const &job );
+	bool PopJob( KDBuildJob_t &job );
+
+	void BuildSubtree( KDBuildJob_t job );
+	bool FindSplit( int32 const *pTris, int nTris, Vector const &mins, Vector const &maxs,
+					int nDepth, int &nAxis, float &flSplitValue, int8 *pClass,
+					int &nLeft, int &nRight, int &nBoth );
+	float EvaluateSplit( int nAxis, float &flSplitValue, int32 const *pTris, int nTris,
+						 Vector const &mins, Vector const &maxs, int8 *pClass,
+						 int &nLeft, int &nRight, int &nBoth );
+	void FlattenNode( int nNodeIndex, KDBuildNode_t *pNode );
+
+	RayTracingEnvironment *m_pEnv;
+	int m_nThreads;
+
+	CThreadFastMutex m_QueueMutex;
+	CThreadEvent m_JobsChanged;								// set when a job is queued or the last one finishes
+	CUtlVector<KDBuildJob_t> m_Jobs;
+	long volatile m_nPendingJobs;
+};
+
+
+CKDTreeBuilder::CKDTreeBuilder( RayTracingEnvironment *pEnv, int nThreads )
+{
+	m_pEnv = pEnv;
+	m_nThreads = clamp( nThreads, 1, KDBUILD_MAX_THREADS );
+	m_nPendingJobs = 0;
+}
+
+
+void CKDTreeBuilder::PushJob( KDBuildJob_t const &job )
+{
+	ThreadInterlockedIncrement( &m_nPendingJobs );
+	m_QueueMutex.Lock();
+	m_Jobs.AddToTail( job );
+	m_QueueMutex.Unlock();
+	m_JobsChanged.Set();
+}
+
+
+bool CKDTreeBuilder::PopJob( KDBuildJob_t &job )
+{
+	bool bFound = false;
+	m_QueueMutex.Lock();
+	if ( m_Jobs.Count() )
 	{
-		CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-		// determine max and min coordinate values for later optimization
-		for(int v=0;v<3;v++)
+		// newest first - keeps the working set of the queue small
+		job = m_Jobs.Tail();
+		m_Jobs.RemoveMultipleFromTail( 1 );
+		bFound = true;
+	}
+	bool bMoreJobs = ( m_Jobs.Count() > 0 );
+	m_QueueMutex.Unlock();
+
+	// the event only wakes one thread, so pass it on while there's work left
+	if ( bMoreJobs )
+		m_JobsChanged.Set();
+	return bFound;
+}
+
+
+unsigned CKDTreeBuilder::WorkerThread( void *pParam )
+{
+	( (CKDTreeBuilder *)pParam )->WorkerLoop();
+	return 0;
+}
+
+
+void CKDTreeBuilder::WorkerLoop( void )
+{
+	while ( 1 )
+	{
+		KDBuildJob_t job;
+		if ( PopJob( job ) )
+		{
+			BuildSubtree( job );
+			if ( ThreadInterlockedDecrement( &m_nPendingJobs ) == 0 )
+				m_JobsChanged.Set();
+		}
+		else if ( m_nPendingJobs == 0 )
+		{
+			// all done. wake the next sleeping thread so it can see that too
+			m_JobsChanged.Set();
+			break;
+		}
+		else
+		{
+			m_JobsChanged.Wait();
+		}
+	}
+}
+
+
+KDBuildNode_t *CKDTreeBuilder::Build( int32 *pTris, int nTris, Vector const &mins, Vector const &maxs )
+{
+	KDBuildNode_t *pRoot = new KDBuildNode_t;
+
+	KDBuildJob_t root;
+	root.m_pNode = pRoot;
+	root.m_pTris = pTris;
+	root.m_nTris = nTris;
+	root.m_Mins = mins;
+	root.m_Maxs = maxs;
+	root.m_nDepth = 0;
+	PushJob( root );
+
+	ThreadHandle_t hThreads[KDBUILD_MAX_THREADS];
+	for ( int i = 1; i < m_nThreads; i++ )
+		hThreads[i] = CreateSimpleThread( WorkerThread, this );
+
+	WorkerLoop();
+
+	for ( int i = 1; i < m_nThreads; i++ )
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+
+	return pRoot;
+}
+
+
+float CKDTreeBuilder::EvaluateSplit( int nAxis, float &flSplitValue, int32 const *pTris, int nTris,
+									 Vector const &mins, Vector const &maxs, int8 *pClass,
+									 int &nLeft, int &nRight, int &nBoth )
+{
+	nLeft = nRight = nBoth = 0;
+	float min_coord = 1.0e23, max_coord = -1.0e23;
+
+	for ( int t = 0; t < nTris; t++ )
+	{
+		CacheOptimizedTriangle &tri = m_pEnv->OptimizedTriangleList[pTris[t]];
+		for ( int v = 0; v < 3; v++ )
 		{
-			min_coord = min( min_coord, tri.Vertex(v)[split_plane] );
-			max_coord = max( max_coord, tri.Vertex(v)[split_plane] );
+			min_coord = min( min_coord, tri.Vertex(v)[nAxis] );
+			max_coord = max( max_coord, tri.Vertex(v)[nAxis] );
 		}
-		switch(tri.ClassifyAgainstAxisSplit(split_plane,split_value))
+		int nClass = tri.ClassifyAgainstAxisSplit( nAxis, flSplitValue );
+		pClass[t] = nClass;
+		switch ( nClass )
 		{
 			case PLANECHECK_NEGATIVE:
-				nleft++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_NEGATIVE;
+				nLeft++;
 				break;
-
 			case PLANECHECK_POSITIVE:
-				nright++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_POSITIVE;
+				nRight++;
 				break;
-
 			case PLANECHECK_STRADDLING:
-				nboth++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_STRADDLING;
+				nBoth++;
 				break;
 		}
 	}
+
 	// now, if the split resulted in one half being empty, "grow" the empty half
-	if (nleft && (nboth==0) && (nright==0))
-		split_value=max_coord;
-	if (nright && (nboth==0) && (nleft==0))
-		split_value=min_coord;
-
-	// now, perform surface area/cost check to determine whether this split was worth it
-	Vector LeftMins=MinBound;
-	Vector LeftMaxes=MaxBound;
-	Vector RightMins=MinBound;
-	Vector RightMaxes=MaxBound;
-	LeftMaxes[split_plane]=split_value;
-	RightMins[split_plane]=split_value;
-	float SA_L=BoxSurfaceArea(LeftMins,LeftMaxes);
-	float SA_R=BoxSurfaceArea(RightMins,RightMaxes);
-	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
-	float cost_of_split=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
-		(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
-	return cost_of_split;
+	if ( nLeft && ( nBoth == 0 ) && ( nRight == 0 ) )
+		flSplitValue = max_coord;
+	if ( nRight && ( nBoth == 0 ) && ( nLeft == 0 ) )
+		flSplitValue = min_coord;
+
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[nAxis] = flSplitValue;
+	RightMins[nAxis] = flSplitValue;
+	float SA_L = BoxSurfaceArea( mins, LeftMaxes );
+	float SA_R = BoxSurfaceArea( RightMins, maxs );
+	float ISA = 1.0 / BoxSurfaceArea( mins, maxs );
+	return COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ( nBoth + ( SA_L * ISA * nLeft ) + ( SA_R * ISA * nRight ) );
 }
 
 
-#define NEVER_SPLIT 0
-
-void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
-									   Vector MinBound,Vector MaxBound, int depth)
+bool CKDTreeBuilder::FindSplit( int32 const *pTris, int nTris, Vector const &mins, Vector const &maxs,
+								int nDepth, int &nAxis, float &flSplitValue, int8 *pClass,
+								int &nLeft, int &nRight, int &nBoth )
 {
-	if (ntris<3)											// never split empty lists
-	{
-		// no point in continuing
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+	if ( ( nTris < 3 ) || NEVER_SPLIT || ( nDepth > MAX_TREE_DEPTH ) )	// never split tiny lists
+		return false;
 
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
+	// bin the lower and upper extent of every triangle on each axis
+	int nMinBins[3][KDBUILD_SAH_BINS];
+	int nMaxBins[3][KDBUILD_SAH_BINS];
+	memset( nMinBins, 0, sizeof( nMinBins ) );
+	memset( nMaxBins, 0, sizeof( nMaxBins ) );
 
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
-		return;
-	}
+	Vector vecExtent = maxs - mins;
+	float flBinScale[3];
+	for ( int c = 0; c < 3; c++ )
+		flBinScale[c] = ( vecExtent[c] > 0 ) ? KDBUILD_SAH_BINS / vecExtent[c] : 0;
 
-	float best_cost=1.0e23;
-	int best_nleft=0,best_nright=0,best_nboth=0;
-	float best_splitvalue=0;
-	int split_plane=0;
+	for ( int t = 0; t < nTris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = m_pEnv->OptimizedTriangleList[pTris[t]];
+		for ( int c = 0; c < 3; c++ )
+		{
+			float flMin = min( tri.Vertex(0)[c], min( tri.Vertex(1)[c], tri.Vertex(2)[c] ) );
+			float flMax = max( tri.Vertex(0)[c], max( tri.Vertex(1)[c], tri.Vertex(2)[c] ) );
+			int nMinBin = clamp( (int)( ( flMin - mins[c] ) * flBinScale[c] ), 0, KDBUILD_SAH_BINS - 1 );
+			int nMaxBin = clamp( (int)( ( flMax - mins[c] ) * flBinScale[c] ), 0, KDBUILD_SAH_BINS - 1 );
+			nMinBins[c][nMinBin]++;
+			nMaxBins[c][nMaxBin]++;
+		}
+	}
 
-	int tri_skip=1+(ntris/10);								// don't try all trinagles as split
-															// points when there are a lot of them
-	for(int axis=0;axis<3;axis++)
+	// sweep the bucket boundaries. a triangle whose upper extent is in a bucket below the
+	// boundary is entirely on the left, one whose lower extent is at or above it is on the right.
+	float flBestCost = 1.0e23;
+	int nBestAxis = -1;
+	float flBestSplit = 0;
+	float ISA = 1.0 / BoxSurfaceArea( mins, maxs );
+	for ( int c = 0; c < 3; c++ )
 	{
-		for(int ts=-1;ts<ntris;ts+=tri_skip)
+		if ( flBinScale[c] == 0 )
+			continue;
+
+		int nRightCounts[KDBUILD_SAH_BINS + 1];
+		nRightCounts[KDBUILD_SAH_BINS] = 0;
+		for ( int b = KDBUILD_SAH_BINS - 1; b >= 0; b-- )
+			nRightCounts[b] = nRightCounts[b + 1] + nMinBins[c][b];
+
+		int nLeftCount = 0;
+		for ( int b = 1; b < KDBUILD_SAH_BINS; b++ )
 		{
-			for(int tv=0;tv<3;tv++)
+			nLeftCount += nMaxBins[c][b - 1];
+			int nRightCount = nRightCounts[b];
+			int nBothCount = nTris - nLeftCount - nRightCount;
+
+			float flSplit = mins[c] + b * vecExtent[c] * ( 1.0f / KDBUILD_SAH_BINS );
+			Vector LeftMaxes = maxs;
+			Vector RightMins = mins;
+			LeftMaxes[c] = flSplit;
+			RightMins[c] = flSplit;
+			float flCost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ( nBothCount +
+				( BoxSurfaceArea( mins, LeftMaxes ) * ISA * nLeftCount ) +
+				( BoxSurfaceArea( RightMins, maxs ) * ISA * nRightCount ) );
+			if ( flCost < flBestCost )
 			{
-				int trial_nleft,trial_nright,trial_nboth;
-				float trial_splitvalue;
-				if (ts==-1)
-					trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
-				else
-				{
-					// else, split at the triangle vertex if possible
-					CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
-					trial_splitvalue = tri.Vertex(tv)[axis];
-					if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
-						continue;							// don't try this vertex - not inside
-					
-				}
-//				printf("ts=%d tv=%d tp=%f\n",ts,tv,trial_splitvalue);
-				float trial_cost=
-					CalculateCostsOfSplit(axis,tri_list,ntris,MinBound,MaxBound,trial_splitvalue,
-										  trial_nleft,trial_nright, trial_nboth);
-// 				printf("try %d cost=%f nl=%d nr=%d nb=%d sp=%f\n",axis,trial_cost,trial_nleft,trial_nright, trial_nboth,
-// 					   trial_splitvalue);
-				if (trial_cost<best_cost)
-				{
-					split_plane=axis;
-					best_cost=trial_cost;
-					best_nleft=trial_nleft;
-					best_nright=trial_nright;
-					best_nboth=trial_nboth;
-					best_splitvalue=trial_splitvalue;
-					// save away the axis classification of each triangle
-					for(int t=0 ; t < ntris; t++)
-					{
-						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-						tri.m_Data.m_GeometryData.m_nTmpData1 = tri.m_Data.m_GeometryData.m_nTmpData0;
-					}
-				}
-				if (ts==-1)
-					break;
+				flBestCost = flCost;
+				nBestAxis = c;
+				flBestSplit = flSplit;
 			}
 		}
-
 	}
-	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
-	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
+
+	if ( nBestAxis == -1 )
+		return false;
+
+	// the binned counts are approximate at the boundaries, so classify the winner exactly
+	nAxis = nBestAxis;
+	flSplitValue = flBestSplit;
+	float flCost = EvaluateSplit( nAxis, flSplitValue, pTris, nTris, mins, maxs, pClass, nLeft, nRight, nBoth );
+
+	float flCostOfNoSplit = COST_OF_INTERSECTION * nTris;
+	return ( flCost < flCostOfNoSplit );
+}
+
+
+void CKDTreeBuilder::BuildSubtree( KDBuildJob_t job )
+{
+	int8 *pClass = NULL;
+	int nClassSize = 0;
+
+	while ( 1 )
 	{
-		// no benefit to splitting. just make this a leaf node
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+		if ( job.m_nTris > nClassSize )
+		{
+			delete[] pClass;
+			nClassSize = job.m_nTris;
+			pClass = new int8[nClassSize];
+		}
+
+		int nAxis, nLeft, nRight, nBoth;
+		float flSplitValue;
+		KDBuildNode_t *pNode = job.m_pNode;
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+		pNode->m_Mins = job.m_Mins;
+		pNode->m_Maxs = job.m_Maxs;
 #endif
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
-	}
-	else
-	{
-// 		printf("best split was %d at %f (mid=%f,n=%d, sk=%d)\n",split_plane,best_splitvalue,
-// 			   0.5*(MinBound[split_plane]+MaxBound[split_plane]),ntris,tri_skip);
+		if ( !FindSplit( job.m_pTris, job.m_nTris, job.m_Mins, job.m_Maxs, job.m_nDepth,
+						 nAxis, flSplitValue, pClass, nLeft, nRight, nBoth ) )
+		{
+			// no benefit to splitting. just make this a leaf node, and hand it our list
+			pNode->m_nType = KDNODE_STATE_LEAF;
+			pNode->m_pTris = job.m_pTris;
+			pNode->m_nTris = job.m_nTris;
+			pNode->m_pChildren[0] = pNode->m_pChildren[1] = NULL;
+			break;
+		}
+
 		// its worth splitting!
-		// we will achieve the splitting without sorting by using a selection algorithm.
-		int32 *new_triangle_list;
-		new_triangle_list=new int32[ntris];
-
-		// now, perform surface area/cost check to determine whether this split was worth it
-		Vector LeftMins=MinBound;
-		Vector LeftMaxes=MaxBound;
-		Vector RightMins=MinBound;
-		Vector RightMaxes=MaxBound;
-		LeftMaxes[split_plane]=best_splitvalue;
-		RightMins[split_plane]=best_splitvalue;
-		
-		int n_left_output=0;
-		int n_both_output=0;
-		int n_right_output=0;
-		for(int t=0;t<ntris;t++)
+		KDBuildJob_t children[2];
+		children[0].m_nTris = nLeft + nBoth;
+		children[1].m_nTris = nRight + nBoth;
+		for ( int i = 0; i < 2; i++ )
 		{
-			CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-			switch( tri.m_Data.m_GeometryData.m_nTmpData1 )
-			{
-				case PLANECHECK_NEGATIVE:
-//					printf("%d goes left\n",t);
-					new_triangle_list[n_left_output++]=tri_list[t];
-					break;
-				case PLANECHECK_POSITIVE:
-					n_right_output++;
-//					printf("%d goes right\n",t);
-					new_triangle_list[ntris-n_right_output]=tri_list[t];
-					break;
-				case PLANECHECK_STRADDLING:
-//					printf("%d goes both\n",t);
-					new_triangle_list[best_nleft+n_both_output]=tri_list[t];
-					n_both_output++;
-					break;
+			children[i].m_pNode = new KDBuildNode_t;
+			children[i].m_pTris = new int32[ max( children[i].m_nTris, 1 ) ];
+			children[i].m_Mins = job.m_Mins;
+			children[i].m_Maxs = job.m_Maxs;
+			children[i].m_nDepth = job.m_nDepth + 1;
+			if ( ( job.m_nTris < 20 ) && ( ( nLeft == 0 ) || ( nRight == 0 ) ) )
+				children[i].m_nDepth += 100;
+		}
+		children[0].m_Maxs[nAxis] = flSplitValue;
+		children[1].m_Mins[nAxis] = flSplitValue;
 
-					
-			}
+		int nOut[2] = { 0, 0 };
+		for ( int t = 0; t < job.m_nTris; t++ )
+		{
+			if ( pClass[t] != PLANECHECK_POSITIVE )
+				children[0].m_pTris[nOut[0]++] = job.m_pTris[t];
+			if ( pClass[t] != PLANECHECK_NEGATIVE )
+				children[1].m_pTris[nOut[1]++] = job.m_pTris[t];
 		}
-		int left_child=OptimizedKDTree.Count();
-		int right_child=left_child+1;
-// 		printf("node %d split on axis %d at %f, nl=%d nr=%d nb=%d lc=%d rc=%d\n",node_number,
-// 			   split_plane,best_splitvalue,best_nleft,best_nright,best_nboth,
-// 			   left_child,right_child);
-		OptimizedKDTree[node_number].Children=split_plane+(left_child<<2);
-		OptimizedKDTree[node_number].SplittingPlaneValue=best_splitvalue;
+		Assert( nOut[0] == children[0].m_nTris && nOut[1] == children[1].m_nTris );
+		delete[] job.m_pTris;
+
+		pNode->m_nType = nAxis;
+		pNode->m_flSplitValue = flSplitValue;
+		pNode->m_pChildren[0] = children[0].m_pNode;
+		pNode->m_pChildren[1] = children[1].m_pNode;
+		pNode->m_pTris = NULL;
+		pNode->m_nTris = 0;
+
+		// hand the right side to another thread if it is big enough to be worth it, and keep
+		// going down the left side ourselves
+		if ( ( m_nThreads > 1 ) && ( children[1].m_nTris >= KDBUILD_MIN_JOB_TRIS ) )
+			PushJob( children[1] );
+		else
+			BuildSubtree( children[1] );
+		job = children[0];
+	}
+
+	delete[] pClass;
+}
+
+
+void CKDTreeBuilder::FlattenNode( int nNodeIndex, KDBuildNode_t *pNode )
+{
+	CacheOptimizedKDNode &node = m_pEnv->OptimizedKDTree[nNodeIndex];
+	if ( pNode->m_nType == KDNODE_STATE_LEAF )
+	{
+		node.Children = KDNODE_STATE_LEAF + ( m_pEnv->TriangleIndexList.Count() << 2 );
+		node.SetNumberOfTrianglesInLeafNode( pNode->m_nTris );
+		m_pEnv->TriangleIndexList.AddMultipleToTail( pNode->m_nTris, pNode->m_pTris );
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+		node.vecMins = pNode->m_Mins;
+		node.vecMaxs = pNode->m_Maxs;
 #endif
-		CacheOptimizedKDNode newnode;
-		OptimizedKDTree.AddToTail(newnode);
-		OptimizedKDTree.AddToTail(newnode);
-		// now, recurse!
-		if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
-			depth+=100;
-		RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
-		RefineNode(right_child,new_triangle_list+best_nleft,best_nright+best_nboth,
-				   RightMins,RightMaxes,depth+1);
-		delete[] new_triangle_list;
-	}	
+		delete[] pNode->m_pTris;
+	}
+	else
+	{
+		// the right child is always stored after the left child
+		int nLeftChild = m_pEnv->OptimizedKDTree.AddMultipleToTail( 2 );
+		CacheOptimizedKDNode &parent = m_pEnv->OptimizedKDTree[nNodeIndex];
+		parent.Children = pNode->m_nType + ( nLeftChild << 2 );
+		parent.SplittingPlaneValue = pNode->m_flSplitValue;
+#ifdef DEBUG_RAYTRACE
+		parent.vecMins = pNode->m_Mins;
+		parent.vecMaxs = pNode->m_Maxs;
+#endif
+		FlattenNode( nLeftChild, pNode->m_pChildren[0] );
+		FlattenNode( nLeftChild + 1, pNode->m_pChildren[1] );
+	}
+	delete pNode;
+}
+
+
+void CKDTreeBuilder::Flatten( KDBuildNode_t *pRoot )
+{
+	m_pEnv->OptimizedKDTree.AddToTail();
+	FlattenNode( m_pEnv->OptimizedKDTree.Count() - 1, pRoot );
 }
 
 
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
-	CacheOptimizedKDNode root;
-	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
+	int32 *root_triangle_list=new int32[max( OptimizedTriangleList.Count(), 1 )];
 	for(int t=0;t<OptimizedTriangleList.Count();t++)
 		root_triangle_list[t]=t;
 	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
 								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
-	delete[] root_triangle_list;
+
+	int nThreads = m_nBuildThreads;
+	if ( nThreads <= 0 )
+		nThreads = GetCPUInformation()->m_nLogicalProcessors;
+
+	// the builder takes ownership of the triangle list
+	CKDTreeBuilder builder( this, nThreads );
+	KDBuildNode_t *pRoot = builder.Build( root_triangle_list, OptimizedTriangleList.Count(), m_MinBound, m_MaxBound );
+	builder.Flatten( pRoot );
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
@@ -890,6 +1083,68 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 }
 
 
+static void AccumulateTreeStats( RayTracingEnvironment const *pEnv, int nNode, Vector mins, Vector maxs,
+								 int nDepth, float flRootISA, int *pLeafHistogram, int &nNodes,
+								 int &nMaxDepth, int &nTriRefs, float &flCost )
+{
+	CacheOptimizedKDNode const &node = pEnv->OptimizedKDTree[nNode];
+	float flProbability = BoxSurfaceArea( mins, maxs ) * flRootISA;
+	nNodes++;
+	nMaxDepth = max( nMaxDepth, nDepth );
+
+	if ( node.NodeType() == KDNODE_STATE_LEAF )
+	{
+		int nTris = node.NumberOfTrianglesInLeaf();
+		int nBucket = 0;
+		while ( ( nBucket < 7 ) && ( nTris > ( 1 << nBucket ) - 1 ) )
+			nBucket++;
+		pLeafHistogram[nBucket]++;
+		nTriRefs += nTris;
+		flCost += COST_OF_INTERSECTION * nTris * flProbability;
+		return;
+	}
+
+	flCost += COST_OF_TRAVERSAL * flProbability;
+
+	int nAxis = node.NodeType();
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[nAxis] = node.SplittingPlaneValue;
+	RightMins[nAxis] = node.SplittingPlaneValue;
+	AccumulateTreeStats( pEnv, node.LeftChild(), mins, LeftMaxes, nDepth + 1, flRootISA, pLeafHistogram,
+						 nNodes, nMaxDepth, nTriRefs, flCost );
+	AccumulateTreeStats( pEnv, node.RightChild(), RightMins, maxs, nDepth + 1, flRootISA, pLeafHistogram,
+						 nNodes, nMaxDepth, nTriRefs, flCost );
+}
+
+
+void RayTracingEnvironment::PrintAccelerationStructureStats( void ) const
+{
+	if ( !OptimizedKDTree.Count() )
+		return;
+
+	// leaf buckets hold 0, 1, 2-3, 4-7, ... , 64+ triangles
+	int nLeafHistogram[8];
+	memset( nLeafHistogram, 0, sizeof( nLeafHistogram ) );
+	int nNodes = 0, nMaxDepth = 0, nTriRefs = 0;
+	float flCost = 0;
+	float flRootArea = BoxSurfaceArea( m_MinBound, m_MaxBound );
+	AccumulateTreeStats( this, 0, m_MinBound, m_MaxBound, 0, ( flRootArea > 0 ) ? 1.0 / flRootArea : 0,
+						 nLeafHistogram, nNodes, nMaxDepth, nTriRefs, flCost );
+
+	int nLeaves = 0;
+	for ( int i = 0; i < 8; i++ )
+		nLeaves += nLeafHistogram[i];
+
+	Msg( "kd-tree: %d nodes, %d leaves, max depth %d, %d triangles (%.2f refs/tri), SAH cost %.1f\n",
+		 nNodes, nLeaves, nMaxDepth, OptimizedTriangleList.Count(),
+		 OptimizedTriangleList.Count() ? (float)nTriRefs / OptimizedTriangleList.Count() : 0.0f, flCost );
+	Msg( "kd-tree leaf sizes: 0:%d 1:%d 2-3:%d 4-7:%d 8-15:%d 16-31:%d 32-63:%d 64+:%d\n",
+		 nLeafHistogram[0], nLeafHistogram[1], nLeafHistogram[2], nLeafHistogram[3],
+		 nLeafHistogram[4], nLeafHistogram[5], nLeafHistogram[6], nLeafHistogram[7] );
+}
+
+
 
 void RayTracingEnvironment::AddInfinitePointLight(Vector position, Vector intensity)
 {
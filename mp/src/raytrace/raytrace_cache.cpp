@@ -0,0 +1,269 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// Persistent cache of the kd-tree built by SetupAccelerationStructure. The file is a header
+// followed by flat, 16-byte aligned arrays of the nodes, the triangles in intersection format,
+// the leaf triangle index list and the per-triangle colors and materials. It is keyed by an MD5
+// of the triangles that were added, so any change to the geometry invalidates it.
+
+#include "raytrace.h"
+#include <tier0/dbg.h>
+#include <tier1/checksum_md5.h>
+#include <stdio.h>
+
+#define RTCACHE_MAGIC		( ( 'C' << 24 ) + ( 'T' << 16 ) + ( 'R' << 8 ) + 'V' )
+#define RTCACHE_VERSION		1
+#define RTCACHE_ALIGN		16
+
+struct RayTraceCacheHeader_t
+{
+	int32 m_nMagic;
+	int32 m_nVersion;
+	MD5Value_t m_TriangleHash;
+
+	// guard against builds with different structure layouts (DEBUG_RAYTRACE, etc)
+	int32 m_nNodeSize;
+	int32 m_nTriangleSize;
+
+	int32 m_nNodes;
+	int32 m_nTriangles;
+	int32 m_nTriangleIndices;
+	int32 m_nColors;
+	int32 m_nMaterials;
+
+	float m_MinBound[3];
+	float m_MaxBound[3];
+
+	// byte offsets from the start of the file
+	int32 m_nNodeOffset;
+	int32 m_nTriangleOffset;
+	int32 m_nTriangleIndexOffset;
+	int32 m_nColorOffset;
+	int32 m_nMaterialOffset;
+	int32 m_nFileSize;
+};
+
+
+static int AlignCacheOffset( int nOffset )
+{
+	return ( nOffset + RTCACHE_ALIGN - 1 ) & ~( RTCACHE_ALIGN - 1 );
+}
+
+
+// true if nCount elements of nElementSize bytes at nOffset lie between the header and the end of the file
+static bool IsCacheSectionValid( RayTraceCacheHeader_t const &header, int32 nOffset, int32 nCount, int nElementSize )
+{
+	return ( nOffset >= (int)sizeof( header ) && nOffset <= header.m_nFileSize &&
+			 nCount >= 0 && nCount <= ( header.m_nFileSize - nOffset ) / nElementSize );
+}
+
+
+// true if every node's children and triangle range are inside the loaded arrays
+static bool IsCacheTreeValid( CacheOptimizedKDNode const *pNodes, int nNodes, int32 const *pTriangleIndices, int nTriangleIndices, int nTriangles )
+{
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		CacheOptimizedKDNode const &node = pNodes[i];
+		if ( node.NodeType() == KDNODE_STATE_LEAF )
+		{
+			int32 nStart = node.TriangleIndexStart();
+			int32 nCount = node.NumberOfTrianglesInLeaf();
+			if ( nCount && ( nStart < 0 || nCount < 0 || nStart > nTriangleIndices - nCount ) )
+				return false;
+		}
+		else if ( node.LeftChild() <= i || node.RightChild() >= nNodes )
+		{
+			return false;
+		}
+	}
+
+	for ( int i = 0; i < nTriangleIndices; i++ )
+	{
+		if ( pTriangleIndices[i] < 0 || pTriangleIndices[i] >= nTriangles )
+			return false;
+	}
+	return true;
+}
+
+
+void RayTracingEnvironment::ComputeTriangleHash( MD5Value_t &hash )
+{
+	// only hash the fields AddTriangle sets - the kd-tree builder's temp fields are garbage
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+
+	int32 nTris = OptimizedTriangleList.Count();
+	uint32 nFlags = Flags;
+	MD5Update( &ctx, (unsigned char const *)&nTris, sizeof( nTris ) );
+	MD5Update( &ctx, (unsigned char const *)&nFlags, sizeof( nFlags ) );
+
+	for ( int i = 0; i < nTris; i++ )
+	{
+		TriGeometryData_t const &tri = OptimizedTriangleList[i].m_Data.m_GeometryData;
+		MD5Update( &ctx, (unsigned char const *)&tri.m_nTriangleID, sizeof( tri.m_nTriangleID ) );
+		MD5Update( &ctx, (unsigned char const *)tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		MD5Update( &ctx, (unsigned char const *)&tri.m_nFlags, sizeof( tri.m_nFlags ) );
+	}
+
+	if ( TriangleColors.Count() )
+		MD5Update( &ctx, (unsigned char const *)TriangleColors.Base(), TriangleColors.Count() * sizeof( Vector ) );
+	if ( TriangleMaterials.Count() )
+		MD5Update( &ctx, (unsigned char const *)TriangleMaterials.Base(), TriangleMaterials.Count() * sizeof( int32 ) );
+
+	MD5Final( hash.bits, &ctx );
+}
+
+
+bool RayTracingEnvironment::SaveAccelerationStructure( const char *pFileName, const MD5Value_t &hash )
+{
+	RayTraceCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nMagic = RTCACHE_MAGIC;
+	header.m_nVersion = RTCACHE_VERSION;
+	header.m_TriangleHash = hash;
+	header.m_nNodeSize = sizeof( CacheOptimizedKDNode );
+	header.m_nTriangleSize = sizeof( CacheOptimizedTriangle );
+	header.m_nNodes = OptimizedKDTree.Count();
+	header.m_nTriangles = OptimizedTriangleList.Count();
+	header.m_nTriangleIndices = TriangleIndexList.Count();
+	header.m_nColors = TriangleColors.Count();
+	header.m_nMaterials = TriangleMaterials.Count();
+	for ( int c = 0; c < 3; c++ )
+	{
+		header.m_MinBound[c] = m_MinBound[c];
+		header.m_MaxBound[c] = m_MaxBound[c];
+	}
+
+	header.m_nNodeOffset = AlignCacheOffset( sizeof( header ) );
+	header.m_nTriangleOffset = AlignCacheOffset( header.m_nNodeOffset + header.m_nNodes * sizeof( CacheOptimizedKDNode ) );
+	header.m_nTriangleIndexOffset = AlignCacheOffset( header.m_nTriangleOffset + header.m_nTriangles * sizeof( CacheOptimizedTriangle ) );
+	header.m_nColorOffset = AlignCacheOffset( header.m_nTriangleIndexOffset + header.m_nTriangleIndices * sizeof( int32 ) );
+	header.m_nMaterialOffset = AlignCacheOffset( header.m_nColorOffset + header.m_nColors * sizeof( Vector ) );
+	header.m_nFileSize = header.m_nMaterialOffset + header.m_nMaterials * sizeof( int32 );
+
+	FILE *fp = fopen( pFileName, "wb" );
+	if ( !fp )
+		return false;
+
+	static const char zeros[RTCACHE_ALIGN] = { 0 };
+	int nWritten = 0;
+	bool bOk = true;
+
+#define WRITE_CACHE_SECTION( offset, pData, nBytes )										\
+	if ( bOk )																				\
+	{																						\
+		bOk = ( fwrite( zeros, 1, (offset) - nWritten, fp ) == (size_t)( (offset) - nWritten ) );	\
+		nWritten = (offset);																\
+		if ( bOk && (nBytes) )																\
+			bOk = ( fwrite( (pData), 1, (nBytes), fp ) == (size_t)(nBytes) );				\
+		nWritten += (nBytes);																\
+	}
+
+	WRITE_CACHE_SECTION( 0, &header, sizeof( header ) );
+	WRITE_CACHE_SECTION( header.m_nNodeOffset, OptimizedKDTree.Base(), header.m_nNodes * (int)sizeof( CacheOptimizedKDNode ) );
+
+	// the triangle list is a block vector, so write it out element by element
+	WRITE_CACHE_SECTION( header.m_nTriangleOffset, NULL, 0 );
+	for ( int i = 0; bOk && i < header.m_nTriangles; i++ )
+	{
+		bOk = ( fwrite( &OptimizedTriangleList[i], sizeof( CacheOptimizedTriangle ), 1, fp ) == 1 );
+		nWritten += sizeof( CacheOptimizedTriangle );
+	}
+
+	WRITE_CACHE_SECTION( header.m_nTriangleIndexOffset, TriangleIndexList.Base(), header.m_nTriangleIndices * (int)sizeof( int32 ) );
+	WRITE_CACHE_SECTION( header.m_nColorOffset, TriangleColors.Base(), header.m_nColors * (int)sizeof( Vector ) );
+	WRITE_CACHE_SECTION( header.m_nMaterialOffset, TriangleMaterials.Base(), header.m_nMaterials * (int)sizeof( int32 ) );
+
+#undef WRITE_CACHE_SECTION
+
+	fclose( fp );
+
+	if ( !bOk )
+		remove( pFileName );
+	return bOk;
+}
+
+
+bool RayTracingEnvironment::LoadAccelerationStructure( const char *pFileName, const MD5Value_t &hash )
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	RayTraceCacheHeader_t header;
+	if ( fread( &header, sizeof( header ), 1, fp ) != 1 ||
+		 header.m_nMagic != RTCACHE_MAGIC ||
+		 header.m_nVersion != RTCACHE_VERSION ||
+		 header.m_TriangleHash != hash ||
+		 header.m_nNodeSize != sizeof( CacheOptimizedKDNode ) ||
+		 header.m_nTriangleSize != sizeof( CacheOptimizedTriangle ) ||
+		 header.m_nTriangles != OptimizedTriangleList.Count() ||
+		 header.m_nColors != TriangleColors.Count() ||
+		 header.m_nMaterials != TriangleMaterials.Count() ||
+		 header.m_nNodes <= 0 ||
+		 header.m_nFileSize < (int)sizeof( header ) ||
+		 !IsCacheSectionValid( header, header.m_nNodeOffset, header.m_nNodes, sizeof( CacheOptimizedKDNode ) ) ||
+		 !IsCacheSectionValid( header, header.m_nTriangleOffset, header.m_nTriangles, sizeof( CacheOptimizedTriangle ) ) ||
+		 !IsCacheSectionValid( header, header.m_nTriangleIndexOffset, header.m_nTriangleIndices, sizeof( int32 ) ) ||
+		 !IsCacheSectionValid( header, header.m_nColorOffset, header.m_nColors, sizeof( Vector ) ) ||
+		 !IsCacheSectionValid( header, header.m_nMaterialOffset, header.m_nMaterials, sizeof( int32 ) ) )
+	{
+		fclose( fp );
+		return false;
+	}
+
+	// a truncated or padded file isn't one we wrote
+	fseek( fp, 0, SEEK_END );
+	if ( ftell( fp ) != header.m_nFileSize )
+	{
+		fclose( fp );
+		return false;
+	}
+
+	// pull the whole file in with one read, then copy the sections out of it
+	uint8 *pFile = new uint8[header.m_nFileSize];
+	fseek( fp, 0, SEEK_SET );
+	bool bOk = ( fread( pFile, 1, header.m_nFileSize, fp ) == (size_t)header.m_nFileSize );
+	fclose( fp );
+
+	bOk = bOk && IsCacheTreeValid( (CacheOptimizedKDNode const *)( pFile + header.m_nNodeOffset ), header.m_nNodes,
+								   (int32 const *)( pFile + header.m_nTriangleIndexOffset ), header.m_nTriangleIndices, header.m_nTriangles );
+
+	if ( bOk )
+	{
+		OptimizedKDTree.CopyArray( (CacheOptimizedKDNode const *)( pFile + header.m_nNodeOffset ), header.m_nNodes );
+		TriangleIndexList.CopyArray( (int32 const *)( pFile + header.m_nTriangleIndexOffset ), header.m_nTriangleIndices );
+		TriangleColors.CopyArray( (Vector const *)( pFile + header.m_nColorOffset ), header.m_nColors );
+		TriangleMaterials.CopyArray( (int32 const *)( pFile + header.m_nMaterialOffset ), header.m_nMaterials );
+
+		CacheOptimizedTriangle const *pTris = (CacheOptimizedTriangle const *)( pFile + header.m_nTriangleOffset );
+		for ( int i = 0; i < header.m_nTriangles; i++ )
+			OptimizedTriangleList[i] = pTris[i];
+
+		for ( int c = 0; c < 3; c++ )
+		{
+			m_MinBound[c] = header.m_MinBound[c];
+			m_MaxBound[c] = header.m_MaxBound[c];
+		}
+	}
+
+	delete[] pFile;
+	return bOk;
+}
+
+
+bool RayTracingEnvironment::SetupAccelerationStructure( const char *pCacheFileName )
+{
+	MD5Value_t hash;
+	ComputeTriangleHash( hash );
+
+	if ( LoadAccelerationStructure( pCacheFileName, hash ) )
+		return true;
+
+	SetupAccelerationStructure();
+
+	if ( !SaveAccelerationStructure( pCacheFileName, hash ) )
+		Warning( "Unable to write ray-trace cache %s\n", pCacheFileName );
+	return false;
+}
@@ -0,0 +1,337 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// 8-wide packet tracing. Trace8RaysAVX2 is a straight port of the 4-wide Trace4Rays traversal to
+// 256 bit registers. It is only entered when processor_detect reports AVX2 and the OS saves the
+// ymm state, so the rest of the raytracer keeps working on older cpus.
+
+#include "raytrace.h"
+#include <tier1/processor_detect.h>
+
+// MSVC can emit AVX2 intrinsics from any function from VS2012 on. gcc needs the function to be
+// compiled for the avx2 target, which it can do per function from 4.9 on.
+#if defined( _MSC_VER ) && ( _MSC_VER >= 1700 )
+#define RAYTRACE_AVX2 1
+#define AVX2_FUNCTION
+#elif defined( __GNUC__ ) && ( ( __GNUC__ > 4 ) || ( ( __GNUC__ == 4 ) && ( __GNUC_MINOR__ >= 9 ) ) )
+#define RAYTRACE_AVX2 1
+#define AVX2_FUNCTION __attribute__(( target( "avx2" ) ))
+#endif
+
+#ifdef RAYTRACE_AVX2
+#include <immintrin.h>
+#endif
+
+
+void EightRays::GetFourRays( int nHalf, FourRays &out ) const
+{
+	int nBase = nHalf * 4;
+	for ( int i = 0; i < 4; i++ )
+	{
+		out.origin.X(i) = origin[0][nBase + i];
+		out.origin.Y(i) = origin[1][nBase + i];
+		out.origin.Z(i) = origin[2][nBase + i];
+		out.direction.X(i) = direction[0][nBase + i];
+		out.direction.Y(i) = direction[1][nBase + i];
+		out.direction.Z(i) = direction[2][nBase + i];
+	}
+}
+
+
+int EightRays::CalculateDirectionSignMask(void) const
+{
+	// same as the FourRays version - only the sign bits matter, so treat the floats as ints
+	int ret = 0;
+	for ( int c = 0; c < 3; c++ )
+	{
+		int32 const *treat_as_int = (int32 const *)direction[c];
+		int32 ormask = treat_as_int[0];
+		int32 andmask = treat_as_int[0];
+		for ( int i = 1; i < 8; i++ )
+		{
+			ormask |= treat_as_int[i];
+			andmask &= treat_as_int[i];
+		}
+		if ( ormask < 0 )
+		{
+			if ( andmask < 0 )
+				ret |= ( 1 << c );
+			else
+				return -1;
+		}
+	}
+	return ret;
+}
+
+
+bool RayTracingEnvironment::SupportsEightWideTracing( void )
+{
+#ifdef RAYTRACE_AVX2
+	static int s_nSupported = -1;
+	if ( s_nSupported == -1 )
+		s_nSupported = CheckAVX2Technology() ? 1 : 0;
+	return ( s_nSupported == 1 );
+#else
+	return false;
+#endif
+}
+
+
+void RayTracingEnvironment::Trace8Rays(const EightRays &rays, float const *TMin, float const *TMax,
+									   RayTracingResult8 *rslt_out,
+									   int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	if ( !pCallback && SupportsEightWideTracing() )
+	{
+		int msk = rays.CalculateDirectionSignMask();
+		if ( msk != -1 )
+		{
+			Trace8RaysAVX2( rays, TMin, TMax, msk, rslt_out, skip_id );
+			return;
+		}
+	}
+
+	// trace as two packets of 4. Trace4Rays deals with rays that differ in sign.
+	for ( int nHalf = 0; nHalf < 2; nHalf++ )
+	{
+		FourRays fourrays;
+		rays.GetFourRays( nHalf, fourrays );
+		fltx4 fourTMin = LoadUnalignedSIMD( TMin + nHalf * 4 );
+		fltx4 fourTMax = LoadUnalignedSIMD( TMax + nHalf * 4 );
+
+		RayTracingResult tmpresult;
+		Trace4Rays( fourrays, fourTMin, fourTMax, &tmpresult, skip_id, pCallback );
+		for ( int i = 0; i < 4; i++ )
+		{
+			int nOut = nHalf * 4 + i;
+			rslt_out->HitIds[nOut] = tmpresult.HitIds[i];
+			rslt_out->HitDistance[nOut] = SubFloat( tmpresult.HitDistance, i );
+			rslt_out->surface_normal[0][nOut] = tmpresult.surface_normal.X(i);
+			rslt_out->surface_normal[1][nOut] = tmpresult.surface_normal.Y(i);
+			rslt_out->surface_normal[2][nOut] = tmpresult.surface_normal.Z(i);
+		}
+	}
+}
+
+
+#ifdef RAYTRACE_AVX2
+
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
+// a*b+c without fma, the same way MaddSIMD does it on the 4-wide path
+#define Madd8( a, b, c ) _mm256_add_ps( _mm256_mul_ps( a, b ), c )
+
+struct NodeToVisit8
+{
+	CacheOptimizedKDNode const *node;
+	__m256 TMin;
+	__m256 TMax;
+};
+
+AVX2_FUNCTION void RayTracingEnvironment::Trace8RaysAVX2(const EightRays &rays, float const *pTMin, float const *pTMax,
+														 int DirectionSignMask, RayTracingResult8 *rslt_out,
+														 int32 skip_id)
+{
+	const __m256 Eight_Zeros = _mm256_set1_ps( 1.0e-10f );
+	const __m256 Eight_Epsilons = _mm256_set1_ps( 1.0e-10f );
+	const __m256 Eight_NegativeEpsilons = _mm256_set1_ps( -1.0e-10f );
+	const __m256 Eight_Ones = _mm256_set1_ps( 1.0f );
+
+	__m256 origin[3], direction[3], OneOverRayDir[3];
+	for ( int c = 0; c < 3; c++ )
+	{
+		origin[c] = _mm256_loadu_ps( rays.origin[c] );
+		direction[c] = _mm256_loadu_ps( rays.direction[c] );
+
+		// reciprocal, with zeros turned into epsilons like MakeReciprocalSaturate
+		__m256 zero_mask = _mm256_cmp_ps( direction[c], _mm256_setzero_ps(), _CMP_EQ_OQ );
+		__m256 safe_dir = _mm256_or_ps( direction[c], _mm256_and_ps( zero_mask, _mm256_set1_ps( FLT_EPSILON ) ) );
+		OneOverRayDir[c] = _mm256_div_ps( Eight_Ones, safe_dir );
+	}
+
+	__m256i HitIds = _mm256_set1_epi32( -1 );
+	__m256 HitDistance = _mm256_set1_ps( 1.0e23f );
+	__m256 Normal[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+	__m256 TMin = _mm256_loadu_ps( pTMin );
+	__m256 TMax = _mm256_loadu_ps( pTMax );
+
+	// now, clip rays against bounding box
+	for ( int c = 0; c < 3; c++ )
+	{
+		__m256 isect_min_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( m_MinBound[c] ), origin[c] ), OneOverRayDir[c] );
+		__m256 isect_max_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( m_MaxBound[c] ), origin[c] ), OneOverRayDir[c] );
+		TMin = _mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax = _mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+
+	if ( !_mm256_movemask_ps( _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ ) ) )
+	{
+		// missed bounding box
+		_mm256_storeu_si256( (__m256i *)rslt_out->HitIds, HitIds );
+		_mm256_storeu_ps( rslt_out->HitDistance, HitDistance );
+		for ( int c = 0; c < 3; c++ )
+			_mm256_storeu_ps( rslt_out->surface_normal[c], Normal[c] );
+		return;
+	}
+
+	int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
+	memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+	// based on ray direction, whether to visit left or right node first
+	int front_idx[3], back_idx[3];
+	for ( int c = 0; c < 3; c++ )
+	{
+		back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+		front_idx[c] = 1 - back_idx[c];
+	}
+
+	NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+	CacheOptimizedKDNode const *CurNode = &( OptimizedKDTree[0] );
+	NodeToVisit8 *stack_ptr = &NodeQueue[MAX_NODE_STACK_LEN];
+	while ( 1 )
+	{
+		while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+		{
+			int split_plane_number = CurNode->NodeType();
+			CacheOptimizedKDNode const *FrontChild = &( OptimizedKDTree[CurNode->LeftChild()] );
+
+			__m256 dist_to_sep_plane =						// dist=(split-org)/dir
+				_mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( CurNode->SplittingPlaneValue ), origin[split_plane_number] ),
+							   OneOverRayDir[split_plane_number] );
+			__m256 active = _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ );
+
+			// now, decide how to traverse children. can either do front,back, or do front and push
+			// back.
+			__m256 hits_front = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OQ ) );
+			if ( !_mm256_movemask_ps( hits_front ) )
+			{
+				// missed the front. only traverse back
+				CurNode = FrontChild + back_idx[split_plane_number];
+				TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+			}
+			else
+			{
+				__m256 hits_back = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OQ ) );
+				if ( !_mm256_movemask_ps( hits_back ) )
+				{
+					// missed the back - only need to traverse front node
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+				else
+				{
+					// at least some rays hit both nodes.
+					// must push far, traverse near
+					Assert( stack_ptr > NodeQueue );
+					--stack_ptr;
+					stack_ptr->node = FrontChild + back_idx[split_plane_number];
+					stack_ptr->TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+					stack_ptr->TMax = TMax;
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+			}
+		}
+
+		// hit a leaf! must do intersection check
+		int ntris = CurNode->NumberOfTrianglesInLeaf();
+		if ( ntris )
+		{
+			int32 const *tlist = &( TriangleIndexList[CurNode->TriangleIndexStart()] );
+			do
+			{
+				int tnum = *( tlist++ );
+				// check mailbox
+				int mbox_slot = tnum & ( MAILBOX_HASH_SIZE - 1 );
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+					continue;
+				mailboxids[mbox_slot] = tnum;
+
+				// compute plane intersection
+				__m256 Nx = _mm256_set1_ps( tri->m_flNx );
+				__m256 Ny = _mm256_set1_ps( tri->m_flNy );
+				__m256 Nz = _mm256_set1_ps( tri->m_flNz );
+
+				__m256 DDotN = Madd8( direction[2], Nz, Madd8( direction[1], Ny, _mm256_mul_ps( direction[0], Nx ) ) );
+				// mask off zero or near zero (ray parallel to surface)
+				__m256 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, Eight_Epsilons, _CMP_GT_OQ ),
+											   _mm256_cmp_ps( DDotN, Eight_NegativeEpsilons, _CMP_LT_OQ ) );
+
+				__m256 ODotN = Madd8( origin[2], Nz, Madd8( origin[1], Ny, _mm256_mul_ps( origin[0], Nx ) ) );
+				__m256 numerator = _mm256_sub_ps( _mm256_set1_ps( tri->m_flD ), ODotN );
+
+				__m256 isect_t = _mm256_div_ps( numerator, DDotN );
+				// now, we have the distance to the plane. lets update our mask
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, Eight_Zeros, _CMP_GT_OQ ) );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance, _CMP_LT_OQ ) );
+
+				if ( !_mm256_movemask_ps( did_hit ) )
+					continue;
+
+				// now, check 3 edges
+				__m256 hitc1 = Madd8( isect_t, direction[tri->m_nCoordSelect0], origin[tri->m_nCoordSelect0] );
+				__m256 hitc2 = Madd8( isect_t, direction[tri->m_nCoordSelect1], origin[tri->m_nCoordSelect1] );
+
+				// do barycentric coordinate check
+				__m256 B0 = Madd8( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2,
+											 _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1 ) );
+				B0 = _mm256_add_ps( B0, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ) );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, Eight_Zeros, _CMP_GE_OQ ) );
+
+				__m256 B1 = Madd8( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2,
+											 _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1 ) );
+				B1 = _mm256_add_ps( B1, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ) );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, Eight_Zeros, _CMP_GE_OQ ) );
+
+				__m256 B2 = _mm256_add_ps( B1, B0 );
+				did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, Eight_Ones, _CMP_LE_OQ ) );
+
+				if ( !_mm256_movemask_ps( did_hit ) )
+					continue;
+
+				// now, set the hit_id and closest_hit fields for any enabled rays
+				HitIds = _mm256_castps_si256( _mm256_blendv_ps( _mm256_castsi256_ps( HitIds ),
+																_mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), did_hit ) );
+				HitDistance = _mm256_blendv_ps( HitDistance, isect_t, did_hit );
+				Normal[0] = _mm256_blendv_ps( Normal[0], Nx, did_hit );
+				Normal[1] = _mm256_blendv_ps( Normal[1], Ny, did_hit );
+				Normal[2] = _mm256_blendv_ps( Normal[2], Nz, did_hit );
+			} while ( --ntris );
+
+			// now, check if all rays have terminated
+			if ( !_mm256_movemask_ps( _mm256_cmp_ps( TMax, HitDistance, _CMP_LE_OQ ) ) )
+				break;
+		}
+
+		if ( stack_ptr == &NodeQueue[MAX_NODE_STACK_LEN] )
+			break;
+
+		// pop stack!
+		CurNode = stack_ptr->node;
+		TMin = stack_ptr->TMin;
+		TMax = stack_ptr->TMax;
+		stack_ptr++;
+	}
+
+	_mm256_storeu_si256( (__m256i *)rslt_out->HitIds, HitIds );
+	_mm256_storeu_ps( rslt_out->HitDistance, HitDistance );
+	for ( int c = 0; c < 3; c++ )
+		_mm256_storeu_ps( rslt_out->surface_normal[c], Normal[c] );
+}
+
+#else
+
+void RayTracingEnvironment::Trace8RaysAVX2(const EightRays &rays, float const *TMin, float const *TMax,
+										   int DirectionSignMask, RayTracingResult8 *rslt_out,
+										   int32 skip_id)
+{
+	// SupportsEightWideTracing() never returns true for this build
+	Assert( 0 );
+	Trace8Rays( rays, TMin, TMax, rslt_out, skip_id );
+}
+
+#endif // RAYTRACE_AVX2
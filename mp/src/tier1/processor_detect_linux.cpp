@@ -9,6 +9,10 @@
 #define cpuid(in,a,b,c,d)												\
 	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in));
 
+// same as above, for the leaves that take a sub-leaf in ecx
+#define cpuid_count(in,sub,a,b,c,d)									\
+	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in), "c" (sub));
+
 bool CheckMMXTechnology(void)
 {
     unsigned long eax,ebx,edx,unused;
@@ -45,3 +49,33 @@ bool Check3DNowTechnology(void)
     }
     return false;
 }
+
+bool CheckAVXTechnology(void)
+{
+	unsigned long eax,ebx,ecx,edx;
+	cpuid(1,eax,ebx,ecx,edx);
+
+	// bit 27 of ecx is OSXSAVE, bit 28 is AVX
+	if ( ( ecx & ( ( 1 << 27 ) | ( 1 << 28 ) ) ) != ( ( 1 << 27 ) | ( 1 << 28 ) ) )
+		return false;
+
+	// the OS has to save the xmm and ymm state (XCR0 bits 1 and 2) on context switches.
+	// xgetbv is emitted as bytes for old assemblers.
+	unsigned long xcr0_lo, xcr0_hi;
+	asm(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	return ( xcr0_lo & 6 ) == 6;
+}
+
+bool CheckAVX2Technology(void)
+{
+	if ( !CheckAVXTechnology() )
+		return false;
+
+	unsigned long eax,ebx,ecx,edx;
+	cpuid(0,eax,ebx,ecx,edx);
+	if ( eax < 7 )
+		return false;
+
+	cpuid_count(7,0,eax,ebx,ecx,edx);
+	return ( ebx & ( 1 << 5 ) ) != 0;		// bit 5 of ebx is AVX2
+}
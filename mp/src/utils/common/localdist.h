@@ -0,0 +1,65 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spreads the work units of a stage across worker processes that talk
+//			to the master over plain TCP, for build machines that can't run the
+//			VMPI service.
+//
+//			Workers are the same tool started with the same command line plus
+//			-distworker <host:port>. They run the compile up to each distributed
+//			stage themselves, so the data every work unit reads is already there,
+//			then process whatever units the master hands them and send back the
+//			results. The master works on the stage with its own threads too, so a
+//			stage always finishes: units held by a worker that disconnects or goes
+//			quiet are simply put back in the queue.
+//
+//=============================================================================//
+
+#ifndef LOCALDIST_H
+#define LOCALDIST_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlbuffer.h"
+
+
+// Processes a work unit and, if pBuf is non-NULL, writes the results to it. pBuf is NULL
+// when the master processes a unit itself and the stage doesn't broadcast its results.
+typedef void (*LocalDistProcessFn)( int iThread, int iWorkUnit, CUtlBuffer *pBuf );
+
+// Reads the results of a work unit processed by another process. iWorker is -1 on workers
+// receiving the results of a broadcast stage.
+typedef void (*LocalDistReceiveFn)( int iWorkUnit, CUtlBuffer &buf, int iWorker );
+
+
+// Set by the tool's command line parsing.
+extern int	g_nLocalDistWorkers;			// -dist #: worker processes the master starts on this machine
+extern int	g_nLocalDistPort;				// -distport #: port the master listens on (0 picks one)
+extern bool	g_bLocalDistListen;				// -distlisten: accept workers from other machines
+extern char	g_szLocalDistMaster[256];		// -distworker <host:port>: run as a worker of that master
+extern char	g_szLocalDistToken[64];		// -disttoken <secret>: workers have to send the master's token
+
+
+// True if the command line asked for any of the above.
+bool LocalDist_IsRequested();
+
+// Call once the command line is parsed. The master starts listening and launches its local
+// workers, which get argv with the -dist options replaced by -distworker. Their output goes
+// to <pLogBase>_distworker#.log. A worker connects to its master here.
+void LocalDist_Start( int argc, char **argv, const char *pLogBase );
+
+bool LocalDist_IsMaster();
+bool LocalDist_IsWorker();
+
+// Run a stage. Every process in the job has to call this for the same stages in the same
+// order. On the master, processFn runs on the master's threads and receiveFn gets the
+// results workers send back; it's called from the main thread only.
+// If bBroadcastResults is set, every process ends the stage with the results of all the
+// work units, which workers get through receiveFn. Returns the elapsed time in seconds.
+double LocalDist_DistributeWork( int nWorkUnits, LocalDistProcessFn processFn, LocalDistReceiveFn receiveFn, bool bBroadcastResults );
+
+// Workers call this once there are no more distributed stages for them.
+void LocalDist_WorkerExit();
+
+
+#endif // LOCALDIST_H
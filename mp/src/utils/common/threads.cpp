@@ -15,13 +15,11 @@
 
 #include <windows.h>
 #include "cmdlib.h"
+#include "tier0/threadtools.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
 
-#define	MAX_THREADS	16
-
-
 class CRunThreadsData
 {
 public:
@@ -30,18 +28,208 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CRunThreadsData g_RunThreadsData[MAX_TOOL_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+HANDLE g_ThreadHandles[MAX_TOOL_THREADS];
+
+
+/*
+===================================================================
+
+WORK STEALING
+
+Work items [0,workcount) are cut into blocks which are dealt round-robin
+onto a deque per thread, so every thread starts near the front of the
+list and the overall dispatch order stays roughly ascending (vvis relies
+on the cheap portals finishing first). A thread takes small chunks off
+the front of its own deque without touching any shared state, and once
+its deque runs dry it steals the back half of the last block of the
+fullest deque it can find.
+
+===================================================================
+*/
+
+// Upper bound on the number of items a thread takes off its own deque at once.
+#define MAX_WORK_CHUNK		32
+
+// Blocks dealt to each thread when the work is first split up.
+#define WORK_BLOCKS_PER_THREAD	8
+
+struct CWorkRange
+{
+	int m_iStart;
+	int m_iEnd;
+};
+
+class CThreadWorkDeque
+{
+public:
+	CThreadFastMutex	m_Mutex;
+
+	// Ranges in [m_iHead,m_iTail). The owner pops from the head, thieves take from the tail.
+	CWorkRange	*m_pRanges;
+	int			m_iHead;
+	int			m_iTail;
+
+	// Approximate number of items left, read without the lock when picking a victim.
+	volatile int	m_nRemaining;
+
+	// Chunk that the owner has claimed and is handing out one item at a time.
+	int			m_iChunkCur;
+	int			m_iChunkEnd;
+
+	// Keep deques that are hammered by different threads on separate cache lines.
+	char		m_Pad[64];
+};
+
+static CThreadWorkDeque g_WorkDeques[MAX_TOOL_THREADS];
+static CWorkRange *g_pWorkRanges = NULL;
+static int g_nWorkRangesPerThread = 0;
+static int g_nWorkChunk = 1;
+static int g_nWorkThreads = 0;
+
+static long volatile g_nWorkDispatched = 0;
+static CThreadFastMutex g_PacifierMutex;
+static CThreadLocalInt<> g_iWorkThreadIndex;
+
+static long volatile g_nWorkSteals = 0;
+
+
+static void InitThreadWork( int nItems, int nThreads )
+{
+	delete [] g_pWorkRanges;
+	g_pWorkRanges = NULL;
+
+	g_nWorkThreads = Max( nThreads, 1 );
+	g_nWorkDispatched = 0;
+	g_nWorkSteals = 0;
+
+	int nBlocks = g_nWorkThreads * WORK_BLOCKS_PER_THREAD;
+	int nBlockSize = Max( 1, ( nItems + nBlocks - 1 ) / nBlocks );
+	nBlocks = ( nItems + nBlockSize - 1 ) / nBlockSize;
+
+	g_nWorkChunk = Clamp( nBlockSize / 4, 1, MAX_WORK_CHUNK );
+
+	// Each thread needs at least one slot to receive a stolen range in.
+	g_nWorkRangesPerThread = Max( 1, ( nBlocks + g_nWorkThreads - 1 ) / g_nWorkThreads );
+	g_pWorkRanges = new CWorkRange[ g_nWorkRangesPerThread * g_nWorkThreads ];
+
+	for ( int i=0; i < g_nWorkThreads; i++ )
+	{
+		CThreadWorkDeque &deque = g_WorkDeques[i];
+		deque.m_pRanges = &g_pWorkRanges[ i * g_nWorkRangesPerThread ];
+		deque.m_iHead = deque.m_iTail = 0;
+		deque.m_nRemaining = 0;
+		deque.m_iChunkCur = deque.m_iChunkEnd = 0;
+	}
+
+	for ( int iBlock=0; iBlock < nBlocks; iBlock++ )
+	{
+		CThreadWorkDeque &deque = g_WorkDeques[ iBlock % g_nWorkThreads ];
+		CWorkRange &range = deque.m_pRanges[ deque.m_iTail++ ];
+		range.m_iStart = iBlock * nBlockSize;
+		range.m_iEnd = Min( range.m_iStart + nBlockSize, nItems );
+		deque.m_nRemaining += range.m_iEnd - range.m_iStart;
+	}
+}
+
+
+// Claim the next chunk from the front of our own deque.
+static bool PopOwnChunk( CThreadWorkDeque &deque )
+{
+	bool bFound = false;
+
+	deque.m_Mutex.Lock();
+	if ( deque.m_iHead < deque.m_iTail )
+	{
+		CWorkRange &range = deque.m_pRanges[ deque.m_iHead ];
+		int nTake = Min( g_nWorkChunk, range.m_iEnd - range.m_iStart );
+
+		deque.m_iChunkCur = range.m_iStart;
+		deque.m_iChunkEnd = range.m_iStart + nTake;
+		deque.m_nRemaining -= nTake;
+
+		range.m_iStart += nTake;
+		if ( range.m_iStart == range.m_iEnd )
+			deque.m_iHead++;
+
+		bFound = true;
+	}
+	deque.m_Mutex.Unlock();
+
+	return bFound;
+}
+
+
+// Move the back half of the fullest other deque's last range into ours.
+static bool StealWork( int iThread )
+{
+	CThreadWorkDeque &self = g_WorkDeques[iThread];
+
+	while ( 1 )
+	{
+		int iVictim = -1;
+		int nBest = 0;
+		for ( int i=1; i < g_nWorkThreads; i++ )
+		{
+			int iTest = ( iThread + i ) % g_nWorkThreads;
+			int nRemaining = g_WorkDeques[iTest].m_nRemaining;
+			if ( nRemaining > nBest )
+			{
+				nBest = nRemaining;
+				iVictim = iTest;
+			}
+		}
+
+		if ( iVictim == -1 )
+			return false;
+
+		CThreadWorkDeque &victim = g_WorkDeques[iVictim];
+		CWorkRange stolen;
+		bool bStole = false;
+
+		victim.m_Mutex.Lock();
+		if ( victim.m_iHead < victim.m_iTail )
+		{
+			CWorkRange &range = victim.m_pRanges[ victim.m_iTail - 1 ];
+			int nCount = range.m_iEnd - range.m_iStart;
+
+			stolen.m_iEnd = range.m_iEnd;
+			stolen.m_iStart = range.m_iEnd - Max( 1, nCount / 2 );
 
+			range.m_iEnd = stolen.m_iStart;
+			if ( range.m_iStart == range.m_iEnd )
+				victim.m_iTail--;
+
+			victim.m_nRemaining -= stolen.m_iEnd - stolen.m_iStart;
+			bStole = true;
+		}
+		victim.m_Mutex.Unlock();
+
+		if ( bStole )
+		{
+			// Our deque is empty, so there is always room at the front of it.
+			self.m_Mutex.Lock();
+			self.m_iHead = 0;
+			self.m_iTail = 1;
+			self.m_pRanges[0] = stolen;
+			self.m_nRemaining = stolen.m_iEnd - stolen.m_iStart;
+			self.m_Mutex.Unlock();
+
+			ThreadInterlockedIncrement( &g_nWorkSteals );
+			return true;
+		}
+
+		// Someone else emptied the victim first - look again.
+	}
+}
 
 
 /*
@@ -52,23 +240,30 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
+	int iThread = g_iWorkThreadIndex;
+	if ( iThread < 0 || iThread >= g_nWorkThreads )
+		iThread = 0;
 
-	ThreadLock ();
+	CThreadWorkDeque &deque = g_WorkDeques[iThread];
 
-	if (dispatch == workcount)
+	if ( deque.m_iChunkCur == deque.m_iChunkEnd )
 	{
-		ThreadUnlock ();
-		return -1;
-	}
-
-	UpdatePacifier( (float)dispatch / workcount );
+		// A freshly stolen range can itself be stolen before we get to it, so keep trying.
+		while ( !PopOwnChunk( deque ) )
+		{
+			if ( !StealWork( iThread ) )
+				return -1;
+		}
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		long nDispatched = ThreadInterlockedExchangeAdd( &g_nWorkDispatched, deque.m_iChunkEnd - deque.m_iChunkCur );
+		if ( pacifier && g_PacifierMutex.TryLock() )
+		{
+			UpdatePacifier( (float)nDispatched / workcount );
+			g_PacifierMutex.Unlock();
+		}
+	}
 
-	return r;
+	return deque.m_iChunkCur++;
 }
 
 
@@ -136,10 +331,14 @@ void ThreadSetDefault (void)
 	{
 		GetSystemInfo (&info);
 		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	// Per-thread arrays in the tools are sized by MAX_TOOL_THREADS.
+	if (numthreads > MAX_TOOL_THREADS)
+		numthreads = MAX_TOOL_THREADS;
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -169,11 +368,20 @@ void ThreadUnlock (void)
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iWorkThreadIndex = pData->m_iThread;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
 	return 0;
 }
 
 
+// WaitForMultipleObjects only takes MAXIMUM_WAIT_OBJECTS (64) handles at a time.
+static void WaitForThreads( int nThreads, HANDLE *pHandles )
+{
+	for ( int i=0; i < nThreads; i += MAXIMUM_WAIT_OBJECTS )
+		WaitForMultipleObjects( min( nThreads - i, MAXIMUM_WAIT_OBJECTS ), pHandles + i, TRUE, INFINITE );
+}
+
+
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority )
 {
 	Assert( numthreads > 0 );
@@ -212,12 +420,44 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
+	WaitForThreads( numthreads, g_ThreadHandles );
 	for ( int i=0; i < numthreads; i++ )
 		CloseHandle( g_ThreadHandles[i] );
 
 	threaded = false;
 }
+
+
+void RunThreadsNested( int nThreads, RunThreadsFn fn, void *pUserData )
+{
+	CRunThreadsData data[MAX_TOOL_THREADS];
+	HANDLE handles[MAX_TOOL_THREADS];
+
+	if ( nThreads > MAX_TOOL_THREADS )
+		nThreads = MAX_TOOL_THREADS;
+
+	qboolean bWasThreaded = threaded;
+	threaded = true;
+
+	for ( int i=0; i < nThreads; i++ )
+	{
+		data[i].m_iThread = i;
+		data[i].m_pUserData = pUserData;
+		data[i].m_Fn = fn;
+
+		DWORD dwDummy;
+		handles[i] = CreateThread( NULL, 0, InternalRunThreadsFn, &data[i], 0, &dwDummy );
+
+		if( g_bLowPriorityThreads )
+			SetThreadPriority( handles[i], THREAD_PRIORITY_LOWEST );
+	}
+
+	WaitForThreads( nThreads, handles );
+	for ( int i=0; i < nThreads; i++ )
+		CloseHandle( handles[i] );
+
+	threaded = bWasThreaded;
+}
 	
 
 /*
@@ -230,7 +470,6 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier("");
 	pacifier = showpacifier;
@@ -241,6 +480,9 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
+	if ( numthreads > MAX_TOOL_THREADS )
+		numthreads = MAX_TOOL_THREADS;
+	InitThreadWork( workcnt, numthreads );
 	
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
@@ -250,7 +492,10 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	if (pacifier)
 	{
 		EndPacifier(false);
-		printf (" (%i)\n", end-start);
+		printf (" (%i)", end-start);
+		if ( verbose && g_nWorkSteals )
+			printf (" [%i steals]", (int)g_nWorkSteals);
+		printf ("\n");
 	}
 }
 
@@ -0,0 +1,158 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Pools for the small objects the compile tools make and free by the
+//			million.
+//
+//=============================================================================//
+
+#include "cmdlib.h"
+#include "toolarena.h"
+
+
+// Arenas are globals, so they link themselves in during static init.
+static CToolArena *s_pFirstArena = NULL;
+
+
+CToolArena::CToolArena( const char *pName )
+{
+	m_pName = pName;
+	m_nStageAllocs = 0;
+	for ( int i = 0; i < ARENA_NUM_STRIPES; i++ )
+	{
+		Stripe_t &stripe = m_Stripes[i];
+		memset( stripe.m_pFree, 0, sizeof( stripe.m_pFree ) );
+		stripe.m_pCur = NULL;
+		stripe.m_nCurLeft = 0;
+		stripe.m_nAllocs = 0;
+		stripe.m_nFrees = 0;
+		stripe.m_nBigAllocs = 0;
+	}
+
+	m_pNextArena = s_pFirstArena;
+	s_pFirstArena = this;
+}
+
+
+CToolArena::Stripe_t &CToolArena::GetStripe()
+{
+	// Windows thread ids are multiples of 4, so mix them up before picking a stripe.
+	uint32 id = (uint32)(uintp)ThreadGetCurrentId();
+	return m_Stripes[ ( id * 2654435761u ) >> 28 ];
+}
+
+
+void *CToolArena::Alloc( int nBytes )
+{
+	Header_t *pHeader;
+	int iClass = ( nBytes + sizeof( Header_t ) + ARENA_GRANULE - 1 ) / ARENA_GRANULE - 1;
+
+	Stripe_t &stripe = GetStripe();
+	if ( iClass >= ARENA_NUM_CLASSES )
+	{
+		pHeader = (Header_t *)malloc( sizeof( Header_t ) + nBytes );
+		if ( !pHeader )
+			Error( "Out of memory. CToolArena(%s)::Alloc: %d bytes failed", m_pName, nBytes );
+		pHeader->m_iClass = -1;
+
+		AUTO_LOCK_FM( stripe.m_Mutex );
+		stripe.m_nAllocs++;
+		stripe.m_nBigAllocs++;
+		return pHeader + 1;
+	}
+
+	AUTO_LOCK_FM( stripe.m_Mutex );
+	pHeader = stripe.m_pFree[iClass];
+	if ( pHeader )
+	{
+		stripe.m_pFree[iClass] = pHeader->m_pNext;
+	}
+	else
+	{
+		int nSize = ( iClass + 1 ) * ARENA_GRANULE;
+		if ( stripe.m_nCurLeft < nSize )
+		{
+			// The end of the old block is lost, but it's never more than 1k.
+			stripe.m_pCur = (byte *)malloc( ARENA_BLOCK_SIZE );
+			if ( !stripe.m_pCur )
+				Error( "Out of memory. CToolArena(%s)::Alloc: new block failed", m_pName );
+			stripe.m_nCurLeft = ARENA_BLOCK_SIZE;
+			stripe.m_Blocks.AddToTail( stripe.m_pCur );
+		}
+		pHeader = (Header_t *)stripe.m_pCur;
+		stripe.m_pCur += nSize;
+		stripe.m_nCurLeft -= nSize;
+	}
+
+	pHeader->m_iClass = iClass;
+	stripe.m_nAllocs++;
+	return pHeader + 1;
+}
+
+
+void CToolArena::Free( void *p )
+{
+	Header_t *pHeader = (Header_t *)p - 1;
+	int iClass = pHeader->m_iClass;
+
+	Stripe_t &stripe = GetStripe();
+	if ( iClass < 0 )
+	{
+		free( pHeader );
+
+		AUTO_LOCK_FM( stripe.m_Mutex );
+		stripe.m_nFrees++;
+		return;
+	}
+
+	if ( iClass >= ARENA_NUM_CLASSES )
+		Error( "CToolArena(%s)::Free: bad pointer", m_pName );
+
+	// Whichever stripe frees it gets to reuse it.
+	AUTO_LOCK_FM( stripe.m_Mutex );
+	pHeader->m_pNext = stripe.m_pFree[iClass];
+	stripe.m_pFree[iClass] = pHeader;
+	stripe.m_nFrees++;
+}
+
+
+void CToolArena::EndStage( const char *pStageName, bool bRelease )
+{
+	int nAllocs = 0, nFrees = 0, nBigAllocs = 0, nBlocks = 0;
+	for ( int i = 0; i < ARENA_NUM_STRIPES; i++ )
+	{
+		nAllocs += m_Stripes[i].m_nAllocs;
+		nFrees += m_Stripes[i].m_nFrees;
+		nBigAllocs += m_Stripes[i].m_nBigAllocs;
+		nBlocks += m_Stripes[i].m_Blocks.Count();
+	}
+
+	int nAlive = nAllocs - nFrees;
+	if ( nAllocs != m_nStageAllocs )
+	{
+		qprintf( "%-12s %-10s %9d allocs %9d alive %8.1f MB in blocks (%d from malloc)\n",
+			pStageName, m_pName, nAllocs - m_nStageAllocs, nAlive,
+			(float)nBlocks * ARENA_BLOCK_SIZE / ( 1024.0f * 1024.0f ), nBigAllocs );
+	}
+	m_nStageAllocs = nAllocs;
+
+	if ( !bRelease || nAlive != 0 )
+		return;
+
+	for ( int i = 0; i < ARENA_NUM_STRIPES; i++ )
+	{
+		Stripe_t &stripe = m_Stripes[i];
+		for ( int j = 0; j < stripe.m_Blocks.Count(); j++ )
+			free( stripe.m_Blocks[j] );
+		stripe.m_Blocks.Purge();
+		memset( stripe.m_pFree, 0, sizeof( stripe.m_pFree ) );
+		stripe.m_pCur = NULL;
+		stripe.m_nCurLeft = 0;
+	}
+}
+
+
+void ToolArena_EndStage( const char *pStageName, bool bRelease )
+{
+	for ( CToolArena *pArena = s_pFirstArena; pArena; pArena = pArena->m_pNextArena )
+		pArena->EndStage( pStageName, bRelease );
+}
@@ -7,12 +7,16 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "tier0/threadtools.h"
 
 
-int		c_nodes;
-int		c_nonvis;
+long volatile	c_nodes;
+long volatile	c_nonvis;
 int		c_active_brushes;
 
+CToolArena	g_NodeArena( "nodes" );
+CToolArena	g_BrushArena( "brushes" );
+
 // if a brush just barely pokes onto the other side,
 // let it slide by without chopping
 #define	PLANESIDE_EPSILON	0.001
@@ -310,17 +314,15 @@ AllocNode
 */
 node_t *AllocNode (void)
 {
-	static int s_NodeCount = 0;
+	static long volatile s_NodeCount = 0;
 
 	node_t	*node;
 
-	node = (node_t*)malloc(sizeof(*node));
+	node = (node_t*)g_NodeArena.Alloc(sizeof(*node));
 	memset (node, 0, sizeof(*node));
-	node->id = s_NodeCount;
+	node->id = ThreadInterlockedIncrement (&s_NodeCount) - 1;
 	node->diskId = -1;
 
-	s_NodeCount++;
-
 	return node;
 }
 
@@ -332,15 +334,15 @@ AllocBrush
 */
 bspbrush_t *AllocBrush (int numsides)
 {
-	static int s_BrushId = 0;
+	static long volatile s_BrushId = 0;
 
 	bspbrush_t	*bb;
 	int			c;
 
 	c = (int)&(((bspbrush_t *)0)->sides[numsides]);
-	bb = (bspbrush_t*)malloc(c);
+	bb = (bspbrush_t*)g_BrushArena.Alloc(c);
 	memset (bb, 0, c);
-	bb->id = s_BrushId++;
+	bb->id = ThreadInterlockedIncrement (&s_BrushId) - 1;
 	if (numthreads == 1)
 		c_active_brushes++;
 	return bb;
@@ -358,7 +360,7 @@ void FreeBrush (bspbrush_t *brushes)
 	for (i=0 ; i<brushes->numsides ; i++)
 		if (brushes->sides[i].winding)
 			FreeWinding(brushes->sides[i].winding);
-	free (brushes);
+	g_BrushArena.Free (brushes);
 	if (numthreads == 1)
 		c_active_brushes--;
 }
@@ -839,6 +841,134 @@ qboolean CheckPlaneAgainstVolume (int pnum, node_t *node)
 	return good;
 }
 
+/*
+================
+Parallel tree building
+
+Once a node is split its two subtrees don't share anything, so BrushBSP hands
+big ones to other threads. Near the top of the tree there aren't enough
+subtrees to go around, so idle threads help score the split candidates of the
+nodes that are being worked on instead.
+================
+*/
+#define TREE_TASK_MIN_BRUSHES		32		// smaller subtrees are built by the thread that split them
+#define SPLIT_BATCH_MIN_BRUSHES		64		// smaller lists score their split candidates on one thread
+
+struct splitcandidate_t
+{
+	side_t		*side;
+	int			pnum;
+	qboolean	valid;		// passed CheckPlaneAgainstVolume
+	int			value;
+};
+
+struct splitbatch_t
+{
+	bspbrush_t			*brushes;
+	node_t				*node;
+	splitcandidate_t	*candidates;
+	int					numcandidates;
+	long volatile		next;		// next candidate to score
+	long volatile		done;		// candidates scored
+	long volatile		helpers;	// threads other than the owner scoring it
+};
+
+struct treetask_t
+{
+	node_t		*node;
+	bspbrush_t	*brushes;
+};
+
+struct treebuild_t
+{
+	CThreadFastMutex			mutex;
+	CUtlVector<treetask_t>		tasks;		// subtrees waiting for a thread
+	CUtlVector<splitbatch_t *>	batches;	// nodes whose split candidates can be scored
+	long volatile				pending;	// subtrees queued or being built
+};
+
+/*
+================
+ScoreSplitCandidate
+
+Gives a value estimate for splitting brushes with the candidate's plane.
+Only reads the brushes, so it can run on any thread.
+================
+*/
+void ScoreSplitCandidate (bspbrush_t *brushes, node_t *node, splitcandidate_t *c)
+{
+	bspbrush_t	*test;
+	int			value;
+	int			s;
+	int			front, back, facing, splits;
+	int			bsplits;
+	int			epsilonbrush;
+	qboolean	hintsplit = false;
+
+	CheckPlaneAgainstParents (c->pnum, node);
+
+	c->valid = CheckPlaneAgainstVolume (c->pnum, node);
+	if (!c->valid)
+		return;		// would produce a tiny volume
+
+	front = 0;
+	back = 0;
+	facing = 0;
+	splits = 0;
+	epsilonbrush = 0;
+
+	for (test = brushes ; test ; test=test->next)
+	{
+		s = TestBrushToPlanenum (test, c->pnum, &bsplits, &hintsplit, &epsilonbrush);
+
+		splits += bsplits;
+		if (bsplits && (s&PSIDE_FACING) )
+			Error ("PSIDE_FACING with splits");
+
+		if (s & PSIDE_FACING)
+			facing++;
+		if (s & PSIDE_FRONT)
+			front++;
+		if (s & PSIDE_BACK)
+			back++;
+	}
+
+	// give a value estimate for using this plane
+	value =  5*facing - 5*splits - abs(front-back);
+//		value =  -5*splits;
+//		value =  5*facing - 5*splits;
+	if (g_MainMap->mapplanes[c->pnum].type < 3)
+		value+=5;		// axial is better
+	value -= epsilonbrush*1000;	// avoid!
+
+	// trans should split last
+	if ( c->side->surf & SURF_TRANS )
+	{
+		value -= 500;
+	}
+
+	// never split a hint side except with another hint
+	if (hintsplit && !(c->side->surf & SURF_HINT) )
+		value = -9999999;
+
+	// water should split first
+	if (c->side->contents & (CONTENTS_WATER | CONTENTS_SLIME))
+		value = 9999999;
+
+	c->value = value;
+}
+
+void ScoreSplitBatch (splitbatch_t *batch)
+{
+	int		i;
+
+	while ((i = ThreadInterlockedIncrement (&batch->next) - 1) < batch->numcandidates)
+	{
+		ScoreSplitCandidate (batch->brushes, batch->node, &batch->candidates[i]);
+		ThreadInterlockedIncrement (&batch->done);
+	}
+}
+
 /*
 ================
 SelectSplitSide
@@ -846,26 +976,28 @@ SelectSplitSide
 Using a hueristic, choses one of the sides out of the brushlist
 to partition the brushes with.
 Returns NULL if there are no valid planes to split with..
+
+Scoring a plane marks every side on it as tested, so only the first side
+on each plane is a candidate. That makes the candidates independent of each
+other, and the best one is the same no matter where they're scored.
 ================
 */
 
-side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
+side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node, treebuild_t *build)
 {
-	int			value, bestvalue;
+	int			bestvalue;
 	bspbrush_t	*brush, *test;
 	side_t		*side, *bestside;
 	int			i, j, pass, numpasses;
-	int			pnum;
-	int			s;
-	int			front, back, both, facing, splits;
+	int			pnum, bestpnum;
 	int			bsplits;
-	int			bestsplits;
 	int			epsilonbrush;
-	qboolean	hintsplit = false;
+	qboolean	hintsplit;
+	CUtlVector<splitcandidate_t>	candidates;
 
 	bestside = NULL;
 	bestvalue = -99999;
-	bestsplits = 0;
+	bestpnum = -1;
 
 	// the search order goes: visible-structural, nonvisible-structural
 	// If any valid plane is available in a pass, no further
@@ -873,6 +1005,7 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 	numpasses = 2;
 	for (pass = 0 ; pass < numpasses ; pass++)
 	{
+		candidates.RemoveAll();
 		for (brush = brushes ; brush ; brush=brush->next)
 		{
 			for (i=0 ; i<brush->numsides ; i++)
@@ -895,79 +1028,62 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 				pnum = side->planenum;
 				pnum &= ~1;	// allways use positive facing plane
 
-				CheckPlaneAgainstParents (pnum, node);
-
-				if (!CheckPlaneAgainstVolume (pnum, node))
-					continue;	// would produce a tiny volume
-
-				front = 0;
-				back = 0;
-				both = 0;
-				facing = 0;
-				splits = 0;
-				epsilonbrush = 0;
-
+				// every brush that shares this face would come out facing it,
+				// so don't bother testing that facenum as a splitter again
 				for (test = brushes ; test ; test=test->next)
 				{
-					s = TestBrushToPlanenum (test, pnum, &bsplits, &hintsplit, &epsilonbrush);
-
-					splits += bsplits;
-					if (bsplits && (s&PSIDE_FACING) )
-						Error ("PSIDE_FACING with splits");
-
-					test->testside = s;
-					// if the brush shares this face, don't bother
-					// testing that facenum as a splitter again
-					if (s & PSIDE_FACING)
+					for (j=0 ; j<test->numsides ; j++)
 					{
-						facing++;
-						for (j=0 ; j<test->numsides ; j++)
-						{
-							if ( (test->sides[j].planenum&~1) == pnum)
-								test->sides[j].tested = true;
-						}
+						if ( (test->sides[j].planenum&~1) == pnum)
+							test->sides[j].tested = true;
 					}
-					if (s & PSIDE_FRONT)
-						front++;
-					if (s & PSIDE_BACK)
-						back++;
-					if (s == PSIDE_BOTH)
-						both++;
 				}
 
-				// give a value estimate for using this plane
-				value =  5*facing - 5*splits - abs(front-back);
-//					value =  -5*splits;
-//					value =  5*facing - 5*splits;
-				if (g_MainMap->mapplanes[pnum].type < 3)
-					value+=5;		// axial is better
-				value -= epsilonbrush*1000;	// avoid!
+				splitcandidate_t &c = candidates[candidates.AddToTail()];
+				c.side = side;
+				c.pnum = pnum;
+			}
+		}
 
-				// trans should split last
-				if ( side->surf & SURF_TRANS )
-				{
-					value -= 500;
-				}
+		if (build && candidates.Count() > 1 && CountBrushList (brushes) >= SPLIT_BATCH_MIN_BRUSHES)
+		{
+			splitbatch_t batch;
+			batch.brushes = brushes;
+			batch.node = node;
+			batch.candidates = candidates.Base();
+			batch.numcandidates = candidates.Count();
+			batch.next = 0;
+			batch.done = 0;
+			batch.helpers = 0;
 
-				// never split a hint side except with another hint
-				if (hintsplit && !(side->surf & SURF_HINT) )
-					value = -9999999;
+			{
+				AUTO_LOCK_FM (build->mutex);
+				build->batches.AddToTail (&batch);
+			}
 
-				// water should split first
-				if (side->contents & (CONTENTS_WATER | CONTENTS_SLIME))
-					value = 9999999;
+			ScoreSplitBatch (&batch);
 
-				// save off the side test so we don't need
-				// to recalculate it when we actually seperate
-				// the brushes
-				if (value > bestvalue)
-				{
-					bestvalue = value;
-					bestside = side;
-					bestsplits = splits;
-					for (test = brushes ; test ; test=test->next)
-						test->side = test->testside;
-				}
+			{
+				AUTO_LOCK_FM (build->mutex);
+				build->batches.FindAndRemove (&batch);
+			}
+
+			while (batch.done < batch.numcandidates || batch.helpers)
+				ThreadPause();
+		}
+		else
+		{
+			for (i=0 ; i<candidates.Count() ; i++)
+				ScoreSplitCandidate (brushes, node, &candidates[i]);
+		}
+
+		for (i=0 ; i<candidates.Count() ; i++)
+		{
+			if (candidates[i].valid && candidates[i].value > bestvalue)
+			{
+				bestvalue = candidates[i].value;
+				bestside = candidates[i].side;
+				bestpnum = candidates[i].pnum;
 			}
 		}
 
@@ -977,13 +1093,22 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 		{
 			if (pass > 0)
 			{
-				if (numthreads == 1)
-					c_nonvis++;
+				ThreadInterlockedIncrement (&c_nonvis);
 			}
 			break;
 		}
 	}
 
+	// save off the side test so we don't need
+	// to recalculate it when we actually seperate
+	// the brushes
+	if (bestside)
+	{
+		epsilonbrush = 0;
+		for (test = brushes ; test ; test=test->next)
+			test->side = TestBrushToPlanenum (test, bestpnum, &bsplits, &hintsplit, &epsilonbrush);
+	}
+
 	//
 	// clear all the tested flags we set
 	//
@@ -1327,22 +1452,24 @@ void SplitBrushList (bspbrush_t *brushes,
 /*
 ================
 BuildTree_r
+
+If build is set, big subtrees are queued for the other threads.
 ================
 */
 
 
-node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
+node_t *BuildTree_r (node_t *node, bspbrush_t *brushes, treebuild_t *build = NULL)
 {
 	node_t		*newnode;
 	side_t		*bestside;
 	int			i;
 	bspbrush_t	*children[2];
+	bool		bQueued;
 
-	if (numthreads == 1)
-		c_nodes++;
+	ThreadInterlockedIncrement (&c_nodes);
 
 	// find the best plane to use as a splitter
-	bestside = SelectSplitSide (brushes, node);
+	bestside = SelectSplitSide (brushes, node, build);
 
 	if (!bestside)
 	{
@@ -1371,14 +1498,72 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 	SplitBrush (node->volume, node->planenum, &node->children[0]->volume,
 		&node->children[1]->volume);
 
+	// hand the front to another thread if there's one that could use it
+	bQueued = false;
+	if (build && CountBrushList (children[0]) >= TREE_TASK_MIN_BRUSHES)
+	{
+		AUTO_LOCK_FM (build->mutex);
+		if (build->tasks.Count() < g_nVBSPThreads)
+		{
+			treetask_t &task = build->tasks[build->tasks.AddToTail()];
+			task.node = node->children[0];
+			task.brushes = children[0];
+			ThreadInterlockedIncrement (&build->pending);
+			bQueued = true;
+		}
+	}
+
 	// recursively process children
-	for (i=0 ; i<2 ; i++)
+	for (i = bQueued ? 1 : 0 ; i<2 ; i++)
 	{
-		node->children[i] = BuildTree_r (node->children[i], children[i]);
+		node->children[i] = BuildTree_r (node->children[i], children[i], build);
 	}
 
 	return node;
 }
+
+void BuildTreeThread (int iThread, void *pUserData)
+{
+	treebuild_t		*build = (treebuild_t *)pUserData;
+	treetask_t		task;
+	splitbatch_t	*batch;
+	bool			bHaveTask;
+
+	while (build->pending > 0)
+	{
+		bHaveTask = false;
+		batch = NULL;
+		{
+			AUTO_LOCK_FM (build->mutex);
+			if (build->tasks.Count())
+			{
+				task = build->tasks[0];
+				build->tasks.Remove (0);
+				bHaveTask = true;
+			}
+			else if (build->batches.Count())
+			{
+				batch = build->batches[0];
+				ThreadInterlockedIncrement (&batch->helpers);
+			}
+		}
+
+		if (bHaveTask)
+		{
+			BuildTree_r (task.node, task.brushes, build);
+			ThreadInterlockedDecrement (&build->pending);
+		}
+		else if (batch)
+		{
+			ScoreSplitBatch (batch);
+			ThreadInterlockedDecrement (&batch->helpers);
+		}
+		else
+		{
+			ThreadSleep (0);
+		}
+	}
+}
 	  
 
 //===========================================================
@@ -1447,10 +1632,28 @@ tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
 
 	tree->headnode = node;
 
-	node = BuildTree_r (node, brushlist);
-	qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
-	qprintf ("%5i nonvis nodes\n", c_nonvis);
-	qprintf ("%5i leafs\n", (c_nodes+1)/2);
+	if (g_nVBSPThreads > 1 && c_brushes >= TREE_TASK_MIN_BRUSHES*2)
+	{
+		treebuild_t		build;
+		treetask_t		&task = build.tasks[build.tasks.AddToTail()];
+
+		task.node = node;
+		task.brushes = brushlist;
+		build.pending = 1;
+
+		// the winding and brush counters are only kept single threaded
+		int nOldThreads = numthreads;
+		numthreads = g_nVBSPThreads;
+		RunThreadsNested (g_nVBSPThreads, BuildTreeThread, &build);
+		numthreads = nOldThreads;
+	}
+	else
+	{
+		node = BuildTree_r (node, brushlist);
+	}
+	qprintf ("%5i visible nodes\n", (int)(c_nodes/2 - c_nonvis));
+	qprintf ("%5i nonvis nodes\n", (int)c_nonvis);
+	qprintf ("%5i leafs\n", (int)((c_nodes+1)/2));
 #if 0
 {	// debug code
 static node_t	*tnode;
@@ -16,5 +16,9 @@ void GetEdge2_InitOptimizedList();	// Call this before calling GetEdge2() on a b
 int AddEdge( int v1, int v2, face_t *f );
 int GetEdge2(int v1, int v2,  face_t *f);
 
+// Finds an unshared edge from v2 to v1 on a face with the same contents as f, and makes f
+// its back face. Returns -1 if there isn't one.
+int ShareBackEdge( int v1, int v2, face_t *f );
+
 
 #endif // FACES_H
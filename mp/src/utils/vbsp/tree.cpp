@@ -7,7 +7,7 @@
 //=============================================================================//
 #include "vbsp.h"
 
-extern	int	c_nodes;
+extern	long volatile	c_nodes;
 
 void RemovePortalFromNode (portal_t *portal, node_t *l);
 
@@ -92,7 +92,7 @@ void FreeTree_r (node_t *node)
 
 	if (numthreads == 1)
 		c_nodes--;
-	free (node);
+	g_NodeArena.Free (node);
 }
 
 
@@ -56,6 +56,8 @@ bool		g_NodrawTriggers = false;
 bool		g_DisableWaterLighting = false;
 bool		g_bAllowDetailCracks = false;
 bool		g_bNoVirtualMesh = false;
+int			g_nVBSPThreads = 1;
+bool		g_bFastCompress = false;
 
 float		g_defaultLuxelSize = DEFAULT_LUXEL_SIZE;
 float		g_luxelScale = 1.0f;
@@ -257,6 +259,7 @@ void ProcessWorldModel (void)
 
 		RunThreadsOnIndividual ((block_xh-block_xl+1)*(block_yh-block_yl+1),
 			!verbose, ProcessBlock_Thread);
+		ToolArena_EndStage ("BrushBSP");
 
 		//
 		// build the division tree
@@ -303,6 +306,7 @@ void ProcessWorldModel (void)
 
 		// mark the brush sides that actually turned into faces
 		MarkVisibleSides (tree, brush_start, brush_end, NO_DETAIL);
+		ToolArena_EndStage ("Portals");
 		if (noopt || leaked)
 			break;
 		if (!optimize)
@@ -324,6 +328,7 @@ void ProcessWorldModel (void)
 	// it also subdivides each face if necessary to fit max lightmap dimensions
 	MakeFaces (tree->headnode);
 	Msg("done (%d)\n", (int)(Plat_FloatTime() - start) );
+	ToolArena_EndStage ("MakeFaces");
 
 	if (glview)
 	{
@@ -345,6 +350,7 @@ void ProcessWorldModel (void)
 	// This unifies the vertex list for all edges (splits collinear edges to remove t-junctions)
 	// It also welds the list of vertices out of each winding/portal and rounds nearly integer verts to integer
 	pLeafFaceList = FixTjuncs (tree->headnode, pLeafFaceList);
+	ToolArena_EndStage ("FixTjuncs");
 
 	// this merges all of the solid nodes that have separating planes
 	if (!noprune)
@@ -367,6 +373,7 @@ void ProcessWorldModel (void)
 
 	FreeTree( tree );
 	FreeLeafFaces( pLeafFaceList );
+	ToolArena_EndStage ("World", true);
 }
 
 /*
@@ -426,6 +433,7 @@ void ProcessSubModel( )
 #endif
 
 	FreeTree (tree);
+	ToolArena_EndStage ("Submodel", true);
 }
 
 
@@ -986,6 +994,17 @@ int RunVBSP( int argc, char **argv )
 			Msg ("onlyprops = true\n");
 			onlyprops = true;
 		}
+		else if (!Q_stricmp(argv[i], "-fastcompress"))
+		{
+			Msg ("fastcompress = true\n");
+			g_bFastCompress = true;
+		}
+		else if (!Q_stricmp(argv[i], "-weldcell"))
+		{
+			g_flWeldCellSize = atof(argv[i+1]);
+			Msg ("weldcell = %f\n", g_flWeldCellSize);
+			i++;
+		}
 		else if (!Q_stricmp(argv[i], "-micro"))
 		{
 			microvolume = atof(argv[i+1]);
@@ -1179,6 +1198,13 @@ int RunVBSP( int argc, char **argv )
 				"  -nocsg       : Don't chop out intersecting brush areas.\n"
 				"  -noshare     : Emit unique face edges instead of sharing them.\n"
 				"  -notjunc     : Don't fixup t-junctions.\n"
+				"  -fastcompress: Compress the lumps of the .bsp with snappy. vvis and vrad\n"
+				"                 read it and write it back uncompressed, but the engine\n"
+				"                 can't load it until they have.\n"
+				"  -weldcell <#>: Size of the cells vertices are sorted into for welding and\n"
+				"                 t-junction fixing (default: 64). Any size gives the same\n"
+				"                 output, but vertexes now weld across the old 128 unit xy\n"
+				"                 grid lines, so maps can differ slightly from older vbsp.\n"
 				"  -noopt       : By default, vbsp removes the 'outer shell' of the map, which\n"
 				"                 are all the faces you can't see because you can never get\n"
 				"                 outside the map. -noopt disables this behaviour.\n"
@@ -1242,6 +1268,8 @@ int RunVBSP( int argc, char **argv )
 	}
 
 	ThreadSetDefault ();
+	g_nVBSPThreads = numthreads;	// the few stages that scale spread themselves over these
+	g_nLumpThreads = g_nVBSPThreads;
 	numthreads = 1;		// multiple threads aren't helping...
 
 	// Setup the logfile.
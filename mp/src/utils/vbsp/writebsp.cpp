@@ -294,31 +294,18 @@ int CreateOrigFace( face_t *f )
         eIndex[0] = vIndices[i];
         eIndex[1] = vIndices[(i+1)%pWinding->numpoints];
 
-        for( j = firstmodeledge; j < numedges; j++ )
+        j = ShareBackEdge( eIndex[0], eIndex[1], f );
+        if( j != -1 )
         {
-            if( ( eIndex[0] == dedges[j].v[1] ) &&
-                ( eIndex[1] == dedges[j].v[0] ) &&
-         	    ( edgefaces[j][0]->contents == f->contents ) )
-            {
-                // check for multiple backward edges!! -- shouldn't have
-				if( edgefaces[j][1] )
-					continue;
-
-                // set back edge
-				edgefaces[j][1] = f;
-
-                //
-                // get next surface edge
-                //
-                if( numsurfedges >= MAX_MAP_SURFEDGES )
-                    Error( "Too much brush geometry in bsp, numsurfedges == MAX_MAP_SURFEDGES" );                
-                dsurfedges[numsurfedges] = -j;
-                numsurfedges++;
-                break;
-            }
+            //
+            // get next surface edge
+            //
+            if( numsurfedges >= MAX_MAP_SURFEDGES )
+                Error( "Too much brush geometry in bsp, numsurfedges == MAX_MAP_SURFEDGES" );                
+            dsurfedges[numsurfedges] = -j;
+            numsurfedges++;
         }
-        
-        if( j == numedges )
+        else
         {
             //
             // get next edge
@@ -1288,6 +1275,10 @@ void EndBSPFile (void)
 	GetPlatformMapPath( source, targetPath, g_nDXLevel, 1024 );
 	Msg ("Writing %s\n", targetPath);
 	WriteBSPFile (targetPath);
+
+	// only tools can read it, but vvis and vrad always come next
+	if (g_bFastCompress)
+		CompressBSPFile (targetPath, CompressLumpSnappy);
 }
 
 
@@ -19,6 +19,8 @@
 #pragma once
 #endif
 
+#include "utlvector.h"
+
 #define MAX_MAX_LIGHTMAP_WIDTH 2048
 
 
@@ -31,8 +33,12 @@ public:
 	bool Reset( int maxLightmapWidth, int maxLightmapHeight );
 	bool AddBlock( int width, int height, int *returnX, int *returnY );
 
+	int GetAreaUsed() const { return m_AreaUsed; }
+	int GetMinimumHeight() const { return m_MinimumHeight; }
+
 protected:
 	int GetMaxYIndex( int firstX, int width );
+	int GetWastedArea( int firstX, int width, int y );
 
 	int m_MaxLightmapWidth;
 	int m_MaxLightmapHeight;
@@ -48,4 +54,46 @@ protected:
 };
 
 
+//-----------------------------------------------------------------------------
+// Packs a whole set of blocks into as few pages as it can
+//-----------------------------------------------------------------------------
+enum
+{
+	IMAGEPACKER_SORT_NONE = 0,		// in the order they were given
+	IMAGEPACKER_SORT_HEIGHT,
+	IMAGEPACKER_SORT_AREA,
+	IMAGEPACKER_SORT_MAX_SIDE,
+	IMAGEPACKER_SORT_WIDTH,
+
+	IMAGEPACKER_SORT_COUNT
+};
+
+// Width and height go in, page and position come out
+struct ImagePackerBlock_t
+{
+	int m_nWidth;
+	int m_nHeight;
+	int m_nPage;
+	int m_nX;
+	int m_nY;
+};
+
+struct ImagePackerStats_t
+{
+	int		m_nSortOrder;		// IMAGEPACKER_SORT_ the blocks went in
+	int		m_nPages;
+	int64	m_nBlockArea;		// area of all the blocks
+	int64	m_nPageArea;		// every page but the last is full, the last one only up to its top block
+};
+
+// Packs the blocks in a single order. Returns false if a block is bigger than a page.
+bool PackImageBlocks( CUtlVector<ImagePackerBlock_t> &blocks, int nPageWidth, int nPageHeight, 
+					 int nSortOrder, ImagePackerStats_t *pStats );
+
+// Tries every sort order, on all threads if bThreaded, and keeps the one that needs
+// the fewest pages.
+bool PackImageBlocksBestOrder( CUtlVector<ImagePackerBlock_t> &blocks, int nPageWidth, int nPageHeight, 
+							  bool bThreaded, ImagePackerStats_t *pStats );
+
+
 #endif // IMAGEPACKER_H
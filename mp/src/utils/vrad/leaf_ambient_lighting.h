@@ -10,6 +10,19 @@
 #pragma once
 #endif
 
+#include "mathlib/vector.h"
+#include "utlvector.h"
+
+
+struct ambientsample_t
+{
+	Vector pos;
+	Vector cube[6];
+};
+
+// samples for each leaf, valid after ComputePerLeafAmbientLighting
+extern CUtlVector< CUtlVector<ambientsample_t> > g_LeafAmbientSamples;
+
 
 void ComputePerLeafAmbientLighting();
 
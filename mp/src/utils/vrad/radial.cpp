@@ -13,6 +13,7 @@
 #include "utlrbtree.h"
 #include "mathlib/VMatrix.h"
 #include "macro_texture.h"
+#include "relightcache.h"
 
 
 void WorldToLuxelSpace( lightinfo_t const *l, Vector const &world, Vector2D &coord )
@@ -669,6 +670,10 @@ void FinalLightFace( int iThread, int facenum )
 	if ( !lightstyles )
 		return;
 
+	// faces nothing changed around keep the lightmap of the last compile
+	if ( g_RelightCache.RestoreFaceLighting( facenum ) )
+		return;
+
 	
 	//
 	// sample the triangulation
@@ -715,16 +720,31 @@ void FinalLightFace( int iThread, int facenum )
 			}
 		}
 
+		const ColorRGBExp32 *pCachedIndirect = NULL;
+		ColorRGBExp32 *pCapturedIndirect = NULL;
 		if (numbounce > 0 && k == 0)
 		{
-			// currently only radiosity light non-displacement surfaces!
-			if( !bDisp )
+			if ( g_RelightCache.IsRelighting() )
 			{
-				prad = BuildPatchRadial( facenum );
+				// there was no bounce, use the bounced light of the last full compile
+				pCachedIndirect = g_RelightCache.GetFaceIndirect( facenum, fl->numluxels * bumpSampleCount );
 			}
 			else
 			{
-				prad = StaticDispMgr()->BuildPatchRadial( facenum, needsBumpmap );
+				// currently only radiosity light non-displacement surfaces!
+				if( !bDisp )
+				{
+					prad = BuildPatchRadial( facenum );
+				}
+				else
+				{
+					prad = StaticDispMgr()->BuildPatchRadial( facenum, needsBumpmap );
+				}
+
+				if ( g_RelightCache.WantsFaceIndirect() )
+				{
+					pCapturedIndirect = g_RelightCache.AllocFaceIndirect( facenum, fl->numluxels * bumpSampleCount );
+				}
 			}
 		}
 
@@ -784,6 +804,23 @@ void FinalLightFace( int iThread, int facenum )
 				{
 					lb[bumpSample].AddLight( v[bumpSample] );
 				}
+
+				if ( pCapturedIndirect )
+				{
+					for( bumpSample = 0; bumpSample < bumpSampleCount; ++bumpSample )
+					{
+						VectorToColorRGBExp32( v[bumpSample].m_vecLighting, pCapturedIndirect[j * bumpSampleCount + bumpSample] );
+					}
+				}
+			}
+			else if ( pCachedIndirect )
+			{
+				for( bumpSample = 0; bumpSample < bumpSampleCount; ++bumpSample )
+				{
+					Vector vecIndirect;
+					ColorRGBExp32ToVector( pCachedIndirect[j * bumpSampleCount + bumpSample], vecIndirect );
+					lb[bumpSample].AddWeighted( vecIndirect, 1.0f );
+				}
 			}
 
 			if ( bDisp && g_bDumpPatches )
@@ -0,0 +1,1226 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Sidecar cache used to relight only what changed since the last
+//			compile of a map. See relightcache.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "relightcache.h"
+#include "lightmap.h"
+#include "leaf_ambient_lighting.h"
+#include <stdio.h>
+
+
+#define RELIGHTCACHE_MAGIC			( ( 'C' << 24 ) + ( 'R' << 16 ) + ( 'D' << 8 ) + 'V' )
+#define RELIGHTCACHE_VERSION		2
+
+// size of the cells the shadow casting triangles are hashed into
+#define RELIGHT_CELL_SIZE			256.0f
+
+// light below this doesn't count when working out how far a light reaches
+#define RELIGHT_MIN_LIGHT			( 1.0f / 1024.0f )
+
+// how far around changed geometry the sky ambient light is assumed to change
+#define RELIGHT_SKY_AMBIENT_RADIUS	1024.0f
+
+// slop around changed geometry and between displacements that are filtered together
+#define RELIGHT_GEOMETRY_PAD		16.0f
+
+
+CRelightCache g_RelightCache;
+
+
+struct RelightCacheHeader_t
+{
+	int32 m_nMagic;
+	int32 m_nVersion;
+	MD5Value_t m_SettingsHash;
+
+	int32 m_nLights;
+	int32 m_nCells;
+	int32 m_nFaces;
+	int32 m_nLeafs;
+	int32 m_nLeafSamples;
+	int32 m_nPad;
+	int64 m_nFaceDataSize;
+};
+
+// lights are compared byte for byte, so records are zeroed before they are filled in
+struct RelightLight_t
+{
+	dworldlight_t m_Light;
+	float m_flStartFadeDistance;
+	float m_flEndFadeDistance;
+	float m_flCapDist;
+};
+
+struct RelightCell_t
+{
+	int64 m_nKey;
+	uint64 m_nHash;				// sum of the hashes of the triangles centered in the cell
+	Vector m_Mins;				// bounds of those triangles
+	Vector m_Maxs;
+};
+
+struct RelightFace_t
+{
+	int64 m_nDataOffset;		// into the face data
+	MD5Value_t m_Hash;
+	byte m_Styles[MAXLIGHTMAPS];
+	int32 m_nLightBytes;		// average colors and lightmaps as laid out in the lighting lump
+	int32 m_nIndirect;			// bounced light samples that follow them
+	int32 m_nPad;
+};
+
+struct RelightLeaf_t
+{
+	int32 m_nContents;
+	int32 m_nCluster;
+	int16 m_Mins[3];
+	int16 m_Maxs[3];
+	int32 m_nFirstSample;
+	int32 m_nSamples;
+};
+
+
+//-----------------------------------------------------------------------------
+// Helpers
+//-----------------------------------------------------------------------------
+static uint64 HashRelightBytes( uint64 nHash, const void *pData, int nBytes )
+{
+	// 64-bit FNV-1a
+	const byte *pBytes = (const byte *)pData;
+	for ( int i = 0; i < nBytes; i++ )
+	{
+		nHash ^= pBytes[i];
+		nHash *= 0x100000001b3ull;
+	}
+	return nHash;
+}
+
+static int64 RelightCellKey( const Vector &vecPoint )
+{
+	int64 nKey = 0;
+	for ( int i = 0; i < 3; i++ )
+	{
+		int nCell = (int)floor( vecPoint[i] / RELIGHT_CELL_SIZE );
+		nKey = ( nKey << 16 ) | ( nCell & 0xFFFF );
+	}
+	return nKey;
+}
+
+static int CompareRelightCells( const void *a, const void *b )
+{
+	int64 nKeyA = ( (const RelightCell_t *)a )->m_nKey;
+	int64 nKeyB = ( (const RelightCell_t *)b )->m_nKey;
+	return ( nKeyA < nKeyB ) ? -1 : ( nKeyA > nKeyB );
+}
+
+static int CompareRelightLights( const void *a, const void *b )
+{
+	return memcmp( a, b, sizeof( RelightLight_t ) );
+}
+
+struct FaceHashIndex_t
+{
+	MD5Value_t m_Hash;
+	int m_nIndex;
+};
+
+static int CompareFaceHashIndices( const void *a, const void *b )
+{
+	int nCmp = memcmp( a, b, sizeof( MD5Value_t ) );
+	if ( nCmp )
+		return nCmp;
+	return ( (const FaceHashIndex_t *)a )->m_nIndex - ( (const FaceHashIndex_t *)b )->m_nIndex;
+}
+
+// qsort has no context argument, so the bounds the face indices are sorted by go through here
+static const Vector *s_pSortFaceMins = NULL;
+
+static int CompareFaceMinsX( const void *a, const void *b )
+{
+	float flA = s_pSortFaceMins[*(const int *)a].x;
+	float flB = s_pSortFaceMins[*(const int *)b].x;
+	return ( flA < flB ) ? -1 : ( flA > flB );
+}
+
+static bool IsSkyLight( const RelightLight_t &light )
+{
+	return light.m_Light.type == emit_skylight || light.m_Light.type == emit_skyambient;
+}
+
+static bool BoxesTouch( const Vector &mins1, const Vector &maxs1, const Vector &mins2, const Vector &maxs2 )
+{
+	return mins1.x <= maxs2.x && mins2.x <= maxs1.x &&
+		   mins1.y <= maxs2.y && mins2.y <= maxs1.y &&
+		   mins1.z <= maxs2.z && mins2.z <= maxs1.z;
+}
+
+// Conservative test for whether a box can be in the shadow a sun casts past another box.
+// Both boxes are treated as their bounding spheres, and the shadow widens by flSpread per unit.
+static bool BoxInSunShadow( const Vector &casterMins, const Vector &casterMaxs, const Vector &vecSunDir,
+							float flSpread, const Vector &mins, const Vector &maxs )
+{
+	float flRadius = 0.5f * ( ( casterMaxs - casterMins ).Length() + ( maxs - mins ).Length() );
+	Vector vecDelta = ( mins + maxs - casterMins - casterMaxs ) * 0.5f;
+	float t = DotProduct( vecDelta, vecSunDir );
+	if ( t < -flRadius )
+		return false;
+
+	Vector vecPerp = vecDelta - vecSunDir * t;
+	return vecPerp.Length() <= flRadius + max( t, 0.0f ) * flSpread;
+}
+
+// How far a light can reach before it drops below RELIGHT_MIN_LIGHT
+static float LightInfluenceRadius( const RelightLight_t &light )
+{
+	const dworldlight_t &wl = light.m_Light;
+	if ( light.m_flEndFadeDistance > light.m_flStartFadeDistance )
+		return light.m_flEndFadeDistance;
+	if ( wl.radius > 0 )
+		return wl.radius;
+
+	float c = wl.constant_attn;
+	float l = wl.linear_attn;
+	float q = wl.quadratic_attn;
+	if ( c == 0 && l == 0 && q == 0 )
+	{
+		// surface lights fall off with the square of the distance
+		q = 1;
+	}
+
+	float flIntensity = max( wl.intensity.x, max( wl.intensity.y, wl.intensity.z ) );
+	float flTarget = flIntensity / RELIGHT_MIN_LIGHT - c;
+	float flRadius = MAX_TRACE_LENGTH;
+	if ( flTarget <= 0 )
+		flRadius = 0;
+	else if ( q > 0 )
+		flRadius = ( -l + sqrt( l * l + 4 * q * flTarget ) ) / ( 2 * q );
+	else if ( l > 0 )
+		flRadius = flTarget / l;
+
+	return min( flRadius, (float)MAX_TRACE_LENGTH );
+}
+
+static int FaceLightStyles( const byte *pStyles )
+{
+	int nStyles;
+	for ( nStyles = 0; nStyles < MAXLIGHTMAPS; nStyles++ )
+	{
+		if ( pStyles[nStyles] == 255 )
+			break;
+	}
+	return nStyles;
+}
+
+static int FaceLightStyles( const dface_t *f )
+{
+	return FaceLightStyles( f->styles );
+}
+
+// Size of a face's average colors and lightmaps with the given styles, the same way
+// PrecompLightmapOffsets lays them out
+static int FaceLightBytes( const dface_t *f, const byte *pStyles )
+{
+	if ( texinfo[f->texinfo].flags & TEX_SPECIAL )
+		return 0;
+
+	int nStyles = FaceLightStyles( pStyles );
+	int nLuxels = ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+	int nBumps = ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT ) ? NUM_BUMP_VECTS + 1 : 1;
+	return nStyles * 4 + nLuxels * 4 * nStyles * nBumps;
+}
+
+static int FaceLightBytes( const dface_t *f )
+{
+	return FaceLightBytes( f, f->styles );
+}
+
+
+//-----------------------------------------------------------------------------
+// CRelightCache
+//-----------------------------------------------------------------------------
+CRelightCache::CRelightCache()
+{
+	m_bEnabled = false;
+	m_bRelighting = false;
+	m_bFaceLightingDone = false;
+	m_szFileName[0] = 0;
+	memset( &m_SettingsHash, 0, sizeof( m_SettingsHash ) );
+	m_bHasSun = false;
+	m_bHasSkyAmbient = false;
+	m_vecSunDir.Init();
+	FreeCache();
+}
+
+CRelightCache::~CRelightCache()
+{
+}
+
+void CRelightCache::SetCommandLine( int argc, char **argv )
+{
+	// options that don't change the lighting, and how many values follow them
+	static const struct
+	{
+		const char *m_pName;
+		int m_nValues;
+	} s_IgnoredOptions[] =
+	{
+		{ "-v", 0 }, { "-verbose", 0 }, { "-threads", 1 }, { "-low", 0 }, { "-relight", 0 },
+		{ "-vradcache", 0 }, { "-rtcache", 0 }, { "-rtbench", 0 }, { "-transfermem", 1 },
+		{ "-game", 1 }, { "-vproject", 1 }, { "-novconfig", 0 }, { "-StopOnExit", 0 }, { "-steam", 0 },
+		{ "-allowdebug", 0 }, { "-FullMinidumps", 0 }, { "-rederrors", 0 }, { "-dump", 0 },
+		{ "-dumpnormals", 0 }, { "-dumptrace", 0 }, { "-lightmappackestimate", 0 }, { "-loghash", 0 }, { "-dist", 1 }, { "-distport", 1 },
+		{ "-distlisten", 0 }, { "-distworker", 1 }, { "-disttoken", 1 },
+	};
+
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+
+	int nVersion = RELIGHTCACHE_VERSION;
+	MD5Update( &ctx, (unsigned char const *)&nVersion, sizeof( nVersion ) );
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !Q_strncasecmp( argv[i], "-mpi", 4 ) )
+		{
+			if ( i + 1 < argc && argv[i+1][0] != '-' )
+				++i;
+			continue;
+		}
+
+		int nSkip = -1;
+		for ( int j = 0; j < ARRAYSIZE( s_IgnoredOptions ); j++ )
+		{
+			if ( !Q_stricmp( argv[i], s_IgnoredOptions[j].m_pName ) )
+			{
+				nSkip = s_IgnoredOptions[j].m_nValues;
+				break;
+			}
+		}
+
+		if ( nSkip >= 0 )
+		{
+			i += nSkip;
+			continue;
+		}
+
+		char szOption[256];
+		Q_strncpy( szOption, argv[i], sizeof( szOption ) );
+		Q_strlower( szOption );
+		MD5Update( &ctx, (unsigned char const *)szOption, Q_strlen( szOption ) + 1 );
+	}
+
+	MD5Final( m_SettingsHash.bits, &ctx );
+}
+
+void CRelightCache::Init( const char *pMapBase )
+{
+	m_bEnabled = true;
+	Q_snprintf( m_szFileName, sizeof( m_szFileName ), "%s%s.vradcache", pMapBase, g_bHDR ? "_hdr" : "" );
+}
+
+void CRelightCache::HashShadowCasters()
+{
+	if ( !m_bEnabled )
+		return;
+
+	int nTris = g_RtEnv.OptimizedTriangleList.Count();
+	bool bColors = ( g_RtEnv.TriangleColors.Count() == nTris );
+	bool bMaterials = ( g_RtEnv.TriangleMaterials.Count() == nTris );
+
+	CUtlVector<RelightCell_t> tris;
+	tris.SetCount( nTris );
+	for ( int i = 0; i < nTris; i++ )
+	{
+		TriGeometryData_t &tri = g_RtEnv.OptimizedTriangleList[i].m_Data.m_GeometryData;
+
+		// the low bits of the id are prop indices, which move around when props are added
+		int32 nIdType = tri.m_nTriangleID & 0xFF000000;
+		uint64 nHash = 0xcbf29ce484222325ull;
+		nHash = HashRelightBytes( nHash, tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		nHash = HashRelightBytes( nHash, &tri.m_nFlags, sizeof( tri.m_nFlags ) );
+		nHash = HashRelightBytes( nHash, &nIdType, sizeof( nIdType ) );
+		if ( bColors )
+			nHash = HashRelightBytes( nHash, &g_RtEnv.TriangleColors[i], sizeof( Vector ) );
+		if ( bMaterials )
+			nHash = HashRelightBytes( nHash, &g_RtEnv.TriangleMaterials[i], sizeof( int32 ) );
+
+		RelightCell_t &cell = tris[i];
+		cell.m_nHash = nHash;
+		cell.m_Mins = tri.Vertex( 0 );
+		cell.m_Maxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( cell.m_Mins, tri.Vertex( v ), cell.m_Mins );
+			VectorMax( cell.m_Maxs, tri.Vertex( v ), cell.m_Maxs );
+		}
+		cell.m_nKey = RelightCellKey( ( cell.m_Mins + cell.m_Maxs ) * 0.5f );
+	}
+
+	qsort( tris.Base(), tris.Count(), sizeof( RelightCell_t ), CompareRelightCells );
+
+	// the hashes are summed so the order the triangles were added in doesn't matter
+	m_Cells.RemoveAll();
+	for ( int i = 0; i < nTris; i++ )
+	{
+		if ( m_Cells.Count() && m_Cells.Tail().m_nKey == tris[i].m_nKey )
+		{
+			RelightCell_t &cell = m_Cells.Tail();
+			cell.m_nHash += tris[i].m_nHash;
+			VectorMin( cell.m_Mins, tris[i].m_Mins, cell.m_Mins );
+			VectorMax( cell.m_Maxs, tris[i].m_Maxs, cell.m_Maxs );
+		}
+		else
+		{
+			m_Cells.AddToTail( tris[i] );
+		}
+	}
+}
+
+void CRelightCache::BeginLighting()
+{
+	if ( !m_bEnabled )
+		return;
+
+	m_Lights.RemoveAll();
+	m_bHasSun = false;
+	m_bHasSkyAmbient = false;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		RelightLight_t &light = m_Lights[m_Lights.AddToTail()];
+		memset( &light, 0, sizeof( light ) );
+		light.m_Light = dl->light;
+		light.m_Light.flags = 0;
+		light.m_flStartFadeDistance = dl->m_flStartFadeDistance;
+		light.m_flEndFadeDistance = dl->m_flEndFadeDistance;
+		light.m_flCapDist = dl->m_flCapDist;
+
+		if ( dl->light.type == emit_skylight )
+		{
+			m_bHasSun = true;
+			m_vecSunDir = dl->light.normal;
+		}
+		else if ( dl->light.type == emit_skyambient && !dl->light.intensity.IsZero() )
+		{
+			m_bHasSkyAmbient = true;
+		}
+	}
+	qsort( m_Lights.Base(), m_Lights.Count(), sizeof( RelightLight_t ), CompareRelightLights );
+
+	m_FaceIndirect.SetCount( numfaces );
+}
+
+void CRelightCache::ComputeFaceHashes()
+{
+	if ( m_FaceHashes.Count() == numfaces )
+		return;
+
+	m_FaceHashes.SetCount( numfaces );
+	m_FaceMins.SetCount( numfaces );
+	m_FaceMaxs.SetCount( numfaces );
+
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		dface_t *f = &g_pFaces[iFace];
+
+		MD5Context_t ctx;
+		memset( &ctx, 0, sizeof( ctx ) );
+		MD5Init( &ctx );
+
+		dplane_t *pPlane = &dplanes[f->planenum];
+		MD5Update( &ctx, (unsigned char const *)&pPlane->normal, sizeof( pPlane->normal ) );
+		MD5Update( &ctx, (unsigned char const *)&pPlane->dist, sizeof( pPlane->dist ) );
+
+		Vector mins( COORD_EXTENT, COORD_EXTENT, COORD_EXTENT );
+		Vector maxs( -COORD_EXTENT, -COORD_EXTENT, -COORD_EXTENT );
+		for ( int j = 0; j < f->numedges; j++ )
+		{
+			int surfEdge = dsurfedges[f->firstedge + j];
+			int v = ( surfEdge < 0 ) ? dedges[-surfEdge].v[1] : dedges[surfEdge].v[0];
+			Vector &vecPoint = dvertexes[v].point;
+			MD5Update( &ctx, (unsigned char const *)&vecPoint, sizeof( vecPoint ) );
+			VectorMin( mins, vecPoint, mins );
+			VectorMax( maxs, vecPoint, maxs );
+		}
+
+		texinfo_t *pTexInfo = &texinfo[f->texinfo];
+		MD5Update( &ctx, (unsigned char const *)pTexInfo, sizeof( texinfo_t ) );
+		if ( pTexInfo->texdata >= 0 )
+		{
+			dtexdata_t *pTexData = &dtexdata[pTexInfo->texdata];
+			MD5Update( &ctx, (unsigned char const *)&pTexData->reflectivity, sizeof( pTexData->reflectivity ) );
+			const char *pMaterial = TexDataStringTable_GetString( pTexData->nameStringTableID );
+			MD5Update( &ctx, (unsigned char const *)pMaterial, Q_strlen( pMaterial ) );
+		}
+
+		MD5Update( &ctx, (unsigned char const *)f->m_LightmapTextureMinsInLuxels, sizeof( f->m_LightmapTextureMinsInLuxels ) );
+		MD5Update( &ctx, (unsigned char const *)f->m_LightmapTextureSizeInLuxels, sizeof( f->m_LightmapTextureSizeInLuxels ) );
+		MD5Update( &ctx, (unsigned char const *)&f->smoothingGroups, sizeof( f->smoothingGroups ) );
+
+		if ( f->dispinfo != -1 )
+		{
+			ddispinfo_t &disp = g_dispinfo[f->dispinfo];
+			MD5Update( &ctx, (unsigned char const *)&disp.startPosition, sizeof( disp.startPosition ) );
+			MD5Update( &ctx, (unsigned char const *)&disp.power, sizeof( disp.power ) );
+			MD5Update( &ctx, (unsigned char const *)&disp.smoothingAngle, sizeof( disp.smoothingAngle ) );
+
+			// the surface can be anywhere its verts are pushed to
+			float flMaxDist = 0;
+			for ( int j = 0; j < disp.NumVerts(); j++ )
+			{
+				CDispVert &vert = g_DispVerts[disp.m_iDispVertStart + j];
+				MD5Update( &ctx, (unsigned char const *)&vert, sizeof( CDispVert ) );
+				flMaxDist = max( flMaxDist, vert.m_vVector.Length() * fabs( vert.m_flDist ) );
+			}
+			mins -= Vector( flMaxDist, flMaxDist, flMaxDist );
+			maxs += Vector( flMaxDist, flMaxDist, flMaxDist );
+		}
+
+		float flMinLight = FloatForKey( face_entity[iFace], "_minlight" );
+		MD5Update( &ctx, (unsigned char const *)&flMinLight, sizeof( flMinLight ) );
+		MD5Update( &ctx, (unsigned char const *)&face_offset[iFace], sizeof( face_offset[iFace] ) );
+
+		MD5Final( m_FaceHashes[iFace].bits, &ctx );
+
+		m_FaceMins[iFace] = mins + face_offset[iFace];
+		m_FaceMaxs[iFace] = maxs + face_offset[iFace];
+	}
+}
+
+bool CRelightCache::LoadCache()
+{
+	FreeCache();
+
+	FILE *fp = fopen( m_szFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	long nFileSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+
+	bool bOk = ( nFileSize >= (long)sizeof( RelightCacheHeader_t ) );
+	if ( bOk )
+	{
+		m_CacheFile.SetCount( nFileSize );
+		bOk = ( fread( m_CacheFile.Base(), 1, nFileSize, fp ) == (size_t)nFileSize );
+	}
+	fclose( fp );
+
+	if ( !bOk )
+	{
+		FreeCache();
+		return false;
+	}
+
+	const RelightCacheHeader_t *pHeader = (const RelightCacheHeader_t *)m_CacheFile.Base();
+	if ( pHeader->m_nLights < 0 || pHeader->m_nCells < 0 || pHeader->m_nFaces < 0 ||
+		 pHeader->m_nLeafs < 0 || pHeader->m_nLeafSamples < 0 || pHeader->m_nFaceDataSize < 0 )
+	{
+		FreeCache();
+		return false;
+	}
+
+	int64 nExpectedSize = sizeof( RelightCacheHeader_t ) +
+		(int64)pHeader->m_nLights * sizeof( RelightLight_t ) +
+		(int64)pHeader->m_nCells * sizeof( RelightCell_t ) +
+		(int64)pHeader->m_nFaces * sizeof( RelightFace_t ) +
+		pHeader->m_nFaceDataSize +
+		(int64)pHeader->m_nLeafs * sizeof( RelightLeaf_t ) +
+		(int64)pHeader->m_nLeafSamples * sizeof( ambientsample_t );
+
+	if ( pHeader->m_nMagic != RELIGHTCACHE_MAGIC ||
+		 pHeader->m_nVersion != RELIGHTCACHE_VERSION ||
+		 pHeader->m_SettingsHash != m_SettingsHash ||
+		 nExpectedSize != nFileSize )
+	{
+		FreeCache();
+		return false;
+	}
+
+	const byte *pData = m_CacheFile.Base() + sizeof( RelightCacheHeader_t );
+	m_nCachedLights = pHeader->m_nLights;
+	m_pCachedLights = (const RelightLight_t *)pData;
+	pData += m_nCachedLights * sizeof( RelightLight_t );
+
+	m_nCachedCells = pHeader->m_nCells;
+	m_pCachedCells = (const RelightCell_t *)pData;
+	pData += m_nCachedCells * sizeof( RelightCell_t );
+
+	m_nCachedFaces = pHeader->m_nFaces;
+	m_pCachedFaces = (const RelightFace_t *)pData;
+	pData += m_nCachedFaces * sizeof( RelightFace_t );
+
+	m_pCachedFaceData = pData;
+	pData += pHeader->m_nFaceDataSize;
+
+	m_nCachedLeafs = pHeader->m_nLeafs;
+	m_pCachedLeafs = (const RelightLeaf_t *)pData;
+	pData += m_nCachedLeafs * sizeof( RelightLeaf_t );
+
+	m_pCachedLeafSamples = (const ambientsample_t *)pData;
+
+	// every record has to point inside the data it indexes
+	for ( int i = 0; i < m_nCachedFaces; i++ )
+	{
+		const RelightFace_t &face = m_pCachedFaces[i];
+		if ( face.m_nDataOffset < 0 || face.m_nLightBytes < 0 || face.m_nIndirect < 0 ||
+			 face.m_nDataOffset + face.m_nLightBytes + (int64)face.m_nIndirect * sizeof( ColorRGBExp32 ) > pHeader->m_nFaceDataSize )
+		{
+			FreeCache();
+			return false;
+		}
+	}
+	for ( int i = 0; i < m_nCachedLeafs; i++ )
+	{
+		const RelightLeaf_t &leaf = m_pCachedLeafs[i];
+		if ( leaf.m_nFirstSample < 0 || leaf.m_nSamples < 0 ||
+			 (int64)leaf.m_nFirstSample + leaf.m_nSamples > pHeader->m_nLeafSamples )
+		{
+			FreeCache();
+			return false;
+		}
+	}
+	return true;
+}
+
+void CRelightCache::FreeCache()
+{
+	m_CacheFile.Purge();
+	m_nCachedLights = m_nCachedCells = m_nCachedFaces = m_nCachedLeafs = 0;
+	m_pCachedLights = NULL;
+	m_pCachedCells = NULL;
+	m_pCachedFaces = NULL;
+	m_pCachedFaceData = NULL;
+	m_pCachedLeafs = NULL;
+	m_pCachedLeafSamples = NULL;
+}
+
+// Returns the number of lights that were added, removed or changed, or -1 if the sky changed
+int CRelightCache::DiffLights( CUtlVector<Region_t> &regions )
+{
+	// both lists are sorted, so walk them together
+	int nChanged = 0;
+	int iCur = 0, iCached = 0;
+	while ( iCur < m_Lights.Count() || iCached < m_nCachedLights )
+	{
+		const RelightLight_t *pChanged;
+		if ( iCached >= m_nCachedLights )
+		{
+			pChanged = &m_Lights[iCur++];
+		}
+		else if ( iCur >= m_Lights.Count() )
+		{
+			pChanged = &m_pCachedLights[iCached++];
+		}
+		else
+		{
+			int nCmp = CompareRelightLights( &m_Lights[iCur], &m_pCachedLights[iCached] );
+			if ( nCmp == 0 )
+			{
+				++iCur;
+				++iCached;
+				continue;
+			}
+			pChanged = ( nCmp < 0 ) ? &m_Lights[iCur++] : &m_pCachedLights[iCached++];
+		}
+
+		// the sky reaches everything
+		if ( IsSkyLight( *pChanged ) )
+			return -1;
+
+		float flRadius = LightInfluenceRadius( *pChanged );
+		Region_t &region = regions[regions.AddToTail()];
+		region.m_Mins = pChanged->m_Light.origin - Vector( flRadius, flRadius, flRadius );
+		region.m_Maxs = pChanged->m_Light.origin + Vector( flRadius, flRadius, flRadius );
+		++nChanged;
+	}
+	return nChanged;
+}
+
+void CRelightCache::DiffShadowCasters( CUtlVector<Region_t> &changes )
+{
+	int iCur = 0, iCached = 0;
+	while ( iCur < m_Cells.Count() || iCached < m_nCachedCells )
+	{
+		Region_t change;
+		if ( iCached >= m_nCachedCells ||
+			 ( iCur < m_Cells.Count() && m_Cells[iCur].m_nKey < m_pCachedCells[iCached].m_nKey ) )
+		{
+			change.m_Mins = m_Cells[iCur].m_Mins;
+			change.m_Maxs = m_Cells[iCur].m_Maxs;
+			++iCur;
+		}
+		else if ( iCur >= m_Cells.Count() || m_pCachedCells[iCached].m_nKey < m_Cells[iCur].m_nKey )
+		{
+			change.m_Mins = m_pCachedCells[iCached].m_Mins;
+			change.m_Maxs = m_pCachedCells[iCached].m_Maxs;
+			++iCached;
+		}
+		else
+		{
+			const RelightCell_t &cur = m_Cells[iCur++];
+			const RelightCell_t &cached = m_pCachedCells[iCached++];
+			if ( cur.m_nHash == cached.m_nHash )
+				continue;
+
+			VectorMin( cur.m_Mins, cached.m_Mins, change.m_Mins );
+			VectorMax( cur.m_Maxs, cached.m_Maxs, change.m_Maxs );
+		}
+		changes.AddToTail( change );
+	}
+}
+
+void CRelightCache::AddGeometryChangeRegions( const CUtlVector<Region_t> &changes, CUtlVector<Region_t> &regions, CUtlVector<Region_t> &sunChanges )
+{
+	Vector vecPad( RELIGHT_GEOMETRY_PAD, RELIGHT_GEOMETRY_PAD, RELIGHT_GEOMETRY_PAD );
+	Vector vecSkyAmbient( RELIGHT_SKY_AMBIENT_RADIUS, RELIGHT_SKY_AMBIENT_RADIUS, RELIGHT_SKY_AMBIENT_RADIUS );
+
+	CUtlVector<bool> lightAdded;
+	lightAdded.SetCount( m_Lights.Count() );
+	for ( int i = 0; i < m_Lights.Count(); i++ )
+		lightAdded[i] = false;
+
+	for ( int i = 0; i < changes.Count(); i++ )
+	{
+		const Region_t &change = changes[i];
+
+		Region_t &region = regions[regions.AddToTail()];
+		region.m_Mins = change.m_Mins - vecPad;
+		region.m_Maxs = change.m_Maxs + vecPad;
+
+		// anything a light that reaches the change lights can have its shadows changed
+		for ( int j = 0; j < m_Lights.Count(); j++ )
+		{
+			if ( lightAdded[j] || IsSkyLight( m_Lights[j] ) )
+				continue;
+
+			float flRadius = LightInfluenceRadius( m_Lights[j] );
+			Vector vecRadius( flRadius, flRadius, flRadius );
+			Vector vecOrigin = m_Lights[j].m_Light.origin;
+			if ( BoxesTouch( vecOrigin - vecRadius, vecOrigin + vecRadius, change.m_Mins, change.m_Maxs ) )
+			{
+				Region_t &lightRegion = regions[regions.AddToTail()];
+				lightRegion.m_Mins = vecOrigin - vecRadius;
+				lightRegion.m_Maxs = vecOrigin + vecRadius;
+				lightAdded[j] = true;
+			}
+		}
+
+		if ( m_bHasSkyAmbient )
+		{
+			Region_t &skyRegion = regions[regions.AddToTail()];
+			skyRegion.m_Mins = change.m_Mins - vecSkyAmbient;
+			skyRegion.m_Maxs = change.m_Maxs + vecSkyAmbient;
+		}
+
+		if ( m_bHasSun )
+		{
+			sunChanges.AddToTail( change );
+		}
+	}
+}
+
+bool CRelightCache::MatchFaces()
+{
+	CUtlVector<FaceHashIndex_t> sorted;
+	sorted.SetCount( m_nCachedFaces );
+	for ( int i = 0; i < m_nCachedFaces; i++ )
+	{
+		sorted[i].m_Hash = m_pCachedFaces[i].m_Hash;
+		sorted[i].m_nIndex = i;
+	}
+	qsort( sorted.Base(), sorted.Count(), sizeof( FaceHashIndex_t ), CompareFaceHashIndices );
+
+	CUtlVector<bool> used;
+	used.SetCount( m_nCachedFaces );
+	for ( int i = 0; i < m_nCachedFaces; i++ )
+		used[i] = false;
+
+	m_FaceCacheIndex.SetCount( numfaces );
+	int nUnmatched = 0;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		m_FaceCacheIndex[iFace] = -1;
+		if ( texinfo[g_pFaces[iFace].texinfo].flags & TEX_SPECIAL )
+			continue;
+
+		const MD5Value_t &hash = m_FaceHashes[iFace];
+
+		// the face usually hasn't moved in the face list
+		if ( iFace < m_nCachedFaces && !used[iFace] && m_pCachedFaces[iFace].m_Hash == hash )
+		{
+			m_FaceCacheIndex[iFace] = iFace;
+			used[iFace] = true;
+			continue;
+		}
+
+		// otherwise find the first unused face with the same geometry
+		int nLow = 0, nHigh = sorted.Count();
+		while ( nLow < nHigh )
+		{
+			int nMid = ( nLow + nHigh ) / 2;
+			if ( memcmp( &sorted[nMid].m_Hash, &hash, sizeof( MD5Value_t ) ) < 0 )
+				nLow = nMid + 1;
+			else
+				nHigh = nMid;
+		}
+		for ( ; nLow < sorted.Count() && sorted[nLow].m_Hash == hash; nLow++ )
+		{
+			if ( !used[sorted[nLow].m_nIndex] )
+			{
+				m_FaceCacheIndex[iFace] = sorted[nLow].m_nIndex;
+				used[sorted[nLow].m_nIndex] = true;
+				break;
+			}
+		}
+
+		if ( m_FaceCacheIndex[iFace] == -1 )
+			++nUnmatched;
+	}
+
+	if ( nUnmatched )
+	{
+		Msg( "%d faces were added or changed since the last compile.\n", nUnmatched );
+		return false;
+	}
+	return true;
+}
+
+void CRelightCache::MarkRelitFaces( const CUtlVector<Region_t> &regions, const CUtlVector<Region_t> &sunChanges )
+{
+	m_FaceState.SetCount( numfaces );
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		m_FaceState[iFace] = FACE_CACHED;
+		if ( m_FaceCacheIndex[iFace] == -1 )
+			continue;
+
+		const Vector &mins = m_FaceMins[iFace];
+		const Vector &maxs = m_FaceMaxs[iFace];
+
+		// a record that doesn't fit the face can't be restored, so the face is lit again
+		const RelightFace_t &cached = m_pCachedFaces[m_FaceCacheIndex[iFace]];
+		bool bRelit = ( cached.m_nLightBytes != FaceLightBytes( &g_pFaces[iFace], cached.m_Styles ) );
+		for ( int i = 0; !bRelit && i < regions.Count(); i++ )
+		{
+			bRelit = BoxesTouch( mins, maxs, regions[i].m_Mins, regions[i].m_Maxs );
+		}
+		for ( int i = 0; !bRelit && i < sunChanges.Count(); i++ )
+		{
+			bRelit = BoxInSunShadow( sunChanges[i].m_Mins, sunChanges[i].m_Maxs, m_vecSunDir, g_SunAngularExtent, mins, maxs );
+		}
+
+		if ( bRelit )
+			m_FaceState[iFace] = FACE_RELIT;
+	}
+
+	// Luxels are filtered with samples from the neighboring faces, and displacements with
+	// samples from the displacements around them, so those need their direct light too.
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( m_FaceState[iFace] != FACE_RELIT )
+			continue;
+
+		faceneighbor_t *fn = &faceneighbor[iFace];
+		for ( int j = 0; j < fn->numneighbors; j++ )
+		{
+			int iNeighbor = fn->neighbor[j];
+			if ( m_FaceState[iNeighbor] == FACE_CACHED && m_FaceCacheIndex[iNeighbor] != -1 )
+				m_FaceState[iNeighbor] = FACE_SAMPLED;
+		}
+	}
+
+	CUtlVector<DispPair_t> dispPairs;
+	FindDispNeighbors( dispPairs );
+	for ( int i = 0; i < dispPairs.Count(); i++ )
+	{
+		int iFace = dispPairs[i].m_iFace;
+		int iOther = dispPairs[i].m_iOther;
+		if ( m_FaceState[iFace] == FACE_RELIT && m_FaceState[iOther] == FACE_CACHED && m_FaceCacheIndex[iOther] != -1 )
+			m_FaceState[iOther] = FACE_SAMPLED;
+		else if ( m_FaceState[iOther] == FACE_RELIT && m_FaceState[iFace] == FACE_CACHED && m_FaceCacheIndex[iFace] != -1 )
+			m_FaceState[iFace] = FACE_SAMPLED;
+	}
+}
+
+// Pairs of displacements whose padded bounds touch. The displacements are sorted along x
+// and swept, so only ones that overlap along x are compared.
+void CRelightCache::FindDispNeighbors( CUtlVector<DispPair_t> &pairs )
+{
+	CUtlVector<int> disps;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( g_pFaces[iFace].dispinfo != -1 )
+			disps.AddToTail( iFace );
+	}
+
+	s_pSortFaceMins = m_FaceMins.Base();
+	qsort( disps.Base(), disps.Count(), sizeof( int ), CompareFaceMinsX );
+	s_pSortFaceMins = NULL;
+
+	Vector vecPad( RELIGHT_GEOMETRY_PAD, RELIGHT_GEOMETRY_PAD, RELIGHT_GEOMETRY_PAD );
+	for ( int i = 0; i < disps.Count(); i++ )
+	{
+		int iFace = disps[i];
+		Vector mins = m_FaceMins[iFace] - vecPad;
+		Vector maxs = m_FaceMaxs[iFace] + vecPad;
+		for ( int j = i + 1; j < disps.Count() && m_FaceMins[disps[j]].x <= maxs.x; j++ )
+		{
+			int iOther = disps[j];
+			if ( BoxesTouch( mins, maxs, m_FaceMins[iOther], m_FaceMaxs[iOther] ) )
+			{
+				DispPair_t &pair = pairs[pairs.AddToTail()];
+				pair.m_iFace = iFace;
+				pair.m_iOther = iOther;
+			}
+		}
+	}
+}
+
+void CRelightCache::MarkRelitLeafs( const CUtlVector<Region_t> &regions )
+{
+	// clusters holding a relit face
+	int nClusterBytes = ( dvis->numclusters + 7 ) / 8;
+	CUtlVector<byte> relitClusters;
+	relitClusters.SetCount( nClusterBytes + 1 );
+	memset( relitClusters.Base(), 0, relitClusters.Count() );
+
+	bool bAnyRelit = false;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( m_FaceState[iFace] != FACE_RELIT )
+			continue;
+
+		bAnyRelit = true;
+		int nCluster = ClusterFromPoint( ( m_FaceMins[iFace] + m_FaceMaxs[iFace] ) * 0.5f );
+		if ( nCluster >= 0 )
+			relitClusters[nCluster >> 3] |= ( 1 << ( nCluster & 7 ) );
+	}
+	for ( int iLeaf = 0; iLeaf < numleafs; iLeaf++ )
+	{
+		int nCluster = dleafs[iLeaf].cluster;
+		if ( nCluster < 0 )
+			continue;
+
+		for ( int j = 0; j < dleafs[iLeaf].numleaffaces; j++ )
+		{
+			int iFace = dleaffaces[dleafs[iLeaf].firstleafface + j];
+			if ( m_FaceState[iFace] == FACE_RELIT )
+			{
+				relitClusters[nCluster >> 3] |= ( 1 << ( nCluster & 7 ) );
+				break;
+			}
+		}
+	}
+
+	// clusters that can see one of them
+	CUtlVector<bool> clusterSeesRelit;
+	clusterSeesRelit.SetCount( dvis->numclusters );
+	CUtlVector<byte> pvs;
+	pvs.SetCount( nClusterBytes + 1 );
+	for ( int iCluster = 0; iCluster < dvis->numclusters; iCluster++ )
+	{
+		if ( !visdatasize )
+		{
+			clusterSeesRelit[iCluster] = bAnyRelit;
+			continue;
+		}
+
+		DecompressVis( &dvisdata[dvis->bitofs[iCluster][DVIS_PVS]], pvs.Base() );
+		clusterSeesRelit[iCluster] = false;
+		for ( int i = 0; i < nClusterBytes; i++ )
+		{
+			if ( pvs[i] & relitClusters[i] )
+			{
+				clusterSeesRelit[iCluster] = true;
+				break;
+			}
+		}
+	}
+
+	m_LeafRelit.SetCount( numleafs );
+	for ( int iLeaf = 0; iLeaf < numleafs; iLeaf++ )
+	{
+		dleaf_t *pLeaf = &dleafs[iLeaf];
+
+		bool bRelit = true;
+		if ( iLeaf < m_nCachedLeafs )
+		{
+			const RelightLeaf_t &cached = m_pCachedLeafs[iLeaf];
+			bRelit = cached.m_nContents != pLeaf->contents || cached.m_nCluster != pLeaf->cluster ||
+					 memcmp( cached.m_Mins, pLeaf->mins, sizeof( cached.m_Mins ) ) ||
+					 memcmp( cached.m_Maxs, pLeaf->maxs, sizeof( cached.m_Maxs ) );
+		}
+
+		if ( !bRelit && pLeaf->cluster >= 0 && pLeaf->cluster < dvis->numclusters )
+		{
+			bRelit = clusterSeesRelit[pLeaf->cluster];
+		}
+
+		Vector mins( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] );
+		Vector maxs( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] );
+		for ( int i = 0; !bRelit && i < regions.Count(); i++ )
+		{
+			bRelit = BoxesTouch( mins, maxs, regions[i].m_Mins, regions[i].m_Maxs );
+		}
+
+		m_LeafRelit[iLeaf] = bRelit;
+	}
+}
+
+bool CRelightCache::BeginRelight()
+{
+	if ( !m_bEnabled )
+		return false;
+
+	if ( !LoadCache() )
+	{
+		Msg( "No up to date relight cache in %s, lighting the whole map.\n", m_szFileName );
+		return false;
+	}
+
+	CUtlVector<Region_t> regions;
+	int nChangedLights = DiffLights( regions );
+	if ( nChangedLights < 0 )
+	{
+		Msg( "The sky lighting changed, lighting the whole map.\n" );
+		FreeCache();
+		return false;
+	}
+
+	ComputeFaceHashes();
+	if ( !MatchFaces() )
+	{
+		Msg( "Lighting the whole map.\n" );
+		FreeCache();
+		return false;
+	}
+
+	CUtlVector<Region_t> changes, sunChanges;
+	DiffShadowCasters( changes );
+	AddGeometryChangeRegions( changes, regions, sunChanges );
+
+	MarkRelitFaces( regions, sunChanges );
+	MarkRelitLeafs( regions );
+
+	// Relit faces get the bounced light of the last full compile, and it carries over to
+	// the next cache for all faces.
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		m_FaceIndirect[iFace].Purge();
+		if ( m_FaceCacheIndex[iFace] == -1 )
+			continue;
+
+		const RelightFace_t &cached = m_pCachedFaces[m_FaceCacheIndex[iFace]];
+		if ( cached.m_nIndirect )
+		{
+			m_FaceIndirect[iFace].CopyArray( (const ColorRGBExp32 *)( m_pCachedFaceData + cached.m_nDataOffset + cached.m_nLightBytes ), cached.m_nIndirect );
+		}
+	}
+
+	int nRelitFaces = 0, nSampledFaces = 0, nRelitLeafs = 0;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( m_FaceState[iFace] == FACE_RELIT )
+			++nRelitFaces;
+		else if ( m_FaceState[iFace] == FACE_SAMPLED )
+			++nSampledFaces;
+	}
+	for ( int iLeaf = 0; iLeaf < numleafs; iLeaf++ )
+	{
+		if ( m_LeafRelit[iLeaf] )
+			++nRelitLeafs;
+	}
+
+	Msg( "Relighting: %d lights and %d shadow cells changed, relighting %d of %d faces (%d more sampled) and %d of %d leaves\n",
+		nChangedLights, changes.Count(), nRelitFaces, numfaces, nSampledFaces, nRelitLeafs, numleafs );
+
+	m_bRelighting = true;
+	return true;
+}
+
+void CRelightCache::GetFacesToSample( CUtlVector<byte> &faces )
+{
+	faces.SetSize( numfaces/8 + 1 );
+	memset( faces.Base(), 0, faces.Count() );
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( m_FaceState[iFace] != FACE_CACHED )
+			faces[iFace >> 3] |= ( 1 << ( iFace & 7 ) );
+	}
+}
+
+void CRelightCache::RestoreFaceStyles()
+{
+	int nPromoted = 0;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( m_FaceState[iFace] == FACE_RELIT || m_FaceCacheIndex[iFace] == -1 )
+			continue;
+
+		dface_t *f = &g_pFaces[iFace];
+		const RelightFace_t &cached = m_pCachedFaces[m_FaceCacheIndex[iFace]];
+
+		// A neighbor that picked up a new style can't use its cached lightmap
+		if ( m_FaceState[iFace] == FACE_SAMPLED && memcmp( f->styles, cached.m_Styles, MAXLIGHTMAPS ) )
+		{
+			m_FaceState[iFace] = FACE_RELIT;
+			++nPromoted;
+			continue;
+		}
+
+		memcpy( f->styles, cached.m_Styles, MAXLIGHTMAPS );
+	}
+
+	if ( nPromoted )
+		qprintf( "%d neighboring faces picked up new light styles and are relit too\n", nPromoted );
+}
+
+bool CRelightCache::RestoreFaceLighting( int iFace )
+{
+	if ( !m_bRelighting || m_FaceState[iFace] == FACE_RELIT || m_FaceCacheIndex[iFace] == -1 )
+		return false;
+
+	dface_t *f = &g_pFaces[iFace];
+	const RelightFace_t &cached = m_pCachedFaces[m_FaceCacheIndex[iFace]];
+	if ( cached.m_nLightBytes != FaceLightBytes( f ) || f->lightofs == -1 )
+	{
+		// A cache miss: light the face. MarkRelitFaces already sent faces whose records
+		// don't fit through BuildFacelights, so it has samples to be lit from.
+		return false;
+	}
+
+	int nStyles = FaceLightStyles( f );
+	memcpy( &(*pdlightdata)[f->lightofs - nStyles * 4], m_pCachedFaceData + cached.m_nDataOffset, cached.m_nLightBytes );
+	return true;
+}
+
+const ColorRGBExp32 *CRelightCache::GetFaceIndirect( int iFace, int nSamples ) const
+{
+	if ( iFace >= m_FaceIndirect.Count() || m_FaceIndirect[iFace].Count() != nSamples )
+		return NULL;
+	return m_FaceIndirect[iFace].Base();
+}
+
+ColorRGBExp32 *CRelightCache::AllocFaceIndirect( int iFace, int nSamples )
+{
+	// each face is only touched by the thread lighting it
+	m_FaceIndirect[iFace].SetCount( nSamples );
+	return m_FaceIndirect[iFace].Base();
+}
+
+bool CRelightCache::RestoreLeafAmbient( int iLeaf, CUtlVector<ambientsample_t> &samples ) const
+{
+	if ( !m_bRelighting || m_LeafRelit[iLeaf] )
+		return false;
+
+	const RelightLeaf_t &cached = m_pCachedLeafs[iLeaf];
+	samples.CopyArray( m_pCachedLeafSamples + cached.m_nFirstSample, cached.m_nSamples );
+	return true;
+}
+
+void CRelightCache::Save()
+{
+	if ( !m_bEnabled || !m_bFaceLightingDone )
+		return;
+
+	ComputeFaceHashes();
+
+	// lay out the face data
+	CUtlVector<RelightFace_t> faces;
+	faces.SetCount( numfaces );
+	int64 nFaceDataSize = 0;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		dface_t *f = &g_pFaces[iFace];
+		RelightFace_t &face = faces[iFace];
+		memset( &face, 0, sizeof( face ) );
+		face.m_Hash = m_FaceHashes[iFace];
+		memcpy( face.m_Styles, f->styles, MAXLIGHTMAPS );
+		face.m_nLightBytes = ( f->lightofs != -1 ) ? FaceLightBytes( f ) : 0;
+		face.m_nIndirect = m_FaceIndirect.Count() ? m_FaceIndirect[iFace].Count() : 0;
+		face.m_nDataOffset = nFaceDataSize;
+		nFaceDataSize += face.m_nLightBytes + face.m_nIndirect * sizeof( ColorRGBExp32 );
+	}
+
+	CUtlVector<RelightLeaf_t> leafs;
+	int nLeafSamples = 0;
+	if ( g_LeafAmbientSamples.Count() == numleafs )
+	{
+		leafs.SetCount( numleafs );
+		for ( int iLeaf = 0; iLeaf < numleafs; iLeaf++ )
+		{
+			RelightLeaf_t &leaf = leafs[iLeaf];
+			leaf.m_nContents = dleafs[iLeaf].contents;
+			leaf.m_nCluster = dleafs[iLeaf].cluster;
+			memcpy( leaf.m_Mins, dleafs[iLeaf].mins, sizeof( leaf.m_Mins ) );
+			memcpy( leaf.m_Maxs, dleafs[iLeaf].maxs, sizeof( leaf.m_Maxs ) );
+			leaf.m_nFirstSample = nLeafSamples;
+			leaf.m_nSamples = g_LeafAmbientSamples[iLeaf].Count();
+			nLeafSamples += leaf.m_nSamples;
+		}
+	}
+
+	RelightCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nMagic = RELIGHTCACHE_MAGIC;
+	header.m_nVersion = RELIGHTCACHE_VERSION;
+	header.m_SettingsHash = m_SettingsHash;
+	header.m_nLights = m_Lights.Count();
+	header.m_nCells = m_Cells.Count();
+	header.m_nFaces = faces.Count();
+	header.m_nLeafs = leafs.Count();
+	header.m_nLeafSamples = nLeafSamples;
+	header.m_nFaceDataSize = nFaceDataSize;
+
+	FILE *fp = fopen( m_szFileName, "wb" );
+	if ( !fp )
+	{
+		Warning( "Unable to write relight cache %s\n", m_szFileName );
+		return;
+	}
+
+	bool bOk = fwrite( &header, sizeof( header ), 1, fp ) == 1;
+	if ( bOk && m_Lights.Count() )
+		bOk = fwrite( m_Lights.Base(), sizeof( RelightLight_t ), m_Lights.Count(), fp ) == (size_t)m_Lights.Count();
+	if ( bOk && m_Cells.Count() )
+		bOk = fwrite( m_Cells.Base(), sizeof( RelightCell_t ), m_Cells.Count(), fp ) == (size_t)m_Cells.Count();
+	if ( bOk && faces.Count() )
+		bOk = fwrite( faces.Base(), sizeof( RelightFace_t ), faces.Count(), fp ) == (size_t)faces.Count();
+
+	for ( int iFace = 0; bOk && iFace < numfaces; iFace++ )
+	{
+		const RelightFace_t &face = faces[iFace];
+		if ( face.m_nLightBytes )
+		{
+			int nStyles = FaceLightStyles( &g_pFaces[iFace] );
+			bOk = fwrite( &(*pdlightdata)[g_pFaces[iFace].lightofs - nStyles * 4], face.m_nLightBytes, 1, fp ) == 1;
+		}
+		if ( bOk && face.m_nIndirect )
+		{
+			bOk = fwrite( m_FaceIndirect[iFace].Base(), sizeof( ColorRGBExp32 ), face.m_nIndirect, fp ) == (size_t)face.m_nIndirect;
+		}
+	}
+
+	if ( bOk && leafs.Count() )
+		bOk = fwrite( leafs.Base(), sizeof( RelightLeaf_t ), leafs.Count(), fp ) == (size_t)leafs.Count();
+	for ( int iLeaf = 0; bOk && iLeaf < leafs.Count(); iLeaf++ )
+	{
+		int nSamples = g_LeafAmbientSamples[iLeaf].Count();
+		if ( nSamples )
+			bOk = fwrite( g_LeafAmbientSamples[iLeaf].Base(), sizeof( ambientsample_t ), nSamples, fp ) == (size_t)nSamples;
+	}
+
+	fclose( fp );
+
+	if ( !bOk )
+	{
+		Warning( "Unable to write relight cache %s\n", m_szFileName );
+		remove( m_szFileName );
+	}
+}
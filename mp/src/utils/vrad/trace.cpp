@@ -13,6 +13,7 @@
 #include "trace.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "vstdlib/random.h"
 
 
 //=============================================================================
@@ -126,17 +127,10 @@ class CCoverageCountTexture : public CCoverageCount
 public:
 	virtual bool VisitTriangle_ShouldContinue( const TriIntersectData_t &triangle, const FourRays &rays, fltx4 *pHitMask, fltx4 *b0, fltx4 *b1, fltx4 *b2, int32 hitID )
 	{
+		// the triangle's material is looked up once for all the lanes that hit it
 		int sign = TestSignSIMD( *pHitMask );
-		float addedCoverage[4];
-		for ( int s = 0; s < 4; s++)
-		{
-			addedCoverage[s] = 0.0f;
-			if ( ( sign >> s) & 0x1 )
-			{
-				addedCoverage[s] = ComputeCoverageFromTexture( b0->m128_f32[s], b1->m128_f32[s], b2->m128_f32[s], hitID );
-			}
-		}
-		m_coverage = AddSIMD( m_coverage, LoadUnalignedSIMD( addedCoverage ) );
+		fltx4 addedCoverage = ComputeCoverageFromTexture4( *b0, *b1, *b2, sign, hitID );
+		m_coverage = AddSIMD( m_coverage, addedCoverage );
 		m_coverage = MinSIMD( m_coverage, Four_Ones );
 		fltx4 onesMask = CmpEqSIMD( m_coverage, Four_Ones );
 
@@ -651,3 +645,110 @@ void AddBrushesForRayTrace( void )
 		}
 	}
 }
+
+
+//-----------------------------------------------------------------------------
+// Fires the same fixed set of rays through g_RtEnv one at a time, 4 at a time and 8 at a time
+// and reports rays/sec for each. Each packet of 8 shares an origin and a direction octant, the
+// way hemisphere samples from a luxel do.
+//-----------------------------------------------------------------------------
+void RunRayTraceBenchmark( int nPackets )
+{
+	CUniformRandomStream random;
+	random.SetSeed( 0x5eed );
+
+	Vector vecWorldSize = g_RtEnv.m_MaxBound - g_RtEnv.m_MinBound;
+	float flRayLength = vecWorldSize.Length();
+
+	EightRays *pPackets = new EightRays[nPackets];
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		Vector vecOrigin;
+		for ( int c = 0; c < 3; c++ )
+			vecOrigin[c] = g_RtEnv.m_MinBound[c] + random.RandomFloat( 0, vecWorldSize[c] );
+		int nOctant = random.RandomInt( 0, 7 );
+		for ( int r = 0; r < 8; r++ )
+		{
+			Vector vecDir;
+			for ( int c = 0; c < 3; c++ )
+			{
+				vecDir[c] = random.RandomFloat( 0.01f, 1.0f );
+				if ( nOctant & ( 1 << c ) )
+					vecDir[c] = -vecDir[c];
+			}
+			VectorNormalize( vecDir );
+			pPackets[p].SetRay( r, vecOrigin, vecDir );
+		}
+	}
+
+	ALIGN16 float flTMin[8] ALIGN16_POST = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	ALIGN16 float flTMax[8] ALIGN16_POST;
+	for ( int r = 0; r < 8; r++ )
+		flTMax[r] = flRayLength;
+
+	int32 *pHits[3];
+	for ( int w = 0; w < 3; w++ )
+		pHits[w] = new int32[nPackets * 8];
+
+	Msg( "Ray-trace benchmark: %d rays, %d triangles\n", nPackets * 8, g_RtEnv.OptimizedTriangleList.Count() );
+
+	// scalar - each ray duplicated into all 4 lanes
+	double flStart = Plat_FloatTime();
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		for ( int r = 0; r < 8; r++ )
+		{
+			FourRays myrays;
+			myrays.origin.DuplicateVector( Vector( pPackets[p].origin[0][r], pPackets[p].origin[1][r], pPackets[p].origin[2][r] ) );
+			myrays.direction.DuplicateVector( Vector( pPackets[p].direction[0][r], pPackets[p].direction[1][r], pPackets[p].direction[2][r] ) );
+			RayTracingResult rt_result;
+			g_RtEnv.Trace4Rays( myrays, Four_Zeros, ReplicateX4( flRayLength ), &rt_result );
+			pHits[0][p * 8 + r] = rt_result.HitIds[0];
+		}
+	}
+	double flScalar = Plat_FloatTime() - flStart;
+
+	// 4-wide
+	flStart = Plat_FloatTime();
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		for ( int nHalf = 0; nHalf < 2; nHalf++ )
+		{
+			FourRays myrays;
+			pPackets[p].GetFourRays( nHalf, myrays );
+			RayTracingResult rt_result;
+			g_RtEnv.Trace4Rays( myrays, Four_Zeros, ReplicateX4( flRayLength ), &rt_result );
+			memcpy( &pHits[1][p * 8 + nHalf * 4], rt_result.HitIds, sizeof( rt_result.HitIds ) );
+		}
+	}
+	double flFour = Plat_FloatTime() - flStart;
+
+	// 8-wide. falls back to 2x4 when the cpu doesn't have AVX2
+	flStart = Plat_FloatTime();
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		RayTracingResult8 rt_result;
+		g_RtEnv.Trace8Rays( pPackets[p], flTMin, flTMax, &rt_result );
+		memcpy( &pHits[2][p * 8], rt_result.HitIds, sizeof( rt_result.HitIds ) );
+	}
+	double flEight = Plat_FloatTime() - flStart;
+
+	int nMismatches = 0;
+	for ( int i = 0; i < nPackets * 8; i++ )
+	{
+		if ( pHits[0][i] != pHits[1][i] || pHits[0][i] != pHits[2][i] )
+			nMismatches++;
+	}
+
+	int nRays = nPackets * 8;
+	Msg( "  scalar : %10.0f rays/sec\n", nRays / MAX( flScalar, 1e-6 ) );
+	Msg( "  4-wide : %10.0f rays/sec\n", nRays / MAX( flFour, 1e-6 ) );
+	Msg( "  8-wide : %10.0f rays/sec%s\n", nRays / MAX( flEight, 1e-6 ),
+		 RayTracingEnvironment::SupportsEightWideTracing() ? "" : " (no AVX2, traced as 2x4)" );
+	if ( nMismatches )
+		Warning( "  %d rays hit different triangles at different widths\n", nMismatches );
+
+	for ( int w = 0; w < 3; w++ )
+		delete[] pHits[w];
+	delete[] pPackets;
+}
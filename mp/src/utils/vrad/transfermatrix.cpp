@@ -0,0 +1,542 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed storage for the patch to patch transfer lists.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+#define TRANSFER_BLOCK_SIZE		( 4 * 1024 * 1024 )
+#define TRANSFER_VIEW_SIZE		( 4 * 1024 * 1024 )
+#define TRANSFER_VIEW_ALIGN		( 64 * 1024 )		// allocation granularity on windows
+#define TRANSFER_QUANTIZE		65535.0f
+
+CTransferMatrix g_TransferMatrix;
+
+
+//-----------------------------------------------------------------------------
+// CTransferSpillFile
+//-----------------------------------------------------------------------------
+#ifdef _WIN32
+
+CTransferSpillFile::CTransferSpillFile()
+{
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+}
+
+bool CTransferSpillFile::Open( const char *pFileName )
+{
+	Close();
+	m_hFile = ::CreateFile( pFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL );
+	return ( m_hFile != INVALID_HANDLE_VALUE );
+}
+
+void CTransferSpillFile::Close()
+{
+	if ( m_hMapping )
+	{
+		::CloseHandle( m_hMapping );
+		m_hMapping = NULL;
+	}
+	if ( m_hFile != INVALID_HANDLE_VALUE )
+	{
+		::CloseHandle( m_hFile );
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool CTransferSpillFile::IsOpen() const
+{
+	return ( m_hFile != INVALID_HANDLE_VALUE );
+}
+
+bool CTransferSpillFile::Write( int64 nOffset, const void *pData, int nBytes )
+{
+	OVERLAPPED overlapped;
+	memset( &overlapped, 0, sizeof( overlapped ) );
+	overlapped.Offset = (DWORD)( nOffset & 0xFFFFFFFF );
+	overlapped.OffsetHigh = (DWORD)( nOffset >> 32 );
+	DWORD nWritten = 0;
+	return ::WriteFile( m_hFile, pData, nBytes, &nWritten, &overlapped ) && ( nWritten == (DWORD)nBytes );
+}
+
+bool CTransferSpillFile::Read( int64 nOffset, void *pData, int nBytes )
+{
+	OVERLAPPED overlapped;
+	memset( &overlapped, 0, sizeof( overlapped ) );
+	overlapped.Offset = (DWORD)( nOffset & 0xFFFFFFFF );
+	overlapped.OffsetHigh = (DWORD)( nOffset >> 32 );
+	DWORD nRead = 0;
+	return ::ReadFile( m_hFile, pData, nBytes, &nRead, &overlapped ) && ( nRead == (DWORD)nBytes );
+}
+
+bool CTransferSpillFile::BeginMapping()
+{
+	m_hMapping = ::CreateFileMapping( m_hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	return ( m_hMapping != NULL );
+}
+
+void *CTransferSpillFile::MapView( int64 nOffset, int nBytes )
+{
+	return ::MapViewOfFile( m_hMapping, FILE_MAP_READ, (DWORD)( nOffset >> 32 ), (DWORD)( nOffset & 0xFFFFFFFF ), nBytes );
+}
+
+void CTransferSpillFile::UnmapView( void *pView, int nBytes )
+{
+	::UnmapViewOfFile( pView );
+}
+
+#else
+
+CTransferSpillFile::CTransferSpillFile()
+{
+	m_nFile = -1;
+}
+
+bool CTransferSpillFile::Open( const char *pFileName )
+{
+	Close();
+	m_nFile = open( pFileName, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+	if ( m_nFile == -1 )
+		return false;
+
+	// the file goes away once it is closed
+	unlink( pFileName );
+	return true;
+}
+
+void CTransferSpillFile::Close()
+{
+	if ( m_nFile != -1 )
+	{
+		close( m_nFile );
+		m_nFile = -1;
+	}
+}
+
+bool CTransferSpillFile::IsOpen() const
+{
+	return ( m_nFile != -1 );
+}
+
+bool CTransferSpillFile::Write( int64 nOffset, const void *pData, int nBytes )
+{
+	return ( pwrite( m_nFile, pData, nBytes, nOffset ) == nBytes );
+}
+
+bool CTransferSpillFile::Read( int64 nOffset, void *pData, int nBytes )
+{
+	return ( pread( m_nFile, pData, nBytes, nOffset ) == nBytes );
+}
+
+bool CTransferSpillFile::BeginMapping()
+{
+	return true;
+}
+
+void *CTransferSpillFile::MapView( int64 nOffset, int nBytes )
+{
+	void *pView = mmap( NULL, nBytes, PROT_READ, MAP_SHARED, m_nFile, nOffset );
+	return ( pView == MAP_FAILED ) ? NULL : pView;
+}
+
+void CTransferSpillFile::UnmapView( void *pView, int nBytes )
+{
+	munmap( pView, nBytes );
+}
+
+#endif
+
+CTransferSpillFile::~CTransferSpillFile()
+{
+	Close();
+}
+
+
+//-----------------------------------------------------------------------------
+// Row encoding
+//-----------------------------------------------------------------------------
+static int VarIntSize( unsigned int nValue )
+{
+	int nBytes = 1;
+	while ( nValue >= 0x80 )
+	{
+		nValue >>= 7;
+		++nBytes;
+	}
+	return nBytes;
+}
+
+static byte *WriteVarInt( byte *pOut, unsigned int nValue )
+{
+	while ( nValue >= 0x80 )
+	{
+		*pOut++ = (byte)( nValue | 0x80 );
+		nValue >>= 7;
+	}
+	*pOut++ = (byte)nValue;
+	return pOut;
+}
+
+static const byte *ReadVarInt( const byte *pIn, unsigned int &nValue )
+{
+	nValue = 0;
+	int nShift = 0;
+	while ( *pIn & 0x80 )
+	{
+		nValue |= ( *pIn++ & 0x7F ) << nShift;
+		nShift += 7;
+	}
+	nValue |= *pIn++ << nShift;
+	return pIn;
+}
+
+static int CompareTransferPatch( const void *a, const void *b )
+{
+	return ( (const transfer_t *)a )->patch - ( (const transfer_t *)b )->patch;
+}
+
+static int DecodeRow( const byte *pIn, int nBytes, int *pPatches, float *pTransfers )
+{
+	const byte *pEnd = pIn + nBytes;
+
+	float flScale;
+	memcpy( &flScale, pIn, sizeof( flScale ) );
+	pIn += sizeof( flScale );
+
+	int nTransfers = 0;
+	unsigned int nPatch = 0;
+	while ( pIn < pEnd )
+	{
+		unsigned int nDelta;
+		pIn = ReadVarInt( pIn, nDelta );
+		nPatch += nDelta;
+		int nQuantized = pIn[0] | ( pIn[1] << 8 );
+		pIn += 2;
+
+		pPatches[nTransfers] = nPatch;
+		pTransfers[nTransfers] = nQuantized * flScale;
+		++nTransfers;
+	}
+	return nTransfers;
+}
+
+
+//-----------------------------------------------------------------------------
+// CTransferMatrix
+//-----------------------------------------------------------------------------
+CTransferMatrix::CTransferMatrix()
+{
+	m_nPatches = 0;
+	m_nMemoryLimit = 0;
+	m_szSpillFileBase[0] = 0;
+	m_pRowLocations = NULL;
+	m_nResidentSize = 0;
+	m_pRowOffsets = NULL;
+	m_pRowData = NULL;
+	memset( m_Views, 0, sizeof( m_Views ) );
+	m_nCompressedSize = 0;
+	m_nSpilledSize = 0;
+	m_nTransfers = 0;
+}
+
+CTransferMatrix::~CTransferMatrix()
+{
+	Shutdown();
+}
+
+void CTransferMatrix::Init( int nPatches, int64 nMemoryLimit, const char *pSpillFileBase )
+{
+	Shutdown();
+
+	m_nPatches = nPatches;
+	m_nMemoryLimit = nMemoryLimit;
+	Q_strncpy( m_szSpillFileBase, pSpillFileBase, sizeof( m_szSpillFileBase ) );
+
+	m_pRowLocations = (RowLocation_t *)calloc( nPatches, sizeof( RowLocation_t ) );
+	if ( !m_pRowLocations )
+		Error( "Memory allocation failure" );
+}
+
+void CTransferMatrix::Shutdown()
+{
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		free( m_Blocks[i].m_pData );
+	}
+	m_Blocks.Purge();
+
+	for ( int i = 0; i < ARRAYSIZE( m_Views ); i++ )
+	{
+		if ( m_Views[i].m_pView )
+			m_RowSpillFile.UnmapView( m_Views[i].m_pView, m_Views[i].m_nBytes );
+	}
+	memset( m_Views, 0, sizeof( m_Views ) );
+
+	m_BuildSpillFile.Close();
+	m_RowSpillFile.Close();
+
+	free( m_pRowLocations );
+	m_pRowLocations = NULL;
+	delete[] m_pRowOffsets;
+	m_pRowOffsets = NULL;
+	free( m_pRowData );
+	m_pRowData = NULL;
+
+	m_nPatches = 0;
+	m_nResidentSize = 0;
+	m_nCompressedSize = 0;
+	m_nSpilledSize = 0;
+	m_nTransfers = 0;
+}
+
+void CTransferMatrix::AllocBlock( int nMinSize )
+{
+	Block_t &block = m_Blocks[m_Blocks.AddToTail()];
+	block.m_nSize = max( nMinSize, TRANSFER_BLOCK_SIZE );
+	block.m_nUsed = 0;
+	block.m_nSpillOffset = -1;
+	block.m_pData = (byte *)malloc( block.m_nSize );
+	if ( !block.m_pData )
+		Error( "Memory allocation failure" );
+
+	m_nResidentSize += block.m_nSize;
+	if ( m_nMemoryLimit && m_nResidentSize > m_nMemoryLimit )
+	{
+		SpillBlocks();
+	}
+}
+
+void CTransferMatrix::SpillBlocks()
+{
+	if ( !m_BuildSpillFile.IsOpen() )
+	{
+		char szFileName[MAX_PATH];
+		Q_snprintf( szFileName, sizeof( szFileName ), "%s.build.vradtmp", m_szSpillFileBase );
+		if ( !m_BuildSpillFile.Open( szFileName ) )
+			Error( "Can't create transfer spill file %s\n", szFileName );
+	}
+
+	// the last block is still being filled, so it stays
+	for ( int i = 0; i < m_Blocks.Count() - 1 && m_nResidentSize > m_nMemoryLimit; i++ )
+	{
+		Block_t &block = m_Blocks[i];
+		if ( !block.m_pData )
+			continue;
+
+		block.m_nSpillOffset = m_nSpilledSize;
+		if ( !m_BuildSpillFile.Write( block.m_nSpillOffset, block.m_pData, block.m_nUsed ) )
+			Error( "Error writing transfer spill file (disk full?)\n" );
+
+		m_nSpilledSize += block.m_nUsed;
+		m_nResidentSize -= block.m_nSize;
+		free( block.m_pData );
+		block.m_pData = NULL;
+	}
+}
+
+void CTransferMatrix::SetRow( int iPatch, transfer_t *pTransfers, int nTransfers )
+{
+	Assert( iPatch >= 0 && iPatch < m_nPatches );
+	if ( nTransfers <= 0 )
+		return;
+
+	// sort by patch so the indices delta encode to a byte or two
+	qsort( pTransfers, nTransfers, sizeof( transfer_t ), CompareTransferPatch );
+
+	float flMax = 0.0f;
+	int nBytes = sizeof( float );
+	int nPrevPatch = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		flMax = max( flMax, pTransfers[i].transfer );
+		nBytes += VarIntSize( pTransfers[i].patch - nPrevPatch ) + 2;
+		nPrevPatch = pTransfers[i].patch;
+	}
+	float flScale = flMax / TRANSFER_QUANTIZE;
+	float flInvScale = ( flMax > 0.0f ) ? ( TRANSFER_QUANTIZE / flMax ) : 0.0f;
+
+	m_Mutex.Lock();
+
+	if ( !m_Blocks.Count() || m_Blocks.Tail().m_nUsed + nBytes > m_Blocks.Tail().m_nSize )
+	{
+		AllocBlock( nBytes );
+	}
+
+	Block_t &block = m_Blocks.Tail();
+	RowLocation_t &location = m_pRowLocations[iPatch];
+	location.m_nBlock = m_Blocks.Count() - 1;
+	location.m_nOffset = block.m_nUsed;
+	location.m_nBytes = nBytes;
+	location.m_nTransfers = nTransfers;
+
+	byte *pOut = block.m_pData + block.m_nUsed;
+	memcpy( pOut, &flScale, sizeof( flScale ) );
+	pOut += sizeof( flScale );
+
+	nPrevPatch = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		pOut = WriteVarInt( pOut, pTransfers[i].patch - nPrevPatch );
+		nPrevPatch = pTransfers[i].patch;
+
+		int nQuantized = clamp( (int)( pTransfers[i].transfer * flInvScale + 0.5f ), 0, 65535 );
+		*pOut++ = (byte)( nQuantized & 0xFF );
+		*pOut++ = (byte)( nQuantized >> 8 );
+	}
+	Assert( pOut == block.m_pData + block.m_nUsed + nBytes );
+
+	block.m_nUsed += nBytes;
+
+	m_Mutex.Unlock();
+}
+
+void CTransferMatrix::Finalize()
+{
+	// CSR offsets
+	m_pRowOffsets = new int64[m_nPatches + 1];
+	m_pRowOffsets[0] = 0;
+	m_nTransfers = 0;
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		m_pRowOffsets[i+1] = m_pRowOffsets[i] + m_pRowLocations[i].m_nBytes;
+		m_nTransfers += m_pRowLocations[i].m_nTransfers;
+	}
+	int64 nTotalSize = m_pRowOffsets[m_nPatches];
+	m_nCompressedSize = nTotalSize;
+
+	// keep the rows in memory if they fit next to the blocks they are copied out of
+	bool bInMemory = !m_nMemoryLimit || ( m_nResidentSize + nTotalSize <= m_nMemoryLimit );
+	if ( bInMemory )
+	{
+		m_pRowData = (byte *)malloc( max( nTotalSize, (int64)1 ) );
+		if ( !m_pRowData )
+			Error( "Memory allocation failure" );
+	}
+	else
+	{
+		char szFileName[MAX_PATH];
+		Q_snprintf( szFileName, sizeof( szFileName ), "%s.rows.vradtmp", m_szSpillFileBase );
+		if ( !m_RowSpillFile.Open( szFileName ) )
+			Error( "Can't create transfer spill file %s\n", szFileName );
+	}
+
+	// bucket the rows by the block they were built in so each block is visited once
+	int nBlocks = m_Blocks.Count();
+	CUtlVector<int> blockStart;
+	blockStart.SetCount( nBlocks + 1 );
+	memset( blockStart.Base(), 0, blockStart.Count() * sizeof( int ) );
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		if ( m_pRowLocations[i].m_nBytes )
+			++blockStart[m_pRowLocations[i].m_nBlock + 1];
+	}
+	for ( int i = 0; i < nBlocks; i++ )
+	{
+		blockStart[i+1] += blockStart[i];
+	}
+	CUtlVector<int> blockRows;
+	blockRows.SetCount( blockStart[nBlocks] );
+	CUtlVector<int> blockFill;
+	blockFill.CopyArray( blockStart.Base(), nBlocks );
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		if ( m_pRowLocations[i].m_nBytes )
+			blockRows[blockFill[m_pRowLocations[i].m_nBlock]++] = i;
+	}
+
+	byte *pSpillBuffer = NULL;
+	for ( int iBlock = 0; iBlock < nBlocks; iBlock++ )
+	{
+		Block_t &block = m_Blocks[iBlock];
+		const byte *pBlockData = block.m_pData;
+		if ( !pBlockData )
+		{
+			pSpillBuffer = (byte *)realloc( pSpillBuffer, max( block.m_nUsed, TRANSFER_BLOCK_SIZE ) );
+			if ( !pSpillBuffer )
+				Error( "Memory allocation failure" );
+			if ( !m_BuildSpillFile.Read( block.m_nSpillOffset, pSpillBuffer, block.m_nUsed ) )
+				Error( "Error reading transfer spill file\n" );
+			pBlockData = pSpillBuffer;
+		}
+
+		for ( int j = blockStart[iBlock]; j < blockStart[iBlock+1]; j++ )
+		{
+			int iPatch = blockRows[j];
+			const RowLocation_t &location = m_pRowLocations[iPatch];
+			if ( bInMemory )
+			{
+				memcpy( m_pRowData + m_pRowOffsets[iPatch], pBlockData + location.m_nOffset, location.m_nBytes );
+			}
+			else if ( !m_RowSpillFile.Write( m_pRowOffsets[iPatch], pBlockData + location.m_nOffset, location.m_nBytes ) )
+			{
+				Error( "Error writing transfer spill file (disk full?)\n" );
+			}
+		}
+
+		free( block.m_pData );
+		block.m_pData = NULL;
+	}
+	free( pSpillBuffer );
+
+	m_Blocks.Purge();
+	m_BuildSpillFile.Close();
+	m_nResidentSize = 0;
+	free( m_pRowLocations );
+	m_pRowLocations = NULL;
+
+	if ( bInMemory )
+	{
+		m_nSpilledSize = 0;
+	}
+	else
+	{
+		m_nSpilledSize = nTotalSize;
+		if ( !m_RowSpillFile.BeginMapping() )
+			Error( "Can't map transfer spill file\n" );
+	}
+}
+
+const byte *CTransferMatrix::MapRow( int iThread, int64 nOffset, int nBytes )
+{
+	View_t &view = m_Views[iThread];
+	if ( !view.m_pView || nOffset < view.m_nStart || nOffset + nBytes > view.m_nStart + view.m_nBytes )
+	{
+		if ( view.m_pView )
+			m_RowSpillFile.UnmapView( view.m_pView, view.m_nBytes );
+
+		// rows are read in patch order, so map from this one forward
+		int64 nStart = nOffset & ~(int64)( TRANSFER_VIEW_ALIGN - 1 );
+		int64 nEnd = max( nOffset + nBytes, nStart + TRANSFER_VIEW_SIZE );
+		nEnd = min( nEnd, m_pRowOffsets[m_nPatches] );
+
+		view.m_nStart = nStart;
+		view.m_nBytes = (int)( nEnd - nStart );
+		view.m_pView = m_RowSpillFile.MapView( view.m_nStart, view.m_nBytes );
+		if ( !view.m_pView )
+			Error( "Can't map transfer spill file\n" );
+	}
+
+	return (const byte *)view.m_pView + ( nOffset - view.m_nStart );
+}
+
+int CTransferMatrix::GetRow( int iThread, int iPatch, int *pPatches, float *pTransfers )
+{
+	Assert( m_pRowOffsets );
+	int64 nOffset = m_pRowOffsets[iPatch];
+	int nBytes = (int)( m_pRowOffsets[iPatch+1] - nOffset );
+	if ( !nBytes )
+		return 0;
+
+	const byte *pRow = m_pRowData ? m_pRowData + nOffset : MapRow( iThread, nOffset, nBytes );
+	return DecodeRow( pRow, nBytes, pPatches, pTransfers );
+}
@@ -0,0 +1,142 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed storage for the patch to patch transfer lists made by
+//			MakeScales and read by GatherLight every bounce.
+//
+//			Each row is a float scale followed by one entry per transfer: the
+//			delta from the previous patch index as a varint and the transfer
+//			quantized to 16 bits of the row's largest transfer. Once all rows
+//			are built they are laid out back to back in patch order (CSR).
+//			If a memory limit is set, rows that don't fit are spilled to a
+//			temp file next to the map, which is memory mapped for the bounces.
+//
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "tier0/threadtools.h"
+#include "threads.h"
+
+
+struct transfer_t;
+
+
+// A file used to hold rows that don't fit in memory. Deleted when it is closed.
+class CTransferSpillFile
+{
+public:
+	CTransferSpillFile();
+	~CTransferSpillFile();
+
+	bool Open( const char *pFileName );
+	void Close();
+	bool IsOpen() const;
+
+	bool Write( int64 nOffset, const void *pData, int nBytes );
+	bool Read( int64 nOffset, void *pData, int nBytes );
+
+	// Call once all writes are done, before mapping views
+	bool BeginMapping();
+
+	// Map a read-only view of the file. nOffset must be a multiple of TRANSFER_VIEW_ALIGN.
+	void *MapView( int64 nOffset, int nBytes );
+	void UnmapView( void *pView, int nBytes );
+
+private:
+#ifdef _WIN32
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+#else
+	int m_nFile;
+#endif
+};
+
+
+class CTransferMatrix
+{
+public:
+	CTransferMatrix();
+	~CTransferMatrix();
+
+	// nMemoryLimit is in bytes, 0 means no limit. pSpillFileBase names the temp
+	// files that are used once the limit is exceeded.
+	void Init( int nPatches, int64 nMemoryLimit, const char *pSpillFileBase );
+	void Shutdown();
+
+	// Store the (already scaled) transfers of a patch. Sorts pTransfers by patch index.
+	// Can be called from any thread.
+	void SetRow( int iPatch, transfer_t *pTransfers, int nTransfers );
+
+	// Lay all rows out in patch order. Call after the last SetRow and before GetRow.
+	void Finalize();
+
+	// Decode a row into separate patch index and transfer arrays and return the number of
+	// transfers in it. Both must have room for max_transfer entries. Can be called from
+	// any thread.
+	int GetRow( int iThread, int iPatch, int *pPatches, float *pTransfers );
+
+	// valid after Finalize
+	int64 GetCompressedSize() const		{ return m_nCompressedSize; }
+	int64 GetSpilledSize() const		{ return m_nSpilledSize; }
+	int64 GetNumTransfers() const		{ return m_nTransfers; }
+
+private:
+	struct Block_t
+	{
+		byte *m_pData;			// NULL once it has been spilled
+		int64 m_nSpillOffset;
+		int m_nUsed;
+		int m_nSize;
+	};
+
+	struct RowLocation_t
+	{
+		int m_nBlock;
+		int m_nOffset;
+		int m_nBytes;
+		int m_nTransfers;
+	};
+
+	struct View_t
+	{
+		void *m_pView;
+		int64 m_nStart;
+		int m_nBytes;
+	};
+
+	void AllocBlock( int nMinSize );
+	void SpillBlocks();
+	const byte *MapRow( int iThread, int64 nOffset, int nBytes );
+
+	CThreadFastMutex m_Mutex;
+	int m_nPatches;
+	int64 m_nMemoryLimit;
+	char m_szSpillFileBase[MAX_PATH];
+
+	// while building
+	CUtlVector<Block_t> m_Blocks;
+	RowLocation_t *m_pRowLocations;
+	int64 m_nResidentSize;
+	CTransferSpillFile m_BuildSpillFile;
+
+	// after Finalize
+	int64 *m_pRowOffsets;
+	byte *m_pRowData;
+	CTransferSpillFile m_RowSpillFile;
+	View_t m_Views[MAX_TOOL_THREADS+1];
+
+	int64 m_nCompressedSize;
+	int64 m_nSpilledSize;
+	int64 m_nTransfers;
+};
+
+
+extern CTransferMatrix g_TransferMatrix;
+
+
+#endif // TRANSFERMATRIX_H
@@ -236,8 +236,7 @@ struct CPatch
 //	struct		patch_s		*nextparent;		    // next in face
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
-	int			numtransfers;
-	transfer_t	*transfers;
+	int			numtransfers;			// the transfers themselves are in g_TransferMatrix
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -301,6 +300,8 @@ extern bool IsModelTextureShadowsForced( const char *pModelName );
 #define TRACE_ID_STATICPROP    0x04000000  // static prop - lower bits are prop ID
 extern RayTracingEnvironment g_RtEnv;
 
+void RunRayTraceBenchmark( int nPackets );
+
 #include "mpivrad.h"
 
 void MakeShadowSplits (void);
@@ -361,6 +362,7 @@ int SaveIncremental(char *filename);
 int PartialHead (void);
 void BuildFacelights (int facenum, int threadnum);
 void PrecompLightmapOffsets();
+void ReportLightmapPackEstimate();
 void FinalLightFace (int threadnum, int facenum);
 void PvsForOrigin (Vector& org, byte *pvs);
 void ConvertRGBExp32ToRGBA8888( const ColorRGBExp32 *pSrc, unsigned char *pDst );
@@ -579,6 +581,11 @@ void ComputeDetailPropLighting( int iThread );
 void ComputeIndirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, 
 									 int iThread, bool force_fast = false, bool bIgnoreNormals = false );
 
+// Caches the average radiance of each face for CalcRayAmbientLighting. Build once the
+// lightmaps are final.
+void BuildFaceRadianceCache();
+void FreeFaceRadianceCache();
+
 //-----------------------------------------------------------------------------
 // VRad static props
 //-----------------------------------------------------------------------------
@@ -606,5 +613,6 @@ extern DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
 IVradStaticPropMgr* StaticPropMgr();
 
 extern float ComputeCoverageFromTexture( float b0, float b1, float b2, int32 hitID );
+extern fltx4 ComputeCoverageFromTexture4( const fltx4 &b0, const fltx4 &b1, const fltx4 &b2, int hitMask, int32 hitID );
 
 #endif // VRAD_H
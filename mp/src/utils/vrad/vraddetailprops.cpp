@@ -263,6 +263,47 @@ static void ComputeAmbientFromSurface( dface_t* pFace, directlight_t* pSkylight,
 // Computes the lightmap color at a particular point
 //-----------------------------------------------------------------------------
 
+static void ComputeFaceAverageRadiance( dface_t* pFace, directlight_t* pSkylight, int maps, Vector &color )
+{
+	ColorRGBExp32* pAvgColor = dface_AvgLightColor( pFace, maps );
+
+	// this code expects values from [0..1] not [0..255]
+	color[0] = TexLightToLinear( pAvgColor->r, pAvgColor->exponent );
+	color[1] = TexLightToLinear( pAvgColor->g, pAvgColor->exponent );
+	color[2] = TexLightToLinear( pAvgColor->b, pAvgColor->exponent );
+
+	ComputeAmbientFromSurface( pFace, pSkylight, color );
+}
+
+//-----------------------------------------------------------------------------
+// Every ray that ends on a face far enough away uses the face's average, so
+// it's worked out once per face and lightmap style for all of them.
+//-----------------------------------------------------------------------------
+static CUtlVector<Vector> s_FaceAverageRadiance;		// MAXLIGHTMAPS per face
+
+void BuildFaceRadianceCache()
+{
+	directlight_t *pSkyLight = FindAmbientSkyLight();
+
+	s_FaceAverageRadiance.SetCount( numfaces * MAXLIGHTMAPS );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *pFace = &g_pFaces[i];
+		if ( texinfo[pFace->texinfo].flags & SURF_SKY )
+			continue;
+
+		for (int maps = 0 ; maps < MAXLIGHTMAPS && pFace->styles[maps] != 255 ; ++maps)
+		{
+			ComputeFaceAverageRadiance( pFace, pSkyLight, maps, s_FaceAverageRadiance[i * MAXLIGHTMAPS + maps] );
+		}
+	}
+}
+
+void FreeFaceRadianceCache()
+{
+	s_FaceAverageRadiance.Purge();
+}
+
 static void ComputeLightmapColorFromAverage( dface_t* pFace, directlight_t* pSkylight, float scale, Vector pColor[MAX_LIGHTSTYLES] )
 {
 	texinfo_t* pTex = &texinfo[pFace->texinfo];
@@ -277,17 +318,18 @@ static void ComputeLightmapColorFromAverage( dface_t* pFace, directlight_t* pSky
 		return;
 	}
 
+	const Vector *pCached = s_FaceAverageRadiance.Count() ? &s_FaceAverageRadiance[( pFace - g_pFaces ) * MAXLIGHTMAPS] : NULL;
 	for (int maps = 0 ; maps < MAXLIGHTMAPS && pFace->styles[maps] != 255 ; ++maps)
 	{
-		ColorRGBExp32* pAvgColor = dface_AvgLightColor( pFace, maps );
-
-		// this code expects values from [0..1] not [0..255]
 		Vector color;
-		color[0] = TexLightToLinear( pAvgColor->r, pAvgColor->exponent );
-		color[1] = TexLightToLinear( pAvgColor->g, pAvgColor->exponent );
-		color[2] = TexLightToLinear( pAvgColor->b, pAvgColor->exponent );
-
-		ComputeAmbientFromSurface( pFace, pSkylight, color );
+		if ( pCached )
+		{
+			color = pCached[maps];
+		}
+		else
+		{
+			ComputeFaceAverageRadiance( pFace, pSkylight, maps, color );
+		}
 
 		int style = pFace->styles[maps];
 		pColor[style] += color * scale;
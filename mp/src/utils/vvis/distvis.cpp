@@ -0,0 +1,111 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: The vvis stages that run across worker processes with -dist. These
+//			mirror the VMPI versions in mpivis.cpp, but go through localdist so
+//			they don't need the VMPI service or windows.
+//
+//=============================================================================//
+
+#include "vis.h"
+#include "threads.h"
+#include "pacifier.h"
+#include "localdist.h"
+#include "distvis.h"
+
+
+//-----------------------------------------
+//
+// BasePortalVis. Every process needs all the results for PortalFlow, so they're
+// broadcast to the workers.
+//
+
+static void Dist_ProcessBasePortalVis( int iThread, int iPortal, CUtlBuffer *pBuf )
+{
+	BasePortalVis( iThread, iPortal );
+
+	if ( pBuf )
+	{
+		portal_t *p = &portals[iPortal];
+		pBuf->Put( p->portalfront, portalbytes );
+		pBuf->Put( p->portalflood, portalbytes );
+	}
+}
+
+
+static void Dist_ReceiveBasePortalVis( int iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	portal_t *p = &portals[iWorkUnit];
+	if ( buf.GetBytesRemaining() != portalbytes*2 )
+		Error( "Dist_ReceiveBasePortalVis: invalid results for portal %d from worker %d.\n", iWorkUnit, iWorker );
+
+	//
+	// allocate memory for bitwise vis solutions for this portal
+	//
+	p->portalfront = (byte*)malloc (portalbytes);
+	buf.Get( p->portalfront, portalbytes );
+
+	p->portalflood = (byte*)malloc (portalbytes);
+	buf.Get( p->portalflood, portalbytes );
+
+	p->portalvis = (byte*)malloc (portalbytes);
+	memset (p->portalvis, 0, portalbytes);
+
+	p->nummightsee = CountBits( p->portalflood, g_numportals*2 );
+}
+
+
+void RunDistBasePortalVis()
+{
+	Msg( "%-20s ", "BasePortalVis:" );
+	StartPacifier( "" );
+
+	double elapsed = LocalDist_DistributeWork( g_numportals * 2, Dist_ProcessBasePortalVis, Dist_ReceiveBasePortalVis, true );
+
+	EndPacifier( false );
+	Msg( " (%d)\n", (int)elapsed );
+}
+
+
+//-----------------------------------------
+//
+// PortalFlow. Work units index sorted_portals, which SortPortals leaves in the same
+// order in every process. Results are broadcast too: a portal that's done gives
+// RecursiveLeafFlow a tighter bound than its portalflood.
+//
+
+static void Dist_ProcessPortalFlow( int iThread, int iPortal, CUtlBuffer *pBuf )
+{
+	PortalFlow( iThread, iPortal );
+
+	if ( pBuf )
+	{
+		portal_t *p = sorted_portals[iPortal];
+		pBuf->Put( p->portalvis, portalbytes );
+	}
+}
+
+
+static void Dist_ReceivePortalFlow( int iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	portal_t *p = sorted_portals[iWorkUnit];
+	if ( buf.GetBytesRemaining() != portalbytes )
+		Error( "Dist_ReceivePortalFlow: invalid results for portal %d from worker %d.\n", iWorkUnit, iWorker );
+
+	if ( p->status != stat_done )
+	{
+		buf.Get( p->portalvis, portalbytes );
+		p->status = stat_done;
+	}
+}
+
+
+void RunDistPortalFlow()
+{
+	Msg( "%-20s ", "PortalFlow:" );
+	StartPacifier( "" );
+
+	double elapsed = LocalDist_DistributeWork( g_numportals * 2, Dist_ProcessPortalFlow, Dist_ReceivePortalFlow, true );
+
+	EndPacifier( false );
+	Msg( " (%d)\n", (int)elapsed );
+}
@@ -0,0 +1,18 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: The vvis stages that run across worker processes with -dist.
+//
+//=============================================================================//
+
+#ifndef DISTVIS_H
+#define DISTVIS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+void RunDistBasePortalVis();
+void RunDistPortalFlow();
+
+
+#endif // DISTVIS_H
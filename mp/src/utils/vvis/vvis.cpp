@@ -14,6 +14,8 @@
 #include "pacifier.h"
 #include "vmpi.h"
 #include "mpivis.h"
+#include "localdist.h"
+#include "distvis.h"
 #include "tier1/strtools.h"
 #include "collisionutils.h"
 #include "tier0/icommandline.h"
@@ -122,13 +124,22 @@ SortPortals
 
 Sorts the portals from the least complex, so the later ones can reuse
 the earlier information.
+
+The most expensive ones are left at the end where they get the most reuse, but
+in reverse, so the longest jobs start first and the last threads aren't left
+waiting on one big portal that only started at the very end.
 =============
 */
+#define LONGEST_FIRST_FRACTION	8		// the costliest portals that make up 1/8 of the estimated total
+
 int PComp (const void *a, const void *b)
 {
-	if ( (*(portal_t **)a)->nummightsee == (*(portal_t **)b)->nummightsee)
-		return 0;
-	if ( (*(portal_t **)a)->nummightsee < (*(portal_t **)b)->nummightsee)
+	if ( (*(portal_t **)a)->estimatedcost == (*(portal_t **)b)->estimatedcost)
+	{
+		// keep the order the same in every process of a distributed compile
+		return (int)((*(portal_t **)a) - (*(portal_t **)b));
+	}
+	if ( (*(portal_t **)a)->estimatedcost < (*(portal_t **)b)->estimatedcost)
 		return -1;
 
 	return 1;
@@ -153,7 +164,30 @@ void SortPortals (void)
 
 	if (nosort)
 		return;
+
+	int64 totalcost = 0;
+	for (i=0 ; i<g_numportals*2 ; i++)
+	{
+		portals[i].estimatedcost = EstimatePortalFlowCost (&portals[i]);
+		totalcost += portals[i].estimatedcost;
+	}
+
 	qsort (sorted_portals, g_numportals*2, sizeof(sorted_portals[0]), PComp);
+
+	// reverse the expensive tail
+	int64 tailcost = 0;
+	int first = g_numportals*2;
+	while (first > 0 && tailcost < totalcost / LONGEST_FIRST_FRACTION)
+	{
+		first--;
+		tailcost += sorted_portals[first]->estimatedcost;
+	}
+	for (int lo = first, hi = g_numportals*2 - 1; lo < hi; lo++, hi--)
+	{
+		portal_t *temp = sorted_portals[lo];
+		sorted_portals[lo] = sorted_portals[hi];
+		sorted_portals[hi] = temp;
+	}
 }
 
 
@@ -306,6 +340,10 @@ void CalcPortalVis (void)
 	{
  		RunMPIPortalFlow();
 	}
+	else if ( LocalDist_IsMaster() || LocalDist_IsWorker() )
+	{
+		RunDistPortalFlow();
+	}
 	else 
 	{
 		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
@@ -335,6 +373,10 @@ void CalcVis (void)
 	{
 		RunMPIBasePortalVis();
 	}
+	else if ( LocalDist_IsMaster() || LocalDist_IsWorker() )
+	{
+		RunDistBasePortalVis();
+	}
 	else 
 	{
 	    RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
@@ -344,6 +386,10 @@ void CalcVis (void)
 
 	CalcPortalVis ();
 
+	// The rest isn't distributed, and only the master writes the map.
+	if ( LocalDist_IsWorker() )
+		LocalDist_WorkerExit();
+
 	//
 	// assemble the leaf vis lists by oring the portal lists
 	//
@@ -953,6 +999,30 @@ int ParseCommandLine( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-dist" ) )
+		{
+			g_nLocalDistWorkers = atoi( argv[i+1] );
+			i++;
+		}
+		else if ( !Q_stricmp( argv[i], "-distport" ) )
+		{
+			g_nLocalDistPort = atoi( argv[i+1] );
+			i++;
+		}
+		else if ( !Q_stricmp( argv[i], "-distlisten" ) )
+		{
+			g_bLocalDistListen = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-disttoken" ) )
+		{
+			Q_strncpy( g_szLocalDistToken, argv[i+1], sizeof( g_szLocalDistToken ) );
+			i++;
+		}
+		else if ( !Q_stricmp( argv[i], "-distworker" ) )
+		{
+			Q_strncpy( g_szLocalDistMaster, argv[i+1], sizeof( g_szLocalDistMaster ) );
+			i++;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1017,6 +1087,8 @@ void PrintUsage( int argc, char **argv )
 		"  -v (or -verbose): Turn on verbose output (also shows more command\n"
 		"  -fast           : Only do first quick pass on vis calculations.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
+		"  -dist #         : Start # worker processes on this machine and split\n"
+		"                    BasePortalVis and PortalFlow with them over TCP.\n"
 		"  -low            : Run as an idle-priority process.\n"
 		"                    env_fog_controller specifies one.\n"
 		"\n"
@@ -1030,6 +1102,13 @@ void PrintUsage( int argc, char **argv )
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -distport #     : Port the -dist master listens on (default: any free one).\n"
+		"  -distlisten     : Let workers on other machines join a -dist master. Needs\n"
+		"                    -disttoken.\n"
+		"  -disttoken <secret> : Shared secret workers send the -dist master. Workers\n"
+		"                    without it are turned away.\n"
+		"  -distworker <host:port> : Work for the -dist master at host:port. Run with\n"
+		"                    the master's options and a path to the same map.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1100,8 +1179,18 @@ int RunVVis( int argc, char **argv )
 
 	start = Plat_FloatTime();
 
+	if ( g_bUseMPI && LocalDist_IsRequested() )
+	{
+		Warning( "-dist can't be used with -mpi, ignoring it.\n" );
+		g_nLocalDistWorkers = 0;
+		g_bLocalDistListen = false;
+		g_szLocalDistMaster[0] = 0;
+	}
+
+	// Workers are started before loading so they load the map alongside us.
+	LocalDist_Start( argc, argv, source );
 
-	if (!g_bUseMPI)
+	if (!g_bUseMPI && !LocalDist_IsWorker())
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -1116,6 +1205,7 @@ int RunVVis( int argc, char **argv )
 	}
 	
 	ThreadSetDefault ();
+	g_nLumpThreads = numthreads;
 
 	char	targetPath[1024];
 	GetPlatformMapPath( source, targetPath, 0, 1024 );
@@ -1184,6 +1274,10 @@ int RunVVis( int argc, char **argv )
 		{
 			Warning("Can't compile trace in MPI mode\n");
 		}
+		if ( LocalDist_IsWorker() )
+		{
+			LocalDist_WorkerExit();
+		}
 		CalcVisTrace ();
 		WritePortalTrace(source);
 	}
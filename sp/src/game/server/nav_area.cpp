@@ -3610,17 +3610,15 @@ void CNavArea::SetCorner( NavCornerType corner, const Vector& newPosition )
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Returns true if an existing hiding spot is too close to given position
+ * Returns true if a hiding spot already found is too close to given position
  */
-bool CNavArea::IsHidingSpotCollision( const Vector &pos ) const
+static bool IsHidingSpotCollision( const HidingSpotCandidateVector &candidates, const Vector &pos )
 {
 	const float collisionRange = 30.0f;
 
-	FOR_EACH_VEC( m_hidingSpots, it )
+	FOR_EACH_VEC( candidates, it )
 	{
-		const HidingSpot *spot = m_hidingSpots[ it ];
-
-		if ((spot->GetPosition() - pos).IsLengthLessThan( collisionRange ))
+		if ((candidates[ it ].pos - pos).IsLengthLessThan( collisionRange ))
 			return true;
 	}
 
@@ -3671,7 +3669,7 @@ bool IsHidingSpotInCover( const Vector &spot )
  * Finds the hiding spot position in a corner's area.  If the typical inset is off the nav area (small
  * hand-constructed areas), it tries to fit the position inside the area.
  */
-static Vector FindPositionInArea( CNavArea *area, NavCornerType corner )
+static Vector FindPositionInArea( const CNavArea *area, NavCornerType corner )
 {
 	int multX = 1, multY = 1;
 	switch ( corner )
@@ -3731,6 +3729,18 @@ static Vector FindPositionInArea( CNavArea *area, NavCornerType corner )
  * Analyze local area neighborhood to find "hiding spots" for this area
  */
 void CNavArea::ComputeHidingSpots( void )
+{
+	HidingSpotCandidateVector candidates;
+	FindHidingSpots( &candidates );
+	CreateHidingSpots( candidates );
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find the "hiding spots" for this area. Only traces and reads the mesh, so many areas
+ * can be analyzed at once - the spots are created afterwards by CreateHidingSpots().
+ */
+void CNavArea::FindHidingSpots( HidingSpotCandidateVector *candidates ) const
 {
 	struct
 	{
@@ -3738,7 +3748,7 @@ void CNavArea::ComputeHidingSpots( void )
 	}
 	extent;
 
-	m_hidingSpots.PurgeAndDeleteElements();
+	candidates->RemoveAll();
 
 
 	// "jump areas" cannot have hiding spots
@@ -3836,17 +3846,33 @@ void CNavArea::ComputeHidingSpots( void )
 		if (cornerCount[c] == 2)
 		{
 			Vector pos = FindPositionInArea( this, (NavCornerType)c );
-			if ( !c || !IsHidingSpotCollision( pos ) )
+			if ( !c || !IsHidingSpotCollision( *candidates, pos ) )
 			{
-				HidingSpot *spot = TheNavMesh->CreateHidingSpot();
-				spot->SetPosition( pos );
-				spot->SetFlags( IsHidingSpotInCover( pos ) ? HidingSpot::IN_COVER : HidingSpot::EXPOSED );
-				m_hidingSpots.AddToTail( spot );
+				HidingSpotCandidate &candidate = candidates->Element( candidates->AddToTail() );
+				candidate.pos = pos;
+				candidate.flags = IsHidingSpotInCover( pos ) ? HidingSpot::IN_COVER : HidingSpot::EXPOSED;
 			}
 		}
 	}
 }
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Replace the hiding spots of this area. Spots get their IDs here, so areas must be done in order.
+ */
+void CNavArea::CreateHidingSpots( const HidingSpotCandidateVector &candidates )
+{
+	m_hidingSpots.PurgeAndDeleteElements();
+
+	FOR_EACH_VEC( candidates, it )
+	{
+		HidingSpot *spot = TheNavMesh->CreateHidingSpot();
+		spot->SetPosition( candidates[ it ].pos );
+		spot->SetFlags( candidates[ it ].flags );
+		m_hidingSpots.AddToTail( spot );
+	}
+}
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Determine how much walkable area we can see from the spot, and how far away we can see.
@@ -4016,8 +4042,14 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 	Vector dir = e->path.to - e->path.from;
 	float length = dir.NormalizeInPlace();
 
-	// create unique marker to flag used spots
-	HidingSpot::ChangeMasterMarker();
+	// flag used spots by their index - the spots' own markers are shared, and areas may be
+	// analyzed on several threads at once
+	CUtlVector< bool > isSpotMarked;
+	isSpotMarked.SetCount( TheHidingSpots.Count() );
+	FOR_EACH_VEC( isSpotMarked, mit )
+	{
+		isSpotMarked[ mit ] = false;
+	}
 
 	const float stepSize = 25.0f;		// 50
 	const float seeSpotRange = 2000.0f;	// 3000
@@ -4050,7 +4082,7 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 			if (!spot->HasGoodCover())
 				continue;
 
-			if (spot->IsMarked())
+			if (isSpotMarked[ it ])
 				continue;
 
 			const Vector &spotPos = spot->GetPosition();
@@ -4086,7 +4118,7 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 			}
 
 			// mark spot as encountered
-			spot->Mark();
+			isSpotMarked[ it ] = true;
 		}
 	}
 
@@ -5525,11 +5557,10 @@ void CNavArea::ResetPotentiallyVisibleAreas()
  */
 
 CNavArea *g_pCurVisArea;
-CTSListWithFreeList< CNavArea::AreaBindInfo > g_ComputedVis;
 
-void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
+void CNavArea::ComputeVisToArea( VisToAreaJob &job )
 {
-	CNavArea *area = assert_cast< CNavArea * >( pOtherArea );
+	CNavArea *area = job.area;
 	VisibilityType visThisToOther = ( area == g_pCurVisArea ) ? COMPLETELY_VISIBLE : NOT_VISIBLE;
 	VisibilityType visOtherToThis = NOT_VISIBLE;
 
@@ -5555,20 +5586,9 @@ void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
 		}
 	}
 
-	CNavArea::AreaBindInfo info;
-	if ( visThisToOther != NOT_VISIBLE )
-	{
-		info.area = area;
-		info.attributes = visThisToOther;
-		g_ComputedVis.PushItem( info );
-	}
-
-	if ( visOtherToThis != NOT_VISIBLE )
-	{
-		info.area = g_pCurVisArea;
-		info.attributes = visOtherToThis;
-		area->m_potentiallyVisibleAreas.AddToTail( info );
-	}
+	// the results are added to the lists in order once all jobs are done, so they don't depend on thread timing
+	job.visThisToOther = visThisToOther;
+	job.visOtherToThis = visOtherToThis;
 }
 
 
@@ -5608,13 +5628,34 @@ void CNavArea::ComputeVisibilityToMesh( void )
 
 	SetupPVS();
 
+	CUtlVector< VisToAreaJob > jobs;
+	jobs.SetCount( collector.m_area.Count() );
+	FOR_EACH_VEC( collector.m_area, jit )
+	{
+		jobs[ jit ].area = collector.m_area[ jit ];
+	}
+
 	g_pCurVisArea = this;
-	ParallelProcess( "CNavArea::ComputeVisibilityToMesh", collector.m_area.Base(), collector.m_area.Count(), &ComputeVisToArea );
+	ParallelProcess( "CNavArea::ComputeVisibilityToMesh", jobs.Base(), jobs.Count(), &ComputeVisToArea );
 
-	m_potentiallyVisibleAreas.EnsureCapacity( g_ComputedVis.Count() );
-	while ( g_ComputedVis.Count() )
+	AreaBindInfo info;
+	FOR_EACH_VEC( jobs, jit )
 	{
-		g_ComputedVis.PopItem( &m_potentiallyVisibleAreas[ m_potentiallyVisibleAreas.AddToTail() ] );
+		const VisToAreaJob &job = jobs[ jit ];
+
+		if ( job.visThisToOther != NOT_VISIBLE )
+		{
+			info.area = job.area;
+			info.attributes = job.visThisToOther;
+			m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		if ( job.visOtherToThis != NOT_VISIBLE )
+		{
+			info.area = this;
+			info.attributes = job.visOtherToThis;
+			job.area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
 	}
 
 	FOR_EACH_VEC( collector.m_area, it )
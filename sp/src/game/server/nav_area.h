@@ -168,6 +168,18 @@ extern HidingSpotVector TheHidingSpots;
 extern HidingSpot *GetHidingSpotByID( unsigned int id );
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A hiding spot found by analysis, before the HidingSpot itself is created
+ */
+struct HidingSpotCandidate
+{
+	Vector pos;
+	int flags;
+};
+typedef CUtlVectorFixedGrowable< HidingSpotCandidate, NUM_CORNERS > HidingSpotCandidateVector;
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Stores a pointer to an interesting "spot", and a parametric distance along a path
@@ -271,9 +283,13 @@ public:
 	virtual void OnEditDestroyNotify( CNavArea *deadArea ) { }		// invoked when given area has just been deleted from the mesh in edit mode
 	virtual void OnEditDestroyNotify( CNavLadder *deadLadder ) { }	// invoked when given ladder has just been deleted from the mesh in edit mode
 
-	virtual void Save( CUtlBuffer &fileBuffer, unsigned int version ) const;	// (EXTEND)
-	virtual NavErrorType Load( CUtlBuffer &fileBuffer, unsigned int version, unsigned int subVersion );		// (EXTEND)
+	virtual void Save( CUtlBuffer &fileBuffer, unsigned int version ) const;	// legacy field by field format - if a derived class extends this, the whole mesh is saved as version 17, extend SaveCustomData() instead
+	virtual NavErrorType Load( CUtlBuffer &fileBuffer, unsigned int version, unsigned int subVersion );		// legacy field by field format - only used for files older than version 18, extend LoadCustomData() instead
 	virtual NavErrorType PostLoad( void );								// (EXTEND) invoked after all areas have been loaded - for pointer binding, etc
+	NavErrorType ResolveLoadedIDs( void );								// convert the IDs read by Load() into pointers
+
+	virtual void SaveCustomData( CUtlBuffer &fileBuffer ) const { }						// (EXTEND) store custom area data for derived classes - flat array files only
+	virtual void LoadCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion ) { }	// (EXTEND) load custom area data for derived classes - flat array files only
 
 	virtual void SaveToSelectedSet( KeyValues *areaKey ) const;		// (EXTEND) saves attributes for the area to a KeyValues
 	virtual void RestoreFromSelectedSet( KeyValues *areaKey );		// (EXTEND) restores attributes from a KeyValues
@@ -291,6 +307,7 @@ public:
 
 	unsigned int GetID( void ) const	{ return m_id; }		// return this area's unique ID
 	static void CompressIDs( void );							// re-orders area ID's so they are continuous
+	static unsigned int GetNextID( void )	{ return m_nextID; }	// one more than the largest area ID handed out so far
 	unsigned int GetDebugID( void ) const { return m_debugid; }
 
 	void SetAttributes( int bits )			{ m_attributeFlags = bits; }
@@ -476,6 +493,8 @@ public:
 
 	//- generation and analysis -------------------------------------------------------------------------
 	virtual void ComputeHidingSpots( void );					// analyze local area neighborhood to find "hiding spots" in this area - for map learning
+	virtual void FindHidingSpots( HidingSpotCandidateVector *candidates ) const;	// find the "hiding spots" in this area without creating them - safe to run on job threads
+	void CreateHidingSpots( const HidingSpotCandidateVector &candidates );		// replace the hiding spots in this area with the given ones
 	virtual void ComputeSniperSpots( void );					// analyze local area neighborhood to find "sniper spots" in this area - for map learning
 	virtual void ComputeSpotEncounters( void );					// compute spot encounter data - for map learning
 	virtual void ComputeEarliestOccupyTimes( void );
@@ -686,7 +705,6 @@ private:
 
 	//- hiding spots ------------------------------------------------------------------------------------
 	HidingSpotVector m_hidingSpots;
-	bool IsHidingSpotCollision( const Vector &pos ) const;		// returns true if an existing hiding spot is too close to given position
 
 	//- encounter spots ---------------------------------------------------------------------------------
 	SpotEncounterVector m_spotEncounters;						// list of possible ways to move thru this area, and the spots to look at as we do
@@ -738,7 +756,13 @@ private:
 	//- visibility --------------------------------------------------------------------------------------
 	void ComputeVisibilityToMesh( void );						// compute visibility to surrounding mesh
 	void ResetPotentiallyVisibleAreas();
-	static void ComputeVisToArea( CNavArea *&pOtherArea );
+	struct VisToAreaJob
+	{
+		CNavArea *area;
+		unsigned char visThisToOther;			// VisibilityType
+		unsigned char visOtherToThis;			// VisibilityType
+	};
+	static void ComputeVisToArea( VisToAreaJob &job );
 
 #ifndef _X360
 	typedef CUtlVectorConservative<AreaBindInfo> CAreaBindInfoArray; // shaves 8 bytes off structure caused by need to support editing
@@ -0,0 +1,91 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_cluster.h
+// Clusters of nav areas for hierarchical path finding
+
+#ifndef _NAV_CLUSTER_H_
+#define _NAV_CLUSTER_H_
+
+#include "utlvector.h"
+
+class CNavArea;
+class CNavPathSearch;
+class CUtlBuffer;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The areas of the mesh grouped into small connected clusters. An area with a connection
+ * to or from another cluster is a "portal". The cheapest way between every two portals of
+ * a cluster is worked out ahead of time and saved with the mesh, so a long path search
+ * only has to step from portal to portal instead of expanding every area on the way.
+ *
+ * Portal costs are computed as if nothing were blocked. Once any area in a cluster becomes
+ * blocked, searches through that cluster work its portal costs out again until all of
+ * its areas are unblocked.
+ */
+class CNavClusterGraph
+{
+public:
+	CNavClusterGraph( void );
+
+	void Reset( void );
+	void Build( void );											// group the current mesh into clusters and compute the portal costs
+	bool IsBuilt( void ) const				{ return m_clusterCount > 0; }
+
+	void Save( CUtlBuffer &fileBuffer ) const;
+	void Load( CUtlBuffer &fileBuffer, unsigned int version );
+
+	int GetClusterCount( void ) const		{ return m_clusterCount; }
+	int GetCluster( const CNavArea *area ) const;				// return the area's cluster, or -1 if it has none
+
+	void OnAreaBlocked( CNavArea *area );
+	void OnAreaUnblocked( CNavArea *area );
+
+	/**
+	 * Find the shortest path from startArea to goalArea over the portals, then fill in the
+	 * areas in between. The path cost is at most nav_cluster_path_bound times the optimal.
+	 * Returns false if there is no path, or if the clusters can't answer this query (same
+	 * cluster, no clusters built, or the mesh was edited since) - use a plain search then.
+	 * Only reads the graph, so any number of these can run at once.
+	 */
+	bool BuildPath( CNavPathSearch &portalSearch, CNavPathSearch &areaSearch, CNavArea *startArea, CNavArea *goalArea,
+					CUtlVector< CNavArea * > *path, int teamID, bool ignoreNavBlockers ) const;
+
+private:
+	struct Portal
+	{
+		CNavArea *m_area;
+		int m_firstEdge;
+		int m_edgeCount;
+	};
+
+	struct Edge
+	{
+		int m_toPortal;
+		float m_cost;
+		bool m_isCrossing;										// a direct connection into another cluster
+	};
+
+	void SearchCluster( CNavPathSearch &search, CNavArea *fromArea, CNavArea *toArea, bool useBlocking, int teamID, bool ignoreNavBlockers ) const;
+	bool AppendClusterPath( CNavPathSearch &search, CNavArea *fromArea, CNavArea *toArea, CUtlVector< CNavArea * > *path, int teamID, bool ignoreNavBlockers ) const;
+	void BindClusters( void );									// fill in the by-ID and by-cluster lookups from m_clusterAreas
+
+	int m_clusterCount;
+	CUtlVector< CNavArea * > m_clusterAreas;					// the areas of each cluster, one cluster after another
+	CUtlVector< int > m_clusterFirstArea;						// by cluster, into m_clusterAreas, plus one past the end
+	CUtlVector< Portal > m_portals;								// one cluster after another
+	CUtlVector< int > m_clusterFirstPortal;						// by cluster, into m_portals, plus one past the end
+	CUtlVector< Edge > m_edges;
+	CUtlVector< int > m_areaCluster;							// by area ID
+	CUtlVector< int > m_areaPortal;								// by area ID, -1 if the area isn't a portal
+	CUtlVector< bool > m_isClusterBlocked;						// by cluster, true while any of its areas might be blocked
+};
+
+
+#endif // _NAV_CLUSTER_H_
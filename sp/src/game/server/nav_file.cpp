@@ -36,7 +36,10 @@
 /// IMPORTANT: If this version changes, the swap function in makegamedata 
 /// must be updated to match. If not, this will break the Xbox 360.
 // TODO: Was changed from 15, update when latest 360 code is integrated (MSB 5/5/09)
-const int NavCurrentVersion = 16;
+const int NavCurrentVersion = 18;
+
+/// The last version that stores each area field by field through CNavArea::Save()
+const int NavLegacyAreaVersion = 17;
 
 //--------------------------------------------------------------------------------------------------------------
 //
@@ -673,10 +676,10 @@ NavErrorType CNavArea::Load( CUtlBuffer &fileBuffer, unsigned int version, unsig
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Convert loaded IDs to pointers
+ * Convert the IDs read by Load() to pointers
  * Make sure all IDs are converted, even if corrupt data is encountered.
  */
-NavErrorType CNavArea::PostLoad( void )
+NavErrorType CNavArea::ResolveLoadedIDs( void )
 {
 	NavErrorType error = NAV_OK;
 
@@ -716,7 +719,6 @@ NavErrorType CNavArea::PostLoad( void )
 				Msg( "CNavArea::PostLoad: Corrupt navigation data. Cannot connect Navigation Areas.\n" );
 				error = NAV_CORRUPT_DATA;
 			}
-			connect->length = ( connect->area->GetCenter() - GetCenter() ).Length();
 		}
 	}
 
@@ -740,18 +742,6 @@ NavErrorType CNavArea::PostLoad( void )
 			error = NAV_CORRUPT_DATA;
 		}
 
-		if (e->from.area && e->to.area)
-		{
-			// compute path
-			float halfWidth;
-			ComputePortal( e->to.area, e->toDir, &e->path.to, &halfWidth );
-			ComputePortal( e->from.area, e->fromDir, &e->path.from, &halfWidth );
-
-			const float eyeHeight = HalfHumanHeight;
-			e->path.from.z = e->from.area->GetZ( e->path.from ) + eyeHeight;
-			e->path.to.z = e->to.area->GetZ( e->path.to ) + eyeHeight;
-		}
-
 		// resolve HidingSpot IDs
 		FOR_EACH_VEC( e->spots, sit )
 		{
@@ -779,6 +769,50 @@ NavErrorType CNavArea::PostLoad( void )
 	}
 
 	m_inheritVisibilityFrom.area = TheNavMesh->GetNavAreaByID( m_inheritVisibilityFrom.id );
+
+	return error;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Finish setting up the area once all areas have been loaded and linked to each other.
+ * Areas loaded field by field have had their IDs resolved by ResolveLoadedIDs() before this,
+ * areas loaded from flat arrays come out of the loader already linked.
+ */
+NavErrorType CNavArea::PostLoad( void )
+{
+	for( int d=0; d<NUM_DIRECTIONS; d++ )
+	{
+		FOR_EACH_VEC( m_connect[d], it )
+		{
+			NavConnect *connect = &m_connect[ d ][ it ];
+			if ( connect->area )
+			{
+				connect->length = ( connect->area->GetCenter() - GetCenter() ).Length();
+			}
+		}
+	}
+
+	// compute encounter paths
+	SpotEncounter *e;
+	FOR_EACH_VEC( m_spotEncounters, it )
+	{
+		e = m_spotEncounters[ it ];
+
+		if (e->from.area && e->to.area)
+		{
+			// compute path
+			float halfWidth;
+			ComputePortal( e->to.area, e->toDir, &e->path.to, &halfWidth );
+			ComputePortal( e->from.area, e->fromDir, &e->path.from, &halfWidth );
+
+			const float eyeHeight = HalfHumanHeight;
+			e->path.from.z = e->from.area->GetZ( e->path.from ) + eyeHeight;
+			e->path.to.z = e->to.area->GetZ( e->path.to ) + eyeHeight;
+		}
+	}
+
 	Assert( m_inheritVisibilityFrom.area != this );
 
 	// remove any invalid areas from the list
@@ -789,7 +823,7 @@ NavErrorType CNavArea::PostLoad( void )
 	// func avoid/prefer attributes are controlled by func_nav_cost entities
 	ClearAllNavCostEntities();
 
-	return error;
+	return NAV_OK;
 }
 
 
@@ -1065,6 +1099,331 @@ static void WarnIfMeshNeedsAnalysis( int version )
 #endif
 }
 
+//--------------------------------------------------------------------------------------------------------------
+//
+// Since version 18 the areas are stored as a handful of flat arrays of fixed size records. Links
+// between records are indexes into these arrays, so the loader can use the arrays in place in the
+// file buffer and connect every area as it creates it - no per-field parsing and no ID lookups.
+// The arrays start on 4 byte boundaries and are stored in native byte order.
+//
+struct NavFileArrayHeader
+{
+	int areaRecordSize;						// catches files saved with a different MAX_NAV_TEAMS
+	int areaCount;
+	int connectionCount;
+	int hidingSpotCount;
+	int encounterCount;
+	int encounterSpotCount;
+	int ladderLinkCount;
+	int visibleAreaCount;
+	int ladderCount;
+};
+
+struct NavFileArea
+{
+	unsigned int id;
+	int attributeFlags;
+	float nwCorner[3];
+	float seCorner[3];
+	float neZ;
+	float swZ;
+	float earliestOccupyTime[ MAX_NAV_TEAMS ];
+	float lightIntensity[ NUM_CORNERS ];
+	int place;								// PlaceDirectory index
+	int firstConnection;					// connections for each direction, one direction after another
+	int connectionCount[ NUM_DIRECTIONS ];
+	int firstHidingSpot;
+	int hidingSpotCount;
+	int firstEncounter;
+	int encounterCount;
+	int firstLadderLink;					// ladder links for each ladder direction, one after another
+	int ladderLinkCount[ CNavLadder::NUM_LADDER_DIRECTIONS ];
+	int firstVisibleArea;
+	int visibleAreaCount;
+	int inheritVisibilityFrom;				// area index, or -1
+};
+
+struct NavFileHidingSpot
+{
+	unsigned int id;
+	float pos[3];
+	int flags;
+};
+
+struct NavFileEncounter
+{
+	int fromArea;							// area index
+	int toArea;								// area index
+	unsigned char fromDir;
+	unsigned char toDir;
+	unsigned short spotCount;
+	int firstSpot;
+};
+
+struct NavFileEncounterSpot
+{
+	int hidingSpot;							// hiding spot index, or -1
+	float t;
+};
+
+struct NavFileVisibleArea
+{
+	int area;								// area index
+	int attributes;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+template < typename T >
+static void PutNavFileArray( CUtlBuffer &fileBuffer, const CUtlVector< T > &array )
+{
+	while ( fileBuffer.TellPut() % 4 )
+	{
+		fileBuffer.PutUnsignedChar( 0 );
+	}
+
+	fileBuffer.Put( array.Base(), array.Count() * sizeof( T ) );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the array of 'count' records at the read position of the file buffer and skip past it,
+ * or NULL if the file is too short
+ */
+template < typename T >
+static const T *GetNavFileArray( CUtlBuffer &fileBuffer, int count )
+{
+	fileBuffer.SeekGet( CUtlBuffer::SEEK_HEAD, AlignValue( fileBuffer.TellGet(), 4 ) );
+
+	if ( count < 0 || fileBuffer.GetBytesRemaining() < 0 || count > fileBuffer.GetBytesRemaining() / (int)sizeof( T ) )
+		return NULL;
+
+	const T *array = (const T *)( (const unsigned char *)fileBuffer.Base() + fileBuffer.TellGet() );
+	fileBuffer.SeekGet( CUtlBuffer::SEEK_CURRENT, count * sizeof( T ) );
+
+	return array;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline bool IsValidNavFileRange( int first, int count, int total )
+{
+	return first >= 0 && count >= 0 && first <= total - count;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Store the areas, their hiding spots and all of the links between them as flat arrays
+ */
+void CNavMesh::SaveAreaArrays( CUtlBuffer &fileBuffer ) const
+{
+	// index of each area and hiding spot in the arrays, by ID
+	CUtlVector< int > areaIndex;
+	areaIndex.SetCount( CNavArea::GetNextID() );
+	for( int i=0; i<areaIndex.Count(); ++i )
+	{
+		areaIndex[i] = -1;
+	}
+
+	CUtlVector< int > hidingSpotIndex;
+	hidingSpotIndex.SetCount( HidingSpot::m_nextID );
+	for( int i=0; i<hidingSpotIndex.Count(); ++i )
+	{
+		hidingSpotIndex[i] = -1;
+	}
+
+	CUtlVector< NavFileHidingSpot > hidingSpots;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+		areaIndex[ area->GetID() ] = it;
+
+		FOR_EACH_VEC( area->m_hidingSpots, hit )
+		{
+			const HidingSpot *spot = area->m_hidingSpots[ hit ];
+			hidingSpotIndex[ spot->GetID() ] = hidingSpots.Count();
+
+			NavFileHidingSpot &record = hidingSpots[ hidingSpots.AddToTail() ];
+			record.id = spot->GetID();
+			record.pos[0] = spot->m_pos.x;
+			record.pos[1] = spot->m_pos.y;
+			record.pos[2] = spot->m_pos.z;
+			record.flags = spot->m_flags;
+		}
+	}
+
+	CUtlVector< NavFileArea > areas;
+	CUtlVector< int > connections;
+	CUtlVector< NavFileEncounter > encounters;
+	CUtlVector< NavFileEncounterSpot > encounterSpots;
+	CUtlVector< int > ladderLinks;
+	CUtlVector< NavFileVisibleArea > visibleAreas;
+
+	areas.EnsureCapacity( TheNavAreas.Count() );
+
+	int firstHidingSpot = 0;
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+
+		NavFileArea &record = areas[ areas.AddToTail() ];
+		V_memset( &record, 0, sizeof( record ) );
+
+		record.id = area->m_id;
+		record.attributeFlags = area->m_attributeFlags;
+		area->m_nwCorner.CopyToArray( record.nwCorner );
+		area->m_seCorner.CopyToArray( record.seCorner );
+		record.neZ = area->m_neZ;
+		record.swZ = area->m_swZ;
+
+		for( int i=0; i<MAX_NAV_TEAMS; ++i )
+		{
+			record.earliestOccupyTime[i] = area->m_earliestOccupyTime[i];
+		}
+
+		for( int i=0; i<NUM_CORNERS; ++i )
+		{
+			record.lightIntensity[i] = area->m_lightIntensity[i];
+		}
+
+		record.place = placeDirectory.GetIndex( area->GetPlace() );
+
+		record.firstConnection = connections.Count();
+		for( int d=0; d<NUM_DIRECTIONS; d++ )
+		{
+			record.connectionCount[d] = area->m_connect[d].Count();
+
+			FOR_EACH_VEC( area->m_connect[d], cit )
+			{
+				connections.AddToTail( areaIndex[ area->m_connect[d][ cit ].area->GetID() ] );
+			}
+		}
+
+		record.firstHidingSpot = firstHidingSpot;
+		record.hidingSpotCount = area->m_hidingSpots.Count();
+		firstHidingSpot += record.hidingSpotCount;
+
+		record.firstEncounter = encounters.Count();
+		record.encounterCount = area->m_spotEncounters.Count();
+		FOR_EACH_VEC( area->m_spotEncounters, eit )
+		{
+			const SpotEncounter *e = area->m_spotEncounters[ eit ];
+
+			NavFileEncounter &encounter = encounters[ encounters.AddToTail() ];
+			encounter.fromArea = ( e->from.area ) ? areaIndex[ e->from.area->GetID() ] : -1;
+			encounter.toArea = ( e->to.area ) ? areaIndex[ e->to.area->GetID() ] : -1;
+			encounter.fromDir = (unsigned char)e->fromDir;
+			encounter.toDir = (unsigned char)e->toDir;
+			encounter.firstSpot = encounterSpots.Count();
+			encounter.spotCount = (unsigned short)MIN( e->spots.Count(), 0xFFFF );
+
+			for( int s=0; s<encounter.spotCount; ++s )
+			{
+				const SpotOrder &order = e->spots[s];
+
+				// order.spot may be NULL if we've loaded a nav mesh that has been edited but not re-analyzed
+				NavFileEncounterSpot &spot = encounterSpots[ encounterSpots.AddToTail() ];
+				spot.hidingSpot = ( order.spot ) ? hidingSpotIndex[ order.spot->GetID() ] : -1;
+				spot.t = order.t;
+			}
+		}
+
+		record.firstLadderLink = ladderLinks.Count();
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			record.ladderLinkCount[dir] = area->m_ladder[dir].Count();
+
+			FOR_EACH_VEC( area->m_ladder[dir], lit )
+			{
+				ladderLinks.AddToTail( m_ladders.Find( area->m_ladder[dir][ lit ].ladder ) );
+			}
+		}
+
+		record.firstVisibleArea = visibleAreas.Count();
+		FOR_EACH_VEC( area->m_potentiallyVisibleAreas, vit )
+		{
+			const CNavArea::AreaBindInfo &info = area->m_potentiallyVisibleAreas[ vit ];
+			if ( info.area == NULL )
+				continue;
+
+			NavFileVisibleArea &visible = visibleAreas[ visibleAreas.AddToTail() ];
+			visible.area = areaIndex[ info.area->GetID() ];
+			visible.attributes = info.attributes;
+		}
+		record.visibleAreaCount = visibleAreas.Count() - record.firstVisibleArea;
+
+		record.inheritVisibilityFrom = ( area->m_inheritVisibilityFrom.area ) ? areaIndex[ area->m_inheritVisibilityFrom.area->GetID() ] : -1;
+	}
+
+	NavFileArrayHeader header;
+	header.areaRecordSize = sizeof( NavFileArea );
+	header.areaCount = areas.Count();
+	header.connectionCount = connections.Count();
+	header.hidingSpotCount = hidingSpots.Count();
+	header.encounterCount = encounters.Count();
+	header.encounterSpotCount = encounterSpots.Count();
+	header.ladderLinkCount = ladderLinks.Count();
+	header.visibleAreaCount = visibleAreas.Count();
+	header.ladderCount = m_ladders.Count();
+	fileBuffer.Put( &header, sizeof( header ) );
+
+	PutNavFileArray( fileBuffer, areas );
+	PutNavFileArray( fileBuffer, connections );
+	PutNavFileArray( fileBuffer, hidingSpots );
+	PutNavFileArray( fileBuffer, encounters );
+	PutNavFileArray( fileBuffer, encounterSpots );
+	PutNavFileArray( fileBuffer, ladderLinks );
+	PutNavFileArray( fileBuffer, visibleAreas );
+
+	// derived class area data, in area order - each block is prefixed by its size, so a
+	// loader that reads too little or too much still finds the next one
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		int sizePos = fileBuffer.TellPut();
+		fileBuffer.PutUnsignedInt( 0 );
+
+		TheNavAreas[ it ]->SaveCustomData( fileBuffer );
+
+		int endPos = fileBuffer.TellPut();
+		fileBuffer.SeekPut( CUtlBuffer::SEEK_HEAD, sizePos );
+		fileBuffer.PutUnsignedInt( endPos - sizePos - sizeof( unsigned int ) );
+		fileBuffer.SeekPut( CUtlBuffer::SEEK_HEAD, endPos );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if a derived area class writes more in Save() than CNavArea does. The flat
+ * arrays never call Save(), so that data would be lost.
+ */
+bool CNavMesh::HasLegacyAreaData( void ) const
+{
+	CUtlBuffer baseBuffer;
+	CUtlBuffer areaBuffer;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+
+		baseBuffer.Purge();
+		area->CNavArea::Save( baseBuffer, NavLegacyAreaVersion );
+
+		areaBuffer.Purge();
+		area->Save( areaBuffer, NavLegacyAreaVersion );
+
+		if ( areaBuffer.TellPut() != baseBuffer.TellPut() )
+			return true;
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
 /**
  * Store Navigation Mesh to a file
  */
@@ -1091,6 +1450,14 @@ bool CNavMesh::Save( void ) const
 
 	CUtlBuffer fileBuffer( 4096, 1024*1024 );
 
+	// areas that extend CNavArea::Save() can only be stored field by field
+	unsigned int version = NavCurrentVersion;
+	if ( HasLegacyAreaData() )
+	{
+		Warning( "Nav areas store data through CNavArea::Save(), saving in the version %d format. Move it to SaveCustomData() to use the version %d format.\n", NavLegacyAreaVersion, NavCurrentVersion );
+		version = NavLegacyAreaVersion;
+	}
+
 	// store "magic number" to help identify this kind of file
 	unsigned int magic = NAV_MAGIC_NUMBER;
 	fileBuffer.PutUnsignedInt( magic );
@@ -1114,7 +1481,9 @@ bool CNavMesh::Save( void ) const
 	// 14 - Added a bool for if the nav needs analysis
 	// 15 - removed approach areas
 	// 16 - Added visibility data to the base mesh
-	fileBuffer.PutUnsignedInt( NavCurrentVersion );
+	// 17 - Added area clusters for hierarchical path finding
+	// 18 - Areas stored as flat arrays linked by index
+	fileBuffer.PutUnsignedInt( version );
 
 	// The sub-version number is maintained and owned by classes derived from CNavMesh and CNavArea
 	// and allows them to track their custom data just as we do at this top level
@@ -1150,6 +1519,11 @@ bool CNavMesh::Save( void ) const
 	//
 	// Store navigation areas
 	//
+	if ( version >= 18 )
+	{
+		SaveAreaArrays( fileBuffer );
+	}
+	else
 	{
 		// store number of areas
 		unsigned int count = TheNavAreas.Count();
@@ -1160,7 +1534,7 @@ bool CNavMesh::Save( void ) const
 		{
 			CNavArea *area = TheNavAreas[ it ];
 
-			area->Save( fileBuffer, NavCurrentVersion );
+			area->Save( fileBuffer, version );
 		}
 	}
 
@@ -1179,6 +1553,11 @@ bool CNavMesh::Save( void ) const
 			ladder->Save( fileBuffer, NavCurrentVersion );
 		}
 	}
+
+	//
+	// Store area clusters
+	//
+	m_clusters.Save( fileBuffer );
 	
 	//
 	// Store derived class mesh info
@@ -1376,6 +1755,292 @@ const CUtlVector< Place > *CNavMesh::GetPlacesFromNavFile( bool *hasUnnamedPlace
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Create the areas and hiding spots from the flat arrays and link them together. Links are
+ * indexes, so everything is connected here and only ladder links are left to bind once the
+ * ladders are loaded. Bad links are reported and dropped, like the ID based loader does.
+ */
+NavErrorType CNavMesh::LoadAreaArrays( CUtlBuffer &fileBuffer, unsigned int subVersion )
+{
+	NavFileArrayHeader header;
+	fileBuffer.Get( &header, sizeof( header ) );
+	if ( !fileBuffer.IsValid() || header.areaCount <= 0 )
+	{
+		return NAV_INVALID_FILE;
+	}
+
+	if ( header.areaRecordSize != sizeof( NavFileArea ) )
+	{
+		Msg( "Navigation file areas are %d bytes, expected %d.\n", header.areaRecordSize, (int)sizeof( NavFileArea ) );
+		return NAV_BAD_FILE_VERSION;
+	}
+
+	const NavFileArea *areas = GetNavFileArray< NavFileArea >( fileBuffer, header.areaCount );
+	const int *connections = GetNavFileArray< int >( fileBuffer, header.connectionCount );
+	const NavFileHidingSpot *hidingSpots = GetNavFileArray< NavFileHidingSpot >( fileBuffer, header.hidingSpotCount );
+	const NavFileEncounter *encounters = GetNavFileArray< NavFileEncounter >( fileBuffer, header.encounterCount );
+	const NavFileEncounterSpot *encounterSpots = GetNavFileArray< NavFileEncounterSpot >( fileBuffer, header.encounterSpotCount );
+	const int *ladderLinks = GetNavFileArray< int >( fileBuffer, header.ladderLinkCount );
+	const NavFileVisibleArea *visibleAreas = GetNavFileArray< NavFileVisibleArea >( fileBuffer, header.visibleAreaCount );
+
+	if ( !areas || !connections || !hidingSpots || !encounters || !encounterSpots || !ladderLinks || !visibleAreas )
+	{
+		Msg( "Navigation file is truncated.\n" );
+		return NAV_INVALID_FILE;
+	}
+
+	// create everything up front so links can be bound as the areas are filled in
+	PreLoadAreas( header.areaCount );
+	TheNavAreas.EnsureCapacity( header.areaCount );
+	for( int i=0; i<header.areaCount; ++i )
+	{
+		TheNavAreas.AddToTail( CreateArea() );
+	}
+
+	CUtlVector< HidingSpot * > spots;
+	spots.EnsureCapacity( header.hidingSpotCount );
+	TheHidingSpots.EnsureCapacity( TheHidingSpots.Count() + header.hidingSpotCount );
+	for( int i=0; i<header.hidingSpotCount; ++i )
+	{
+		const NavFileHidingSpot &record = hidingSpots[i];
+
+		HidingSpot *spot = CreateHidingSpot();
+		spot->m_id = record.id;
+		spot->m_pos.Init( record.pos[0], record.pos[1], record.pos[2] );
+		spot->m_flags = (unsigned char)record.flags;
+
+		// update next ID to avoid ID collisions by later spots
+		if ( spot->m_id >= HidingSpot::m_nextID )
+			HidingSpot::m_nextID = spot->m_id+1;
+
+		spots.AddToTail( spot );
+	}
+
+	for( int i=0; i<header.areaCount; ++i )
+	{
+		const NavFileArea &record = areas[i];
+		CNavArea *area = TheNavAreas[i];
+
+		area->m_id = record.id;
+
+		// update nextID to avoid collisions
+		if ( area->m_id >= CNavArea::m_nextID )
+			CNavArea::m_nextID = area->m_id+1;
+
+		area->m_attributeFlags = record.attributeFlags;
+		area->m_nwCorner.Init( record.nwCorner[0], record.nwCorner[1], record.nwCorner[2] );
+		area->m_seCorner.Init( record.seCorner[0], record.seCorner[1], record.seCorner[2] );
+		area->m_center = ( area->m_nwCorner + area->m_seCorner ) / 2.0f;
+
+		if ( ( area->m_seCorner.x - area->m_nwCorner.x ) > 0.0f && ( area->m_seCorner.y - area->m_nwCorner.y ) > 0.0f )
+		{
+			area->m_invDxCorners = 1.0f / ( area->m_seCorner.x - area->m_nwCorner.x );
+			area->m_invDyCorners = 1.0f / ( area->m_seCorner.y - area->m_nwCorner.y );
+		}
+		else
+		{
+			area->m_invDxCorners = area->m_invDyCorners = 0;
+
+			DevWarning( "Degenerate Navigation Area #%d at setpos %g %g %g\n", 
+				area->m_id, area->m_center.x, area->m_center.y, area->m_center.z );
+		}
+
+		area->m_neZ = record.neZ;
+		area->m_swZ = record.swZ;
+
+		area->CheckWaterLevel();
+
+		for( int t=0; t<MAX_NAV_TEAMS; ++t )
+		{
+			area->m_earliestOccupyTime[t] = record.earliestOccupyTime[t];
+		}
+
+		for( int c=0; c<NUM_CORNERS; ++c )
+		{
+			area->m_lightIntensity[c] = record.lightIntensity[c];
+		}
+
+		area->SetPlace( placeDirectory.IndexToPlace( (PlaceDirectory::IndexType)record.place ) );
+
+		// connections to adjacent areas
+		int first = record.firstConnection;
+		for( int d=0; d<NUM_DIRECTIONS; d++ )
+		{
+			int count = record.connectionCount[d];
+			if ( !IsValidNavFileRange( first, count, header.connectionCount ) )
+			{
+				Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Cannot connect Navigation Area #%d.\n", area->m_id );
+				break;
+			}
+
+			area->m_connect[d].EnsureCapacity( count );
+			for( int c=first; c<first+count; ++c )
+			{
+				int to = connections[c];
+				if ( to < 0 || to >= header.areaCount )
+				{
+					Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Cannot connect Navigation Area #%d.\n", area->m_id );
+					continue;
+				}
+
+				// don't allow self-referential connections
+				if ( to == i )
+					continue;
+
+				NavConnect connect;
+				connect.area = TheNavAreas[ to ];
+				area->m_connect[d].AddToTail( connect );
+			}
+
+			first += count;
+		}
+
+		// hiding spots
+		if ( IsValidNavFileRange( record.firstHidingSpot, record.hidingSpotCount, header.hidingSpotCount ) )
+		{
+			area->m_hidingSpots.EnsureCapacity( record.hidingSpotCount );
+			for( int h=record.firstHidingSpot; h<record.firstHidingSpot+record.hidingSpotCount; ++h )
+			{
+				area->m_hidingSpots.AddToTail( spots[h] );
+			}
+		}
+		else
+		{
+			Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Bad Hiding Spots for Navigation Area #%d.\n", area->m_id );
+		}
+
+		// encounter paths
+		if ( IsValidNavFileRange( record.firstEncounter, record.encounterCount, header.encounterCount ) )
+		{
+			area->m_spotEncounters.EnsureCapacity( record.encounterCount );
+			for( int e=record.firstEncounter; e<record.firstEncounter+record.encounterCount; ++e )
+			{
+				const NavFileEncounter &encounterRecord = encounters[e];
+
+				SpotEncounter *encounter = new SpotEncounter;
+
+				encounter->from.area = ( encounterRecord.fromArea >= 0 && encounterRecord.fromArea < header.areaCount ) ? TheNavAreas[ encounterRecord.fromArea ] : NULL;
+				encounter->fromDir = static_cast<NavDirType>( encounterRecord.fromDir );
+				encounter->to.area = ( encounterRecord.toArea >= 0 && encounterRecord.toArea < header.areaCount ) ? TheNavAreas[ encounterRecord.toArea ] : NULL;
+				encounter->toDir = static_cast<NavDirType>( encounterRecord.toDir );
+
+				if ( encounter->from.area == NULL || encounter->to.area == NULL )
+				{
+					Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Missing Navigation Area for Encounter Spot.\n" );
+				}
+
+				if ( IsValidNavFileRange( encounterRecord.firstSpot, encounterRecord.spotCount, header.encounterSpotCount ) )
+				{
+					encounter->spots.EnsureCapacity( encounterRecord.spotCount );
+					for( int s=encounterRecord.firstSpot; s<encounterRecord.firstSpot+encounterRecord.spotCount; ++s )
+					{
+						int spotIndex = encounterSpots[s].hidingSpot;
+
+						SpotOrder order;
+						order.spot = ( spotIndex >= 0 && spotIndex < header.hidingSpotCount ) ? spots[ spotIndex ] : NULL;
+						order.t = encounterSpots[s].t;
+
+						if ( order.spot == NULL )
+						{
+							Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Missing Hiding Spot\n" );
+						}
+
+						encounter->spots.AddToTail( order );
+					}
+				}
+				else
+				{
+					Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Bad Encounter Spots for Navigation Area #%d.\n", area->m_id );
+				}
+
+				area->m_spotEncounters.AddToTail( encounter );
+			}
+		}
+		else
+		{
+			Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Bad Encounter Paths for Navigation Area #%d.\n", area->m_id );
+		}
+
+		// ladder links hold ladder indexes until the ladders themselves are loaded
+		first = record.firstLadderLink;
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			int count = record.ladderLinkCount[dir];
+			if ( !IsValidNavFileRange( first, count, header.ladderLinkCount ) )
+			{
+				Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation ladder data. Cannot connect Navigation Area #%d.\n", area->m_id );
+				break;
+			}
+
+			for( int l=first; l<first+count; ++l )
+			{
+				if ( ladderLinks[l] < 0 || ladderLinks[l] >= header.ladderCount )
+				{
+					Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation ladder data. Cannot connect Navigation Area #%d.\n", area->m_id );
+					continue;
+				}
+
+				NavLadderConnect connect;
+				connect.id = ladderLinks[l];
+				area->m_ladder[dir].AddToTail( connect );
+			}
+
+			first += count;
+		}
+
+		// visibility
+		if ( IsValidNavFileRange( record.firstVisibleArea, record.visibleAreaCount, header.visibleAreaCount ) )
+		{
+			area->m_potentiallyVisibleAreas.EnsureCapacity( record.visibleAreaCount );
+			for( int v=record.firstVisibleArea; v<record.firstVisibleArea+record.visibleAreaCount; ++v )
+			{
+				if ( visibleAreas[v].area < 0 || visibleAreas[v].area >= header.areaCount )
+				{
+					Warning( "Invalid area in visible set for area #%d\n", area->m_id );
+					continue;
+				}
+
+				CNavArea::AreaBindInfo info;
+				info.area = TheNavAreas[ visibleAreas[v].area ];
+				info.attributes = (unsigned char)visibleAreas[v].attributes;
+				area->m_potentiallyVisibleAreas.AddToTail( info );
+			}
+		}
+		else
+		{
+			Warning( "Invalid visible set for area #%d\n", area->m_id );
+		}
+
+		int inherit = record.inheritVisibilityFrom;
+		area->m_inheritVisibilityFrom.area = ( inherit >= 0 && inherit < header.areaCount && inherit != i ) ? TheNavAreas[ inherit ] : NULL;
+	}
+
+	// derived class area data, in area order
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		unsigned int size = fileBuffer.GetUnsignedInt();
+		if ( !fileBuffer.IsValid() || size > (unsigned int)fileBuffer.GetBytesRemaining() )
+		{
+			Msg( "CNavMesh::LoadAreaArrays: Corrupt navigation data. Bad custom data for Navigation Area #%d.\n", TheNavAreas[ it ]->m_id );
+			return NAV_CORRUPT_DATA;
+		}
+
+		int endPos = fileBuffer.TellGet() + size;
+
+		TheNavAreas[ it ]->LoadCustomData( fileBuffer, subVersion );
+
+		if ( fileBuffer.TellGet() != endPos )
+		{
+			Warning( "Custom data for area #%d was not read exactly, skipping to its end\n", TheNavAreas[ it ]->m_id );
+			fileBuffer.SeekGet( CUtlBuffer::SEEK_HEAD, endPos );
+		}
+	}
+
+	return fileBuffer.IsValid() ? NAV_OK : NAV_INVALID_FILE;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Load AI navigation data from a file
@@ -1494,13 +2159,36 @@ NavErrorType CNavMesh::Load( void )
 
 	LoadCustomDataPreArea( fileBuffer, subVersion );
 
-	// get number of areas
-	unsigned int count = fileBuffer.GetUnsignedInt();
+	unsigned int count;
 	unsigned int i;
 
-	if ( count == 0 )
+	if ( version >= 18 )
 	{
-		return NAV_INVALID_FILE;
+		// load the areas from the flat arrays, already linked together
+		NavErrorType areaResult = LoadAreaArrays( fileBuffer, subVersion );
+		if ( areaResult != NAV_OK )
+		{
+			return areaResult;
+		}
+	}
+	else
+	{
+		// get number of areas
+		count = fileBuffer.GetUnsignedInt();
+
+		if ( count == 0 )
+		{
+			return NAV_INVALID_FILE;
+		}
+
+		// load the areas one field at a time - their IDs are resolved in PostLoad()
+		TheNavMesh->PreLoadAreas( count );
+		for( i=0; i<count; ++i )
+		{
+			CNavArea *area = TheNavMesh->CreateArea();
+			area->Load( fileBuffer, version, subVersion );
+			TheNavAreas.AddToTail( area );
+		}
 	}
 
 	Extent extent;
@@ -1509,16 +2197,11 @@ NavErrorType CNavMesh::Load( void )
 	extent.hi.x = -9999999999.9f;
 	extent.hi.y = -9999999999.9f;
 
-	// load the areas and compute total extent
-	TheNavMesh->PreLoadAreas( count );
+	// compute total extent
 	Extent areaExtent;
-	for( i=0; i<count; ++i )
+	FOR_EACH_VEC( TheNavAreas, eit )
 	{
-		CNavArea *area = TheNavMesh->CreateArea();
-		area->Load( fileBuffer, version, subVersion );
-		TheNavAreas.AddToTail( area );
-
-		area->GetExtent( &areaExtent );
+		TheNavAreas[ eit ]->GetExtent( &areaExtent );
 
 		if (areaExtent.lo.x < extent.lo.x)
 			extent.lo.x = areaExtent.lo.x;
@@ -1560,6 +2243,39 @@ NavErrorType CNavMesh::Load( void )
 		BuildLadders();
 	}
 
+	if ( version >= 18 )
+	{
+		// ladder links were loaded as indexes into the ladder list
+		FOR_EACH_VEC( TheNavAreas, lit )
+		{
+			CNavArea *area = TheNavAreas[ lit ];
+
+			for ( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+			{
+				FOR_EACH_VEC_BACK( area->m_ladder[dir], it )
+				{
+					NavLadderConnect &connect = area->m_ladder[dir][it];
+					if ( connect.id >= (unsigned int)m_ladders.Count() )
+					{
+						Msg( "CNavMesh::Load: Corrupt navigation ladder data. Cannot connect Navigation Area #%d.\n", area->GetID() );
+						area->m_ladder[dir].Remove( it );
+						continue;
+					}
+
+					connect.ladder = m_ladders[ connect.id ];
+				}
+			}
+		}
+	}
+
+	//
+	// Load area clusters
+	//
+	if ( version >= 17 )
+	{
+		m_clusters.Load( fileBuffer, version );
+	}
+
 	// mark stairways (TODO: this can be removed once all maps are re-saved with this attribute in them)
 	MarkStairAreas();
 
@@ -1602,6 +2318,15 @@ struct OneWayLink_t
  */
 NavErrorType CNavMesh::PostLoad( unsigned int version )
 {
+	// areas loaded field by field refer to each other by ID until now
+	if ( version < 18 )
+	{
+		FOR_EACH_VEC( TheNavAreas, rit )
+		{
+			TheNavAreas[ rit ]->ResolveLoadedIDs();
+		}
+	}
+
 	// allow areas to connect to each other, etc
 	FOR_EACH_VEC( TheNavAreas, pit )
 	{
@@ -1682,6 +2407,12 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 
 	ValidateNavAreaConnections();
 
+	// meshes saved without clusters get them now
+	if ( !m_clusters.IsBuilt() )
+	{
+		m_clusters.Build();
+	}
+
 	// TERROR: loading into a map directly creates entities before the mesh is loaded.  Tell the preexisting
 	// entities now that the mesh is loaded so they can update areas.
 	for ( int i=0; i<m_avoidanceObstacles.Count(); ++i )
@@ -17,6 +17,7 @@
 #include "viewport_panel_names.h"
 //#include "terror/TerrorShared.h"
 #include "fmtstr.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "func_simpleladder.h"
@@ -42,6 +43,10 @@ ConVar nav_generate_fixup_jump_areas( "nav_generate_fixup_jump_areas", "1", FCVA
 ConVar nav_generate_incremental_range( "nav_generate_incremental_range", "2000", FCVAR_CHEAT );
 ConVar nav_generate_incremental_tolerance( "nav_generate_incremental_tolerance", "0", FCVAR_CHEAT, "Z tolerance for adding new nav areas." );
 ConVar nav_area_max_size( "nav_area_max_size", "50", FCVAR_CHEAT, "Max area size created in nav generation" );
+ConVar nav_generate_threaded( "nav_generate_threaded", "1", FCVAR_CHEAT, "Trace the sampling, hiding spot, encounter spot and sniper spot steps of nav generation on the job threads. The mesh is the same either way." );
+
+const int NavGenerateBatchSize = 128;				// areas analyzed per batch of jobs when nav_generate_threaded is on
+const int MaxPrecomputedSampleSteps = 1000000;		// limit on sampling steps traced ahead of time, to bound memory
 
 // Common bounding box for traces
 Vector NavTraceMins( -0.45, -0.45, 0 );
@@ -1506,6 +1511,7 @@ void CNavMesh::CommandNavRemoveJumpAreas( void )
 {
 	JumpConnector connector;
 	ForAllAreas( connector );
+	OnEditConnectNotify();
 
 	int before = TheNavAreas.Count();
 	RemoveJumpAreas();
@@ -3427,6 +3433,7 @@ void CNavMesh::BeginGeneration( bool incremental )
 
 	m_generationState = SAMPLE_WALKABLE_SPACE;
 	m_sampleTick = 0;
+	m_sampleSteps.RemoveAll();
 	m_generationMode = (incremental) ? GENERATE_INCREMENTAL : GENERATE_FULL;
 	lastMsgTime = 0.0f;
 
@@ -3463,6 +3470,12 @@ void CNavMesh::BeginGeneration( bool incremental )
 
 	Msg( "Generating Navigation Mesh...\n" );
 	m_generationStartTime = Plat_FloatTime();
+	m_generationStateStartTime = m_generationStartTime;
+
+	if ( nav_generate_threaded.GetBool() )
+	{
+		PrecomputeSampleSteps();
+	}
 }
 
 
@@ -3530,6 +3543,7 @@ void CNavMesh::BeginAnalysis( bool quitWhenFinished )
 	m_bQuitWhenFinished = quitWhenFinished;
 	lastMsgTime = 0.0f;
 	m_generationStartTime = Plat_FloatTime();
+	m_generationStateStartTime = m_generationStartTime;
 }
 
 
@@ -3609,6 +3623,56 @@ static void HideAnalysisProgress( void )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+static void ComputeSpotEncountersForArea( CNavArea *&area )
+{
+	area->ComputeSpotEncounters();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static void ComputeSniperSpotsForArea( CNavArea *&area )
+{
+	area->ComputeSniperSpots();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+struct HidingSpotJob
+{
+	CNavArea *area;
+	HidingSpotCandidateVector candidates;
+};
+
+static void FindHidingSpotsForArea( HidingSpotJob &job )
+{
+	job.area->FindHidingSpots( &job.candidates );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find the hiding spots of 'count' areas starting at TheNavAreas[ first ] on the job threads.
+ * The spots are created afterwards in area order, so they get the same IDs as in a serial run.
+ */
+void CNavMesh::ComputeHidingSpotsInParallel( int first, int count )
+{
+	CUtlVector< HidingSpotJob > jobs;
+	jobs.SetCount( count );
+	for( int i=0; i<count; ++i )
+	{
+		jobs[i].area = TheNavAreas[ first + i ];
+	}
+
+	ParallelProcess( "CNavArea::FindHidingSpots", jobs.Base(), jobs.Count(), &FindHidingSpotsForArea );
+
+	FOR_EACH_VEC( jobs, it )
+	{
+		jobs[ it ].area->CreateHidingSpots( jobs[ it ].candidates );
+	}
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Process the auto-generation for 'maxTime' seconds. return false if generation is complete.
@@ -3639,8 +3703,12 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
+			Msg( "Sampling walkable space...DONE (%.1f seconds)\n", Plat_FloatTime() - m_generationStateStartTime );
+			m_sampleSteps.Purge();
+
 			// sampling is complete, now build nav areas
 			m_generationState = CREATE_AREAS_FROM_SAMPLES;
+			m_generationStateStartTime = Plat_FloatTime();
 
 			return true;
 		}
@@ -3688,8 +3756,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
+			Msg( "Creating navigation areas from sampled data...DONE (%.1f seconds)\n", Plat_FloatTime() - m_generationStateStartTime );
+
 			m_generationState = FIND_HIDING_SPOTS;
 			m_generationIndex = 0;
+			m_generationStateStartTime = Plat_FloatTime();
 			return true;
 		}
 
@@ -3698,10 +3769,19 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		{
 			while( m_generationIndex < TheNavAreas.Count() )
 			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
+				if ( nav_generate_threaded.GetBool() )
+				{
+					int count = MIN( NavGenerateBatchSize, TheNavAreas.Count() - m_generationIndex );
+					ComputeHidingSpotsInParallel( m_generationIndex, count );
+					m_generationIndex += count;
+				}
+				else
+				{
+					CNavArea *area = TheNavAreas[ m_generationIndex ];
+					++m_generationIndex;
 
-				area->ComputeHidingSpots();
+					area->ComputeHidingSpots();
+				}
 
 				// don't go over our time allotment
 				if( Plat_FloatTime() - startTime > maxTime )
@@ -3711,10 +3791,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding hiding spots...DONE\n" );
+			Msg( "Finding hiding spots...DONE (%.1f seconds)\n", Plat_FloatTime() - m_generationStateStartTime );
 
 			m_generationState = FIND_ENCOUNTER_SPOTS;
 			m_generationIndex = 0;
+			m_generationStateStartTime = Plat_FloatTime();
 			return true;
 		}
 
@@ -3723,10 +3804,20 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		{
 			while( m_generationIndex < TheNavAreas.Count() )
 			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
+				if ( nav_generate_threaded.GetBool() )
+				{
+					// each area only writes its own encounters
+					int count = MIN( NavGenerateBatchSize, TheNavAreas.Count() - m_generationIndex );
+					ParallelProcess( "CNavArea::ComputeSpotEncounters", TheNavAreas.Base() + m_generationIndex, count, &ComputeSpotEncountersForArea );
+					m_generationIndex += count;
+				}
+				else
+				{
+					CNavArea *area = TheNavAreas[ m_generationIndex ];
+					++m_generationIndex;
 
-				area->ComputeSpotEncounters();
+					area->ComputeSpotEncounters();
+				}
 
 				// don't go over our time allotment
 				if( Plat_FloatTime() - startTime > maxTime )
@@ -3736,10 +3827,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding encounter spots...DONE\n" );
+			Msg( "Finding encounter spots...DONE (%.1f seconds)\n", Plat_FloatTime() - m_generationStateStartTime );
 
 			m_generationState = FIND_SNIPER_SPOTS;
 			m_generationIndex = 0;
+			m_generationStateStartTime = Plat_FloatTime();
 			return true;
 		}
 
@@ -3748,10 +3840,20 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		{
 			while( m_generationIndex < TheNavAreas.Count() )
 			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
+				if ( nav_generate_threaded.GetBool() )
+				{
+					// each area only classifies its own spots
+					int count = MIN( NavGenerateBatchSize, TheNavAreas.Count() - m_generationIndex );
+					ParallelProcess( "CNavArea::ComputeSniperSpots", TheNavAreas.Base() + m_generationIndex, count, &ComputeSniperSpotsForArea );
+					m_generationIndex += count;
+				}
+				else
+				{
+					CNavArea *area = TheNavAreas[ m_generationIndex ];
+					++m_generationIndex;
 
-				area->ComputeSniperSpots();
+					area->ComputeSniperSpots();
+				}
 
 				// don't go over our time allotment
 				if( Plat_FloatTime() - startTime > maxTime )
@@ -3761,10 +3863,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding sniper spots...DONE\n" );
+			Msg( "Finding sniper spots...DONE (%.1f seconds)\n", Plat_FloatTime() - m_generationStateStartTime );
 
 			m_generationState = COMPUTE_MESH_VISIBILITY;
 			m_generationIndex = 0;
+			m_generationStateStartTime = Plat_FloatTime();
 			BeginVisibilityComputations();
 			Msg( "Computing mesh visibility...\n" );
 		
@@ -3793,10 +3896,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 
 			EndVisibilityComputations();
 
-			Msg( "Computing mesh visibility...DONE\n" );
+			Msg( "Computing mesh visibility...DONE (%.1f seconds)\n", Plat_FloatTime() - m_generationStateStartTime );
 
 			m_generationState = FIND_EARLIEST_OCCUPY_TIMES;
 			m_generationIndex = 0;
+			m_generationStateStartTime = Plat_FloatTime();
 			return true;
 		}
 
@@ -3989,6 +4093,9 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 
 			HideAnalysisProgress();
 
+			// group the finished mesh into clusters, they are saved with it
+			BuildClusters();
+
 			// save the mesh
 			if (Save())
 			{
@@ -4331,6 +4438,369 @@ static bool IsNodeOverlapped( const Vector& pos, const Vector& offset )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+bool CNavMesh::SampleStepKeyLessFunc( const SampleStepKey &lhs, const SampleStepKey &rhs )
+{
+	if ( lhs.from.x != rhs.from.x )
+		return lhs.from.x < rhs.from.x;
+
+	if ( lhs.from.y != rhs.from.y )
+		return lhs.from.y < rhs.from.y;
+
+	if ( lhs.from.z != rhs.from.z )
+		return lhs.from.z < rhs.from.z;
+
+	return lhs.dir < rhs.dir;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavMesh::ComputeSampleStepJob( SampleStepJob &job )
+{
+	job.result.isValid = TheNavMesh->ComputeSampleStep( job.key.from, (NavDirType)job.key.dir, &job.result );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A grid position and height band, for telling which positions have already been stepped from
+ */
+struct NavSampleCell
+{
+	int x;
+	int y;
+	int band;
+};
+
+static bool NavSampleCellLessFunc( const NavSampleCell &lhs, const NavSampleCell &rhs )
+{
+	if ( lhs.x != rhs.x )
+		return lhs.x < rhs.x;
+
+	if ( lhs.y != rhs.y )
+		return lhs.y < rhs.y;
+
+	return lhs.band < rhs.band;
+}
+
+typedef CUtlMap< NavSampleCell, float, int > NavSampleCellMap;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if no position within node tolerance of 'pos' has been stepped from yet, and remember 'pos'
+ */
+static bool VisitSampleCell( NavSampleCellMap *visited, const Vector &pos )
+{
+	const float tolerance = 0.45f * GenerationStepSize;		// the same tolerance CNavNode::GetNode() uses
+
+	NavSampleCell cell;
+	cell.x = (int)floor( pos.x + 0.5f );
+	cell.y = (int)floor( pos.y + 0.5f );
+
+	int band = (int)floor( pos.z / tolerance );
+	for( cell.band = band-1; cell.band <= band+1; ++cell.band )
+	{
+		int index = visited->Find( cell );
+		if ( index != visited->InvalidIndex() && fabs( visited->Element( index ) - pos.z ) < tolerance )
+			return false;
+	}
+
+	cell.band = band;
+	if ( visited->Find( cell ) == visited->InvalidIndex() )
+	{
+		visited->Insert( cell, pos.z );
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Trace the sampling steps out from the walkable seeds ahead of time, one ring of positions
+ * at a time on the job threads. A step only depends on where it starts, so SampleStep() still
+ * creates the same nodes in the same order - it just finds most of its traces already done,
+ * and traces the rest itself.
+ */
+void CNavMesh::PrecomputeSampleSteps( void )
+{
+	double startTime = Plat_FloatTime();
+
+	m_sampleSteps.RemoveAll();
+
+	NavSampleCellMap visited( NavSampleCellLessFunc );
+	CUtlVector< Vector > frontier;
+	FOR_EACH_VEC( m_walkableSeeds, sit )
+	{
+		if ( VisitSampleCell( &visited, m_walkableSeeds[ sit ].pos ) )
+		{
+			frontier.AddToTail( m_walkableSeeds[ sit ].pos );
+		}
+	}
+
+	CUtlVector< SampleStepJob > jobs;
+	while( frontier.Count() && m_sampleSteps.Count() < MaxPrecomputedSampleSteps )
+	{
+		jobs.SetCount( frontier.Count() * NUM_DIRECTIONS );
+		FOR_EACH_VEC( frontier, fit )
+		{
+			for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+			{
+				SampleStepJob &job = jobs[ fit * NUM_DIRECTIONS + dir ];
+				job.key.from = frontier[ fit ];
+				job.key.dir = dir;
+			}
+		}
+
+		ParallelProcess( "CNavMesh::PrecomputeSampleSteps", jobs.Base(), jobs.Count(), &ComputeSampleStepJob );
+
+		// the ends of this ring of steps are the starts of the next one
+		frontier.RemoveAll();
+		FOR_EACH_VEC( jobs, jit )
+		{
+			const SampleStepJob &job = jobs[ jit ];
+			m_sampleSteps.InsertOrReplace( job.key, job.result );
+
+			if ( job.result.isValid && VisitSampleCell( &visited, job.result.to ) )
+			{
+				frontier.AddToTail( job.result.to );
+			}
+		}
+	}
+
+	Msg( "Traced %d sampling steps ahead...DONE (%.1f seconds)\n", m_sampleSteps.Count(), Plat_FloatTime() - startTime );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Trace one step of sampling, from a node at 'from' to its neighbor in direction 'dir'.
+ * Returns false if no node can be added there. Only traces and reads the mesh, so steps can be traced on job threads.
+ */
+bool CNavMesh::ComputeSampleStep( const Vector &from, NavDirType dir, SampleStepResult *step ) const
+{
+	Vector pos = from;
+
+	// snap to grid
+	int cx = SnapToGrid( pos.x );
+	int cy = SnapToGrid( pos.y );
+
+	// attempt to move to adjacent node
+	switch( dir )
+	{
+		case NORTH:		cy -= GenerationStepSize; break;
+		case SOUTH:		cy += GenerationStepSize; break;
+		case EAST:		cx += GenerationStepSize; break;
+		case WEST:		cx -= GenerationStepSize; break;
+	}
+
+	pos.x = cx;
+	pos.y = cy;
+
+	// sanity check to not generate across the world for incremental generation
+	const float incrementalRange = nav_generate_incremental_range.GetFloat();
+	if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
+	{
+		bool inRange = false;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
+			{
+				inRange = true;
+				break;
+			}
+		}
+
+		if ( !inRange )
+		{
+			return false;
+		}
+	}
+
+	if ( m_generationMode == GENERATE_SIMPLIFY )
+	{
+		if ( !m_simplifyGenerationExtent.Contains( pos ) )
+		{
+			return false;
+		}
+	}
+
+	// test if we can move to new position
+	trace_t result;
+	CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
+	Vector to, toNormal;
+	float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
+	if ( TraceAdjacentNode( 0, from, pos, &result ) )
+	{
+		to = result.endpos;
+		toNormal = result.plane.normal;
+	}
+	else
+	{
+		// test going up ClimbUpHeight
+		bool success = false;
+		for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
+		{						
+			trace_t tr;
+			Vector start( from );
+			Vector end( pos );
+			start.z += height;
+			end.z += height;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+			if ( !tr.startsolid && tr.fraction == 1.0f )
+			{
+				if ( !StayOnFloor( &tr ) )
+				{
+					break;
+				}
+
+				to = tr.endpos;
+				toNormal = tr.plane.normal;
+
+				start = end = from;
+				end.z += height;
+				UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+				if ( tr.fraction < 1.0f )
+				{
+					break;
+				}
+
+				// keep track of far up we had to go to find a path to the next node
+				obstacleHeight = height;
+				success = true;
+				break;
+			}
+			else
+			{
+				// Could not trace from node to node at this height, something is in the way.
+				// Trace in the other direction to see if we hit something
+				Vector vecToObstacleStart = tr.endpos - start;
+				Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
+				if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
+				{
+					UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
+					if ( !tr.startsolid && tr.fraction < 1.0 )
+					{
+						// We hit something going the other direction.  There is some obstacle between the two nodes.
+						Vector vecToObstacleEnd = tr.endpos - start;
+						Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
+						if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
+						{
+							// Remember the distances to start and end of the obstacle (with respect to the "from" node).
+							// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
+							// If we do eventually clear the obstacle, these values will be the start and end distance to the
+							// very tip of the obstacle.
+							obstacleStartDist = vecToObstacleStart.Length();
+							obstacleEndDist = vecToObstacleEnd.Length();
+							if ( obstacleEndDist == 0 )
+							{
+								obstacleEndDist = GenerationStepSize;
+							}
+						}								
+					}
+				}
+			}
+		}
+
+		if ( !success )
+		{
+			return false;
+		}
+	}
+
+	// Don't generate nodes if we spill off the end of the world onto skybox
+	if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+	{
+		return false;
+	}
+
+	// If we're incrementally generating, don't overlap existing nav areas.
+	Vector testPos( to );
+	bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
+	bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
+	bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
+	bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
+	if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
+	{
+		return false;
+	}
+
+	int nTolerance = nav_generate_incremental_tolerance.GetInt();
+	if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
+	{
+		bool bValid = false;
+		int zPos = to.z;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			int zMin = seedPos.z - nTolerance;
+			int zMax = seedPos.z + nTolerance;
+
+			if ( zPos >= zMin && zPos <= zMax )
+			{
+				bValid = true;
+				break;
+			}
+		}
+
+		if ( !bValid )
+			return false;
+	}
+
+
+	bool isOnDisplacement = result.IsDispSurface();
+
+	if ( nav_displacement_test.GetInt() > 0 )
+	{
+		// Test for nodes under displacement surfaces.
+		// This happens during development, and is a pain because the space underneath a displacement
+		// is not 'solid'.
+		Vector start = to + Vector( 0, 0, 0 );
+		Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
+		UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
+
+		if ( result.fraction > 0 )
+		{
+			end = start;
+			start = result.endpos;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
+			if ( result.fraction < 1 )
+			{
+				// if we made it down to within StepHeight, maybe we're on a static prop
+				if ( result.endpos.z > to.z + StepHeight )
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	float deltaZ = to.z - from.z;
+	// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
+	// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
+	// and distances
+	if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
+	{
+		obstacleHeight = 0;
+		obstacleStartDist = 0;
+		obstacleEndDist = GenerationStepSize;
+	}
+
+	// we can move here
+	// create a new navigation node, and update current node pointer
+
+	step->to = to;
+	step->toNormal = toNormal;
+	step->isOnDisplacement = isOnDisplacement;
+	step->obstacleHeight = obstacleHeight;
+	step->obstacleStartDist = obstacleStartDist;
+	step->obstacleEndDist = obstacleEndDist;
+	return true;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Search the world and build a map of possible movements.
@@ -4389,224 +4859,37 @@ bool CNavMesh::SampleStep( void )
 			{
 				// have not searched in this direction yet
 
-				// start at current node position
-				Vector pos = *m_currentNode->GetPosition();
-
-				// snap to grid
-				int cx = SnapToGrid( pos.x );
-				int cy = SnapToGrid( pos.y );
-
-				// attempt to move to adjacent node
-				switch( dir )
-				{
-					case NORTH:		cy -= GenerationStepSize; break;
-					case SOUTH:		cy += GenerationStepSize; break;
-					case EAST:		cx += GenerationStepSize; break;
-					case WEST:		cx -= GenerationStepSize; break;
-				}
-
-				pos.x = cx;
-				pos.y = cy;
-
 				m_generationDir = (NavDirType)dir;
 
 				// mark direction as visited
 				m_currentNode->MarkAsVisited( m_generationDir );
 
-				// sanity check to not generate across the world for incremental generation
-				const float incrementalRange = nav_generate_incremental_range.GetFloat();
-				if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
+				// use the step if it was traced ahead of time
+				SampleStepResult step;
+				bool isStepValid;
+				SampleStepKey key;
+				key.from = *m_currentNode->GetPosition();
+				key.dir = dir;
+				int index = m_sampleSteps.Find( key );
+				if ( index != m_sampleSteps.InvalidIndex() )
 				{
-					bool inRange = false;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
-						{
-							inRange = true;
-							break;
-						}
-					}
-
-					if ( !inRange )
-					{
-						return true;
-					}
-				}
-
-				if ( m_generationMode == GENERATE_SIMPLIFY )
-				{
-					if ( !m_simplifyGenerationExtent.Contains( pos ) )
-					{
-						return true;
-					}
-				}
-
-				// test if we can move to new position
-				trace_t result;
-				Vector from( *m_currentNode->GetPosition() );
-				CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
-				Vector to, toNormal;
-				float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
-				if ( TraceAdjacentNode( 0, from, pos, &result ) )
-				{
-					to = result.endpos;
-					toNormal = result.plane.normal;
+					step = m_sampleSteps[ index ];
+					isStepValid = step.isValid;
+					m_sampleSteps.RemoveAt( index );
 				}
 				else
 				{
-					// test going up ClimbUpHeight
-					bool success = false;
-					for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
-					{						
-						trace_t tr;
-						Vector start( from );
-						Vector end( pos );
-						start.z += height;
-						end.z += height;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-						if ( !tr.startsolid && tr.fraction == 1.0f )
-						{
-							if ( !StayOnFloor( &tr ) )
-							{
-								break;
-							}
-
-							to = tr.endpos;
-							toNormal = tr.plane.normal;
-
-							start = end = from;
-							end.z += height;
-							UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-							if ( tr.fraction < 1.0f )
-							{
-								break;
-							}
-
-							// keep track of far up we had to go to find a path to the next node
-							obstacleHeight = height;
-							success = true;
-							break;
-						}
-						else
-						{
-							// Could not trace from node to node at this height, something is in the way.
-							// Trace in the other direction to see if we hit something
-							Vector vecToObstacleStart = tr.endpos - start;
-							Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
-							if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
-							{
-								UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-								if ( !tr.startsolid && tr.fraction < 1.0 )
-								{
-									// We hit something going the other direction.  There is some obstacle between the two nodes.
-									Vector vecToObstacleEnd = tr.endpos - start;
-									Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
-									if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
-									{
-										// Remember the distances to start and end of the obstacle (with respect to the "from" node).
-										// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
-										// If we do eventually clear the obstacle, these values will be the start and end distance to the
-										// very tip of the obstacle.
-										obstacleStartDist = vecToObstacleStart.Length();
-										obstacleEndDist = vecToObstacleEnd.Length();
-										if ( obstacleEndDist == 0 )
-										{
-											obstacleEndDist = GenerationStepSize;
-										}
-									}								
-								}
-							}
-						}
-					}
-
-					if ( !success )
-					{
-						return true;
-					}
-				}
-
-				// Don't generate nodes if we spill off the end of the world onto skybox
-				if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
-				{
-					return true;
+					isStepValid = ComputeSampleStep( key.from, m_generationDir, &step );
 				}
 
-				// If we're incrementally generating, don't overlap existing nav areas.
-				Vector testPos( to );
-				bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
-				bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
-				bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
-				bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
-				if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
+				if ( !isStepValid )
 				{
 					return true;
 				}
 
-				int nTolerance = nav_generate_incremental_tolerance.GetInt();
-				if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
-				{
-					bool bValid = false;
-					int zPos = to.z;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						int zMin = seedPos.z - nTolerance;
-						int zMax = seedPos.z + nTolerance;
-
-						if ( zPos >= zMin && zPos <= zMax )
-						{
-							bValid = true;
-							break;
-						}
-					}
-
-					if ( !bValid )
-						return true;
-				}
-
-
-				bool isOnDisplacement = result.IsDispSurface();
-
-				if ( nav_displacement_test.GetInt() > 0 )
-				{
-					// Test for nodes under displacement surfaces.
-					// This happens during development, and is a pain because the space underneath a displacement
-					// is not 'solid'.
-					Vector start = to + Vector( 0, 0, 0 );
-					Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
-					UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-
-					if ( result.fraction > 0 )
-					{
-						end = start;
-						start = result.endpos;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-						if ( result.fraction < 1 )
-						{
-							// if we made it down to within StepHeight, maybe we're on a static prop
-							if ( result.endpos.z > to.z + StepHeight )
-							{
-								return true;
-							}
-						}
-					}
-				}
-
-				float deltaZ = to.z - m_currentNode->GetPosition()->z;
-				// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
-				// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
-				// and distances
-				if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
-				{
-					obstacleHeight = 0;
-					obstacleStartDist = 0;
-					obstacleEndDist = GenerationStepSize;
-				}
-
 				// we can move here
 				// create a new navigation node, and update current node pointer
-				AddNode( to, toNormal, m_generationDir, m_currentNode, isOnDisplacement, obstacleHeight, obstacleStartDist, obstacleEndDist );
+				AddNode( step.to, step.toNormal, m_generationDir, m_currentNode, step.isOnDisplacement, step.obstacleHeight, step.obstacleStartDist, step.obstacleEndDist );
 
 				return true;
 			}
@@ -294,6 +294,8 @@ void CNavMesh::CommandNavMergeMesh( const CCommand &args )
 
 		// Connect selected areas with pre-existing areas
 		StitchAreaSet( &areaVector );
+
+		OnEditConnectNotify();
 	}
 
 	data->deleteThis();
@@ -13,6 +13,7 @@
 #include "filesystem.h"
 #include "nav_mesh.h"
 #include "nav_node.h"
+#include "nav_pathfind.h"
 #include "fmtstr.h"
 #include "utlbuffer.h"
 #include "tier0/vprof.h"
@@ -65,6 +66,8 @@ CNavMesh::CNavMesh( void )
 	m_hostThreadModeRestoreValue = 0;
 	m_placeCount = 0;
 	m_placeName = NULL;
+	m_sampleSteps.SetLessFunc( SampleStepKeyLessFunc );
+	m_generationStateStartTime = 0.0f;
 
 	LoadPlaceDatabase();
 
@@ -159,6 +162,8 @@ void CNavMesh::DestroyNavigationMesh( bool incremental )
 	m_blockedAreas.RemoveAll();
 	m_avoidanceObstacleAreas.RemoveAll();
 	m_transientAreas.RemoveAll();
+	m_clusters.Reset();
+	TheNavPathCache.Clear();
 
 	if ( !incremental )
 	{
@@ -2301,6 +2306,11 @@ void CommandNavSave( void )
 	if ( !UTIL_IsCommandIssuedByServerAdmin() )
 		return;
 
+	if ( !TheNavMesh->GetClusterGraph().IsBuilt() )
+	{
+		TheNavMesh->BuildClusters();
+	}
+
 	if (TheNavMesh->Save())
 	{
 		Msg( "Navigation map '%s' saved.\n", TheNavMesh->GetFilename() );
@@ -2719,6 +2729,9 @@ void CommandNavCompressID( void )
 
 	CNavArea::CompressIDs();
 	CNavLadder::CompressIDs();
+
+	// the clusters index areas by ID
+	TheNavMesh->OnEditConnectNotify();
 }
 static ConCommand nav_compress_id( "nav_compress_id", CommandNavCompressID, "Re-orders area and ladder ID's so they are continuous.", FCVAR_GAMEDLL | FCVAR_CHEAT );
 
@@ -2758,6 +2771,7 @@ void NavEditClearAllAttributes( void )
 {
 	NavAttributeClearer clear( (NavAttributeType)0xFFFF );
 	TheNavMesh->ForAllSelectedAreas( clear );
+	TheNavMesh->OnEditConnectNotify();
 	TheNavMesh->ClearSelectedSet();
 }
 static ConCommand ClearAllNavAttributes( "wipe_nav_attributes", NavEditClearAllAttributes, "Clear all nav attributes of selected area.", FCVAR_CHEAT );
@@ -2877,6 +2891,7 @@ void NavEditClearAttribute( const CCommand &args )
 	{
 		NavAttributeClearer clear( attribute );
 		TheNavMesh->ForAllSelectedAreas( clear );
+		TheNavMesh->OnEditConnectNotify();
 		TheNavMesh->ClearSelectedSet();
 		return;
 	}
@@ -2901,6 +2916,7 @@ void NavEditMarkAttribute( const CCommand &args )
 	{
 		NavAttributeSetter setter( attribute );	
 		TheNavMesh->ForAllSelectedAreas( setter );
+		TheNavMesh->OnEditConnectNotify();
 		TheNavMesh->ClearSelectedSet();
 		return;
 	}
@@ -2990,6 +3006,15 @@ void CNavMesh::StripNavigationAreas( void )
 	m_isAnalyzed = false;
 }
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Group the areas into clusters and work out the costs between their portals
+ */
+void CNavMesh::BuildClusters( void )
+{
+	m_clusters.Build();
+}
+
 //--------------------------------------------------------------------------------------------------------------
 
 HidingSpotVector TheHidingSpots;
@@ -3115,6 +3140,9 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 	{
 		m_blockedAreas.AddToTail( area );
 	}
+
+	m_clusters.OnAreaBlocked( area );
+	TheNavPathCache.OnAreaBlocked( area );
 }
 
 
@@ -3123,6 +3151,9 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 void CNavMesh::OnAreaUnblocked( CNavArea *area )
 {
 	m_blockedAreas.FindAndRemove( area );
+
+	m_clusters.OnAreaUnblocked( area );
+	TheNavPathCache.OnAreaUnblocked( area );
 }
 
 
@@ -3161,6 +3192,8 @@ void CNavMesh::OnAvoidanceObstacleEnteredArea( CNavArea *area )
 	{
 		m_avoidanceObstacleAreas.AddToTail( area );
 	}
+
+	TheNavPathCache.OnAreaBlocked( area );
 }
 
 
@@ -3169,6 +3202,8 @@ void CNavMesh::OnAvoidanceObstacleEnteredArea( CNavArea *area )
 void CNavMesh::OnAvoidanceObstacleLeftArea( CNavArea *area )
 {
 	m_avoidanceObstacleAreas.FindAndRemove( area );
+
+	TheNavPathCache.OnAreaUnblocked( area );
 }
 
 
@@ -20,12 +20,14 @@
 #define _NAV_MESH_H_
 
 #include "utlbuffer.h"
+#include "utlmap.h"
 #include "filesystem.h"
 #include "GameEventListener.h"
 
 #include "nav.h"
 #include "nav_area.h"
 #include "nav_colors.h"
+#include "nav_cluster.h"
 
 
 class CNavArea;
@@ -307,12 +309,14 @@ public:
 	virtual void OnEditCreateNotify( CNavArea *newArea );				// invoked when given area has just been added to the mesh in edit mode
 	virtual void OnEditDestroyNotify( CNavArea *deadArea );				// invoked when given area has just been deleted from the mesh in edit mode
 	virtual void OnEditDestroyNotify( CNavLadder *deadLadder );			// invoked when given ladder has just been deleted from the mesh in edit mode
+	virtual void OnEditConnectNotify( void );							// invoked when connections, IDs, or path cost attributes have just been changed in edit mode
 	virtual void OnNodeAdded( CNavNode *node ) {};						
 
 	// Obstructions
 	void RegisterAvoidanceObstacle( INavAvoidanceObstacle *obstruction );
 	void UnregisterAvoidanceObstacle( INavAvoidanceObstacle *obstruction );
 	const CUtlVector< INavAvoidanceObstacle * > &GetObstructions( void ) const { return m_avoidanceObstacles; }
+	bool HasBlockedOrObstructedAreas( void ) const { return m_blockedAreas.Count() > 0 || m_avoidanceObstacleAreas.Count() > 0; }
 
 	unsigned int GetNavAreaCount( void ) const	{ return m_areaCount; }	// return total number of nav areas
 
@@ -470,6 +474,8 @@ public:
 
 	const Vector &GetEditCursorPosition( void ) const	{ return m_editCursorPos; }	// return position of edit cursor
 	void StripNavigationAreas( void );
+	void BuildClusters( void );											// group the areas into clusters for hierarchical path finding
+	const CNavClusterGraph &GetClusterGraph( void ) const	{ return m_clusters; }
 	const char *GetFilename( void ) const;								// return the filename for this map's "nav" file
 
 	/// @todo Remove old select code and make all commands use this selected set
@@ -1075,11 +1081,16 @@ private:
 	bool m_isLoaded;											// true if a Navigation Mesh has been loaded
 	bool m_isOutOfDate;											// true if the Navigation Mesh is older than the actual BSP
 	bool m_isAnalyzed;											// true if the Navigation Mesh needs analysis
+	CNavClusterGraph m_clusters;								// areas grouped into clusters for hierarchical path finding
 
 	enum { HASH_TABLE_SIZE = 256 };
 	CNavArea *m_hashTable[ HASH_TABLE_SIZE ];					// hash table to optimize lookup by ID
 	int ComputeHashKey( unsigned int id ) const;				// returns a hash key for the given nav area ID
 
+	void SaveAreaArrays( CUtlBuffer &fileBuffer ) const;		// store the areas as flat arrays linked by index
+	bool HasLegacyAreaData( void ) const;						// return true if the areas extend CNavArea::Save(), which the flat arrays don't call
+	NavErrorType LoadAreaArrays( CUtlBuffer &fileBuffer, unsigned int subVersion );	// create the areas from flat arrays, binding links as they are read
+
 	int WorldToGridX( float wx ) const;							// given X component, return grid index
 	int WorldToGridY( float wy ) const;							// given Y component, return grid index
 	void AllocateGrid( float minX, float maxX, float minY, float maxY );	// clear and reset the grid to the given extents
@@ -1163,6 +1174,34 @@ private:
 	void DestroyLadders( void );
 
 	bool SampleStep( void );									// sample the walkable areas of the map
+
+	struct SampleStepKey
+	{
+		Vector from;
+		int dir;
+	};
+	struct SampleStepResult
+	{
+		bool isValid;											// false if no node can be added at the end of the step
+		Vector to;
+		Vector toNormal;
+		bool isOnDisplacement;
+		float obstacleHeight;
+		float obstacleStartDist;
+		float obstacleEndDist;
+	};
+	struct SampleStepJob
+	{
+		SampleStepKey key;
+		SampleStepResult result;
+	};
+	bool ComputeSampleStep( const Vector &from, NavDirType dir, SampleStepResult *step ) const;	// trace one step of sampling without changing the nodes
+	void PrecomputeSampleSteps( void );							// trace the sampling steps out from the walkable seeds on the job threads
+	static void ComputeSampleStepJob( SampleStepJob &job );
+	static bool SampleStepKeyLessFunc( const SampleStepKey &lhs, const SampleStepKey &rhs );
+	CUtlMap< SampleStepKey, SampleStepResult, int > m_sampleSteps;	// steps traced ahead of time, removed as SampleStep() uses them
+
+	void ComputeHidingSpotsInParallel( int first, int count );	// find the hiding spots of a run of TheNavAreas on the job threads
 	void CreateNavAreasFromNodes( void );						// cover all of the sampled nodes with nav areas
 
 	bool TestArea( CNavNode *node, int width, int height );		// check if an area of size (width, height) can fit, starting from node as upper left corner
@@ -1219,6 +1258,7 @@ private:
 	int m_sampleTick;											// counter for displaying pseudo-progress while sampling walkable space
 	bool m_bQuitWhenFinished;
 	float m_generationStartTime;
+	float m_generationStateStartTime;							// when the current generation state began, for timing each step
 	Extent m_simplifyGenerationExtent;
 
 	char *m_spawnName;											// name of player spawn entity, used to initiate sampling
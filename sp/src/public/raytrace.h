@@ -13,6 +13,8 @@
 #include <mathlib/mathlib.h>
 #include <bspfile.h>
 
+struct MD5Value_t;
+
 // fast SSE-ONLY ray tracing module. Based upon various "real time ray tracing" research.
 //#define DEBUG_RAYTRACE 1
 
@@ -41,6 +43,31 @@ public:
 
 };
 
+/// 8 rays traced as one packet by the AVX2 path. Stored as plain floats, one array of 8 per
+/// component, so that this header does not need the AVX types.
+class EightRays
+{
+public:
+	ALIGN32 float origin[3][8] ALIGN32_POST;
+	ALIGN32 float direction[3][8] ALIGN32_POST;
+
+	inline void SetRay( int nRay, Vector const &org, Vector const &dir )
+	{
+		for ( int c = 0; c < 3; c++ )
+		{
+			origin[c][nRay] = org[c];
+			direction[c][nRay] = dir[c];
+		}
+	}
+
+	// pack lanes 0-3 or 4-7 into a FourRays
+	void GetFourRays( int nHalf, FourRays &out ) const;
+
+	// returns direction sign mask for 8 rays. returns -1 if the rays can not be traced as a
+	// bundle.
+	int CalculateDirectionSignMask(void) const;
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -209,6 +236,14 @@ struct RayTracingResult
 };
 
 
+struct RayTracingResult8
+{
+	ALIGN32 float surface_normal[3][8] ALIGN32_POST;		// surface normal at intersection
+	ALIGN32 int32 HitIds[8] ALIGN32_POST;					// -1=no hit. otherwise, triangle index
+	ALIGN32 float HitDistance[8] ALIGN32_POST;				// distance to intersection
+};
+
+
 class RayTraceLight
 {
 public:
@@ -228,18 +263,45 @@ enum RayTraceLightingMode_t {
 };
 
 
+// number of rays a RayStream queues up before it sorts and traces them
+#define RAYSTREAM_CAPACITY 1024
+
+struct RayStreamStats_t
+{
+	int64 m_nRays;											// rays added to streams
+	int64 m_nLanes;											// packet lanes traced, including padding
+	int64 m_nPackets;										// 4 or 8 wide packets traced
+};
+
 class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
-	int n_in_stream[8];
-	FourRays PendingRays[8];
+public:
+	struct PendingRay_t
+	{
+		Vector m_Start;
+		Vector m_Delta;
+		RayTracingSingleResult *m_pOutput;
+	};
+
+	struct SortKey_t
+	{
+		uint64 m_nKey;
+		int m_nRay;
+	};
+
+private:
+	PendingRay_t PendingRays[RAYSTREAM_CAPACITY];
+	SortKey_t SortKeys[RAYSTREAM_CAPACITY];
+	int n_in_stream;
+	RayStreamStats_t Stats;
 
 public:
 	RayStream(void)
 	{
-		memset(n_in_stream,0,sizeof(n_in_stream));
+		n_in_stream=0;
+		memset(&Stats,0,sizeof(Stats));
 	}
 };
 
@@ -267,12 +329,17 @@ public:
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
+	int m_nBuildThreads;									//< threads used to build the kd-tree.
+															//< 0 = one per logical processor
+	RayStreamStats_t m_RayStreamStats;						//< accumulated by FinishRayStream
 
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		m_nBuildThreads=0;
+		memset(&m_RayStreamStats,0,sizeof(m_RayStreamStats));
 	}
 
 
@@ -297,6 +364,21 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// same as above, but reuses the tree stored in pCacheFileName if it was built from the
+	// same triangles, and writes a new cache file otherwise. returns true on a cache hit.
+	bool SetupAccelerationStructure( const char *pCacheFileName );
+
+	// print node count, leaf size histogram and SAH cost of the built tree
+	void PrintAccelerationStructureStats( void ) const;
+
+	// hash of all triangles added so far. only valid before the acceleration structure is set up.
+	void ComputeTriangleHash( MD5Value_t &hash );
+
+	// (de)serialize the built tree, triangles, colors and materials. Load fails if the file is
+	// missing or was built from different triangles.
+	bool SaveAccelerationStructure( const char *pFileName, const MD5Value_t &hash );
+	bool LoadAccelerationStructure( const char *pFileName, const MD5Value_t &hash );
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -310,6 +392,21 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// 8-wide version of the above. Uses the AVX2 kernel when the cpu supports it and falls back
+	// to two Trace4Rays calls otherwise, or when a transparency callback is given (the callback
+	// interface is 4-wide). TMin and TMax point at 8 floats.
+	void Trace8Rays(const EightRays &rays, float const *TMin, float const *TMax,
+					RayTracingResult8 *rslt_out,
+					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
+	// the AVX2 kernel. all 8 rays must have the same direction signs. only call this when
+	// SupportsEightWideTracing() is true.
+	void Trace8RaysAVX2(const EightRays &rays, float const *TMin, float const *TMax,
+						int DirectionSignMask, RayTracingResult8 *rslt_out, int32 skip_id=-1);
+
+	// whether this cpu and build can use Trace8RaysAVX2. checked once, via processor_detect.
+	static bool SupportsEightWideTracing( void );
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -330,29 +427,26 @@ public:
 					 
 	/// raytracing stream - lets you trace an array of rays by feeding them to this function.
 	/// results will not be returned until FinishStream is called. This function handles sorting
-	/// the rays by direction, tracing them 4 at a time, and de-interleaving the results.
+	/// the rays by direction sign, origin and direction so that packets are coherent, tracing
+	/// them 8 (or 4) at a time, and de-interleaving the results.
+	/// Streams only report the nearest hit, so rays that need a transparency callback (vrad's
+	/// texture shadows), a sky test, or the face and luxel that was hit can't use them.
 
 	void AddToRayStream(RayStream &s,
 						Vector const &start,Vector const &end,RayTracingSingleResult *rslt_out);
 
-	inline void FlushStreamEntry(RayStream &s,int msk);
+	/// sort and trace everything queued in the stream
+	void FlushRayStream(RayStream &s);
 
 	/// call this when you are done. handles all cleanup. After this is called, all rslt ptrs
 	/// previously passed to AddToRaySteam will have been filled in.
 	void FinishRayStream(RayStream &s);
 
+	/// totals of all streams finished so far, and a verbose report of them
+	void GetRayStreamStats( RayStreamStats_t &stats );
+	void PrintRayStreamStats( void );
 
-	int MakeLeafNode(int first_tri, int last_tri);
 
-
-	float CalculateCostsOfSplit(
-		int split_plane,int32 const *tri_list,int ntris,
-		Vector MinBound,Vector MaxBound, float &split_value,
-		int &nleft, int &nright, int &nboth);
-		
-	void RefineNode(int node_number,int32 const *tri_list,int ntris,
-						 Vector MinBound,Vector MaxBound, int depth);
-	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
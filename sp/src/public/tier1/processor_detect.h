@@ -10,3 +10,7 @@ bool CheckSSETechnology(void);
 bool CheckSSE2Technology(void);
 bool Check3DNowTechnology(void);
 
+// These also check that the OS saves the AVX register state on context switches.
+bool CheckAVXTechnology(void);
+bool CheckAVX2Technology(void);
+
@@ -2,6 +2,8 @@
 // $Id$
 #include "raytrace.h"
 #include <mathlib/halton.h>
+#include <tier0/threadtools.h>
+#include <tier0/dbg.h>
 
 static uint32 MapDistanceToPixel(float t)
 {
@@ -303,74 +305,194 @@ static unsigned int GetSignMask(Vector const &v)
 }
 
 
-inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
+// spread the low 10 bits of x out so that there are two zero bits between each of them
+static uint32 SpreadMortonBits(uint32 x)
 {
-	assert(msk>=0);
-	assert(msk<8);
-	fltx4 tmax=s.PendingRays[msk].direction.length();
+	x&=0x3ff;
+	x=(x|(x<<16)) & 0x030000ff;
+	x=(x|(x<<8)) & 0x0300f00f;
+	x=(x|(x<<4)) & 0x030c30c3;
+	x=(x|(x<<2)) & 0x09249249;
+	return x;
+}
+
+static int CompareRayStreamKeys(const void *a, const void *b)
+{
+	RayStream::SortKey_t const *pA=(RayStream::SortKey_t const *) a;
+	RayStream::SortKey_t const *pB=(RayStream::SortKey_t const *) b;
+	if (pA->m_nKey!=pB->m_nKey)
+		return (pA->m_nKey<pB->m_nKey)?-1:1;
+	// ties go by insertion order so the trace order is deterministic
+	return pA->m_nRay-pB->m_nRay;
+}
+
+// normalize the directions of a packet, returning the ray lengths
+static FORCEINLINE fltx4 NormalizeStreamPacket(FourRays &rays)
+{
+	fltx4 tmax=rays.direction.length();
 	fltx4 scl=ReciprocalSaturateSIMD(tmax);
-	s.PendingRays[msk].direction*=scl;					// normalize
-	RayTracingResult tmpresult;
-	Trace4Rays(s.PendingRays[msk],Four_Zeros,tmax,msk,&tmpresult);
-	// now, write out results
-	for(int r=0;r<4;r++)
-	{
-		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
-		out->ray_length=SubFloat( tmax, r );
-		out->surface_normal.x=tmpresult.surface_normal.X(r);
-		out->surface_normal.y=tmpresult.surface_normal.Y(r);
-		out->surface_normal.z=tmpresult.surface_normal.Z(r);
-		out->HitID=tmpresult.HitIds[r];
-		out->HitDistance=SubFloat( tmpresult.HitDistance, r );
-	}
-	s.n_in_stream[msk]=0;
+	rays.direction*=scl;
+	return tmax;
 }
 
-void RayTracingEnvironment::AddToRayStream(RayStream &s,
-										   Vector const &start,Vector const &end,
-										   RayTracingSingleResult *rslt_out)
+void RayTracingEnvironment::FlushRayStream(RayStream &s)
 {
-	Vector delta=end;
-	delta-=start;
-	int msk=GetSignMask(delta);
-	assert(msk>=0);
-	assert(msk<8);
-	int pos=s.n_in_stream[msk];
-	assert(pos<4);
-	s.PendingRays[msk].origin.X(pos)=start.x;
-	s.PendingRays[msk].origin.Y(pos)=start.y;
-	s.PendingRays[msk].origin.Z(pos)=start.z;
-	s.PendingRays[msk].direction.X(pos)=delta.x;
-	s.PendingRays[msk].direction.Y(pos)=delta.y;
-	s.PendingRays[msk].direction.Z(pos)=delta.z;
-	s.PendingStreamOutputs[msk][pos]=rslt_out;
-	if (pos==3)
+	int nRays=s.n_in_stream;
+	if (!nRays)
+		return;
+
+	// key = direction sign octant : morton code of the origin cell (10 bits/axis within the
+	// scene bounds) : morton code of the quantized direction (7 bits/axis). sorting on it puts
+	// rays that can be traced together next to each other and keeps rays that start near each
+	// other and go the same way in the same packet, so they walk the same kd-tree nodes.
+	Vector vecScale;
+	for(int c=0;c<3;c++)
+		vecScale[c]=1023.0/max(1.0f,m_MaxBound[c]-m_MinBound[c]);
+
+	for(int i=0;i<nRays;i++)
 	{
-		FlushStreamEntry(s,msk);
+		RayStream::PendingRay_t const &ray=s.PendingRays[i];
+		uint32 nOriginCode=0;
+		uint32 nDirCode=0;
+		float flInvLength=1.0/max(1.0e-20f,ray.m_Delta.Length());
+		for(int c=0;c<3;c++)
+		{
+			int nCell=(int) ((ray.m_Start[c]-m_MinBound[c])*vecScale[c]);
+			nOriginCode|=SpreadMortonBits(clamp(nCell,0,1023))<<c;
+			int nDir=(int) ((ray.m_Delta[c]*flInvLength*0.5+0.5)*127.0);
+			nDirCode|=SpreadMortonBits(clamp(nDir,0,127))<<c;
+		}
+		s.SortKeys[i].m_nKey=( ((uint64) GetSignMask(ray.m_Delta))<<61 ) |
+			( ((uint64) nOriginCode)<<21 ) | nDirCode;
+		s.SortKeys[i].m_nRay=i;
 	}
-	else
-		s.n_in_stream[msk]++;
-}
+	qsort(s.SortKeys,nRays,sizeof(RayStream::SortKey_t),CompareRayStreamKeys);
 
-void RayTracingEnvironment::FinishRayStream(RayStream &s)
-{
-	for(int msk=0;msk<8;msk++)
+	bool bEightWide=SupportsEightWideTracing();
+	int nMaxPacket=bEightWide?8:4;
+	for(int i=0;i<nRays;)
 	{
-		int cnt=s.n_in_stream[msk];
-		if (cnt)
+		int msk=(int) (s.SortKeys[i].m_nKey>>61);
+		int nPacket=1;
+		while( (nPacket<nMaxPacket) && (i+nPacket<nRays) &&
+			   ( (int) (s.SortKeys[i+nPacket].m_nKey>>61)==msk ) )
+			nPacket++;
+
+		// unfilled lanes get dups of the first ray
+		FourRays rays[2];
+		RayStream::PendingRay_t const *pLaneRays[8];
+		for(int l=0;l<8;l++)
+		{
+			pLaneRays[l]=&s.PendingRays[s.SortKeys[ (l<nPacket)?i+l:i ].m_nRay];
+			FourRays &half=rays[l>>2];
+			half.origin.X(l&3)=pLaneRays[l]->m_Start.x;
+			half.origin.Y(l&3)=pLaneRays[l]->m_Start.y;
+			half.origin.Z(l&3)=pLaneRays[l]->m_Start.z;
+			half.direction.X(l&3)=pLaneRays[l]->m_Delta.x;
+			half.direction.Y(l&3)=pLaneRays[l]->m_Delta.y;
+			half.direction.Z(l&3)=pLaneRays[l]->m_Delta.z;
+		}
+		fltx4 tmax=NormalizeStreamPacket(rays[0]);
+
+		if (nPacket>4)
+		{
+			fltx4 tmax1=NormalizeStreamPacket(rays[1]);
+			EightRays eightrays;
+			ALIGN32 float TMin[8] ALIGN32_POST;
+			ALIGN32 float TMax[8] ALIGN32_POST;
+			for(int l=0;l<8;l++)
+			{
+				FourRays const &half=rays[l>>2];
+				eightrays.origin[0][l]=half.origin.X(l&3);
+				eightrays.origin[1][l]=half.origin.Y(l&3);
+				eightrays.origin[2][l]=half.origin.Z(l&3);
+				eightrays.direction[0][l]=half.direction.X(l&3);
+				eightrays.direction[1][l]=half.direction.Y(l&3);
+				eightrays.direction[2][l]=half.direction.Z(l&3);
+				TMin[l]=0;
+				TMax[l]=SubFloat( (l<4)?tmax:tmax1, l&3 );
+			}
+			RayTracingResult8 tmpresult;
+			Trace8RaysAVX2(eightrays,TMin,TMax,msk,&tmpresult);
+			for(int r=0;r<nPacket;r++)
+			{
+				RayTracingSingleResult *out=pLaneRays[r]->m_pOutput;
+				out->ray_length=TMax[r];
+				out->surface_normal.x=tmpresult.surface_normal[0][r];
+				out->surface_normal.y=tmpresult.surface_normal[1][r];
+				out->surface_normal.z=tmpresult.surface_normal[2][r];
+				out->HitID=tmpresult.HitIds[r];
+				out->HitDistance=tmpresult.HitDistance[r];
+			}
+			s.Stats.m_nLanes+=8;
+		}
+		else
 		{
-			// fill in unfilled entries with dups of first
-			for(int c=cnt;c<4;c++)
+			// a partial packet of 8 is cheaper traced 4 wide
+			RayTracingResult tmpresult;
+			Trace4Rays(rays[0],Four_Zeros,tmax,msk,&tmpresult);
+			for(int r=0;r<nPacket;r++)
 			{
-				s.PendingRays[msk].origin.X(c) = s.PendingRays[msk].origin.X(0);
-				s.PendingRays[msk].origin.Y(c) = s.PendingRays[msk].origin.Y(0);
-				s.PendingRays[msk].origin.Z(c) = s.PendingRays[msk].origin.Z(0);
-				s.PendingRays[msk].direction.X(c) = s.PendingRays[msk].direction.X(0);
-				s.PendingRays[msk].direction.Y(c) = s.PendingRays[msk].direction.Y(0);
-				s.PendingRays[msk].direction.Z(c) = s.PendingRays[msk].direction.Z(0);
-				s.PendingStreamOutputs[msk][c]=s.PendingStreamOutputs[msk][0];
+				RayTracingSingleResult *out=pLaneRays[r]->m_pOutput;
+				out->ray_length=SubFloat( tmax, r );
+				out->surface_normal.x=tmpresult.surface_normal.X(r);
+				out->surface_normal.y=tmpresult.surface_normal.Y(r);
+				out->surface_normal.z=tmpresult.surface_normal.Z(r);
+				out->HitID=tmpresult.HitIds[r];
+				out->HitDistance=SubFloat( tmpresult.HitDistance, r );
 			}
-			FlushStreamEntry(s,msk);
+			s.Stats.m_nLanes+=4;
 		}
+		s.Stats.m_nPackets++;
+		i+=nPacket;
 	}
+	s.Stats.m_nRays+=nRays;
+	s.n_in_stream=0;
+}
+
+void RayTracingEnvironment::AddToRayStream(RayStream &s,
+										   Vector const &start,Vector const &end,
+										   RayTracingSingleResult *rslt_out)
+{
+	int pos=s.n_in_stream;
+	assert(pos<RAYSTREAM_CAPACITY);
+	s.PendingRays[pos].m_Start=start;
+	s.PendingRays[pos].m_Delta=end;
+	s.PendingRays[pos].m_Delta-=start;
+	s.PendingRays[pos].m_pOutput=rslt_out;
+	s.n_in_stream++;
+	if (s.n_in_stream==RAYSTREAM_CAPACITY)
+		FlushRayStream(s);
+}
+
+static CThreadFastMutex s_RayStreamStatsMutex;
+
+void RayTracingEnvironment::FinishRayStream(RayStream &s)
+{
+	FlushRayStream(s);
+
+	s_RayStreamStatsMutex.Lock();
+	m_RayStreamStats.m_nRays+=s.Stats.m_nRays;
+	m_RayStreamStats.m_nLanes+=s.Stats.m_nLanes;
+	m_RayStreamStats.m_nPackets+=s.Stats.m_nPackets;
+	s_RayStreamStatsMutex.Unlock();
+	memset(&s.Stats,0,sizeof(s.Stats));
+}
+
+void RayTracingEnvironment::GetRayStreamStats( RayStreamStats_t &stats )
+{
+	s_RayStreamStatsMutex.Lock();
+	stats=m_RayStreamStats;
+	s_RayStreamStatsMutex.Unlock();
+}
+
+void RayTracingEnvironment::PrintRayStreamStats( void )
+{
+	RayStreamStats_t stats;
+	GetRayStreamStats( stats );
+	if ( !stats.m_nPackets )
+		return;
+	Msg( "Ray streams: %lld rays in %lld packets (%.2f rays/packet), %.1f%% lane utilization\n",
+		 stats.m_nRays, stats.m_nPackets, (double)stats.m_nRays / stats.m_nPackets,
+		 100.0 * stats.m_nRays / stats.m_nLanes );
 }
@@ -12,6 +12,8 @@ bool CheckMMXTechnology(void) { return false; }
 bool CheckSSETechnology(void) { return false; }
 bool CheckSSE2Technology(void) { return false; }
 bool Check3DNowTechnology(void) { return false; }
+bool CheckAVXTechnology(void) { return false; }
+bool CheckAVX2Technology(void) { return false; }
 
 #elif defined( _WIN32 ) && !defined( _X360 )
 
@@ -271,4 +273,44 @@ bool Check3DNowTechnology(void)
 
 #pragma optimize( "", on )
 
+// AVX needs VS2010 SP1 for _xgetbv, AVX2 needs VS2012 for the intrinsics to be useful at all.
+#if _MSC_VER >= 1700
+
+#include <intrin.h>
+
+bool CheckAVXTechnology(void)
+{
+	int regs[4];	// eax, ebx, ecx, edx
+	__cpuid( regs, 1 );
+
+	// bit 27 of ecx is OSXSAVE, bit 28 is AVX
+	if ( ( regs[2] & ( ( 1 << 27 ) | ( 1 << 28 ) ) ) != ( ( 1 << 27 ) | ( 1 << 28 ) ) )
+		return false;
+
+	// The OS has to save the xmm and ymm state (XCR0 bits 1 and 2) on context switches.
+	unsigned __int64 xcr0 = _xgetbv( 0 );
+	return ( xcr0 & 6 ) == 6;
+}
+
+bool CheckAVX2Technology(void)
+{
+	if ( !CheckAVXTechnology() )
+		return false;
+
+	int regs[4];
+	__cpuid( regs, 0 );
+	if ( regs[0] < 7 )
+		return false;
+
+	__cpuidex( regs, 7, 0 );
+	return ( regs[1] & ( 1 << 5 ) ) != 0;		// bit 5 of ebx is AVX2
+}
+
+#else
+
+bool CheckAVXTechnology(void) { return false; }
+bool CheckAVX2Technology(void) { return false; }
+
+#endif // _MSC_VER >= 1700
+
 #endif // _WIN32
@@ -26,6 +26,17 @@
 #include "tier0/dbg.h"
 #include "lumpfiles.h"
 #include "vtf/vtf.h"
+#include "tier0/threadtools.h"
+#include "tier1/lzmaDecoder.h"
+#include "tier1/snappy.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 //=============================================================================
 
@@ -703,6 +714,10 @@ template< class T > static void AddLump( int lumpnum, CUtlVector<T> &data, int v
 dheader_t		*g_pBSPHeader;
 FileHandle_t	g_hBSPFile;
 
+// g_pBSPHeader is this when the open BSP is mapped rather than loaded
+static void		*s_pBSPMapping = NULL;
+static int		s_nBSPMappingSize = 0;
+
 struct Lump_t
 {
 	void	*pLumps[HEADER_LUMPS];
@@ -2118,15 +2133,461 @@ void ValidateHeader( const char *filename, const dheader_t *pHeader )
 }
 
 //-----------------------------------------------------------------------------
-//	Low level BSP opener for external parsing. Parses headers, but nothing else.
-//	You must close the BSP, via CloseBSPFile().
+//	Lumps get compressed and decompressed on every processor at once, or on
+//	g_nLumpThreads if the tool set it. bsplib also goes in tools that don't
+//	have threads.cpp, so this sits right on tier0.
 //-----------------------------------------------------------------------------
-void OpenBSPFile( const char *filename )
+int g_nLumpThreads = 0;
+
+typedef void (*LumpJobFn_t)( void *pContext, int iJob );
+
+struct LumpJobs_t
+{
+	LumpJobFn_t		pFn;
+	void			*pContext;
+	int				nJobs;
+	long volatile	nNextJob;
+};
+
+static unsigned LumpJobThread( void *pParam )
+{
+	LumpJobs_t *pJobs = (LumpJobs_t *)pParam;
+	for ( ;; )
+	{
+		int iJob = ThreadInterlockedIncrement( &pJobs->nNextJob ) - 1;
+		if ( iJob >= pJobs->nJobs )
+			break;
+		pJobs->pFn( pJobs->pContext, iJob );
+	}
+	return 0;
+}
+
+static void RunLumpJobs( int nJobs, LumpJobFn_t pFn, void *pContext )
+{
+	LumpJobs_t jobs;
+	jobs.pFn = pFn;
+	jobs.pContext = pContext;
+	jobs.nJobs = nJobs;
+	jobs.nNextJob = 0;
+
+	int nThreads = ( g_nLumpThreads > 0 ) ? g_nLumpThreads : GetCPUInformation()->m_nLogicalProcessors;
+	if ( nThreads > nJobs )
+	{
+		nThreads = nJobs;
+	}
+
+	// this thread takes jobs too
+	CUtlVector< ThreadHandle_t > threads;
+	for ( int i = 1; i < nThreads; i++ )
+	{
+		ThreadHandle_t hThread = CreateSimpleThread( LumpJobThread, &jobs );
+		if ( hThread )
+		{
+			threads.AddToTail( hThread );
+		}
+	}
+	LumpJobThread( &jobs );
+
+	for ( int i = 0; i < threads.Count(); i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	Snappy lumps compress in a small fraction of the time LZMA takes, but come
+//	out bigger. The engine only reads LZMA lumps, so they're for BSPs only the
+//	tools read, like the one vbsp -fastcompress hands to vvis and vrad.
+//-----------------------------------------------------------------------------
+#define SNAPPY_LUMP_ID	(('P'<<24)|('A'<<16)|('N'<<8)|('S'))
+
+struct snappylumpheader_t
+{
+	unsigned int	id;				// always little endian
+	unsigned int	actualSize;		// always little endian
+	unsigned int	snappySize;		// always little endian
+};
+
+bool CompressLumpSnappy( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer )
+{
+	int nInputSize = inputBuffer.TellPut() - inputBuffer.TellGet();
+	if ( nInputSize <= (int)sizeof( snappylumpheader_t ) )
+	{
+		return false;
+	}
+
+	outputBuffer.EnsureCapacity( sizeof( snappylumpheader_t ) + snappy::MaxCompressedLength( nInputSize ) );
+
+	snappylumpheader_t *pHeader = (snappylumpheader_t *)outputBuffer.Base();
+	size_t nSnappySize;
+	snappy::RawCompress( (const char *)inputBuffer.PeekGet(), nInputSize, (char *)( pHeader + 1 ), &nSnappySize );
+	if ( sizeof( snappylumpheader_t ) + nSnappySize >= (size_t)nInputSize )
+	{
+		// not worth it
+		return false;
+	}
+
+	pHeader->id = LittleLong( SNAPPY_LUMP_ID );
+	pHeader->actualSize = LittleLong( nInputSize );
+	pHeader->snappySize = LittleLong( (int)nSnappySize );
+	outputBuffer.SeekPut( CUtlBuffer::SEEK_HEAD, sizeof( snappylumpheader_t ) + nSnappySize );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+//	The size a lump compressed with LZMA or snappy has uncompressed, 0 if the
+//	data isn't compressed.
+//-----------------------------------------------------------------------------
+static unsigned int GetLumpActualSize( byte *pData, unsigned int nLength )
+{
+	if ( nLength >= sizeof( lzma_header_t ) )
+	{
+		CLZMA lzma;
+		lzma_header_t *pHeader = (lzma_header_t *)pData;
+		if ( lzma.IsCompressed( pData ) && LittleLong( pHeader->lzmaSize ) <= nLength - sizeof( lzma_header_t ) )
+		{
+			return lzma.GetActualSize( pData );
+		}
+	}
+
+	if ( nLength >= sizeof( snappylumpheader_t ) )
+	{
+		snappylumpheader_t *pHeader = (snappylumpheader_t *)pData;
+		if ( LittleLong( pHeader->id ) == SNAPPY_LUMP_ID && LittleLong( pHeader->snappySize ) <= nLength - sizeof( snappylumpheader_t ) )
+		{
+			return LittleLong( pHeader->actualSize );
+		}
+	}
+
+	return 0;
+}
+
+static bool DecompressLumpData( byte *pData, byte *pOutput, unsigned int nActualSize )
+{
+	CLZMA lzma;
+	if ( lzma.IsCompressed( pData ) )
+	{
+		return ( lzma.Uncompress( pData, pOutput ) == nActualSize );
+	}
+
+	snappylumpheader_t *pHeader = (snappylumpheader_t *)pData;
+	const char *pSnappyData = (const char *)( pHeader + 1 );
+	unsigned int nSnappySize = LittleLong( pHeader->snappySize );
+
+	size_t nUncompressedSize;
+	if ( !snappy::GetUncompressedLength( pSnappyData, nSnappySize, &nUncompressedSize ) || nUncompressedSize != nActualSize )
+	{
+		return false;
+	}
+	return snappy::RawUncompress( pSnappyData, nSnappySize, (char *)pOutput );
+}
+
+//-----------------------------------------------------------------------------
+//	Maps the BSP into memory instead of reading it in. Callers that only use
+//	GetLumpView read just the lumps they look at. LoadBSPFile still copies every
+//	lump out, so it reads the whole file, but needs no heap buffer for all of it.
+//	The mapping is private, so writing to it (byte swapping on load does) copies
+//	the page it's on and never touches the file. Returns false if the file can't
+//	be mapped, e.g. because it's only in the filesystem's search paths.
+//-----------------------------------------------------------------------------
+static bool MapBSPFile( const char *filename )
+{
+	if ( !Q_IsAbsolutePath( filename ) )
+		return false;
+
+#ifdef _WIN32
+	HANDLE hFile = ::CreateFile( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD nSize = ::GetFileSize( hFile, NULL );
+	HANDLE hMapping = NULL;
+	if ( nSize != INVALID_FILE_SIZE && nSize >= sizeof( dheader_t ) && nSize < 0x7fffffff )
+	{
+		hMapping = ::CreateFileMapping( hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+	}
+	if ( hMapping )
+	{
+		// the view keeps the file open
+		s_pBSPMapping = ::MapViewOfFile( hMapping, FILE_MAP_COPY, 0, 0, 0 );
+		s_nBSPMappingSize = (int)nSize;
+		::CloseHandle( hMapping );
+	}
+	::CloseHandle( hFile );
+#else
+	int nFile = open( filename, O_RDONLY );
+	if ( nFile == -1 )
+		return false;
+
+	struct stat st;
+	if ( fstat( nFile, &st ) == 0 && st.st_size >= (off_t)sizeof( dheader_t ) && st.st_size < 0x7fffffff )
+	{
+		s_pBSPMapping = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, nFile, 0 );
+		s_nBSPMappingSize = (int)st.st_size;
+		if ( s_pBSPMapping == MAP_FAILED )
+		{
+			s_pBSPMapping = NULL;
+		}
+	}
+	close( nFile );
+#endif
+
+	if ( !s_pBSPMapping )
+	{
+		s_nBSPMappingSize = 0;
+		return false;
+	}
+
+	g_pBSPHeader = (dheader_t *)s_pBSPMapping;
+	return true;
+}
+
+static void UnmapBSPFile( void )
+{
+#ifdef _WIN32
+	::UnmapViewOfFile( s_pBSPMapping );
+#else
+	munmap( s_pBSPMapping, s_nBSPMappingSize );
+#endif
+	s_pBSPMapping = NULL;
+	s_nBSPMappingSize = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	Makes g_pBSPHeader point at the whole file, mapped if it can be. Tools that
+//	write the file they read have to have it loaded.
+//-----------------------------------------------------------------------------
+static void MapOrLoadBSPFile( const char *filename, bool bAllowMapping )
+{
+	if ( !bAllowMapping || !MapBSPFile( filename ) )
+	{
+		LoadFile( filename, (void **)&g_pBSPHeader );
+	}
+}
+
+//-----------------------------------------------------------------------------
+//	True if the file was written for the other byte order. Only reads the ident.
+//-----------------------------------------------------------------------------
+static bool IsBSPFileSwapped( const char *filename )
+{
+	int ident = 0;
+
+	FileHandle_t f = SafeOpenRead( filename );
+	SafeRead( f, &ident, sizeof( ident ) );
+	g_pFileSystem->Close( f );
+
+	return ( ident == BigLong( IDBSPHEADER ) );
+}
+
+//-----------------------------------------------------------------------------
+//	Rebuilds an open BSP that CompressBSP compressed in memory, with every lump
+//	and game lump decompressed, so nothing past OpenBSPFile has to know.
+//-----------------------------------------------------------------------------
+struct DecompressLumpJob_t
+{
+	int				lumpNum;			// for errors; game lumps are -1
+	byte			*pData;
+	unsigned int	nLength;
+	unsigned int	nActualSize;		// 0 if the data is just copied
+	unsigned int	nOutOffset;
+	byte			*pOutput;
+	bool			bOK;
+};
+
+static void DecompressLumpJob( void *pContext, int iJob )
+{
+	DecompressLumpJob_t *pJob = &((DecompressLumpJob_t *)pContext)[iJob];
+	if ( pJob->nActualSize )
+	{
+		pJob->bOK = DecompressLumpData( pJob->pData, pJob->pOutput, pJob->nActualSize );
+	}
+	else
+	{
+		memcpy( pJob->pOutput, pJob->pData, pJob->nLength );
+		pJob->bOK = true;
+	}
+}
+
+static void DecompressBSPFile( const char *filename )
+{
+	byte *pBase = (byte *)g_pBSPHeader;
+	bool bAnyCompressed = false;
+
+	// compressed lumps have their uncompressed size in the fourCC
+	unsigned int nActualSizes[HEADER_LUMPS];
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		lump_t *pLump = &g_pBSPHeader->lumps[i];
+		unsigned int nFourCC = *(unsigned int *)pLump->fourCC;
+
+		nActualSizes[i] = 0;
+		if ( i != LUMP_GAME_LUMP && nFourCC && pLump->filelen )
+		{
+			unsigned int nActualSize = GetLumpActualSize( pBase + pLump->fileofs, pLump->filelen );
+			if ( nActualSize && nActualSize == (unsigned int)BigLong( nFourCC ) )
+			{
+				nActualSizes[i] = nActualSize;
+				bAnyCompressed = true;
+			}
+		}
+	}
+
+	// compressed game lumps keep their uncompressed size, the next entry's offset ends them
+	CUtlVector< dgamelump_t > gameLumps;
+	CUtlVector< unsigned int > gameLumpLengths;
+	lump_t *pGameLumpLump = &g_pBSPHeader->lumps[LUMP_GAME_LUMP];
+	if ( pGameLumpLump->filelen >= (int)sizeof( dgamelumpheader_t ) )
+	{
+		dgamelumpheader_t gameLumpHeader = *(dgamelumpheader_t *)( pBase + pGameLumpLump->fileofs );
+		if ( g_bSwapOnLoad )
+		{
+			g_Swap.SwapFieldsToTargetEndian( &gameLumpHeader );
+		}
+
+		gameLumps.CopyArray( (dgamelump_t *)( pBase + pGameLumpLump->fileofs + sizeof( dgamelumpheader_t ) ), gameLumpHeader.lumpCount );
+		if ( g_bSwapOnLoad )
+		{
+			g_Swap.SwapFieldsToTargetEndian( gameLumps.Base(), gameLumps.Count() );
+		}
+
+		for ( int i = 0; i < gameLumps.Count(); i++ )
+		{
+			unsigned int nLength = gameLumps[i].filelen;
+			if ( gameLumps[i].flags & GAMELUMPFLAG_COMPRESSED )
+			{
+				if ( i + 1 >= gameLumps.Count() )
+				{
+					Error( "%s: compressed game lump %d has no terminal entry", filename, i );
+				}
+				nLength = gameLumps[i+1].fileofs - gameLumps[i].fileofs;
+				bAnyCompressed = true;
+			}
+			gameLumpLengths.AddToTail( nLength );
+		}
+	}
+
+	if ( !bAnyCompressed )
+	{
+		return;
+	}
+
+	// the terminal entry was only there to size the last compressed one
+	int nGameLumps = gameLumps.Count();
+	while ( nGameLumps && !gameLumps[nGameLumps-1].id && !gameLumps[nGameLumps-1].filelen )
+	{
+		nGameLumps--;
+	}
+
+	// lay out the uncompressed file
+	dheader_t newHeader = *g_pBSPHeader;
+	CUtlVector< DecompressLumpJob_t > jobs;
+	unsigned int nNewSize = sizeof( dheader_t );
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		lump_t *pLump = &newHeader.lumps[i];
+		if ( !pLump->filelen )
+			continue;
+
+		nNewSize = AlignValue( nNewSize, 4 );
+		unsigned int nLumpOffset = nNewSize;
+
+		if ( i == LUMP_GAME_LUMP && gameLumps.Count() )
+		{
+			nNewSize += sizeof( dgamelumpheader_t ) + nGameLumps * sizeof( dgamelump_t );
+			for ( int j = 0; j < nGameLumps; j++ )
+			{
+				nNewSize = AlignValue( nNewSize, 4 );
+
+				DecompressLumpJob_t &job = jobs[ jobs.AddToTail() ];
+				job.lumpNum = -1;
+				job.pData = pBase + gameLumps[j].fileofs;
+				job.nLength = gameLumpLengths[j];
+				job.nActualSize = 0;
+				if ( gameLumps[j].flags & GAMELUMPFLAG_COMPRESSED )
+				{
+					job.nActualSize = GetLumpActualSize( job.pData, job.nLength );
+					if ( job.nActualSize != (unsigned int)gameLumps[j].filelen )
+					{
+						Error( "%s: game lump %d is not compressed the way its entry says", filename, j );
+					}
+				}
+				job.nOutOffset = nNewSize;
+
+				gameLumps[j].fileofs = nNewSize;
+				gameLumps[j].flags &= ~GAMELUMPFLAG_COMPRESSED;
+				nNewSize += gameLumps[j].filelen;
+			}
+		}
+		else
+		{
+			DecompressLumpJob_t &job = jobs[ jobs.AddToTail() ];
+			job.lumpNum = i;
+			job.pData = pBase + pLump->fileofs;
+			job.nLength = pLump->filelen;
+			job.nActualSize = nActualSizes[i];
+			job.nOutOffset = nNewSize;
+
+			if ( nActualSizes[i] )
+			{
+				pLump->filelen = nActualSizes[i];
+				*(unsigned int *)pLump->fourCC = 0;
+			}
+			nNewSize += pLump->filelen;
+		}
+
+		pLump->fileofs = nLumpOffset;
+		pLump->filelen = nNewSize - nLumpOffset;
+	}
+
+	byte *pNewBase = (byte *)malloc( nNewSize );
+	if ( !pNewBase )
+	{
+		Error( "%s: out of memory decompressing (%u bytes)", filename, nNewSize );
+	}
+	memcpy( pNewBase, &newHeader, sizeof( dheader_t ) );
+
+	if ( gameLumps.Count() && newHeader.lumps[LUMP_GAME_LUMP].filelen )
+	{
+		// the directory stays in the file's byte order, ParseGameLump swaps it
+		dgamelumpheader_t *pGameLumpHeader = (dgamelumpheader_t *)( pNewBase + newHeader.lumps[LUMP_GAME_LUMP].fileofs );
+		dgamelump_t *pGameLump = (dgamelump_t *)( pGameLumpHeader + 1 );
+		pGameLumpHeader->lumpCount = nGameLumps;
+		memcpy( pGameLump, gameLumps.Base(), nGameLumps * sizeof( dgamelump_t ) );
+		if ( g_bSwapOnLoad )
+		{
+			g_Swap.SwapFieldsToTargetEndian( pGameLumpHeader );
+			g_Swap.SwapFieldsToTargetEndian( pGameLump, nGameLumps );
+		}
+	}
+
+	for ( int i = 0; i < jobs.Count(); i++ )
+	{
+		jobs[i].pOutput = pNewBase + jobs[i].nOutOffset;
+	}
+	RunLumpJobs( jobs.Count(), DecompressLumpJob, jobs.Base() );
+
+	for ( int i = 0; i < jobs.Count(); i++ )
+	{
+		if ( !jobs[i].bOK )
+		{
+			if ( jobs[i].lumpNum >= 0 )
+				Error( "%s: lump %d failed to decompress", filename, jobs[i].lumpNum );
+			else
+				Error( "%s: a game lump failed to decompress", filename );
+		}
+	}
+
+	CloseBSPFile();
+	g_pBSPHeader = (dheader_t *)pNewBase;
+}
+
+static void OpenBSPFileInternal( const char *filename, bool bAllowMapping )
 {
 	Lumps_Init();
 
 	// load the file header
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	MapOrLoadBSPFile( filename, bAllowMapping );
 
 	if ( g_bSwapOnLoad )
 	{
@@ -2136,18 +2597,58 @@ void OpenBSPFile( const char *filename )
 
 	ValidateHeader( filename, g_pBSPHeader );
 
+	DecompressBSPFile( filename );
+
 	g_MapRevision = g_pBSPHeader->mapRevision;
 }
 
+//-----------------------------------------------------------------------------
+//	Low level BSP opener for external parsing. Parses headers, but nothing else.
+//	You must close the BSP, via CloseBSPFile().
+//-----------------------------------------------------------------------------
+void OpenBSPFile( const char *filename )
+{
+	OpenBSPFileInternal( filename, true );
+}
+
 //-----------------------------------------------------------------------------
 //	CloseBSPFile
 //-----------------------------------------------------------------------------
 void CloseBSPFile( void )
 {
-	free( g_pBSPHeader );
+	if ( g_pBSPHeader && g_pBSPHeader == s_pBSPMapping )
+	{
+		UnmapBSPFile();
+	}
+	else
+	{
+		free( g_pBSPHeader );
+	}
 	g_pBSPHeader = NULL;
 }
 
+//-----------------------------------------------------------------------------
+//	Returns a lump of the open BSP as it is in the file, without copying it.
+//	Nothing is byte swapped. The data is gone once the BSP is closed.
+//-----------------------------------------------------------------------------
+const void *GetLumpView( int lump, int *pLength, int forceVersion )
+{
+	g_Lumps.bLumpParsed[lump] = true;
+
+	unsigned int length = g_pBSPHeader->lumps[lump].filelen;
+	unsigned int ofs = g_pBSPHeader->lumps[lump].fileofs;
+
+	ValidateLump( lump, length, 1, forceVersion );
+
+	if ( s_pBSPMapping && ( ofs > (unsigned int)s_nBSPMappingSize || length > s_nBSPMappingSize - ofs ) )
+	{
+		Error( "GetLumpView: lump %d is past the end of the file", lump );
+	}
+
+	*pLength = length;
+	return length ? (byte *)g_pBSPHeader + ofs : NULL;
+}
+
 //-----------------------------------------------------------------------------
 //	LoadBSPFile
 //-----------------------------------------------------------------------------
@@ -2241,21 +2742,19 @@ void LoadBSPFile( const char *filename )
 	}
 	*/
 		
-	// Load PAK file lump into appropriate data structure
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	// Load PAK file lump into appropriate data structure, straight from the file
+	int paksize;
+	const void *pakbuffer = GetLumpView( LUMP_PAKFILE, &paksize );
 	if ( paksize > 0 )
 	{
 		GetPakFile()->ActivateByteSwapping( IsX360() );
-		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
+		GetPakFile()->ParseFromBuffer( (void *)pakbuffer, paksize );
 	}
 	else
 	{
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
-
 	g_GameLumps.ParseGameLump( g_pBSPHeader );
 
 	// NOTE: Do NOT call CopyLump after Lumps_Parse() it parses all un-Copied lumps
@@ -2386,27 +2885,24 @@ void LoadBSPFile_FileSystemOnly( const char *filename )
 	//
 	// load the file header
 	//
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	MapOrLoadBSPFile( filename, true );
 
 	ValidateHeader( filename, g_pBSPHeader );
 
 	// Load PAK file lump into appropriate data structure
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer, 1 );
+	int paksize;
+	const void *pakbuffer = GetLumpView( LUMP_PAKFILE, &paksize, 1 );
 	if ( paksize > 0 )
 	{
-		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
+		GetPakFile()->ParseFromBuffer( (void *)pakbuffer, paksize );
 	}
 	else
 	{
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
-
 	// everything has been copied out
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	CloseBSPFile();
 }
 
 void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
@@ -2416,29 +2912,32 @@ void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
 	//
 	// load the file header
 	//
-	LoadFile( pBSPFileName, (void **)&g_pBSPHeader);
+	MapOrLoadBSPFile( pBSPFileName, true );
 
 	ValidateHeader( pBSPFileName, g_pBSPHeader );
 
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	int paksize;
+	const void *pakbuffer = GetLumpView( LUMP_PAKFILE, &paksize );
 	if ( paksize > 0 )
 	{
 		FILE *fp;
 		fp = fopen( pZipFileName, "wb" );
-		if( !fp )
+		if( fp )
+		{
+			fwrite( pakbuffer, paksize, 1, fp );
+			fclose( fp );
+		}
+		else
 		{
 			fprintf( stderr, "can't open %s\n", pZipFileName );
-			return;
 		}
-
-		fwrite( pakbuffer, paksize, 1, fp );
-		fclose( fp );
 	}
 	else
 	{		
 		fprintf( stderr, "zip file is zero length!\n" );
 	}
+
+	CloseBSPFile();
 }
 
 /*
@@ -3865,6 +4364,43 @@ const char *ResolveStaticPropToModel( const char *pPropName )
 	return g_StaticPropNames[iModel].String();
 }
 
+//-----------------------------------------------------------------------------
+// A pak file converted and waiting to go in the new pak. The converters run
+// one file at a time, but the VHV compression runs on every processor.
+//-----------------------------------------------------------------------------
+struct ConvertedPakFile_t
+{
+	char		relativeName[MAX_PATH];
+	CUtlBuffer	buf;
+	bool		bCompress;		// a VHV, compress past its header
+};
+
+static void CompressPakFileJob( void *pContext, int iJob )
+{
+	ConvertedPakFile_t *pFile = ((ConvertedPakFile_t **)pContext)[iJob];
+	if ( !pFile->bCompress )
+		return;
+
+	CUtlBuffer &targetBuf = pFile->buf;
+	CUtlBuffer compressedBuffer;
+	targetBuf.SeekGet( CUtlBuffer::SEEK_HEAD, sizeof( HardwareVerts::FileHeader_t ) );
+	bool bCompressed = g_pCompressFunc( targetBuf, compressedBuffer );
+	if ( bCompressed )
+	{
+		// copy all the header data off
+		CUtlBuffer headerBuffer;
+		headerBuffer.EnsureCapacity( sizeof( HardwareVerts::FileHeader_t ) );
+		headerBuffer.Put( targetBuf.Base(), sizeof( HardwareVerts::FileHeader_t ) );
+
+		// reform the target with the header and then the compressed data
+		targetBuf.Clear();
+		targetBuf.Put( headerBuffer.Base(), sizeof( HardwareVerts::FileHeader_t ) );
+		targetBuf.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
+	}
+
+	targetBuf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+}
+
 //-----------------------------------------------------------------------------
 // Iterate files in pak file, distribute to converters
 // pak file will be ready for serialization upon completion
@@ -3876,7 +4412,9 @@ void ConvertPakFileContents( const char *pInFilename )
 	CUtlBuffer sourceBuf;
 	CUtlBuffer targetBuf;
 	bool bConverted;
+	bool bCompress;
 	CUtlVector< CUtlString > hdrFiles;
+	CUtlVector< ConvertedPakFile_t * > convertedFiles;
 
 	int id = -1;
 	int fileSize;
@@ -3888,6 +4426,7 @@ void ConvertPakFileContents( const char *pInFilename )
 			break;
 
 		bConverted = false;
+		bCompress = false;
 		sourceBuf.Purge();
 		targetBuf.Purge();
 
@@ -3951,35 +4490,18 @@ void ConvertPakFileContents( const char *pInFilename )
 			}
 			targetBuf.SeekPut( CUtlBuffer::SEEK_HEAD, tempBuffer.TellPut() );
 
-			if ( g_pCompressFunc )
-			{
-				CUtlBuffer compressedBuffer;
-				targetBuf.SeekGet( CUtlBuffer::SEEK_HEAD, sizeof( HardwareVerts::FileHeader_t ) );
-				bool bCompressed = g_pCompressFunc( targetBuf, compressedBuffer );
-				if ( bCompressed )
-				{
-					// copy all the header data off
-					CUtlBuffer headerBuffer;
-					headerBuffer.EnsureCapacity( sizeof( HardwareVerts::FileHeader_t ) );
-					headerBuffer.Put( targetBuf.Base(), sizeof( HardwareVerts::FileHeader_t ) );
-
-					// reform the target with the header and then the compressed data
-					targetBuf.Clear();
-					targetBuf.Put( headerBuffer.Base(), sizeof( HardwareVerts::FileHeader_t ) );
-					targetBuf.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				}
-
-				targetBuf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-			}
-
+			// compressed along with the others once they're all converted
+			bCompress = ( g_pCompressFunc != NULL );
 			bConverted = true;
 			pExt = ".vhv";
 		}
 
+		ConvertedPakFile_t *pFile = new ConvertedPakFile_t;
+		pFile->bCompress = bCompress;
 		if ( !bConverted )
 		{
 			// straight copy
-			AddBufferToPak( newPakFile, relativeName, sourceBuf.Base(), sourceBuf.TellMaxPut(), false );
+			pFile->buf.Swap( sourceBuf );
 		}
 		else
 		{
@@ -3987,16 +4509,29 @@ void ConvertPakFileContents( const char *pInFilename )
 			V_StripExtension( relativeName, relativeName, sizeof( relativeName ) );
 			V_strcat( relativeName, ".360", sizeof( relativeName ) );
 			V_strcat( relativeName, pExt, sizeof( relativeName ) );
-			AddBufferToPak( newPakFile, relativeName, targetBuf.Base(), targetBuf.TellMaxPut(), false );
+			pFile->buf.Swap( targetBuf );
 		}
+		V_strncpy( pFile->relativeName, relativeName, sizeof( pFile->relativeName ) );
+		convertedFiles.AddToTail( pFile );
+	}
+
+	RunLumpJobs( convertedFiles.Count(), CompressPakFileJob, convertedFiles.Base() );
 
-		if ( V_stristr( relativeName, ".hdr" ) || V_stristr( relativeName, "_hdr" ) )
+	// add in the order they came in
+	for ( int i = 0; i < convertedFiles.Count(); i++ )
+	{
+		ConvertedPakFile_t *pFile = convertedFiles[i];
+		AddBufferToPak( newPakFile, pFile->relativeName, pFile->buf.Base(), pFile->buf.TellMaxPut(), false );
+
+		if ( V_stristr( pFile->relativeName, ".hdr" ) || V_stristr( pFile->relativeName, "_hdr" ) )
 		{
-			hdrFiles.AddToTail( relativeName );
+			hdrFiles.AddToTail( pFile->relativeName );
 		}
 
-		DevMsg( "Created '%s' in lump pak in '%s'.\n", relativeName, pInFilename );
+		DevMsg( "Created '%s' in lump pak in '%s'.\n", pFile->relativeName, pInFilename );
+		delete pFile;
 	}
+	convertedFiles.Purge();
 
 	// strip ldr version of hdr files
 	for ( int i=0; i<hdrFiles.Count(); i++ )
@@ -4400,17 +4935,47 @@ int SortLumpsByOffset( const SortedLump_t *pSortedLumpA, const SortedLump_t *pSo
 	return 0;
 }
 
-bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+//-----------------------------------------------------------------------------
+// Every lump and game lump gets compressed on its own, all at once, before
+// CompressBSP puts them together in order. The compress function gets called
+// from several threads at the same time.
+//-----------------------------------------------------------------------------
+struct CompressLumpJob_t
+{
+	byte		*pData;
+	int			nLength;			// 0 if it goes in as is
+	CUtlBuffer	compressedBuffer;
+	bool		bCompressed;
+};
+
+struct CompressLumpJobs_t
+{
+	CompressFunc_t						pCompressFunc;
+	CUtlVector< CompressLumpJob_t >		jobs;
+};
+
+static void CompressLumpJob( void *pContext, int iJob )
+{
+	CompressLumpJobs_t *pJobs = (CompressLumpJobs_t *)pContext;
+	CompressLumpJob_t &job = pJobs->jobs[iJob];
+
+	job.bCompressed = false;
+	if ( job.nLength )
+	{
+		CUtlBuffer inputBuffer;
+		inputBuffer.SetExternalBuffer( job.pData, job.nLength, job.nLength );
+		job.bCompressed = pJobs->pCompressFunc( inputBuffer, job.compressedBuffer );
+	}
+}
+
+bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressLumpJob_t *pJobs, bool bBigEndian )
 {
 	CByteswap	byteSwap;
 
+	// the input directory was swapped along with the header
 	dgamelumpheader_t* pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
 	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
 
-	byteSwap.ActivateByteSwapping( true );
-	byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
-	byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
-
 	unsigned int newOffset = outputBuffer.TellPut();
 	outputBuffer.Put( pInGameLumpHeader, sizeof( dgamelumpheader_t ) );
 	outputBuffer.Put( pInGameLump, pInGameLumpHeader->lumpCount * sizeof( dgamelump_t ) );
@@ -4427,27 +4992,22 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 
 	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
 	{
-		CUtlBuffer inputBuffer;
-		CUtlBuffer compressedBuffer;
-
 		pOutGameLump[i].fileofs = AlignBuffer( outputBuffer, 4 );
 
 		if ( pInGameLump[i].filelen )
 		{
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs, pInGameLump[i].filelen, pInGameLump[i].filelen );
-
-			bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-			if ( bCompressed )
+			CompressLumpJob_t &job = pJobs[i];
+			if ( job.bCompressed )
 			{
 				pOutGameLump[i].flags |= GAMELUMPFLAG_COMPRESSED;
 
-				outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				compressedBuffer.Purge();
+				outputBuffer.Put( job.compressedBuffer.Base(), job.compressedBuffer.TellPut() );
+				job.compressedBuffer.Purge();
 			}
 			else
 			{
 				// as is
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( job.pData, job.nLength );
 			}
 		}
 	}
@@ -4457,6 +5017,7 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 	pOutGameLump[lastLump].fileofs = outputBuffer.TellPut();
 
 	// fix the output for 360, swapping it back
+	byteSwap.ActivateByteSwapping( bBigEndian );
 	byteSwap.SwapFieldsToTargetEndian( pOutGameLump, pOutGameLumpHeader->lumpCount );
 	byteSwap.SwapFieldsToTargetEndian( pOutGameLumpHeader );
 
@@ -4466,20 +5027,47 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 	return true;
 }
 
-bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+static bool CompressBSPLumps( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, bool bBigEndian )
 {
 	CByteswap	byteSwap;
 
 	dheader_t *pInBSPHeader = (dheader_t *)inputBuffer.Base();
-	if ( pInBSPHeader->ident != BigLong( IDBSPHEADER ) || !pCompressFunc )
+
+	// a 360 bsp gets its header swapped back
+	byteSwap.ActivateByteSwapping( bBigEndian );
+	byteSwap.SwapFieldsToTargetEndian( pInBSPHeader );
+
+	// and the game lump directory, to find its components
+	dgamelumpheader_t *pInGameLumpHeader = NULL;
+	dgamelump_t *pInGameLump = NULL;
+	int nGameLumps = 0;
+	if ( pInBSPHeader->lumps[LUMP_GAME_LUMP].filelen )
 	{
-		// only compress 360 bsp's
-		return false;
+		pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
+		pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
+		byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
+		byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
+		nGameLumps = pInGameLumpHeader->lumpCount;
 	}
 
-	// bsp is 360, swap the header back
-	byteSwap.ActivateByteSwapping( true );
-	byteSwap.SwapFieldsToTargetEndian( pInBSPHeader );
+	// compress everything first, the lumps then the game lump components
+	CompressLumpJobs_t compressJobs;
+	compressJobs.pCompressFunc = pCompressFunc;
+	compressJobs.jobs.SetCount( HEADER_LUMPS + nGameLumps );
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		// the pak goes in as is, the game lump has each of its components individually compressed
+		CompressLumpJob_t &job = compressJobs.jobs[i];
+		job.pData = ((byte *)pInBSPHeader) + pInBSPHeader->lumps[i].fileofs;
+		job.nLength = ( i != LUMP_PAKFILE && i != LUMP_GAME_LUMP ) ? pInBSPHeader->lumps[i].filelen : 0;
+	}
+	for ( int i = 0; i < nGameLumps; i++ )
+	{
+		CompressLumpJob_t &job = compressJobs.jobs[HEADER_LUMPS + i];
+		job.pData = ((byte *)pInBSPHeader) + pInGameLump[i].fileofs;
+		job.nLength = pInGameLump[i].filelen;
+	}
+	RunLumpJobs( compressJobs.jobs.Count(), CompressLumpJob, &compressJobs );
 
 	// output will be smaller, use input size as upper bound
 	outputBuffer.EnsureCapacity( inputBuffer.TellMaxPut() );
@@ -4521,50 +5109,83 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 			// only set by compressed lumps, hides the uncompressed size
 			*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = 0;
 
-			CUtlBuffer inputBuffer;
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen, pSortedLump->pLump->filelen );
-
+			CompressLumpJob_t &job = compressJobs.jobs[lumpNum];
 			if ( lumpNum == LUMP_GAME_LUMP )
 			{
-				// the game lump has to have each of its components individually compressed
-				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, pCompressFunc );
+				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, compressJobs.jobs.Base() + HEADER_LUMPS, bBigEndian );
 			}
-			else if ( lumpNum == LUMP_PAKFILE )
+			else if ( job.bCompressed )
 			{
-				// add as is
+				// placing the uncompressed size in the unused fourCC, will decode at runtime
+				*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( job.nLength );
+				pOutBSPHeader->lumps[lumpNum].filelen = job.compressedBuffer.TellPut();
 				pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( job.compressedBuffer.Base(), job.compressedBuffer.TellPut() );
+				job.compressedBuffer.Purge();
 			}
 			else
 			{
-				CUtlBuffer compressedBuffer;
-				bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-				if ( bCompressed )
-				{
-					// placing the uncompressed size in the unused fourCC, will decode at runtime
-					*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( inputBuffer.TellPut() );
-					pOutBSPHeader->lumps[lumpNum].filelen = compressedBuffer.TellPut();
-					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-					compressedBuffer.Purge();
-				}
-				else
-				{
-					// add as is
-					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
-				}
+				// add as is
+				pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
+				outputBuffer.Put( job.pData, pSortedLump->pLump->filelen );
 			}
 		}
 	}
 
 	// fix the output for 360, swapping it back
-	byteSwap.SetTargetBigEndian( true );
-	byteSwap.SwapFieldsToTargetEndian( pOutBSPHeader );
+	if ( bBigEndian )
+	{
+		byteSwap.SetTargetBigEndian( true );
+		byteSwap.SwapFieldsToTargetEndian( pOutBSPHeader );
+	}
 
 	return true;
 }
 
+bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+{
+	dheader_t *pInBSPHeader = (dheader_t *)inputBuffer.Base();
+	if ( pInBSPHeader->ident != BigLong( IDBSPHEADER ) || !pCompressFunc )
+	{
+		// only compress 360 bsp's
+		return false;
+	}
+
+	return CompressBSPLumps( inputBuffer, outputBuffer, pCompressFunc, true );
+}
+
+//-----------------------------------------------------------------------------
+//	Compresses the lumps of a PC BSP on disk in place. Only the tools can load
+//	the result, OpenBSPFile decompresses it again.
+//-----------------------------------------------------------------------------
+bool CompressBSPFile( const char *pFilename, CompressFunc_t pCompressFunc )
+{
+	CUtlBuffer inputBuffer;
+	if ( !g_pFileSystem->ReadFile( pFilename, NULL, inputBuffer ) )
+	{
+		Warning( "Error! Couldn't read file %s - BSP compression failed!\n", pFilename );
+		return false;
+	}
+
+	if ( inputBuffer.TellPut() < (int)sizeof( dheader_t ) || ((dheader_t *)inputBuffer.Base())->ident != IDBSPHEADER )
+	{
+		Warning( "Error! %s is not a PC BSP - BSP compression failed!\n", pFilename );
+		return false;
+	}
+
+	CUtlBuffer outputBuffer;
+	if ( !CompressBSPLumps( inputBuffer, outputBuffer, pCompressFunc, false ) )
+	{
+		Warning( "Error! Failed to compress BSP '%s'!\n", pFilename );
+		return false;
+	}
+
+	FileHandle_t hFile = SafeOpenWrite( pFilename );
+	SafeWrite( hFile, outputBuffer.Base(), outputBuffer.TellPut() );
+	g_pFileSystem->Close( hFile );
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 //  For all lumps in a bsp: Loads the lump from file A, swaps it, writes it to file B.
 //  This limits the memory used for the swap process which helps the Xbox 360.
@@ -4608,7 +5229,8 @@ bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapO
 
 	g_Swap.ActivateByteSwapping( true );
 
-	OpenBSPFile( pInFilename );
+	// the swapped file may be this one
+	OpenBSPFileInternal( pInFilename, false );
 
 	// CRC the bsp first
 	CRC32_t mapCRC;
@@ -4803,10 +5425,7 @@ bool GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize )
 	}
 
 	// determine endian nature
-	dheader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBSPFileSwapped( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = !bSwap;
@@ -4890,15 +5509,13 @@ bool SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *p
 	}
 
 	// determine endian nature
-	dheader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBSPFileSwapped( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = bSwap;
 
-	OpenBSPFile( pBSPFilename );
+	// the new file may be this one
+	OpenBSPFileInternal( pBSPFilename, false );
 
 	// save a copy of the old header
 	// generating a new bsp is a destructive operation
@@ -204,7 +204,9 @@ void				RemoveFileFromPak( IZip *pak, const char *pRelativeName );
 int					GetNextFilename( IZip *pak, int id, char *pBuffer, int bufferSize, int &fileSize );
 void				ForceAlignment( IZip *pak, bool bAlign, bool bCompatibleFormat, unsigned int alignmentSize );
 
-typedef bool (*CompressFunc_t)( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
+typedef bool (*CompressFunc_t)( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );	// called from several threads at once
+extern int g_nLumpThreads;		// threads lumps are compressed and decompressed on, 0 for every processor
+bool CompressLumpSnappy( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );		// fast, but only tools read it; ship with LZMA
 typedef bool (*VTFConvertFunc_t)( const char *pDebugName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf, CompressFunc_t pCompressFunc );
 typedef bool (*VHVFixupFunc_t)( const char *pVhvFilename, const char *pModelName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf );
 
@@ -288,6 +290,7 @@ int		CompressVis (byte *vis, byte *dest);
 
 void	OpenBSPFile( const char *filename );
 void	CloseBSPFile(void);
+const void *GetLumpView( int lump, int *pLength, int forceVersion = -1 );	// zero-copy, read-only, until CloseBSPFile
 void	LoadBSPFile( const char *filename );
 void	LoadBSPFile_FileSystemOnly( const char *filename );
 void	LoadBSPFileTexinfo( const char *filename );
@@ -296,6 +299,7 @@ void	PrintBSPFileSizes(void);
 void	PrintBSPPackDirectory(void);
 void	ReleasePakFileLumps(void);
 bool	SwapBSPFile( const char *filename, const char *swapFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc );
+bool	CompressBSPFile( const char *filename, CompressFunc_t pCompressFunc );	// PC bsp, in place, tools only
 bool	GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize );
 bool	SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *pPakData, int pakSize );
 void	WriteLumpToFile( char *filename, int lump );
@@ -0,0 +1,1227 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spreads the work units of a stage across worker processes over TCP.
+//
+//=============================================================================//
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include <wincrypt.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include "cmdlib.h"
+#include "threads.h"
+#include "pacifier.h"
+#include "localdist.h"
+#include "tier0/threadtools.h"
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "utlvector.h"
+
+
+#ifndef _WIN32
+typedef int SOCKET;
+#define INVALID_SOCKET		(-1)
+#define closesocket			close
+#endif
+
+#define LOCALDIST_VERSION			2
+#define LOCALDIST_CONNECT_TIMEOUT	30.0	// seconds a worker keeps trying to reach its master
+#define LOCALDIST_HEARTBEAT			5.0		// seconds between a busy worker's heartbeats
+#define LOCALDIST_WORKER_TIMEOUT	60.0	// seconds a worker holding work units can go quiet
+#define LOCALDIST_UNITS_PER_THREAD	2		// work units a worker is given per thread
+#define LOCALDIST_MAX_MESSAGE_BYTES	( 64 * 1024 * 1024 )	// larger messages drop the connection
+
+// select() takes at most FD_SETSIZE sockets on Windows, and the listen socket is one of them.
+#define LOCALDIST_MAX_WORKERS		( FD_SETSIZE - 1 )
+
+enum
+{
+	LOCALDIST_MSG_HELLO = 1,	// worker -> master: version, token, map name
+	LOCALDIST_MSG_READY,		// worker -> master: stage, threads
+	LOCALDIST_MSG_HEARTBEAT,	// worker -> master
+	LOCALDIST_MSG_RESULT,		// worker -> master: stage, work unit, results
+	LOCALDIST_MSG_WORK,			// master -> worker: stage, work unit
+	LOCALDIST_MSG_BROADCAST,	// master -> worker: stage, work unit, results
+	LOCALDIST_MSG_STAGE_DONE,	// master -> worker: stage, whether the worker missed results it needs
+};
+
+enum
+{
+	LOCALDIST_NONE = 0,
+	LOCALDIST_MASTER,
+	LOCALDIST_WORKER
+};
+
+enum
+{
+	UNIT_QUEUED = 0,
+	UNIT_ASSIGNED,
+	UNIT_DONE
+};
+
+struct LocalDistMsgHeader_t
+{
+	int m_nBytes;		// bytes after the header
+	int m_iType;
+};
+
+struct LocalDistUnitHeader_t
+{
+	int m_iStage;
+	int m_iWorkUnit;
+};
+
+
+int		g_nLocalDistWorkers = 0;
+int		g_nLocalDistPort = 0;
+bool	g_bLocalDistListen = false;
+char	g_szLocalDistMaster[256] = "";
+char	g_szLocalDistToken[64] = "";
+
+
+//-----------------------------------------------------------------------------
+// A nonblocking socket with a send queue, so neither end ever blocks on a peer
+// that's busy sending too.
+//-----------------------------------------------------------------------------
+class CLocalDistConnection
+{
+public:
+	CLocalDistConnection( SOCKET s );
+	~CLocalDistConnection();
+
+	void Send( int iType, const void *pHeader, int nHeaderBytes, const void *pData = NULL, int nDataBytes = 0 );
+
+	// Both return false once the connection is gone.
+	bool Flush();
+	bool Receive();
+
+	// Pop the next complete message. msg is left at the start of its payload.
+	bool GetMessage( int &iType, CUtlBuffer &msg );
+
+	bool HasQueuedSends() const		{ return m_nSendOffset < m_SendBuf.Count(); }
+
+	// Set once the peer sent a message with a bad size. Nothing after it can be trusted.
+	bool IsCorrupt() const			{ return m_bCorrupt; }
+
+	SOCKET m_Socket;
+	double m_flConnected;
+	double m_flLastHeard;
+
+	// master side
+	int m_iWorker;
+	bool m_bHello;
+	int m_iReadyStage;
+	int m_nThreads;
+	int m_nUnitsDone;
+	CUtlVector<int> m_Assigned;
+
+private:
+	CUtlVector<byte> m_SendBuf;
+	int m_nSendOffset;
+	CUtlVector<byte> m_RecvBuf;
+	int m_nRecvOffset;
+	int m_nRecvBytes;
+	bool m_bCorrupt;
+};
+
+
+CLocalDistConnection::CLocalDistConnection( SOCKET s )
+{
+	m_Socket = s;
+	m_flConnected = Plat_FloatTime();
+	m_flLastHeard = m_flConnected;
+	m_iWorker = -1;
+	m_bHello = false;
+	m_iReadyStage = -1;
+	m_nThreads = 1;
+	m_nUnitsDone = 0;
+	m_nSendOffset = 0;
+	m_nRecvOffset = 0;
+	m_nRecvBytes = 0;
+	m_bCorrupt = false;
+
+#ifdef _WIN32
+	u_long nNonBlocking = 1;
+	ioctlsocket( m_Socket, FIONBIO, &nNonBlocking );
+#else
+	fcntl( m_Socket, F_SETFL, fcntl( m_Socket, F_GETFL, 0 ) | O_NONBLOCK );
+#endif
+	int nNoDelay = 1;
+	setsockopt( m_Socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&nNoDelay, sizeof( nNoDelay ) );
+}
+
+CLocalDistConnection::~CLocalDistConnection()
+{
+	closesocket( m_Socket );
+}
+
+void CLocalDistConnection::Send( int iType, const void *pHeader, int nHeaderBytes, const void *pData, int nDataBytes )
+{
+	Assert( nHeaderBytes + nDataBytes <= LOCALDIST_MAX_MESSAGE_BYTES );
+
+	LocalDistMsgHeader_t msg;
+	msg.m_nBytes = nHeaderBytes + nDataBytes;
+	msg.m_iType = iType;
+
+	m_SendBuf.AddMultipleToTail( sizeof( msg ), (const byte *)&msg );
+	if ( nHeaderBytes )
+		m_SendBuf.AddMultipleToTail( nHeaderBytes, (const byte *)pHeader );
+	if ( nDataBytes )
+		m_SendBuf.AddMultipleToTail( nDataBytes, (const byte *)pData );
+}
+
+bool CLocalDistConnection::Flush()
+{
+	while ( HasQueuedSends() )
+	{
+		int nSent = send( m_Socket, (const char *)m_SendBuf.Base() + m_nSendOffset, m_SendBuf.Count() - m_nSendOffset, 0 );
+		if ( nSent <= 0 )
+		{
+#ifdef _WIN32
+			if ( nSent < 0 && WSAGetLastError() == WSAEWOULDBLOCK )
+#else
+			if ( nSent < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR ) )
+#endif
+				break;
+
+			return false;
+		}
+
+		m_nSendOffset += nSent;
+	}
+
+	// Drop what has been sent once it's worth the copy.
+	if ( m_nSendOffset == m_SendBuf.Count() )
+	{
+		m_SendBuf.RemoveAll();
+		m_nSendOffset = 0;
+	}
+	else if ( m_nSendOffset > 1024 * 1024 && m_nSendOffset > m_SendBuf.Count() / 2 )
+	{
+		m_SendBuf.RemoveMultiple( 0, m_nSendOffset );
+		m_nSendOffset = 0;
+	}
+	return true;
+}
+
+bool CLocalDistConnection::Receive()
+{
+	// Move what's left of a partly read message to the front.
+	if ( m_nRecvOffset )
+	{
+		memmove( m_RecvBuf.Base(), m_RecvBuf.Base() + m_nRecvOffset, m_nRecvBytes - m_nRecvOffset );
+		m_nRecvBytes -= m_nRecvOffset;
+		m_nRecvOffset = 0;
+	}
+
+	// Leave the rest in the socket until the messages already here are handled.
+	while ( m_nRecvBytes < LOCALDIST_MAX_MESSAGE_BYTES + (int)sizeof( LocalDistMsgHeader_t ) )
+	{
+		if ( m_RecvBuf.Count() - m_nRecvBytes < 64 * 1024 )
+		{
+			m_RecvBuf.SetCountNonDestructively( m_nRecvBytes + 64 * 1024 );
+		}
+
+		int nRead = recv( m_Socket, (char *)m_RecvBuf.Base() + m_nRecvBytes, m_RecvBuf.Count() - m_nRecvBytes, 0 );
+		if ( nRead == 0 )
+			return false;
+
+		if ( nRead < 0 )
+		{
+#ifdef _WIN32
+			return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+			return errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR;
+#endif
+		}
+
+		m_nRecvBytes += nRead;
+		m_flLastHeard = Plat_FloatTime();
+	}
+	return true;
+}
+
+bool CLocalDistConnection::GetMessage( int &iType, CUtlBuffer &msg )
+{
+	int nAvailable = m_nRecvBytes - m_nRecvOffset;
+	if ( m_bCorrupt || nAvailable < (int)sizeof( LocalDistMsgHeader_t ) )
+		return false;
+
+	LocalDistMsgHeader_t header;
+	memcpy( &header, m_RecvBuf.Base() + m_nRecvOffset, sizeof( header ) );
+	if ( header.m_nBytes < 0 || header.m_nBytes > LOCALDIST_MAX_MESSAGE_BYTES )
+	{
+		m_bCorrupt = true;
+		return false;
+	}
+
+	int nTotal = sizeof( header ) + header.m_nBytes;
+	if ( nAvailable < nTotal )
+		return false;
+
+	iType = header.m_iType;
+	msg.Clear();
+	msg.Put( m_RecvBuf.Base() + m_nRecvOffset + sizeof( header ), header.m_nBytes );
+
+	m_nRecvOffset += nTotal;
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// State shared by the stage a process is in
+//-----------------------------------------------------------------------------
+static int s_iMode = LOCALDIST_NONE;
+static int s_iStage = 0;				// index of the current or next stage
+static bool s_bInStage = false;
+static char s_szMapName[MAX_PATH];
+
+// master
+static SOCKET s_ListenSocket = INVALID_SOCKET;
+static int s_nNextWorker = 0;
+static CUtlVector<CLocalDistConnection *> s_Workers;
+static CUtlVector<bool> s_StageNeedsResults;	// per finished stage: workers that missed it are out of sync
+
+// worker
+static CLocalDistConnection *s_pMaster = NULL;
+
+// the current stage
+static CThreadFastMutex s_StageMutex;
+static LocalDistProcessFn s_pProcessFn;
+static bool s_bBroadcastResults;
+static int s_nWorkUnits;
+static int s_nUnitsDone;
+static bool s_bStageDone;
+static CUtlVector<int> s_Queue;					// work units not handed out yet, next one last
+static CUtlVector<byte> s_UnitState;			// master: UNIT_ enum, worker: 1 if it was handed to us
+static CUtlVector< CUtlVector<byte> > s_Results;	// master: results kept for broadcast stages
+static CUtlVector<int> s_FinishedUnits;			// finished by this process's threads, not sent yet
+
+
+static void InitSockets()
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	if ( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+	{
+		Error( "LocalDist: WSAStartup failed.\n" );
+	}
+#else
+	// Writing to a worker that died must not kill the master.
+	signal( SIGPIPE, SIG_IGN );
+	// and workers that exit don't need to be waited on
+	signal( SIGCHLD, SIG_IGN );
+#endif
+}
+
+static void GetExeName( char *pOut, int nOutLen, const char *pArgv0 )
+{
+#ifdef _WIN32
+	if ( GetModuleFileName( NULL, pOut, nOutLen ) )
+		return;
+#else
+	int nLen = readlink( "/proc/self/exe", pOut, nOutLen - 1 );
+	if ( nLen > 0 )
+	{
+		pOut[nLen] = 0;
+		return;
+	}
+#endif
+	Q_strncpy( pOut, pArgv0, nOutLen );
+}
+
+// A random token for the master's own workers when the command line doesn't give one.
+static void GenerateToken( char *pOut, int nOutLen )
+{
+	byte random[16];
+	bool bOk = false;
+#ifdef _WIN32
+	HCRYPTPROV hProv;
+	if ( CryptAcquireContext( &hProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT ) )
+	{
+		bOk = CryptGenRandom( hProv, sizeof( random ), random ) != FALSE;
+		CryptReleaseContext( hProv, 0 );
+	}
+#else
+	int nFile = open( "/dev/urandom", O_RDONLY );
+	if ( nFile >= 0 )
+	{
+		bOk = read( nFile, random, sizeof( random ) ) == (int)sizeof( random );
+		close( nFile );
+	}
+#endif
+	if ( !bOk )
+		Error( "LocalDist: can't generate a session token, pass one with -disttoken.\n" );
+
+	Q_binarytohex( random, sizeof( random ), pOut, nOutLen );
+}
+
+
+//-----------------------------------------------------------------------------
+// Launching local workers
+//-----------------------------------------------------------------------------
+static bool IsLocalDistArg( const char *pArg, int &nValues )
+{
+	if ( !Q_stricmp( pArg, "-dist" ) || !Q_stricmp( pArg, "-distport" ) || !Q_stricmp( pArg, "-distworker" ) ||
+		 !Q_stricmp( pArg, "-disttoken" ) )
+	{
+		nValues = 1;
+		return true;
+	}
+	if ( !Q_stricmp( pArg, "-distlisten" ) )
+	{
+		nValues = 0;
+		return true;
+	}
+	return false;
+}
+
+static void LaunchWorker( int iWorker, int argc, char **argv, int nPort, const char *pLogBase )
+{
+	char szExe[MAX_PATH];
+	GetExeName( szExe, sizeof( szExe ), argv[0] );
+
+	char szMaster[64];
+	Q_snprintf( szMaster, sizeof( szMaster ), "127.0.0.1:%d", nPort );
+
+	char szLogFile[MAX_PATH];
+	Q_snprintf( szLogFile, sizeof( szLogFile ), "%s_distworker%d.log", pLogBase, iWorker );
+
+	// Same command line, minus the -dist options, plus -disttoken and -distworker before the map name.
+	CUtlVector<const char *> args;
+	args.AddToTail( szExe );
+	for ( int i = 1; i < argc - 1; i++ )
+	{
+		int nValues;
+		if ( IsLocalDistArg( argv[i], nValues ) )
+		{
+			i += nValues;
+			continue;
+		}
+		args.AddToTail( argv[i] );
+	}
+	args.AddToTail( "-disttoken" );
+	args.AddToTail( g_szLocalDistToken );
+	args.AddToTail( "-distworker" );
+	args.AddToTail( szMaster );
+	args.AddToTail( argv[argc - 1] );
+
+#ifdef _WIN32
+	CUtlVector<char> cmdLine;
+	for ( int i = 0; i < args.Count(); i++ )
+	{
+		if ( i )
+			cmdLine.AddToTail( ' ' );
+		cmdLine.AddToTail( '\"' );
+		cmdLine.AddMultipleToTail( Q_strlen( args[i] ), args[i] );
+		cmdLine.AddToTail( '\"' );
+	}
+	cmdLine.AddToTail( 0 );
+
+	SECURITY_ATTRIBUTES sa;
+	memset( &sa, 0, sizeof( sa ) );
+	sa.nLength = sizeof( sa );
+	sa.bInheritHandle = TRUE;
+	HANDLE hLog = CreateFile( szLogFile, GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+
+	STARTUPINFO si;
+	memset( &si, 0, sizeof( si ) );
+	si.cb = sizeof( si );
+	if ( hLog != INVALID_HANDLE_VALUE )
+	{
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = GetStdHandle( STD_INPUT_HANDLE );
+		si.hStdOutput = hLog;
+		si.hStdError = hLog;
+	}
+
+	PROCESS_INFORMATION pi;
+	if ( !CreateProcess( szExe, cmdLine.Base(), NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi ) )
+	{
+		Warning( "LocalDist: can't start worker %d (%s).\n", iWorker, szExe );
+	}
+	else
+	{
+		CloseHandle( pi.hThread );
+		CloseHandle( pi.hProcess );
+	}
+
+	if ( hLog != INVALID_HANDLE_VALUE )
+		CloseHandle( hLog );
+#else
+	args.AddToTail( NULL );
+
+	pid_t pid = fork();
+	if ( pid == 0 )
+	{
+		int nLog = open( szLogFile, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if ( nLog >= 0 )
+		{
+			dup2( nLog, 1 );
+			dup2( nLog, 2 );
+			close( nLog );
+		}
+		close( s_ListenSocket );
+		execv( szExe, (char * const *)args.Base() );
+		_exit( 1 );
+	}
+	else if ( pid < 0 )
+	{
+		Warning( "LocalDist: can't start worker %d (%s).\n", iWorker, szExe );
+	}
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// Master
+//-----------------------------------------------------------------------------
+static void StartMaster( int argc, char **argv, const char *pLogBase )
+{
+	// Anyone who can reach the port could otherwise send the master results.
+	if ( !g_szLocalDistToken[0] )
+	{
+		if ( g_bLocalDistListen )
+			Error( "LocalDist: -distlisten needs -disttoken <secret>, which the workers on other machines pass too.\n" );
+
+		GenerateToken( g_szLocalDistToken, sizeof( g_szLocalDistToken ) );
+	}
+
+	if ( g_nLocalDistWorkers > LOCALDIST_MAX_WORKERS )
+	{
+		Warning( "LocalDist: at most %d workers, starting that many.\n", LOCALDIST_MAX_WORKERS );
+		g_nLocalDistWorkers = LOCALDIST_MAX_WORKERS;
+	}
+
+	s_ListenSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	if ( s_ListenSocket == INVALID_SOCKET )
+		Error( "LocalDist: can't create the listen socket.\n" );
+
+	int nReuse = 1;
+	setsockopt( s_ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof( nReuse ) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( g_bLocalDistListen ? INADDR_ANY : INADDR_LOOPBACK );
+	addr.sin_port = htons( (unsigned short)g_nLocalDistPort );
+	if ( bind( s_ListenSocket, (sockaddr *)&addr, sizeof( addr ) ) != 0 || listen( s_ListenSocket, 16 ) != 0 )
+		Error( "LocalDist: can't listen on port %d.\n", g_nLocalDistPort );
+
+#ifdef _WIN32
+	int nAddrLen = sizeof( addr );
+	u_long nNonBlocking = 1;
+	ioctlsocket( s_ListenSocket, FIONBIO, &nNonBlocking );
+#else
+	socklen_t nAddrLen = sizeof( addr );
+	fcntl( s_ListenSocket, F_SETFL, fcntl( s_ListenSocket, F_GETFL, 0 ) | O_NONBLOCK );
+#endif
+	getsockname( s_ListenSocket, (sockaddr *)&addr, &nAddrLen );
+	int nPort = ntohs( addr.sin_port );
+
+	Msg( "Distributing work over port %d%s, starting %d local workers.\n", nPort, g_bLocalDistListen ? " (open to other machines)" : "", g_nLocalDistWorkers );
+	for ( int i = 0; i < g_nLocalDistWorkers; i++ )
+	{
+		LaunchWorker( i, argc, argv, nPort, pLogBase );
+	}
+}
+
+static void DropWorker( int iIndex, const char *pReason )
+{
+	CLocalDistConnection *pWorker = s_Workers[iIndex];
+
+	// Whatever it was working on goes back in the queue.
+	if ( s_bInStage )
+	{
+		AUTO_LOCK( s_StageMutex );
+		for ( int i = 0; i < pWorker->m_Assigned.Count(); i++ )
+		{
+			int iUnit = pWorker->m_Assigned[i];
+			if ( s_UnitState[iUnit] == UNIT_ASSIGNED )
+			{
+				s_UnitState[iUnit] = UNIT_QUEUED;
+				s_Queue.AddToTail( iUnit );
+			}
+		}
+	}
+
+	if ( pWorker->m_Assigned.Count() )
+		Warning( "\nLocalDist: worker %d %s, %d work units go back in the queue.\n", pWorker->m_iWorker, pReason, pWorker->m_Assigned.Count() );
+	else
+		qprintf( "\nLocalDist: worker %d %s.\n", pWorker->m_iWorker, pReason );
+
+	delete pWorker;
+	s_Workers.Remove( iIndex );
+}
+
+static void SendResult( CLocalDistConnection *pTo, int iUnit )
+{
+	LocalDistUnitHeader_t header;
+	header.m_iStage = s_iStage;
+	header.m_iWorkUnit = iUnit;
+	pTo->Send( LOCALDIST_MSG_BROADCAST, &header, sizeof( header ), s_Results[iUnit].Base(), s_Results[iUnit].Count() );
+}
+
+static void OnWorkerReady( CLocalDistConnection *pWorker )
+{
+	if ( pWorker->m_iReadyStage < s_iStage )
+	{
+		// Joined too late for that stage.
+		int data[2] = { pWorker->m_iReadyStage, s_StageNeedsResults[pWorker->m_iReadyStage] };
+		pWorker->Send( LOCALDIST_MSG_STAGE_DONE, data, sizeof( data ) );
+		pWorker->m_iReadyStage = -1;
+		return;
+	}
+
+	if ( pWorker->m_iReadyStage == s_iStage && s_bInStage && s_bBroadcastResults )
+	{
+		// Catch up on the results so far.
+		for ( int iUnit = 0; iUnit < s_nWorkUnits; iUnit++ )
+		{
+			if ( s_UnitState[iUnit] == UNIT_DONE )
+				SendResult( pWorker, iUnit );
+		}
+	}
+}
+
+static void HandleWorkerMessage( int iIndex, int iType, CUtlBuffer &msg, LocalDistReceiveFn receiveFn )
+{
+	CLocalDistConnection *pWorker = s_Workers[iIndex];
+
+	if ( iType == LOCALDIST_MSG_HELLO )
+	{
+		int nVersion = 0;
+		char szToken[sizeof( g_szLocalDistToken )];
+		char szMapName[MAX_PATH];
+		msg.Get( &nVersion, sizeof( nVersion ) );
+		msg.GetString( szToken, sizeof( szToken ) );
+		msg.GetString( szMapName, sizeof( szMapName ) );
+		if ( !msg.IsValid() || Q_strcmp( szToken, g_szLocalDistToken ) )
+		{
+			DropWorker( iIndex, "has the wrong -disttoken" );
+			return;
+		}
+		if ( nVersion != LOCALDIST_VERSION || Q_stricmp( szMapName, s_szMapName ) )
+		{
+			DropWorker( iIndex, "is running a different job" );
+			return;
+		}
+
+		pWorker->m_bHello = true;
+		qprintf( "\nLocalDist: worker %d connected.\n", pWorker->m_iWorker );
+	}
+	else if ( iType == LOCALDIST_MSG_READY && pWorker->m_bHello )
+	{
+		int iStage = -1;
+		int nThreads = 0;
+		msg.Get( &iStage, sizeof( iStage ) );
+		msg.Get( &nThreads, sizeof( nThreads ) );
+		if ( !msg.IsValid() || iStage < 0 || iStage > s_iStage )
+		{
+			DropWorker( iIndex, "sent a bad ready message" );
+			return;
+		}
+
+		pWorker->m_iReadyStage = iStage;
+		pWorker->m_nThreads = clamp( nThreads, 1, MAX_TOOL_THREADS );
+		OnWorkerReady( pWorker );
+	}
+	else if ( iType == LOCALDIST_MSG_RESULT && pWorker->m_bHello )
+	{
+		LocalDistUnitHeader_t header;
+		msg.Get( &header, sizeof( header ) );
+		if ( !msg.IsValid() || !s_bInStage || header.m_iStage != s_iStage || header.m_iWorkUnit < 0 || header.m_iWorkUnit >= s_nWorkUnits )
+			return;
+
+		int iUnit = header.m_iWorkUnit;
+		pWorker->m_Assigned.FindAndFastRemove( iUnit );
+
+		// A unit that went back in the queue may have been done twice, the first result wins.
+		bool bNew;
+		{
+			AUTO_LOCK( s_StageMutex );
+			bNew = ( s_UnitState[iUnit] != UNIT_DONE );
+			if ( bNew )
+			{
+				s_UnitState[iUnit] = UNIT_DONE;
+
+				// It may have been queued again when this worker was thought to be stuck.
+				s_Queue.FindAndRemove( iUnit );
+			}
+		}
+
+		if ( !bNew )
+			return;
+
+		int nResultBytes = msg.GetBytesRemaining();
+		if ( s_bBroadcastResults )
+		{
+			s_Results[iUnit].CopyArray( (const byte *)msg.PeekGet(), nResultBytes );
+			for ( int i = 0; i < s_Workers.Count(); i++ )
+			{
+				if ( s_Workers[i] != pWorker && s_Workers[i]->m_iReadyStage == s_iStage )
+					SendResult( s_Workers[i], iUnit );
+			}
+		}
+
+		receiveFn( iUnit, msg, pWorker->m_iWorker );
+		++pWorker->m_nUnitsDone;
+
+		AUTO_LOCK( s_StageMutex );
+		++s_nUnitsDone;
+	}
+}
+
+static void AssignWork()
+{
+	for ( int i = 0; i < s_Workers.Count(); i++ )
+	{
+		CLocalDistConnection *pWorker = s_Workers[i];
+		if ( pWorker->m_iReadyStage != s_iStage )
+			continue;
+
+		while ( pWorker->m_Assigned.Count() < pWorker->m_nThreads * LOCALDIST_UNITS_PER_THREAD )
+		{
+			int iUnit;
+			{
+				AUTO_LOCK( s_StageMutex );
+				if ( !s_Queue.Count() )
+					return;
+
+				iUnit = s_Queue.Tail();
+				s_Queue.RemoveMultipleFromTail( 1 );
+				s_UnitState[iUnit] = UNIT_ASSIGNED;
+			}
+
+			pWorker->m_Assigned.AddToTail( iUnit );
+
+			LocalDistUnitHeader_t header;
+			header.m_iStage = s_iStage;
+			header.m_iWorkUnit = iUnit;
+			pWorker->Send( LOCALDIST_MSG_WORK, &header, sizeof( header ) );
+		}
+	}
+}
+
+// Accept new workers, send and receive what's waiting and drop workers that went away.
+static void PollWorkers( LocalDistReceiveFn receiveFn, int nTimeoutMS )
+{
+	fd_set readSet, writeSet;
+	FD_ZERO( &readSet );
+	FD_ZERO( &writeSet );
+	FD_SET( s_ListenSocket, &readSet );
+	SOCKET maxSocket = s_ListenSocket;
+	for ( int i = 0; i < s_Workers.Count(); i++ )
+	{
+		FD_SET( s_Workers[i]->m_Socket, &readSet );
+		if ( s_Workers[i]->HasQueuedSends() )
+			FD_SET( s_Workers[i]->m_Socket, &writeSet );
+		maxSocket = MAX( maxSocket, s_Workers[i]->m_Socket );
+	}
+
+	timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = nTimeoutMS * 1000;
+	if ( select( (int)maxSocket + 1, &readSet, &writeSet, NULL, &tv ) <= 0 )
+		return;
+
+	if ( FD_ISSET( s_ListenSocket, &readSet ) )
+	{
+		SOCKET s = accept( s_ListenSocket, NULL, NULL );
+#ifndef _WIN32
+		// FD_SET can't take a descriptor past FD_SETSIZE.
+		if ( s != INVALID_SOCKET && s >= FD_SETSIZE )
+		{
+			closesocket( s );
+			s = INVALID_SOCKET;
+		}
+#endif
+		if ( s != INVALID_SOCKET && s_Workers.Count() >= LOCALDIST_MAX_WORKERS )
+		{
+			Warning( "\nLocalDist: already have %d workers, turning another one away.\n", LOCALDIST_MAX_WORKERS );
+			closesocket( s );
+		}
+		else if ( s != INVALID_SOCKET )
+		{
+			CLocalDistConnection *pWorker = new CLocalDistConnection( s );
+			pWorker->m_iWorker = s_nNextWorker++;
+			s_Workers.AddToTail( pWorker );
+		}
+	}
+
+	for ( int i = s_Workers.Count(); --i >= 0; )
+	{
+		CLocalDistConnection *pWorker = s_Workers[i];
+		if ( !pWorker->Receive() || !pWorker->Flush() )
+		{
+			DropWorker( i, "disconnected" );
+			continue;
+		}
+
+		int iType;
+		CUtlBuffer msg;
+		while ( i < s_Workers.Count() && s_Workers[i] == pWorker && pWorker->GetMessage( iType, msg ) )
+		{
+			HandleWorkerMessage( i, iType, msg, receiveFn );
+		}
+
+		if ( i < s_Workers.Count() && s_Workers[i] == pWorker )
+		{
+			if ( pWorker->IsCorrupt() )
+			{
+				DropWorker( i, "sent a malformed message" );
+			}
+			else if ( !pWorker->m_bHello && Plat_FloatTime() - pWorker->m_flConnected > LOCALDIST_CONNECT_TIMEOUT )
+			{
+				// Connections that never say who they are would hold a worker slot forever.
+				DropWorker( i, "never said hello" );
+			}
+		}
+	}
+}
+
+static void MasterThread( int iThread, void *pUserData )
+{
+	CUtlBuffer buf;
+	while ( 1 )
+	{
+		int iUnit = -1;
+		{
+			AUTO_LOCK( s_StageMutex );
+			if ( s_nUnitsDone == s_nWorkUnits )
+				break;
+
+			if ( s_Queue.Count() )
+			{
+				iUnit = s_Queue.Tail();
+				s_Queue.RemoveMultipleFromTail( 1 );
+				s_UnitState[iUnit] = UNIT_ASSIGNED;
+			}
+		}
+
+		// Wait for units held by workers to come back or be queued again.
+		if ( iUnit < 0 )
+		{
+			ThreadSleep( 5 );
+			continue;
+		}
+
+		buf.Clear();
+		s_pProcessFn( iThread, iUnit, s_bBroadcastResults ? &buf : NULL );
+
+		AUTO_LOCK( s_StageMutex );
+		if ( s_bBroadcastResults )
+		{
+			s_Results[iUnit].CopyArray( (const byte *)buf.Base(), buf.TellPut() );
+			s_FinishedUnits.AddToTail( iUnit );
+		}
+		s_UnitState[iUnit] = UNIT_DONE;
+		++s_nUnitsDone;
+	}
+}
+
+static double MasterDistributeWork( LocalDistReceiveFn receiveFn )
+{
+	double flStart = Plat_FloatTime();
+
+	RunThreads_Start( MasterThread, NULL );
+
+	// Workers that got here before us.
+	for ( int i = 0; i < s_Workers.Count(); i++ )
+	{
+		if ( s_Workers[i]->m_iReadyStage == s_iStage )
+			OnWorkerReady( s_Workers[i] );
+	}
+
+	int nLocalUnits = 0;
+	CUtlVector<int> finished;
+	while ( 1 )
+	{
+		AssignWork();
+		PollWorkers( receiveFn, 10 );
+
+		int nUnitsDone;
+		{
+			AUTO_LOCK( s_StageMutex );
+			finished.Swap( s_FinishedUnits );
+			nUnitsDone = s_nUnitsDone;
+		}
+
+		// Pass on what our own threads did.
+		for ( int i = 0; i < finished.Count(); i++ )
+		{
+			for ( int j = 0; j < s_Workers.Count(); j++ )
+			{
+				if ( s_Workers[j]->m_iReadyStage == s_iStage )
+					SendResult( s_Workers[j], finished[i] );
+			}
+		}
+		nLocalUnits += finished.Count();
+		finished.RemoveAll();
+
+		// Workers that hold work but have stopped talking are presumed dead.
+		double flNow = Plat_FloatTime();
+		for ( int i = s_Workers.Count(); --i >= 0; )
+		{
+			if ( s_Workers[i]->m_Assigned.Count() && flNow - s_Workers[i]->m_flLastHeard > LOCALDIST_WORKER_TIMEOUT )
+				DropWorker( i, "stopped responding" );
+		}
+
+		UpdatePacifier( (float)nUnitsDone / s_nWorkUnits );
+
+		if ( nUnitsDone == s_nWorkUnits )
+			break;
+	}
+
+	RunThreads_End();
+
+	int data[2] = { s_iStage, 0 };
+	for ( int i = s_Workers.Count(); --i >= 0; )
+	{
+		CLocalDistConnection *pWorker = s_Workers[i];
+		if ( pWorker->m_iReadyStage == s_iStage )
+		{
+			if ( pWorker->m_nUnitsDone )
+				qprintf( "\nLocalDist: worker %d did %d work units.", pWorker->m_iWorker, pWorker->m_nUnitsDone );
+
+			pWorker->Send( LOCALDIST_MSG_STAGE_DONE, data, sizeof( data ) );
+			pWorker->m_iReadyStage = -1;
+			pWorker->m_nUnitsDone = 0;
+			pWorker->m_Assigned.RemoveAll();
+		}
+
+	}
+
+	// Make sure the workers hear the stage is over before we go off and do something else.
+	double flFlushStart = Plat_FloatTime();
+	while ( Plat_FloatTime() - flFlushStart < LOCALDIST_WORKER_TIMEOUT )
+	{
+		bool bQueued = false;
+		for ( int i = 0; i < s_Workers.Count(); i++ )
+		{
+			bQueued = bQueued || s_Workers[i]->HasQueuedSends();
+		}
+		if ( !bQueued )
+			break;
+
+		PollWorkers( receiveFn, 10 );
+	}
+
+	return Plat_FloatTime() - flStart;
+}
+
+
+//-----------------------------------------------------------------------------
+// Worker
+//-----------------------------------------------------------------------------
+static void StartWorker()
+{
+	char szHost[256];
+	Q_strncpy( szHost, g_szLocalDistMaster, sizeof( szHost ) );
+	char *pPort = strrchr( szHost, ':' );
+	if ( !pPort )
+		Error( "LocalDist: expected <host:port> after -distworker, got '%s'.\n", g_szLocalDistMaster );
+	*pPort++ = 0;
+
+	hostent *pHost = gethostbyname( szHost );
+	if ( !pHost || pHost->h_addrtype != AF_INET )
+		Error( "LocalDist: can't resolve '%s'.\n", szHost );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	memcpy( &addr.sin_addr, pHost->h_addr_list[0], sizeof( addr.sin_addr ) );
+	addr.sin_port = htons( (unsigned short)atoi( pPort ) );
+
+	// The master may still be starting up.
+	double flStart = Plat_FloatTime();
+	SOCKET s;
+	while ( 1 )
+	{
+		s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+		if ( s != INVALID_SOCKET && connect( s, (sockaddr *)&addr, sizeof( addr ) ) == 0 )
+			break;
+
+		if ( s != INVALID_SOCKET )
+			closesocket( s );
+
+		if ( Plat_FloatTime() - flStart > LOCALDIST_CONNECT_TIMEOUT )
+			Error( "LocalDist: can't connect to the master at %s.\n", g_szLocalDistMaster );
+
+		ThreadSleep( 500 );
+	}
+
+	s_pMaster = new CLocalDistConnection( s );
+
+	CUtlBuffer hello;
+	hello.PutInt( LOCALDIST_VERSION );
+	hello.PutString( g_szLocalDistToken );
+	hello.PutString( s_szMapName );
+	s_pMaster->Send( LOCALDIST_MSG_HELLO, hello.Base(), hello.TellPut() );
+
+	Msg( "Working for the master at %s.\n", g_szLocalDistMaster );
+}
+
+static void LostMaster()
+{
+	Warning( "\nLocalDist: lost the connection to the master, exiting.\n" );
+	CmdLib_Exit( 1 );
+}
+
+static void WorkerThread( int iThread, void *pUserData )
+{
+	CUtlBuffer buf;
+	while ( 1 )
+	{
+		int iUnit = -1;
+		{
+			AUTO_LOCK( s_StageMutex );
+			if ( s_bStageDone )
+				break;
+
+			if ( s_Queue.Count() )
+			{
+				iUnit = s_Queue.Tail();
+				s_Queue.RemoveMultipleFromTail( 1 );
+			}
+		}
+
+		if ( iUnit < 0 )
+		{
+			ThreadSleep( 1 );
+			continue;
+		}
+
+		buf.Clear();
+		s_pProcessFn( iThread, iUnit, &buf );
+
+		AUTO_LOCK( s_StageMutex );
+		if ( s_bStageDone )
+			break;
+
+		LocalDistUnitHeader_t header;
+		header.m_iStage = s_iStage;
+		header.m_iWorkUnit = iUnit;
+		s_pMaster->Send( LOCALDIST_MSG_RESULT, &header, sizeof( header ), buf.Base(), buf.TellPut() );
+	}
+}
+
+static double WorkerDistributeWork( LocalDistReceiveFn receiveFn )
+{
+	double flStart = Plat_FloatTime();
+
+	int ready[2] = { s_iStage, numthreads };
+	s_pMaster->Send( LOCALDIST_MSG_READY, ready, sizeof( ready ) );
+
+	RunThreads_Start( WorkerThread, NULL );
+
+	bool bMissedResults = false;
+	double flLastHeartbeat = flStart;
+	while ( 1 )
+	{
+		bool bConnected;
+		{
+			// Results are queued by the threads.
+			AUTO_LOCK( s_StageMutex );
+			bConnected = s_pMaster->Flush();
+		}
+
+		// The master may hang up right after telling us the stage is done.
+		bConnected = s_pMaster->Receive() && bConnected;
+
+		int iType;
+		CUtlBuffer msg;
+		bool bStageDone = false;
+		while ( !bStageDone && s_pMaster->GetMessage( iType, msg ) )
+		{
+			if ( iType == LOCALDIST_MSG_WORK )
+			{
+				LocalDistUnitHeader_t header;
+				msg.Get( &header, sizeof( header ) );
+				if ( header.m_iStage == s_iStage && header.m_iWorkUnit >= 0 && header.m_iWorkUnit < s_nWorkUnits )
+				{
+					AUTO_LOCK( s_StageMutex );
+					s_UnitState[header.m_iWorkUnit] = 1;
+					s_Queue.InsertBefore( 0, header.m_iWorkUnit );
+				}
+			}
+			else if ( iType == LOCALDIST_MSG_BROADCAST )
+			{
+				LocalDistUnitHeader_t header;
+				msg.Get( &header, sizeof( header ) );
+
+				// Units we were handed are ours already, or being written by one of our threads.
+				if ( header.m_iStage == s_iStage && header.m_iWorkUnit >= 0 && header.m_iWorkUnit < s_nWorkUnits && !s_UnitState[header.m_iWorkUnit] )
+				{
+					s_UnitState[header.m_iWorkUnit] = 1;
+					receiveFn( header.m_iWorkUnit, msg, -1 );
+				}
+			}
+			else if ( iType == LOCALDIST_MSG_STAGE_DONE )
+			{
+				int data[2];
+				msg.Get( data, sizeof( data ) );
+				if ( data[0] == s_iStage )
+				{
+					bMissedResults = ( data[1] != 0 );
+					bStageDone = true;
+				}
+			}
+		}
+
+		if ( bStageDone )
+			break;
+
+		if ( !bConnected || s_pMaster->IsCorrupt() )
+			LostMaster();
+
+		double flNow = Plat_FloatTime();
+		if ( flNow - flLastHeartbeat > LOCALDIST_HEARTBEAT )
+		{
+			AUTO_LOCK( s_StageMutex );
+			s_pMaster->Send( LOCALDIST_MSG_HEARTBEAT, NULL, 0 );
+			flLastHeartbeat = flNow;
+		}
+
+		fd_set readSet;
+		FD_ZERO( &readSet );
+		FD_SET( s_pMaster->m_Socket, &readSet );
+		timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 10 * 1000;
+		select( (int)s_pMaster->m_Socket + 1, &readSet, NULL, NULL, &tv );
+	}
+
+	{
+		AUTO_LOCK( s_StageMutex );
+		s_bStageDone = true;
+		s_Queue.RemoveAll();
+	}
+	RunThreads_End();
+
+	if ( bMissedResults )
+	{
+		Warning( "\nLocalDist: joined after the master finished a stage this worker needs, exiting.\n" );
+		CmdLib_Exit( 1 );
+	}
+
+	return Plat_FloatTime() - flStart;
+}
+
+
+//-----------------------------------------------------------------------------
+// Interface
+//-----------------------------------------------------------------------------
+static void LocalDist_Shutdown()
+{
+	for ( int i = 0; i < s_Workers.Count(); i++ )
+	{
+		delete s_Workers[i];
+	}
+	s_Workers.RemoveAll();
+
+	if ( s_ListenSocket != INVALID_SOCKET )
+	{
+		closesocket( s_ListenSocket );
+		s_ListenSocket = INVALID_SOCKET;
+	}
+
+	delete s_pMaster;
+	s_pMaster = NULL;
+}
+
+bool LocalDist_IsRequested()
+{
+	return g_nLocalDistWorkers > 0 || g_bLocalDistListen || g_szLocalDistMaster[0];
+}
+
+void LocalDist_Start( int argc, char **argv, const char *pLogBase )
+{
+	if ( !LocalDist_IsRequested() )
+		return;
+
+	InitSockets();
+	CmdLib_AtCleanup( LocalDist_Shutdown );
+	Q_FileBase( argv[argc - 1], s_szMapName, sizeof( s_szMapName ) );
+
+	if ( g_szLocalDistMaster[0] )
+	{
+		s_iMode = LOCALDIST_WORKER;
+		StartWorker();
+	}
+	else
+	{
+		s_iMode = LOCALDIST_MASTER;
+		StartMaster( argc, argv, pLogBase );
+	}
+}
+
+bool LocalDist_IsMaster()
+{
+	return s_iMode == LOCALDIST_MASTER;
+}
+
+bool LocalDist_IsWorker()
+{
+	return s_iMode == LOCALDIST_WORKER;
+}
+
+double LocalDist_DistributeWork( int nWorkUnits, LocalDistProcessFn processFn, LocalDistReceiveFn receiveFn, bool bBroadcastResults )
+{
+	Assert( s_iMode != LOCALDIST_NONE );
+
+	s_pProcessFn = processFn;
+	s_bBroadcastResults = bBroadcastResults;
+	s_nWorkUnits = nWorkUnits;
+	s_nUnitsDone = 0;
+	s_bStageDone = false;
+	s_Queue.RemoveAll();
+	s_FinishedUnits.RemoveAll();
+	s_UnitState.SetCount( nWorkUnits );
+	if ( nWorkUnits )
+		memset( s_UnitState.Base(), 0, nWorkUnits );
+	if ( s_iMode == LOCALDIST_MASTER && bBroadcastResults )
+		s_Results.SetCount( nWorkUnits );
+
+	double flElapsed = 0;
+	s_bInStage = true;
+	if ( s_iMode == LOCALDIST_MASTER )
+	{
+		// Hand out units in ascending order.
+		for ( int i = nWorkUnits; --i >= 0; )
+			s_Queue.AddToTail( i );
+
+		if ( nWorkUnits )
+			flElapsed = MasterDistributeWork( receiveFn );
+
+		s_StageNeedsResults.AddToTail( bBroadcastResults && nWorkUnits );
+	}
+	else
+	{
+		flElapsed = WorkerDistributeWork( receiveFn );
+	}
+	s_bInStage = false;
+
+	s_Results.Purge();
+	++s_iStage;
+	return flElapsed;
+}
+
+void LocalDist_WorkerExit()
+{
+	Assert( s_iMode == LOCALDIST_WORKER );
+	Msg( "Done with the distributed stages, exiting.\n" );
+	CmdLib_Exit( 0 );
+}
@@ -12,6 +12,7 @@
 #include "polylib.h"
 #include "worldsize.h"
 #include "threads.h"
+#include "toolarena.h"
 #include "tier0/dbg.h"
 
 // doesn't seem to need to be here? -- in threads.h
@@ -31,7 +32,7 @@ void pw(winding_t *w)
 		printf ("(%5.1f, %5.1f, %5.1f)\n",w->p[i][0], w->p[i][1],w->p[i][2]);
 }
 
-winding_t *winding_pool[MAX_POINTS_ON_WINDING+4];
+CToolArena g_WindingArena( "windings" );
 
 /*
 =============
@@ -50,18 +51,9 @@ winding_t *AllocWinding (int points)
 		if (c_active_windings > c_peak_windings)
 			c_peak_windings = c_active_windings;
 	}
-	ThreadLock();
-	if (winding_pool[points])
-	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
-	}
-	else
-	{
-		w = (winding_t *)malloc(sizeof(*w));
-		w->p = (Vector *)calloc( points, sizeof(Vector) );
-	}
-	ThreadUnlock();
+	// the points live right after the winding
+	w = (winding_t *)g_WindingArena.Alloc( sizeof(*w) + points*sizeof(Vector) );
+	w->p = (Vector *)(w + 1);
 	w->numpoints = 0; // None are occupied yet even though allocated.
 	w->maxpoints = points;
 	w->next = NULL;
@@ -73,11 +65,8 @@ void FreeWinding (winding_t *w)
 	if (w->numpoints == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
 	
-	ThreadLock();
 	w->numpoints = 0xdeaddead; // flag as freed
-	w->next = winding_pool[w->maxpoints];
-	winding_pool[w->maxpoints] = w;
-	ThreadUnlock();
+	g_WindingArena.Free( w );
 }
 
 /*
@@ -18,7 +18,8 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+// This is an upper bound, numthreads still defaults to the processor count.
+#define MAX_TOOL_THREADS	128
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -43,6 +44,10 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Returns the next work item for the calling thread, or -1 when the work is exhausted.
+// Items are handed out from a per-thread deque and stolen from other threads when it
+// runs dry, so the order in which items are returned is only roughly ascending.
 int	GetThreadWork (void);
 
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
@@ -53,6 +58,10 @@ void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *p
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority=k_eRunThreadsPriority_UseGlobalState );
 void RunThreads_End();
 
+// Runs fn on nThreads threads of its own and waits for them. Unlike RunThreads_Start this
+// can be called from a thread that RunThreadsOn started, and it doesn't touch numthreads.
+void RunThreadsNested( int nThreads, RunThreadsFn fn, void *pUserData );
+
 void ThreadLock (void);
 void ThreadUnlock (void);
 
@@ -0,0 +1,78 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Pools for the small objects the compile tools make and free by the
+//			million: windings, brushes, faces, nodes.
+//
+//			Objects are carved out of big blocks and recycled through free lists
+//			by size instead of going through malloc every time. A thread always
+//			works on the same one of a handful of stripes, each with its own
+//			lock, so threads rarely wait on each other. The blocks only go back
+//			to the system at the end of a stage that left nothing alive.
+//
+//=============================================================================//
+
+#ifndef TOOLARENA_H
+#define TOOLARENA_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "utlvector.h"
+
+
+#define ARENA_GRANULE		16
+#define ARENA_NUM_CLASSES	64				// objects up to 1k, bigger ones go straight to malloc
+#define ARENA_BLOCK_SIZE	(256*1024)
+#define ARENA_NUM_STRIPES	16
+
+
+class CToolArena
+{
+public:
+	CToolArena( const char *pName );
+
+	void	*Alloc( int nBytes );
+	void	Free( void *p );
+
+	// Prints what the arena did since the last stage, in verbose mode. If bRelease is set and
+	// nothing allocated from the arena is still alive, the blocks go back to the system.
+	// Call with no other threads using the arena.
+	void	EndStage( const char *pStageName, bool bRelease );
+
+private:
+	union Header_t
+	{
+		Header_t	*m_pNext;		// while free
+		int			m_iClass;		// while allocated, -1 if it came from malloc
+		double		m_Align;
+	};
+
+	struct Stripe_t
+	{
+		CThreadFastMutex	m_Mutex;
+		Header_t			*m_pFree[ARENA_NUM_CLASSES];
+		byte				*m_pCur;
+		int					m_nCurLeft;
+		CUtlVector<byte *>	m_Blocks;
+		int					m_nAllocs;
+		int					m_nFrees;
+		int					m_nBigAllocs;
+	};
+
+	Stripe_t	&GetStripe();
+
+	const char	*m_pName;
+	Stripe_t	m_Stripes[ARENA_NUM_STRIPES];
+	int			m_nStageAllocs;			// allocs at the end of the last stage
+
+	CToolArena	*m_pNextArena;
+	friend void ToolArena_EndStage( const char *pStageName, bool bRelease );
+};
+
+
+// EndStage on every arena.
+void ToolArena_EndStage( const char *pStageName, bool bRelease = false );
+
+
+#endif // TOOLARENA_H
@@ -651,12 +651,192 @@ qboolean BrushGE (bspbrush_t *b1, bspbrush_t *b2)
 	return false;
 }
 
+/*
+=================
+Chop grid
+
+Broad phase for ChopBrushes. Brushes are hashed into a uniform grid by their
+bounds, so finding the brushes that might touch one only looks at its cells
+instead of the whole list. Brushes that would cover too many cells go on a
+list that's checked every time.
+=================
+*/
+#define CHOP_MAX_CELLS	64
+
+struct chopentry_t
+{
+	bspbrush_t	*brush;		// NULL once it's kept or freed
+	int			order;		// position in the list as of the last restart
+	int			stamp;		// last query that found it
+};
+
+class CChopGrid
+{
+public:
+	void Init (bspbrush_t *list)
+	{
+		int		count = 0;
+		vec_t	size = 0;
+		for (bspbrush_t *b = list ; b ; b = b->next)
+		{
+			vec_t largest = 0;
+			for (int i = 0 ; i < 3 ; i++)
+			{
+				if (b->maxs[i] - b->mins[i] > largest)
+					largest = b->maxs[i] - b->mins[i];
+			}
+			size += largest;
+			count++;
+		}
+
+		// cells about as big as an average brush
+		m_CellSize = count ? size / count : 64;
+		m_CellSize = clamp (m_CellSize, 64.0f, 4096.0f);
+
+		int numbuckets = 256;
+		while (numbuckets < count*2)
+			numbuckets <<= 1;
+		m_Buckets.SetCount (numbuckets);
+		m_QueryStamp = 0;
+
+		for (bspbrush_t *b = list ; b ; b = b->next)
+			Add (b);
+	}
+
+	void Add (bspbrush_t *b)
+	{
+		int			mins[3], maxs[3];
+		chopentry_t	&entry = m_Entries[m_Entries.AddToTail()];
+
+		b->chopindex = m_Entries.Count() - 1;
+		entry.brush = b;
+		entry.order = 0;
+		entry.stamp = 0;
+
+		if (CellBounds (b, mins, maxs) > CHOP_MAX_CELLS)
+		{
+			m_Big.AddToTail (b->chopindex);
+			return;
+		}
+
+		for (int x = mins[0] ; x <= maxs[0] ; x++)
+			for (int y = mins[1] ; y <= maxs[1] ; y++)
+				for (int z = mins[2] ; z <= maxs[2] ; z++)
+					m_Buckets[Hash (x, y, z)].AddToTail (b->chopindex);
+	}
+
+	void Remove (bspbrush_t *b)
+	{
+		m_Entries[b->chopindex].brush = NULL;
+	}
+
+	void SetOrder (bspbrush_t *b, int order)
+	{
+		m_Entries[b->chopindex].order = order;
+	}
+
+	// Every brush still in the list after b whose bounds overlap b's, in list order.
+	void FindCandidates (bspbrush_t *b, CUtlVector<bspbrush_t *> &candidates)
+	{
+		int		mins[3], maxs[3];
+		int		i;
+
+		candidates.RemoveAll ();
+		m_QueryStamp++;
+		m_Entries[b->chopindex].stamp = m_QueryStamp;
+
+		for (i = 0 ; i < m_Big.Count() ; i++)
+			Consider (b, m_Big[i], candidates);
+
+		if (CellBounds (b, mins, maxs) > CHOP_MAX_CELLS)
+		{
+			// checking every brush is cheaper than all those cells
+			for (i = 0 ; i < m_Entries.Count() ; i++)
+				Consider (b, i, candidates);
+		}
+		else
+		{
+			for (int x = mins[0] ; x <= maxs[0] ; x++)
+				for (int y = mins[1] ; y <= maxs[1] ; y++)
+					for (int z = mins[2] ; z <= maxs[2] ; z++)
+					{
+						CUtlVector<int> &bucket = m_Buckets[Hash (x, y, z)];
+						for (i = 0 ; i < bucket.Count() ; i++)
+							Consider (b, bucket[i], candidates);
+					}
+		}
+
+		if (candidates.Count() > 1)
+		{
+			s_pSortEntries = m_Entries.Base();
+			qsort (candidates.Base(), candidates.Count(), sizeof(bspbrush_t *), CompareOrder);
+		}
+	}
+
+private:
+	int CellBounds (bspbrush_t *b, int *mins, int *maxs)
+	{
+		int cells = 1;
+		for (int i = 0 ; i < 3 ; i++)
+		{
+			mins[i] = (int)floor (b->mins[i] / m_CellSize);
+			maxs[i] = (int)floor (b->maxs[i] / m_CellSize);
+			cells *= maxs[i] - mins[i] + 1;
+		}
+		return cells;
+	}
+
+	int Hash (int x, int y, int z)
+	{
+		return ((x * 73856093) ^ (y * 19349663) ^ (z * 83492791)) & (m_Buckets.Count() - 1);
+	}
+
+	void Consider (bspbrush_t *b, int index, CUtlVector<bspbrush_t *> &candidates)
+	{
+		chopentry_t	&entry = m_Entries[index];
+		if (!entry.brush || entry.stamp == m_QueryStamp)
+			return;
+		entry.stamp = m_QueryStamp;
+
+		if (entry.order <= m_Entries[b->chopindex].order)
+			return;		// b allready had its turn against it
+
+		// same test as the start of BrushesDisjoint
+		for (int i = 0 ; i < 3 ; i++)
+		{
+			if (b->mins[i] >= entry.brush->maxs[i] || b->maxs[i] <= entry.brush->mins[i])
+				return;
+		}
+		candidates.AddToTail (entry.brush);
+	}
+
+	static int CompareOrder (const void *a, const void *b)
+	{
+		return s_pSortEntries[(*(bspbrush_t **)a)->chopindex].order - s_pSortEntries[(*(bspbrush_t **)b)->chopindex].order;
+	}
+
+	float						m_CellSize;
+	CUtlVector<chopentry_t>		m_Entries;
+	CUtlVector< CUtlVector<int> >	m_Buckets;
+	CUtlVector<int>				m_Big;
+	int							m_QueryStamp;
+
+	static chopentry_t			*s_pSortEntries;
+};
+
+chopentry_t *CChopGrid::s_pSortEntries = NULL;
+
+
 /*
 =================
 ChopBrushes
 
 Carves any intersecting solid brushes into the minimum number
 of non-intersecting brushes. 
+
+b1 is only tested against the brushes the grid says overlap it, in the
+order they are in the list, so it meets them in the same order as when it
+was tested against the whole list and the output doesn't change.
 =================
 */
 bspbrush_t *ChopBrushes (bspbrush_t *head)
@@ -666,6 +846,9 @@ bspbrush_t *ChopBrushes (bspbrush_t *head)
 	bspbrush_t	*keep;
 	bspbrush_t	*sub, *sub2;
 	int			c1, c2;
+	int			i, order;
+	CChopGrid	grid;
+	CUtlVector<bspbrush_t *>	candidates;
 
 	qprintf ("---- ChopBrushes ----\n");
 	qprintf ("original brushes: %i\n", CountBrushList (head));
@@ -675,19 +858,24 @@ bspbrush_t *ChopBrushes (bspbrush_t *head)
 		WriteBrushList ("before.gl", head, false);
 #endif
 	keep = NULL;
+	grid.Init (head);
 
 newlist:
 	// find tail
 	if (!head)
 		return NULL;
+	order = 0;
 	for (tail=head ; tail->next ; tail=tail->next)
-	;
+		grid.SetOrder (tail, order++);
+	grid.SetOrder (tail, order);
 
 	for (b1=head ; b1 ; b1=next)
 	{
 		next = b1->next;
-		for (b2=b1->next ; b2 ; b2 = b2->next)
+		grid.FindCandidates (b1, candidates);
+		for (i=0 ; i<candidates.Count() ; i++)
 		{
+			b2 = candidates[i];
 			if (BrushesDisjoint (b1, b2))
 				continue;
 
@@ -704,6 +892,7 @@ newlist:
 					continue;		// didn't really intersect
 				if (!sub)
 				{	// b1 is swallowed by b2
+					grid.Remove (b1);
 					head = CullList (b1, b1);
 					goto newlist;
 				}
@@ -719,6 +908,7 @@ newlist:
 				if (!sub2)
 				{	// b2 is swallowed by b1
 					FreeBrushList (sub);
+					grid.Remove (b2);
 					head = CullList (b1, b2);
 					goto newlist;
 				}
@@ -749,7 +939,10 @@ newlist:
 			{
 				if (sub2)
 					FreeBrushList (sub2);
+				for (b2=sub ; b2 ; b2=b2->next)
+					grid.Add (b2);
 				tail = AddBrushListToTail (sub, tail);
+				grid.Remove (b1);
 				head = CullList (b1, b1);
 				goto newlist;
 			}
@@ -757,14 +950,18 @@ newlist:
 			{
 				if (sub)
 					FreeBrushList (sub);
+				for (sub=sub2 ; sub ; sub=sub->next)
+					grid.Add (sub);
 				tail = AddBrushListToTail (sub2, tail);
+				grid.Remove (b2);
 				head = CullList (b1, b2);
 				goto newlist;
 			}
 		}
 
-		if (!b2)
+		if (i == candidates.Count())
 		{	// b1 is no longer intersecting anything, so keep it
+			grid.Remove (b1);
 			b1->next = keep;
 			keep = b1;
 		}
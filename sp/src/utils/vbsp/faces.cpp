@@ -51,54 +51,98 @@ int		firstmodelface;
 
 int	c_tryedges;
 
-Vector	edge_dir;
-Vector	edge_start;
-vec_t	edge_len;
-
-int		num_edge_verts;
-int		edge_verts[MAX_MAP_VERTS];
-
 
 float	g_maxLightmapDimension = 32;
 
+// Size of the cells vertexes are hashed into for welding and t-junction fixing (-weldcell).
+// It only changes how fast those go, not what comes out of them.
+float	g_flWeldCellSize = 64;
 
-face_t *NewFaceFromFace (face_t *f);
 
-// Used to speed up GetEdge2(). Holds a list of edges connected to each vert.
-CUtlVector<int> g_VertEdgeList[MAX_MAP_VERTS];
+face_t *NewFaceFromFace (face_t *f);
 
 
 //===========================================================================
 
-typedef struct hashvert_s
+// Vertexes are hashed by the cube of space they're in. Cells are found through an open
+// addressing table, and each one chains the vertexes in it together through vertexchain[].
+typedef struct
 {
-	struct hashvert_s	*next;
-	int		num;
-} hashvert_t;
+	int		cell[3];
+	int		firstvert;		// newest vertex in the cell
+	int		generation;		// the slot is empty unless this is verthashgeneration
+} verthash_t;
 
-#define HASH_BITS	7
-#define	HASH_SIZE	(COORD_EXTENT>>HASH_BITS)
+#define	VERT_HASH_SIZE	(MAX_MAP_VERTS*2)
 
+verthash_t	verthash[VERT_HASH_SIZE];
+int			verthashgeneration = 1;
+vec_t		verthashscale = 1;				// 1 / cell size
+int			vertexchain[MAX_MAP_VERTS];		// the next vertex in a hash chain, or -1
 
-int	vertexchain[MAX_MAP_VERTS];		// the next vertex in a hash chain
-int	hashverts[HASH_SIZE*HASH_SIZE];	// a vertex number, or 0 for no verts
+//============================================================================
 
-//face_t		*edgefaces[MAX_MAP_EDGES][2];
 
-//============================================================================
+/*
+=============
+VertCell
 
+The cell boundaries are put half a unit off the integer grid,
+so vertexes on the grid are never close to one.
+=============
+*/
+inline int VertCell (vec_t v)
+{
+	return (int)floor ((v + MAX_COORD_INTEGER + 0.5) * verthashscale);
+}
 
-unsigned HashVec (Vector& vec)
+/*
+=============
+FindVertCell
+
+Returns NULL if the cell has never had a vertex in it, unless create is set.
+=============
+*/
+verthash_t *FindVertCell (int x, int y, int z, qboolean create)
 {
-	int			x, y;
+	unsigned	h;
+	verthash_t	*hv;
 
-	x = (MAX_COORD_INTEGER + (int)(vec[0]+0.5)) >> HASH_BITS;
-	y = (MAX_COORD_INTEGER + (int)(vec[1]+0.5)) >> HASH_BITS;
+	h = (unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^ (unsigned)z * 83492791u;
+	for ( ; ; h++)
+	{
+		hv = &verthash[h & (VERT_HASH_SIZE-1)];
+		if (hv->generation != verthashgeneration)
+			break;
+		if (hv->cell[0] == x && hv->cell[1] == y && hv->cell[2] == z)
+			return hv;
+	}
 
-	if ( x < 0 || x >= HASH_SIZE || y < 0 || y >= HASH_SIZE )
-		Error ("HashVec: point outside valid range");
-	
-	return y*HASH_SIZE + x;
+	// there are never more cells than vertexes, so the table can't fill up
+	if (!create)
+		return NULL;
+
+	hv->cell[0] = x;
+	hv->cell[1] = y;
+	hv->cell[2] = z;
+	hv->firstvert = -1;
+	hv->generation = verthashgeneration;
+	return hv;
+}
+
+/*
+=============
+ClearVertHash
+=============
+*/
+void ClearVertHash (void)
+{
+	COMPILE_TIME_ASSERT ((VERT_HASH_SIZE & (VERT_HASH_SIZE-1)) == 0);
+
+	if (g_flWeldCellSize < 1)
+		g_flWeldCellSize = 1;
+	verthashscale = 1.0 / g_flWeldCellSize;
+	verthashgeneration++;
 }
 
 #ifdef USE_HASHING
@@ -111,10 +155,11 @@ Uses hashing
 */
 int	GetVertexnum (Vector& in)
 {
-	int			h;
-	int			i;
+	int			i, x, y, z;
 	Vector		vert;
-	int			vnum;
+	int			vnum, bestvnum;
+	int			mins[3], maxs[3];
+	verthash_t	*hv;
 
 	c_totalverts++;
 
@@ -124,18 +169,44 @@ int	GetVertexnum (Vector& in)
 			vert[i] = (int)(in[i]+0.5);
 		else
 			vert[i] = in[i];
+
+		if (vert[i] < MIN_COORD_INTEGER || vert[i] > MAX_COORD_INTEGER)
+			Error ("GetVertexnum: outside world, vertex %.1f %.1f %.1f", vert.x, vert.y, vert.z);
+
+		// a match can only be in the cells within POINT_EPSILON
+		mins[i] = VertCell (vert[i] - POINT_EPSILON);
+		maxs[i] = VertCell (vert[i] + POINT_EPSILON);
 	}
-	
-	h = HashVec (vert);
-	
-	for (vnum=hashverts[h] ; vnum ; vnum=vertexchain[vnum])
+
+	// take the oldest match, so which cells the matches fall in doesn't matter
+	bestvnum = -1;
+	for (x=mins[0] ; x<=maxs[0] ; x++)
 	{
-		Vector& p = dvertexes[vnum].point;
-		if ( fabs(p[0]-vert[0])<POINT_EPSILON
-		&& fabs(p[1]-vert[1])<POINT_EPSILON
-		&& fabs(p[2]-vert[2])<POINT_EPSILON )
-			return vnum;
+		for (y=mins[1] ; y<=maxs[1] ; y++)
+		{
+			for (z=mins[2] ; z<=maxs[2] ; z++)
+			{
+				hv = FindVertCell (x, y, z, false);
+				if (!hv)
+					continue;
+
+				for (vnum=hv->firstvert ; vnum != -1 ; vnum=vertexchain[vnum])
+				{
+					if (bestvnum != -1 && vnum > bestvnum)
+						continue;
+
+					Vector& p = dvertexes[vnum].point;
+					if ( fabs(p[0]-vert[0])<POINT_EPSILON
+					&& fabs(p[1]-vert[1])<POINT_EPSILON
+					&& fabs(p[2]-vert[2])<POINT_EPSILON )
+						bestvnum = vnum;
+				}
+			}
+		}
 	}
+
+	if (bestvnum != -1)
+		return bestvnum;
 	
 // emit a vertex
 	if (numvertexes == MAX_MAP_VERTS)
@@ -145,8 +216,9 @@ int	GetVertexnum (Vector& in)
 	dvertexes[numvertexes].point[1] = vert[1];
 	dvertexes[numvertexes].point[2] = vert[2];
 
-	vertexchain[numvertexes] = hashverts[h];
-	hashverts[h] = numvertexes;
+	hv = FindVertCell (VertCell (vert[0]), VertCell (vert[1]), VertCell (vert[2]), true);
+	vertexchain[numvertexes] = hv->firstvert;
+	hv->firstvert = numvertexes;
 
 	c_uniqueverts++;
 
@@ -331,71 +403,125 @@ void EmitLeafFaceVertexes( face_t **ppLeafFaceList )
 }
 
 
+// What TestEdge works with while it breaks up one edge. Every thread fixing
+// t-junctions has its own.
+typedef struct
+{
+	Vector			edge_dir;
+	Vector			edge_start;
+	CUtlVector<int>	edge_verts;
+
+	int				superverts[MAX_SUPERVERTS];
+	int				numsuperverts;
+
+	int				degenerate;
+	int				tjunctions;
+} tjuncwork_t;
+
+int IntCompare (const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
 #ifdef USE_HASHING
 /*
 ==========
 FindEdgeVerts
 
-Uses the hash tables to cut down to a small number
+Uses the hash tables to cut down to a small number.
+The cells are walked a slab at a time along the major axis of the edge, and only
+the ones near the edge in each slab are looked at. Any vertex within OFF_EPSILON
+of the edge is in one of them.
 ==========
 */
-void FindEdgeVerts (Vector& v1, Vector& v2)
+void FindEdgeVerts (tjuncwork_t *work, Vector& v1, Vector& v2)
 {
-	int		x1, x2, y1, y2, t;
-	int		x, y;
-	int		vnum;
+	int			i, axis, slab;
+	int			x, y, z, vnum;
+	int			mins[3], maxs[3];
+	Vector		p1, p2, delta;
+	vec_t		lo, hi, t1, t2, a, b, pad;
+	verthash_t	*hv;
 
-#if 0
-{
-	int		i;
-	num_edge_verts = numvertexes-1;
-	for (i=0 ; i<numvertexes-1 ; i++)
-		edge_verts[i] = i+1;
-}
-#endif
+	work->edge_verts.RemoveAll ();
 
-	x1 = (MAX_COORD_INTEGER + (int)(v1[0]+0.5)) >> HASH_BITS;
-	y1 = (MAX_COORD_INTEGER + (int)(v1[1]+0.5)) >> HASH_BITS;
-	x2 = (MAX_COORD_INTEGER + (int)(v2[0]+0.5)) >> HASH_BITS;
-	y2 = (MAX_COORD_INTEGER + (int)(v2[1]+0.5)) >> HASH_BITS;
-
-	if (x1 > x2)
+	// go along the major axis the positive way
+	VectorSubtract (v2, v1, delta);
+	axis = 0;
+	for (i=1 ; i<3 ; i++)
 	{
-		t = x1;
-		x1 = x2;
-		x2 = t;
+		if (fabs(delta[i]) > fabs(delta[axis]))
+			axis = i;
 	}
-	if (y1 > y2)
+	if (delta[axis] >= 0)
 	{
-		t = y1;
-		y1 = y2;
-		y2 = t;
+		VectorCopy (v1, p1);
+		VectorCopy (v2, p2);
 	}
-#if 0
-	x1--;
-	x2++;
-	y1--;
-	y2++;
-	if (x1 < 0)
-		x1 = 0;
-	if (x2 >= HASH_SIZE)
-		x2 = HASH_SIZE;
-	if (y1 < 0)
-		y1 = 0;
-	if (y2 >= HASH_SIZE)
-		y2 = HASH_SIZE;
-#endif
-	num_edge_verts = 0;
-	for (x=x1 ; x <= x2 ; x++)
+	else
 	{
-		for (y=y1 ; y <= y2 ; y++)
+		VectorCopy (v2, p1);
+		VectorCopy (v1, p2);
+	}
+	VectorSubtract (p2, p1, delta);
+
+	pad = 2 * OFF_EPSILON;		// with room for rounding
+	for (slab=VertCell (p1[axis] - pad) ; slab<=VertCell (p2[axis] + pad) ; slab++)
+	{
+		// the part of the edge that's near this slab
+		lo = slab / verthashscale - MAX_COORD_INTEGER - 0.5 - pad;
+		hi = (slab+1) / verthashscale - MAX_COORD_INTEGER - 0.5 + pad;
+		t1 = 0;
+		t2 = 1;
+		if (delta[axis] > 0)
+		{
+			t1 = (lo - p1[axis]) / delta[axis];
+			t2 = (hi - p1[axis]) / delta[axis];
+			if (t1 < 0)
+				t1 = 0;
+			if (t2 > 1)
+				t2 = 1;
+		}
+
+		for (i=0 ; i<3 ; i++)
+		{
+			if (i == axis)
+			{
+				mins[i] = maxs[i] = slab;
+				continue;
+			}
+			a = p1[i] + t1 * delta[i];
+			b = p1[i] + t2 * delta[i];
+			if (a > b)
+			{
+				vec_t	t = a;
+				a = b;
+				b = t;
+			}
+			mins[i] = VertCell (a - pad);
+			maxs[i] = VertCell (b + pad);
+		}
+
+		for (x=mins[0] ; x<=maxs[0] ; x++)
 		{
-			for (vnum=hashverts[y*HASH_SIZE+x] ; vnum ; vnum=vertexchain[vnum])
+			for (y=mins[1] ; y<=maxs[1] ; y++)
 			{
-				edge_verts[num_edge_verts++] = vnum;
+				for (z=mins[2] ; z<=maxs[2] ; z++)
+				{
+					hv = FindVertCell (x, y, z, false);
+					if (!hv)
+						continue;
+
+					for (vnum=hv->firstvert ; vnum != -1 ; vnum=vertexchain[vnum])
+						work->edge_verts.AddToTail (vnum);
+				}
 			}
 		}
 	}
+
+	// TestEdge takes the first vertex it finds on the edge, so put them in
+	// the order the dumb search would have them in
+	qsort (work->edge_verts.Base(), work->edge_verts.Count(), sizeof(int), IntCompare);
 }
 
 #else
@@ -406,13 +532,13 @@ FindEdgeVerts
 Forced a dumb check of everything
 ==========
 */
-void FindEdgeVerts (Vector& v1, Vector& v2)
+void FindEdgeVerts (tjuncwork_t *work, Vector& v1, Vector& v2)
 {
 	int		i;
 
-	num_edge_verts = numvertexes-1;
-	for (i=0 ; i<num_edge_verts ; i++)
-		edge_verts[i] = i+1;
+	work->edge_verts.RemoveAll ();
+	for (i=1 ; i<numvertexes ; i++)
+		work->edge_verts.AddToTail (i);
 }
 #endif
 
@@ -423,7 +549,7 @@ TestEdge
 Can be recursively reentered
 ==========
 */
-void TestEdge (vec_t start, vec_t end, int p1, int p2, int startvert)
+void TestEdge (tjuncwork_t *work, vec_t start, vec_t end, int p1, int p2, int startvert)
 {
 	int		j, k;
 	vec_t	dist;
@@ -435,23 +561,23 @@ void TestEdge (vec_t start, vec_t end, int p1, int p2, int startvert)
 
 	if (p1 == p2)
 	{
-		c_degenerate++;
+		work->degenerate++;
 		return;		// degenerate edge
 	}
 
-	for (k=startvert ; k<num_edge_verts ; k++)
+	for (k=startvert ; k<work->edge_verts.Count() ; k++)
 	{
-		j = edge_verts[k];
+		j = work->edge_verts[k];
 		if (j==p1 || j == p2)
 			continue;
 
 		VectorCopy (dvertexes[j].point, p);
 
-		VectorSubtract (p, edge_start, delta);
-		dist = DotProduct (delta, edge_dir);
+		VectorSubtract (p, work->edge_start, delta);
+		dist = DotProduct (delta, work->edge_dir);
 		if (dist <=start || dist >= end)
 			continue;		// off an end
-		VectorMA (edge_start, dist, edge_dir, exact);
+		VectorMA (work->edge_start, dist, work->edge_dir, exact);
 		VectorSubtract (p, exact, off);
 		error = off.Length();
 
@@ -459,17 +585,17 @@ void TestEdge (vec_t start, vec_t end, int p1, int p2, int startvert)
 			continue;		// not on the edge
 
 		// break the edge
-		c_tjunctions++;
-		TestEdge (start, dist, p1, j, k+1);
-		TestEdge (dist, end, j, p2, k+1);
+		work->tjunctions++;
+		TestEdge (work, start, dist, p1, j, k+1);
+		TestEdge (work, dist, end, j, p2, k+1);
 		return;
 	}
 
 	// the edge p1 to p2 is now free of tjunctions
-	if (numsuperverts >= MAX_SUPERVERTS)
+	if (work->numsuperverts >= MAX_SUPERVERTS)
 		Error ("Edge with too many vertices due to t-junctions.  Max %d verts along an edge!\n", MAX_SUPERVERTS);
-	superverts[numsuperverts] = p1;
-	numsuperverts++;
+	work->superverts[work->numsuperverts] = p1;
+	work->numsuperverts++;
 }
 
 
@@ -578,46 +704,119 @@ void Triangulate_r( CUtlVector<int> &out, const CUtlVector<int> &inIndices, cons
 	Assert(0);
 }
 
+// A face to fix the t-junctions on. The edges are broken up on any thread, then the
+// faces are fixed on the main thread in the order they were found in, so the output
+// is the same however many threads there are.
+typedef struct
+{
+	face_t	**pList;
+	face_t	*f;
+
+	int		*superverts;
+	int		numsuperverts;
+	int		start[MAXEDGES];	// first supervert of each original edge
+	int		degenerate;
+	int		tjunctions;
+} tjuncface_t;
+
+typedef struct
+{
+	tjuncface_t		*faces;
+	int				numfaces;
+	long volatile	next;
+} tjuncjob_t;
+
+#define	TJUNC_MIN_THREADED_FACES	256
+
+
 /*
 ==================
-FixFaceEdges
+FindFaceTjuncs
 
+Breaks the face's edges on the vertexes that lie on them.
+Touches nothing but tf, so it can run on any thread.
 ==================
 */
-void FixFaceEdges (face_t **pList, face_t *f)
+void FindFaceTjuncs (tjuncwork_t *work, tjuncface_t *tf)
 {
 	int		p1, p2;
 	int		i;
 	Vector	e2;
 	vec_t	len;
-	int		count[MAX_SUPERVERTS], start[MAX_SUPERVERTS];
-	int		base;
-
-	if (f->merged || f->split[0] || f->split[1])
-		return;
+	face_t	*f;
 
-	numsuperverts = 0;
+	f = tf->f;
+	work->numsuperverts = 0;
+	work->degenerate = 0;
+	work->tjunctions = 0;
 
-	int originalPoints = f->numpoints;
 	for (i=0 ; i<f->numpoints ; i++)
 	{
 		p1 = f->vertexnums[i];
 		p2 = f->vertexnums[(i+1)%f->numpoints];
 
-		VectorCopy (dvertexes[p1].point, edge_start);
+		VectorCopy (dvertexes[p1].point, work->edge_start);
 		VectorCopy (dvertexes[p2].point, e2);
 
-		FindEdgeVerts (edge_start, e2);
+		FindEdgeVerts (work, work->edge_start, e2);
 
-		VectorSubtract (e2, edge_start, edge_dir);
-		len = VectorNormalize (edge_dir);
+		VectorSubtract (e2, work->edge_start, work->edge_dir);
+		len = VectorNormalize (work->edge_dir);
 
-		start[i] = numsuperverts;
-		TestEdge (0, len, p1, p2, 0);
-
-		count[i] = numsuperverts - start[i];
+		tf->start[i] = work->numsuperverts;
+		TestEdge (work, 0, len, p1, p2, 0);
 	}
 
+	tf->numsuperverts = work->numsuperverts;
+	tf->superverts = (int *)malloc (work->numsuperverts * sizeof(int));
+	memcpy (tf->superverts, work->superverts, work->numsuperverts * sizeof(int));
+	tf->degenerate = work->degenerate;
+	tf->tjunctions = work->tjunctions;
+}
+
+/*
+==================
+FindTjuncsThread
+==================
+*/
+void FindTjuncsThread (int iThread, void *pUserData)
+{
+	tjuncjob_t	*job = (tjuncjob_t *)pUserData;
+	tjuncwork_t	work;
+	int			i;
+
+	while ((i = ThreadInterlockedIncrement (&job->next) - 1) < job->numfaces)
+		FindFaceTjuncs (&work, &job->faces[i]);
+}
+
+/*
+==================
+FixFaceEdges
+
+Gives the face the vertexes FindFaceTjuncs found for it.
+==================
+*/
+void FixFaceEdges (tjuncface_t *tf)
+{
+	int		i;
+	int		count[MAXEDGES], *start;
+	int		base;
+	face_t	*f;
+
+	f = tf->f;
+	c_degenerate += tf->degenerate;
+	c_tjunctions += tf->tjunctions;
+
+	numsuperverts = tf->numsuperverts;
+	memcpy (superverts, tf->superverts, numsuperverts * sizeof(int));
+	free (tf->superverts);
+	tf->superverts = NULL;
+
+	int originalPoints = f->numpoints;
+	start = tf->start;
+	for (i=0 ; i<f->numpoints ; i++)
+		count[i] = (i+1 < f->numpoints ? start[i+1] : numsuperverts) - start[i];
+
 	if (numsuperverts < 3)
 	{	// entire face collapsed
 		f->numpoints = 0;
@@ -646,7 +845,7 @@ void FixFaceEdges (face_t **pList, face_t *f)
 	}
 
 	// this may fragment the face if > MAXEDGES
-	FaceFromSuperverts (pList, f, base);
+	FaceFromSuperverts (tf->pList, f, base);
 
 	// if this is the world, then re-triangulate to sew cracks
 	if ( f->badstartvert && entity_num == 0 )
@@ -696,10 +895,26 @@ void FixFaceEdges (face_t **pList, face_t *f)
 
 /*
 ==================
-FixEdges_r
+AddTjuncFace
 ==================
 */
-void FixEdges_r (node_t *node)
+void AddTjuncFace (CUtlVector<tjuncface_t> &faces, face_t **pList, face_t *f)
+{
+	if (f->merged || f->split[0] || f->split[1])
+		return;
+
+	tjuncface_t &tf = faces[faces.AddToTail()];
+	tf.pList = pList;
+	tf.f = f;
+	tf.superverts = NULL;
+}
+
+/*
+==================
+FindEdges_r
+==================
+*/
+void FindEdges_r (node_t *node, CUtlVector<tjuncface_t> &faces)
 {
 	int		i;
 	face_t	*f;
@@ -710,26 +925,54 @@ void FixEdges_r (node_t *node)
 	}
 
 	for (f=node->faces ; f ; f=f->next)
-		FixFaceEdges (&node->faces, f);
+		AddTjuncFace (faces, &node->faces, f);
 
 	for (i=0 ; i<2 ; i++)
-		FixEdges_r (node->children[i]);
+		FindEdges_r (node->children[i], faces);
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Fix the t-junctions on detail faces
+// Purpose: Find the t-junctions on detail faces
 //-----------------------------------------------------------------------------
-void FixLeafFaceEdges( face_t **ppLeafFaceList )
+void FindLeafFaceEdges( face_t **ppLeafFaceList, CUtlVector<tjuncface_t> &faces )
 {
 	face_t *f;
 
 	for ( f = *ppLeafFaceList; f; f = f->next )
 	{
-		FixFaceEdges( ppLeafFaceList, f );
+		AddTjuncFace( faces, ppLeafFaceList, f );
 	}
 }
 
+/*
+==================
+FixFaceListEdges
+
+Faces made by splitting one that has too many vertexes go in front of it in
+its list, so they never end up in the list they're being fixed from.
+==================
+*/
+void FixFaceListEdges (CUtlVector<tjuncface_t> &faces)
+{
+	tjuncjob_t	job;
+	int			i;
+
+	job.faces = faces.Base();
+	job.numfaces = faces.Count();
+	job.next = 0;
+
+	if (g_nVBSPThreads > 1 && faces.Count() >= TJUNC_MIN_THREADED_FACES)
+		RunThreadsNested (g_nVBSPThreads, FindTjuncsThread, &job);
+	else
+		FindTjuncsThread (0, &job);
+
+	for (i=0 ; i<faces.Count() ; i++)
+		FixFaceEdges (&faces[i]);
+
+	faces.RemoveAll ();
+}
+
 /*
 ===========
 FixTjuncs
@@ -739,10 +982,11 @@ FixTjuncs
 
 face_t *FixTjuncs (node_t *headnode, face_t *pLeafFaceList)
 {
+	CUtlVector<tjuncface_t>	faces;
+
 	// snap and merge all vertexes
 	qprintf ("---- snap verts ----\n");
-	memset (hashverts, 0, sizeof(hashverts));
-	memset (vertexchain, 0, sizeof(vertexchain));
+	ClearVertHash ();
 	c_totalverts = 0;
 	c_uniqueverts = 0;
 	c_faceoverflows = 0;
@@ -759,17 +1003,20 @@ face_t *FixTjuncs (node_t *headnode, face_t *pLeafFaceList)
 	
 	if ( g_bAllowDetailCracks )
 	{
-		FixEdges_r (headnode);
+		FindEdges_r (headnode, faces);
+		FixFaceListEdges (faces);
 		EmitLeafFaceVertexes( &pLeafFaceList );
-		FixLeafFaceEdges( &pLeafFaceList );
+		FindLeafFaceEdges( &pLeafFaceList, faces );
+		FixFaceListEdges (faces);
 	}
 	else
 	{
 		EmitLeafFaceVertexes( &pLeafFaceList );
 		if (!notjunc)
 		{
-			FixEdges_r (headnode);
-			FixLeafFaceEdges( &pLeafFaceList );
+			FindEdges_r (headnode, faces);
+			FindLeafFaceEdges( &pLeafFaceList, faces );
+			FixFaceListEdges (faces);
 		}
 	}
 
@@ -789,13 +1036,15 @@ face_t *FixTjuncs (node_t *headnode, face_t *pLeafFaceList)
 
 int		c_faces;
 
+CToolArena	g_FaceArena( "faces" );
+
 face_t	*AllocFace (void)
 {
 	static int s_FaceId = 0;
 
 	face_t	*f;
 
-	f = (face_t*)malloc(sizeof(*f));
+	f = (face_t*)g_FaceArena.Alloc(sizeof(*f));
 	memset (f, 0, sizeof(*f));
 	f->id = s_FaceId;
 	++s_FaceId;
@@ -821,7 +1070,7 @@ void FreeFace (face_t *f)
 {
 	if (f->w)
 		FreeWinding (f->w);
-	free (f);
+	g_FaceArena.Free (f);
 	c_faces--;
 }
 
@@ -839,28 +1088,52 @@ void FreeFaceList( face_t *pFaces )
 
 //========================================================
 
-void GetEdge2_InitOptimizedList()
+// Edges are hashed by their vertexes, in the order they were emitted, so a face can find
+// the edge it shares backwards without going through every edge on one of its vertexes.
+struct edgehash_t
 {
-	for( int i=0; i < MAX_MAP_VERTS; i++ )
-		g_VertEdgeList[i].RemoveAll();
-}
+	int		v[2];
+	int		firstEdge;			// the edges with these vertexes, oldest first
+	int		lastEdge;
+	int		generation;			// the slot is empty unless this is g_EdgeHashGeneration
+};
+
+#define EDGE_HASH_SIZE	(1<<19)	// over twice MAX_MAP_EDGES
 
+static edgehash_t	g_EdgeHash[EDGE_HASH_SIZE];
+static int			g_EdgeHashGeneration = 1;
+static int			g_EdgeChain[MAX_MAP_EDGES];	// the next edge with the same vertexes, or -1
 
-void IntSort( CUtlVector<int> &theList )
+
+static edgehash_t *FindEdgeHash( int v1, int v2, bool bCreate )
 {
-	for( int i=0; i < theList.Size()-1; i++ )
+	COMPILE_TIME_ASSERT( EDGE_HASH_SIZE >= MAX_MAP_EDGES * 2 );
+
+	edgehash_t *pHash;
+	for ( unsigned h = (unsigned)v1 * 73856093u ^ (unsigned)v2 * 19349663u; ; h++ )
 	{
-		if( theList[i] > theList[i+1] )
-		{
-			int temp = theList[i];
-			theList[i] = theList[i+1];
-			theList[i+1] = temp;
-			if( i > 0 )
-				i -= 2;
-			else
-				i = -1;
-		}
+		pHash = &g_EdgeHash[h & (EDGE_HASH_SIZE - 1)];
+		if ( pHash->generation != g_EdgeHashGeneration )
+			break;
+		if ( pHash->v[0] == v1 && pHash->v[1] == v2 )
+			return pHash;
 	}
+
+	if ( !bCreate )
+		return NULL;
+
+	pHash->v[0] = v1;
+	pHash->v[1] = v2;
+	pHash->firstEdge = -1;
+	pHash->lastEdge = -1;
+	pHash->generation = g_EdgeHashGeneration;
+	return pHash;
+}
+
+
+void GetEdge2_InitOptimizedList()
+{
+	g_EdgeHashGeneration++;
 }
 
 
@@ -869,10 +1142,13 @@ int AddEdge( int v1, int v2, face_t *f )
 	if (numedges >= MAX_MAP_EDGES)
 		Error ("Too many edges in map, max == %d", MAX_MAP_EDGES);
 
-	g_VertEdgeList[v1].AddToTail( numedges );
-	g_VertEdgeList[v2].AddToTail( numedges );
-	IntSort( g_VertEdgeList[v1] );
-	IntSort( g_VertEdgeList[v2] );
+	edgehash_t *pHash = FindEdgeHash( v1, v2, true );
+	if ( pHash->lastEdge == -1 )
+		pHash->firstEdge = numedges;
+	else
+		g_EdgeChain[pHash->lastEdge] = numedges;
+	pHash->lastEdge = numedges;
+	g_EdgeChain[numedges] = -1;
 			  
 	dedge_t *edge = &dedges[numedges];
 	numedges++;
@@ -884,6 +1160,25 @@ int AddEdge( int v1, int v2, face_t *f )
 }
 
 
+int ShareBackEdge( int v1, int v2, face_t *f )
+{
+	edgehash_t *pHash = FindEdgeHash( v2, v1, false );
+	if ( !pHash )
+		return -1;
+
+	for ( int iEdge = pHash->firstEdge; iEdge != -1; iEdge = g_EdgeChain[iEdge] )
+	{
+		if ( edgefaces[iEdge][1] || edgefaces[iEdge][0]->contents != f->contents )
+			continue;
+
+		edgefaces[iEdge][1] = f;
+		return iEdge;
+	}
+
+	return -1;
+}
+
+
 /*
 ==================
 GetEdge
@@ -894,27 +1189,13 @@ Don't allow four way edges
 */
 int GetEdge2 (int v1, int v2,  face_t *f)
 {
-	dedge_t	*edge;
-
 	c_tryedges++;
 
 	if (!noshare)
 	{
-		// Check all edges connected to v1.
-		CUtlVector<int> &theList = g_VertEdgeList[v1];
-		for( int i=0; i < theList.Size(); i++ )
-		{
-			int iEdge = theList[i];
-			edge = &dedges[iEdge];
-			if (v1 == edge->v[1] && v2 == edge->v[0] && edgefaces[iEdge][0]->contents == f->contents)
-			{
-				if (edgefaces[iEdge][1])
-					continue;
-
-				edgefaces[iEdge][1] = f;
-				return -iEdge;
-			}
-		}
+		int iEdge = ShareBackEdge( v1, v2, f );
+		if ( iEdge != -1 )
+			return -iEdge;
 	}
 
 	return AddEdge( v1, v2, f );
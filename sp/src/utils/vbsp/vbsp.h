@@ -15,6 +15,7 @@
 #include "scriplib.h"
 #include "polylib.h"
 #include "threads.h"
+#include "toolarena.h"
 #include "bsplib.h"
 #include "qfiles.h"
 #include "utilmatlib.h"
@@ -180,6 +181,7 @@ struct bspbrush_t
 	bspbrush_t			*next;
 	Vector	            mins, maxs;
 	int		            side, testside;		// side of node during construction
+	int					chopindex;			// ChopBrushes' index for it in its grid
 	mapbrush_t	        *original;
 	int		            numsides;
 	side_t	            sides[6];			// variably sized
@@ -353,6 +355,8 @@ extern	qboolean	nowater;
 extern	qboolean	noweld;
 extern	qboolean	noshare;
 extern	qboolean	notjunc;
+extern	int			g_nVBSPThreads;		// -threads or the processor count, numthreads is kept at 1
+extern	bool		g_bFastCompress;	// -fastcompress: snappy compress the lumps of the bsp vbsp writes
 extern	qboolean	nocsg;
 extern	qboolean	noopt;
 extern  qboolean	dumpcollide;
@@ -469,6 +473,9 @@ bspbrush_t *CopyBrush (bspbrush_t *brush);
 void SplitBrush (bspbrush_t *brush, int planenum,
 	bspbrush_t **front, bspbrush_t **back);
 
+extern CToolArena g_NodeArena;
+extern CToolArena g_BrushArena;
+
 tree_t *AllocTree (void);
 node_t *AllocNode (void);
 bspbrush_t *AllocBrush (int numsides);
@@ -567,6 +574,7 @@ void MergeFaceList(face_t **pFaceList);
 void SubdivideFaceList(face_t **pFaceList);
 
 extern face_t		*edgefaces[MAX_MAP_EDGES][2];
+extern float		g_flWeldCellSize;
 
 
 //=============================================================================
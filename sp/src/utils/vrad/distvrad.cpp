@@ -0,0 +1,243 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: The vrad stages that run across worker processes with -dist. These
+//			mirror the VMPI versions in mpivrad.cpp, but go through localdist
+//			so they don't need the VMPI service or windows.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "vismat.h"
+#include "transfermatrix.h"
+#include "pacifier.h"
+#include "localdist.h"
+#include "distvrad.h"
+
+
+extern int total_transfer;
+extern int max_transfer;
+
+extern void BuildPatchLights( int facenum );
+
+
+//-----------------------------------------
+//
+// BuildFacelights
+//
+
+template<class T> void PutValues( CUtlBuffer &buf, T const *pSrc, int nNumValues )
+{
+	buf.Put( pSrc, sizeof( pSrc[0] ) * nNumValues );
+}
+
+template<class T> T *GetValues( CUtlBuffer &buf, int nNumValues )
+{
+	T *pDest = (T *)calloc( nNumValues, sizeof( T ) );
+	buf.Get( pDest, sizeof( T ) * nNumValues );
+	return pDest;
+}
+
+
+static void PutFace( CUtlBuffer &buf, int facenum )
+{
+	dface_t     * f  = &g_pFaces[facenum];
+	facelight_t * fl = &facelight[facenum];
+
+	buf.Put( f, sizeof( dface_t ) );
+	buf.Put( fl, sizeof( facelight_t ) );
+
+	PutValues( buf, fl->sample, fl->numsamples );
+
+	for ( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for ( int n = 0; n < NUM_BUMP_VECTS+1; ++n )
+		{
+			if ( fl->light[i][n] )
+			{
+				PutValues( buf, fl->light[i][n], fl->numsamples );
+			}
+		}
+	}
+
+	if ( fl->luxel )
+		PutValues( buf, fl->luxel, fl->numluxels );
+
+	if ( fl->luxelNormals )
+		PutValues( buf, fl->luxelNormals, fl->numluxels );
+}
+
+
+static void GetFace( CUtlBuffer &buf, int facenum, int iWorker )
+{
+	dface_t     * f  = &g_pFaces[facenum];
+	facelight_t * fl = &facelight[facenum];
+
+	buf.Get( f, sizeof( dface_t ) );
+	buf.Get( fl, sizeof( facelight_t ) );
+
+	// The pointers that came over are only used to tell which arrays follow.
+	fl->sample = GetValues<sample_t>( buf, fl->numsamples );
+
+	for ( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for ( int n = 0; n < NUM_BUMP_VECTS+1; ++n )
+		{
+			if ( fl->light[i][n] )
+			{
+				fl->light[i][n] = GetValues<LightingValue_t>( buf, fl->numsamples );
+			}
+		}
+	}
+
+	if ( fl->luxel )
+		fl->luxel = GetValues<Vector>( buf, fl->numluxels );
+
+	if ( fl->luxelNormals )
+		fl->luxelNormals = GetValues<Vector>( buf, fl->numluxels );
+
+	if ( !buf.IsValid() )
+		Error( "GetFace: invalid results for face %d from worker %d.\n", facenum, iWorker );
+}
+
+
+static void Dist_ProcessFaces( int iThread, int iWorkUnit, CUtlBuffer *pBuf )
+{
+	BuildFacelights( iThread, iWorkUnit );
+
+	if ( pBuf )
+	{
+		PutFace( *pBuf, iWorkUnit );
+	}
+}
+
+
+static void Dist_ReceiveFaceResults( int iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	GetFace( buf, iWorkUnit, iWorker );
+
+	// Workers leave this to the master, like VMPI.
+	BuildPatchLights( iWorkUnit );
+}
+
+
+void RunDistBuildFacelights()
+{
+	Msg( "%-20s ", "BuildFaceLights:" );
+	StartPacifier( "" );
+
+	double elapsed = LocalDist_DistributeWork( numfaces, Dist_ProcessFaces, Dist_ReceiveFaceResults, false );
+
+	EndPacifier( false );
+	Msg( " (%d)\n", (int)elapsed );
+}
+
+
+//-----------------------------------------
+//
+// BuildVisLeafs
+//
+
+struct DistVisLeafsThread_t
+{
+	transfer_t *m_pTransfers;
+	CUtlBuffer *m_pBuf;
+	int m_nPatches;
+};
+
+static DistVisLeafsThread_t s_DistVisLeafsThreads[MAX_TOOL_THREADS+1];
+
+
+// Called by BuildVisLeafs_Cluster on workers every time it finishes a patch.
+static void Dist_AddPatchData( int iThread, int patchnum, CPatch *patch )
+{
+	DistVisLeafsThread_t *pData = &s_DistVisLeafsThreads[iThread];
+
+	++pData->m_nPatches;
+	pData->m_pBuf->PutInt( patchnum );
+	pData->m_pBuf->PutInt( patch->numtransfers );
+
+	// MakeScales left this patch's scaled transfers in the thread's buffer
+	pData->m_pBuf->Put( pData->m_pTransfers, patch->numtransfers * sizeof( transfer_t ) );
+}
+
+
+static void Dist_ProcessVisLeafs( int iThread, int iWorkUnit, CUtlBuffer *pBuf )
+{
+	DistVisLeafsThread_t *pData = &s_DistVisLeafsThreads[iThread];
+	if ( !pData->m_pTransfers )
+	{
+		pData->m_pTransfers = BuildVisLeafs_Start();
+	}
+
+	if ( !pBuf )
+	{
+		// The master stores its own rows in MakeScales.
+		BuildVisLeafs_Cluster( iThread, pData->m_pTransfers, iWorkUnit, NULL );
+		return;
+	}
+
+	// The patch count is filled in once the cluster is done.
+	pData->m_pBuf = pBuf;
+	pData->m_nPatches = 0;
+	int iSavePos = pBuf->TellPut();
+	pBuf->PutInt( 0 );
+
+	BuildVisLeafs_Cluster( iThread, pData->m_pTransfers, iWorkUnit, Dist_AddPatchData );
+
+	int iEndPos = pBuf->TellPut();
+	pBuf->SeekPut( CUtlBuffer::SEEK_HEAD, iSavePos );
+	pBuf->PutInt( pData->m_nPatches );
+	pBuf->SeekPut( CUtlBuffer::SEEK_HEAD, iEndPos );
+	pData->m_pBuf = NULL;
+}
+
+
+static void Dist_ReceiveVisLeafsResults( int iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	CUtlVector<transfer_t> transfers;
+
+	int nPatches = buf.GetInt();
+	for ( int k = 0; k < nPatches; ++k )
+	{
+		int patchnum = buf.GetInt();
+		int numtransfers = buf.GetInt();
+		if ( !buf.IsValid() || patchnum < 0 || patchnum >= g_Patches.Count() || numtransfers < 0 )
+			Error( "Dist_ReceiveVisLeafsResults: invalid results for cluster %d from worker %d.\n", iWorkUnit, iWorker );
+
+		CPatch *patch = &g_Patches[patchnum];
+		patch->numtransfers = numtransfers;
+		if ( numtransfers )
+		{
+			transfers.SetCount( numtransfers );
+			buf.Get( transfers.Base(), numtransfers * sizeof( transfer_t ) );
+			g_TransferMatrix.SetRow( patchnum, transfers.Base(), numtransfers );
+		}
+
+		ThreadLock();
+		total_transfer += numtransfers;
+		if ( max_transfer < numtransfers )
+			max_transfer = numtransfers;
+		ThreadUnlock();
+	}
+}
+
+
+void RunDistBuildVisLeafs()
+{
+	Msg( "%-20s ", "BuildVisLeafs  :" );
+	StartPacifier( "" );
+
+	memset( s_DistVisLeafsThreads, 0, sizeof( s_DistVisLeafsThreads ) );
+
+	double elapsed = LocalDist_DistributeWork( dvis->numclusters, Dist_ProcessVisLeafs, Dist_ReceiveVisLeafsResults, false );
+
+	for ( int i = 0; i < ARRAYSIZE( s_DistVisLeafsThreads ); i++ )
+	{
+		if ( s_DistVisLeafsThreads[i].m_pTransfers )
+			BuildVisLeafs_End( s_DistVisLeafsThreads[i].m_pTransfers );
+	}
+
+	EndPacifier( false );
+	Msg( " (%d)\n", (int)elapsed );
+}
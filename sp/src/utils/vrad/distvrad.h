@@ -0,0 +1,18 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: The vrad stages that run across worker processes with -dist.
+//
+//=============================================================================//
+
+#ifndef DISTVRAD_H
+#define DISTVRAD_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+void		RunDistBuildFacelights();
+void		RunDistBuildVisLeafs();
+
+
+#endif // DISTVRAD_H
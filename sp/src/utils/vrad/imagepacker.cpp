@@ -56,6 +56,18 @@ inline int CImagePacker::GetMaxYIndex( int firstX, int width )
 }
 
 
+// How much room would be left unused under a block sitting at height y
+inline int CImagePacker::GetWastedArea( int firstX, int width, int y )
+{
+	int waste = 0;
+	for( int x = firstX; x < firstX + width; ++x )
+	{
+		waste += y - m_pLightmapWavefront[x];
+	}
+	return waste;
+}
+
+
 bool CImagePacker::AddBlock( int width, int height, int *returnX, int *returnY )
 {
 	// If we've already determined that a block this big couldn't fit
@@ -64,6 +76,7 @@ bool CImagePacker::AddBlock( int width, int height, int *returnX, int *returnY )
 		return false;
 
 	int bestX = -1;	
+	int bestWaste = 0;
 	int maxYIdx;
 	int outerX = 0;
 	int outerMinY = m_MaxLightmapHeight;
@@ -85,6 +98,17 @@ bool CImagePacker::AddBlock( int width, int height, int *returnX, int *returnY )
 		{
 			outerMinY = lastMaxYVal;
 			bestX = outerX;
+			bestWaste = GetWastedArea( outerX, width, lastMaxYVal );
+		}
+		else if ( ( outerMinY == lastMaxYVal ) && ( bestX != -1 ) )
+		{
+			// Equally low, so take the spot that leaves the fewest holes underneath
+			int waste = GetWastedArea( outerX, width, lastMaxYVal );
+			if ( waste < bestWaste )
+			{
+				bestX = outerX;
+				bestWaste = waste;
+			}
 		}
 		outerX = maxYIdx + 1;
 	}
@@ -139,3 +163,184 @@ bool CImagePacker::AddBlock( int width, int height, int *returnX, int *returnY )
 	return true;
 }
 
+
+//-----------------------------------------------------------------------------
+// Packing a whole set of blocks
+//-----------------------------------------------------------------------------
+struct ImagePackerSortKey_t
+{
+	int m_nPrimary;
+	int m_nSecondary;
+	int m_nIndex;
+};
+
+// Biggest first, ties in the order the blocks were given
+static int ImagePackerSortKeyCompare( const void *p1, const void *p2 )
+{
+	const ImagePackerSortKey_t *pKey1 = (const ImagePackerSortKey_t *)p1;
+	const ImagePackerSortKey_t *pKey2 = (const ImagePackerSortKey_t *)p2;
+	if ( pKey1->m_nPrimary != pKey2->m_nPrimary )
+		return ( pKey1->m_nPrimary > pKey2->m_nPrimary ) ? -1 : 1;
+	if ( pKey1->m_nSecondary != pKey2->m_nSecondary )
+		return ( pKey1->m_nSecondary > pKey2->m_nSecondary ) ? -1 : 1;
+	return pKey1->m_nIndex - pKey2->m_nIndex;
+}
+
+static void BuildImagePackerSortKey( ImagePackerBlock_t const &block, int nSortOrder, ImagePackerSortKey_t &key )
+{
+	switch( nSortOrder )
+	{
+	case IMAGEPACKER_SORT_HEIGHT:
+		key.m_nPrimary = block.m_nHeight;
+		key.m_nSecondary = block.m_nWidth;
+		break;
+	case IMAGEPACKER_SORT_AREA:
+		key.m_nPrimary = block.m_nWidth * block.m_nHeight;
+		key.m_nSecondary = max( block.m_nWidth, block.m_nHeight );
+		break;
+	case IMAGEPACKER_SORT_MAX_SIDE:
+		key.m_nPrimary = max( block.m_nWidth, block.m_nHeight );
+		key.m_nSecondary = min( block.m_nWidth, block.m_nHeight );
+		break;
+	case IMAGEPACKER_SORT_WIDTH:
+		key.m_nPrimary = block.m_nWidth;
+		key.m_nSecondary = block.m_nHeight;
+		break;
+	default:
+		key.m_nPrimary = 0;
+		key.m_nSecondary = 0;
+		break;
+	}
+}
+
+bool PackImageBlocks( CUtlVector<ImagePackerBlock_t> &blocks, int nPageWidth, int nPageHeight, 
+					 int nSortOrder, ImagePackerStats_t *pStats )
+{
+	int nBlocks = blocks.Count();
+
+	CUtlVector<ImagePackerSortKey_t> order;
+	order.SetSize( nBlocks );
+	for ( int i = 0; i < nBlocks; ++i )
+	{
+		BuildImagePackerSortKey( blocks[i], nSortOrder, order[i] );
+		order[i].m_nIndex = i;
+	}
+	if ( nSortOrder != IMAGEPACKER_SORT_NONE )
+	{
+		qsort( order.Base(), nBlocks, sizeof( ImagePackerSortKey_t ), ImagePackerSortKeyCompare );
+	}
+
+	// Every page stays open; a page that is nearly full turns blocks away
+	// quickly since it remembers the smallest block that didn't fit.
+	CUtlVector<CImagePacker *> pages;
+	bool bAllFit = true;
+	int64 nBlockArea = 0;
+	for ( int i = 0; i < nBlocks; ++i )
+	{
+		ImagePackerBlock_t &block = blocks[ order[i].m_nIndex ];
+		block.m_nPage = -1;
+
+		for ( int p = 0; p < pages.Count(); ++p )
+		{
+			if ( pages[p]->AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+			{
+				block.m_nPage = p;
+				break;
+			}
+		}
+
+		if ( block.m_nPage < 0 )
+		{
+			CImagePacker *pPage = new CImagePacker;
+			pPage->Reset( nPageWidth, nPageHeight );
+			if ( !pPage->AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+			{
+				// Doesn't fit on an empty page either
+				delete pPage;
+				bAllFit = false;
+				continue;
+			}
+			block.m_nPage = pages.AddToTail( pPage );
+		}
+
+		nBlockArea += block.m_nWidth * block.m_nHeight;
+	}
+
+	if ( pStats )
+	{
+		pStats->m_nSortOrder = nSortOrder;
+		pStats->m_nPages = pages.Count();
+		pStats->m_nBlockArea = nBlockArea;
+		pStats->m_nPageArea = 0;
+		if ( pages.Count() )
+		{
+			pStats->m_nPageArea = (int64)( pages.Count() - 1 ) * nPageWidth * nPageHeight;
+			pStats->m_nPageArea += (int64)nPageWidth * pages.Tail()->GetMinimumHeight();
+		}
+	}
+
+	pages.PurgeAndDeleteElements();
+	return bAllFit;
+}
+
+
+//-----------------------------------------------------------------------------
+// Each sort order is packed on its own thread
+//-----------------------------------------------------------------------------
+static CUtlVector<ImagePackerBlock_t> *s_pPackBlocks;
+static int s_nPackPageWidth;
+static int s_nPackPageHeight;
+static CUtlVector<ImagePackerBlock_t> s_PackResults[IMAGEPACKER_SORT_COUNT];
+static ImagePackerStats_t s_PackStats[IMAGEPACKER_SORT_COUNT];
+static bool s_bPackFit[IMAGEPACKER_SORT_COUNT];
+
+static void PackImageBlocksInOrder( int iThread, int nSortOrder )
+{
+	s_PackResults[nSortOrder] = *s_pPackBlocks;
+	s_bPackFit[nSortOrder] = PackImageBlocks( s_PackResults[nSortOrder], s_nPackPageWidth, s_nPackPageHeight, 
+		nSortOrder, &s_PackStats[nSortOrder] );
+}
+
+bool PackImageBlocksBestOrder( CUtlVector<ImagePackerBlock_t> &blocks, int nPageWidth, int nPageHeight, 
+							  bool bThreaded, ImagePackerStats_t *pStats )
+{
+	s_pPackBlocks = &blocks;
+	s_nPackPageWidth = nPageWidth;
+	s_nPackPageHeight = nPageHeight;
+
+	if ( bThreaded )
+	{
+		RunThreadsOnIndividual( IMAGEPACKER_SORT_COUNT, false, PackImageBlocksInOrder );
+	}
+	else
+	{
+		for ( int i = 0; i < IMAGEPACKER_SORT_COUNT; ++i )
+		{
+			PackImageBlocksInOrder( 0, i );
+		}
+	}
+
+	int nBest = 0;
+	for ( int i = 1; i < IMAGEPACKER_SORT_COUNT; ++i )
+	{
+		if ( ( s_PackStats[i].m_nPages < s_PackStats[nBest].m_nPages ) || 
+			 ( ( s_PackStats[i].m_nPages == s_PackStats[nBest].m_nPages ) && ( s_PackStats[i].m_nPageArea < s_PackStats[nBest].m_nPageArea ) ) )
+		{
+			nBest = i;
+		}
+	}
+
+	blocks.Swap( s_PackResults[nBest] );
+	if ( pStats )
+	{
+		*pStats = s_PackStats[nBest];
+	}
+	bool bFit = s_bPackFit[nBest];
+
+	for ( int i = 0; i < IMAGEPACKER_SORT_COUNT; ++i )
+	{
+		s_PackResults[i].Purge();
+	}
+	s_pPackBlocks = NULL;
+	return bFit;
+}
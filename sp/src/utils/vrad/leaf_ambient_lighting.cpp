@@ -16,6 +16,7 @@
 #include "messbuf.h"
 #include "vmpi.h"
 #include "vmpi_distribute_work.h"
+#include "relightcache.h"
 
 static TableVector g_BoxDirections[6] = 
 {
@@ -201,26 +202,56 @@ bool IsLeafAmbientSurfaceLight( dworldlight_t *wl )
 class CLeafSampler
 {
 public:
-	CLeafSampler( int iThread ) : m_iThread(iThread) {}
-
 	// Generate a random point in the leaf's bounding volume
 	// reject any points that aren't actually in the leaf
 	// do a couple of tracing heuristics to eliminate points that are inside detail brushes 
 	// or underneath displacement surfaces in the leaf
 	// return once we have a valid point, use the center if one can't be computed quickly
-	void GenerateLeafSamplePosition( int leafIndex, const CUtlVector<dplane_t> &leafPlanes, Vector &samplePosition )
+	void GenerateLeafSamplePosition( int iThread, int leafIndex, const CUtlVector<dplane_t> &leafPlanes, Vector &samplePosition )
+	{
+		dleaf_t *pLeaf = dleafs + leafIndex;
+		Vector mins( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] );
+		Vector maxs( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] );
+
+		if ( !GenerateSamplePositionInBox( iThread, leafIndex, leafPlanes, mins, maxs, samplePosition ) )
+		{
+			// didn't generate a valid sample point, just use the center of the leaf bbox
+			samplePosition = ( mins + maxs ) * 0.5f;
+		}
+	}
+
+	// Same, but only looks in the part of the leaf within radius of center. Falls back to
+	// the whole leaf.
+	void GenerateLeafSamplePositionNear( int iThread, int leafIndex, const CUtlVector<dplane_t> &leafPlanes, const Vector &center, float radius, Vector &samplePosition )
+	{
+		dleaf_t *pLeaf = dleafs + leafIndex;
+		Vector mins, maxs;
+		for ( int i = 0; i < 3; i++ )
+		{
+			mins[i] = max( center[i] - radius, (float)pLeaf->mins[i] );
+			maxs[i] = min( center[i] + radius, (float)pLeaf->maxs[i] );
+		}
+
+		if ( !GenerateSamplePositionInBox( iThread, leafIndex, leafPlanes, mins, maxs, samplePosition, 100 ) )
+		{
+			GenerateLeafSamplePosition( iThread, leafIndex, leafPlanes, samplePosition );
+		}
+	}
+
+private:
+	bool GenerateSamplePositionInBox( int iThread, int leafIndex, const CUtlVector<dplane_t> &leafPlanes, const Vector &mins, const Vector &maxs, Vector &samplePosition, int nTries = 1000 )
 	{
 		dleaf_t *pLeaf = dleafs + leafIndex;
 
-		float dx = pLeaf->maxs[0] - pLeaf->mins[0];
-		float dy = pLeaf->maxs[1] - pLeaf->mins[1];
-		float dz = pLeaf->maxs[2] - pLeaf->mins[2];
+		float dx = maxs[0] - mins[0];
+		float dy = maxs[1] - mins[1];
+		float dz = maxs[2] - mins[2];
 		bool bValid = false;
-		for ( int i = 0; i < 1000 && !bValid; i++ )
+		for ( int i = 0; i < nTries && !bValid; i++ )
 		{
-			samplePosition.x = pLeaf->mins[0] + m_random.RandomFloat(0, dx);
-			samplePosition.y = pLeaf->mins[1] + m_random.RandomFloat(0, dy);
-			samplePosition.z = pLeaf->mins[2] + m_random.RandomFloat(0, dz);
+			samplePosition.x = mins[0] + m_random.RandomFloat(0, dx);
+			samplePosition.y = mins[1] + m_random.RandomFloat(0, dy);
+			samplePosition.z = mins[2] + m_random.RandomFloat(0, dz);
 			bValid = true;
 
 			for ( int j = leafPlanes.Count(); --j >= 0 && bValid; )
@@ -243,7 +274,7 @@ public:
 				start[axis] = (j<3) ? pLeaf->mins[axis] : pLeaf->maxs[axis];
 				float t;
 				Vector normal;
-				CastRayInLeaf( m_iThread, samplePosition, start, leafIndex, &t, &normal );
+				CastRayInLeaf( iThread, samplePosition, start, leafIndex, &t, &normal );
 				if ( t == 0.0f )
 				{
 					// inside a func_detail, try again.
@@ -262,15 +293,9 @@ public:
 				}
 			}
 		}
-		if ( !bValid )
-		{
-			// didn't generate a valid sample point, just use the center of the leaf bbox
-			samplePosition = ( Vector( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] ) + Vector( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] ) ) * 0.5f;
-		}
+		return bValid;
 	}
 
-private:
-	int		m_iThread;
 	CUniformRandomStream m_random;
 };
 
@@ -302,13 +327,6 @@ void GetLeafBoundaryPlanes( CUtlVector<dplane_t> &list, int leafIndex )
 	}
 }
 
-// this stores each sample of the ambient lighting
-struct ambientsample_t
-{
-	Vector pos;
-	Vector cube[6];
-};
-
 // add the sample to the list.  If we exceed the maximum number of samples, the worst sample will
 // be discarded.  This has the effect of converging on the best samples when enough are added.
 void AddSampleToList( CUtlVector<ambientsample_t> &list, const Vector &samplePosition, Vector *pCube )
@@ -522,13 +540,40 @@ static byte Fixed8Fraction( float t, float tMin, float tMax )
 
 CUtlVector< CUtlVector<ambientsample_t> > g_LeafAmbientSamples;
 
-void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t> &list )
+//-----------------------------------------------------------------------------
+// A leaf's samples are worked out in rounds: place candidate samples, light
+// them, keep the best. The first round spends half of the leaf's candidates
+// spread over the whole leaf. The rest only get spent if the lighting turned
+// out to change across the leaf, and go between the samples that differ most.
+//-----------------------------------------------------------------------------
+struct LeafAmbientJob_t
 {
-	CUtlVector<dplane_t> leafPlanes;
-	CLeafSampler sampler( iThread );
+	int							leafID;
+	int							nRound;
+	int							nSamplesLeft;		// candidates not placed yet
+	CLeafSampler				sampler;
+	CUtlVector<ambientsample_t>	candidates;			// placed this round
+	CUtlVector<ambientsample_t>	list;				// the best so far
+};
+
+// samples that differ by this much in gamma space get more samples between them
+#define LEAF_AMBIENT_REFINE_DELTA	3
+
+static void InitLeafAmbientJob( LeafAmbientJob_t &job, int leafID )
+{
+	job.leafID = leafID;
+	job.nRound = 0;
+	job.candidates.RemoveAll();
+	job.list.RemoveAll();
+
+	if ( dleafs[leafID].contents & CONTENTS_SOLID )
+	{
+		// don't generate any samples in solid leaves
+		// NOTE: We copy the nearest non-solid leaf sample pointers into this leaf at the end
+		job.nSamplesLeft = 0;
+		return;
+	}
 
-	GetLeafBoundaryPlanes( leafPlanes, leafID );
-	list.RemoveAll();
 	// this heuristic tries to generate at least one sample per volume (chosen to be similar to the size of a player) in the space
 	int xSize = (dleafs[leafID].maxs[0] - dleafs[leafID].mins[0]) / 32;
 	int ySize = (dleafs[leafID].maxs[1] - dleafs[leafID].mins[1]) / 32;
@@ -543,45 +588,231 @@ void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t>
 		// save compute time, only do one sample
 		volumeCount = 1;
 	}
-	int sampleCount = clamp( volumeCount, 1, 128 );
-	if ( dleafs[leafID].contents & CONTENTS_SOLID )
+	job.nSamplesLeft = clamp( volumeCount, 1, 128 );
+}
+
+struct RefineTarget_t
+{
+	Vector	center;
+	float	radius;
+	int		delta;
+};
+
+static int CompareRefineTargets( const RefineTarget_t *pA, const RefineTarget_t *pB )
+{
+	// biggest difference first
+	return pB->delta - pA->delta;
+}
+
+// Places this round's candidates. Returns false once the leaf is done.
+static bool PlaceLeafSamples( int iThread, LeafAmbientJob_t &job )
+{
+	job.candidates.RemoveAll();
+	if ( !job.nSamplesLeft )
+		return false;
+
+	CUtlVector<dplane_t> leafPlanes;
+	GetLeafBoundaryPlanes( leafPlanes, job.leafID );
+
+	if ( job.nRound == 0 )
 	{
-		// don't generate any samples in solid leaves
-		// NOTE: We copy the nearest non-solid leaf sample pointers into this leaf at the end
-		return;
+		int nPlace = ( job.nSamplesLeft + 1 ) / 2;
+		job.candidates.SetCount( nPlace );
+		for ( int i = 0; i < nPlace; i++ )
+		{
+			job.sampler.GenerateLeafSamplePosition( iThread, job.leafID, leafPlanes, job.candidates[i].pos );
+		}
+	}
+	else
+	{
+		// look for the samples the lighting changes the most between
+		CUtlVector<RefineTarget_t> targets;
+		for ( int i = 0; i < job.list.Count(); i++ )
+		{
+			for ( int j = i + 1; j < job.list.Count(); j++ )
+			{
+				int delta = CubeDeltaGammaSpace( job.list[i].cube, job.list[j].cube );
+				if ( delta < LEAF_AMBIENT_REFINE_DELTA )
+					continue;
+
+				RefineTarget_t &target = targets[ targets.AddToTail() ];
+				target.center = ( job.list[i].pos + job.list[j].pos ) * 0.5f;
+				target.radius = max( ( job.list[i].pos - job.list[j].pos ).Length() * 0.5f, 16.0f );
+				target.delta = delta;
+			}
+		}
+
+		if ( !targets.Count() )
+		{
+			// the lighting is smooth enough, the samples we have will do
+			job.nSamplesLeft = 0;
+			return false;
+		}
+		targets.Sort( CompareRefineTargets );
+
+		int nPlace = job.nSamplesLeft;
+		job.candidates.SetCount( nPlace );
+		for ( int i = 0; i < nPlace; i++ )
+		{
+			const RefineTarget_t &target = targets[ i % targets.Count() ];
+			job.sampler.GenerateLeafSamplePositionNear( iThread, job.leafID, leafPlanes, target.center, target.radius, job.candidates[i].pos );
+		}
 	}
-	Vector cube[6];
-	for ( int i = 0; i < sampleCount; i++ )
+
+	job.nSamplesLeft -= job.candidates.Count();
+	job.nRound++;
+	return true;
+}
+
+static void LightLeafSamples( int iThread, LeafAmbientJob_t &job, int nFirst, int nCount )
+{
+	for ( int i = nFirst; i < nFirst + nCount; i++ )
+	{
+		ComputeAmbientFromSphericalSamples( iThread, job.candidates[i].pos, job.candidates[i].cube );
+	}
+}
+
+static void KeepLeafSamples( LeafAmbientJob_t &job )
+{
+	for ( int i = 0; i < job.candidates.Count(); i++ )
 	{
-		// compute each candidate sample and add to the list
-		Vector samplePosition;
-		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
-		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
 		// note this will remove the least valuable sample once the limit is reached
-		AddSampleToList( list, samplePosition, cube );
+		AddSampleToList( job.list, job.candidates[i].pos, job.candidates[i].cube );
+	}
+	job.candidates.Purge();
+}
+
+void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t> &list )
+{
+	LeafAmbientJob_t job;
+	InitLeafAmbientJob( job, leafID );
+	while ( PlaceLeafSamples( iThread, job ) )
+	{
+		LightLeafSamples( iThread, job, 0, job.candidates.Count() );
+		KeepLeafSamples( job );
 	}
 
 	// remove any samples that can be reconstructed with the remaining data
-	CompressAmbientSampleList( list );
+	CompressAmbientSampleList( job.list );
+
+	list.RemoveAll();
+	list.AddVectorToTail( job.list );
 }
 
-static void ThreadComputeLeafAmbient( int iThread, void *pUserData )
+// leaves that ComputeLeafAmbientInTasks computes, the others come from the relight cache
+static CUtlVector<int> s_LeafAmbientWork;
+static CUtlVector<LeafAmbientJob_t> s_LeafAmbientJobs;
+
+// candidates are lit in tasks of this many, whatever leaf they're in, so a few huge leaves
+// don't keep one thread busy after all the others are done
+#define LEAF_AMBIENT_TASK_SAMPLES	4
+
+struct LeafAmbientTask_t
+{
+	int		iJob;
+	int		nFirst;
+	int		nCount;
+};
+static CUtlVector<LeafAmbientTask_t> s_LeafAmbientTasks;
+
+static void ThreadPlaceLeafSamples( int iThread, void *pUserData )
+{
+	while (1)
+	{
+		int iWork = GetThreadWork ();
+		if (iWork == -1)
+			break;
+		PlaceLeafSamples( iThread, s_LeafAmbientJobs[iWork] );
+	}
+}
+
+static void ThreadLightLeafSamples( int iThread, void *pUserData )
+{
+	while (1)
+	{
+		int iWork = GetThreadWork ();
+		if (iWork == -1)
+			break;
+		const LeafAmbientTask_t &task = s_LeafAmbientTasks[iWork];
+		LightLeafSamples( iThread, s_LeafAmbientJobs[task.iJob], task.nFirst, task.nCount );
+	}
+}
+
+static void ThreadKeepLeafSamples( int iThread, void *pUserData )
+{
+	while (1)
+	{
+		int iWork = GetThreadWork ();
+		if (iWork == -1)
+			break;
+		KeepLeafSamples( s_LeafAmbientJobs[iWork] );
+	}
+}
+
+static void ThreadFinishLeafSamples( int iThread, void *pUserData )
 {
-	CUtlVector<ambientsample_t> list;
 	while (1)
 	{
-		int leafID = GetThreadWork ();
-		if (leafID == -1)
+		int iWork = GetThreadWork ();
+		if (iWork == -1)
 			break;
-		list.RemoveAll();
-		ComputeAmbientForLeaf(iThread, leafID, list);
+		LeafAmbientJob_t &job = s_LeafAmbientJobs[iWork];
+
+		// remove any samples that can be reconstructed with the remaining data
+		CompressAmbientSampleList( job.list );
+
 		// copy to the output array
-		g_LeafAmbientSamples[leafID].SetCount( list.Count() );
-		for ( int i = 0; i < list.Count(); i++ )
+		g_LeafAmbientSamples[job.leafID].RemoveAll();
+		g_LeafAmbientSamples[job.leafID].AddVectorToTail( job.list );
+		job.list.Purge();
+	}
+}
+
+static void ComputeLeafAmbientInTasks()
+{
+	int nJobs = s_LeafAmbientWork.Count();
+	s_LeafAmbientJobs.SetCount( nJobs );
+	for ( int i = 0; i < nJobs; i++ )
+	{
+		InitLeafAmbientJob( s_LeafAmbientJobs[i], s_LeafAmbientWork[i] );
+	}
+
+	for ( int nRound = 0; nJobs; nRound++ )
+	{
+		RunThreadsOn( nJobs, false, ThreadPlaceLeafSamples );
+
+		s_LeafAmbientTasks.RemoveAll();
+		int nLeaves = 0;
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			int nCandidates = s_LeafAmbientJobs[i].candidates.Count();
+			for ( int nFirst = 0; nFirst < nCandidates; nFirst += LEAF_AMBIENT_TASK_SAMPLES )
+			{
+				LeafAmbientTask_t &task = s_LeafAmbientTasks[ s_LeafAmbientTasks.AddToTail() ];
+				task.iJob = i;
+				task.nFirst = nFirst;
+				task.nCount = min( LEAF_AMBIENT_TASK_SAMPLES, nCandidates - nFirst );
+			}
+			nLeaves += ( nCandidates != 0 );
+		}
+		if ( !s_LeafAmbientTasks.Count() )
+			break;
+
+		if ( nRound )
 		{
-			g_LeafAmbientSamples[leafID].Element(i) = list.Element(i);
+			Msg( "Refining the ambient lighting of %d leaves.\n", nLeaves );
 		}
+		RunThreadsOn( s_LeafAmbientTasks.Count(), true, ThreadLightLeafSamples );
+		RunThreadsOn( nJobs, false, ThreadKeepLeafSamples );
 	}
+
+	if ( nJobs )
+	{
+		RunThreadsOn( nJobs, false, ThreadFinishLeafSamples );
+	}
+
+	s_LeafAmbientTasks.Purge();
+	s_LeafAmbientJobs.Purge();
 }
 
 void VMPI_ProcessLeafAmbient( int iThread, uint64 iLeaf, MessageBuffer *pBuf )
@@ -650,7 +881,18 @@ void ComputePerLeafAmbientLighting()
 	}
 	else
 	{
-		RunThreadsOn(numleafs, true, ThreadComputeLeafAmbient);
+		s_LeafAmbientWork.RemoveAll();
+		for ( int leafID = 0; leafID < numleafs; leafID++ )
+		{
+			if ( !g_RelightCache.RestoreLeafAmbient( leafID, g_LeafAmbientSamples[leafID] ) )
+				s_LeafAmbientWork.AddToTail( leafID );
+		}
+		if ( s_LeafAmbientWork.Count() < numleafs )
+		{
+			Msg( "Reusing the ambient lighting of %d of %d leaves.\n", numleafs - s_LeafAmbientWork.Count(), numleafs );
+		}
+
+		ComputeLeafAmbientInTasks();
 	}
 
 	// now write out the data
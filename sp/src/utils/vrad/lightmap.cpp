@@ -12,6 +12,7 @@
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
 #include "vmpi.h"
+#include "localdist.h"
 #include "mathlib/anorms.h"
 #include "map_utils.h"
 #include "mathlib/halton.h"
@@ -2485,10 +2486,74 @@ static void ComputeIlluminationPointAndNormalsSSE( lightinfo_t const& l, FourVec
 		pInfo->m_Clusters[i] = ClusterFromPoint( pos.Vec( i ) );
 }
 
+//-----------------------------------------------------------------------------
+// What each light added to each luxel of a face in the base gather. Supersampling
+// looks at these to find the lights that actually cause an edge and only resamples
+// those; everything else keeps its base sample.
+//-----------------------------------------------------------------------------
+struct LightContrib_t
+{
+	directlight_t	*m_pLight;
+	int				m_nStyleIndex;
+	float			*m_pAmount;		// per luxel: falloff x dot for each normal, then the sun amount
+};
+
+struct FaceLightContribs_t
+{
+	int							m_nStride;			// m_NormalCount + 1
+	int							*m_pLightContrib;	// by light index, -1 if the light added nothing
+	bool						*m_pHasSample;		// per luxel, luxels off the face have no sample
+	CUtlVector<LightContrib_t>	m_Contribs;
+};
+
+static void InitFaceLightContribs( SSE_SampleInfo_t const& info, FaceLightContribs_t& contribs )
+{
+	contribs.m_nStride = info.m_NormalCount + 1;
+	contribs.m_pLightContrib = (int *)malloc( numdlights * sizeof(int) );
+	memset( contribs.m_pLightContrib, 0xFF, numdlights * sizeof(int) );
+
+	contribs.m_pHasSample = (bool *)calloc( info.m_LightmapSize, sizeof(bool) );
+	for ( int i = 0; i < info.m_pFaceLight->numsamples; ++i )
+	{
+		sample_t const &sample = info.m_pFaceLight->sample[i];
+		contribs.m_pHasSample[sample.s + sample.t * info.m_LightmapWidth] = true;
+	}
+}
+
+static void FreeFaceLightContribs( FaceLightContribs_t& contribs )
+{
+	for ( int i = 0; i < contribs.m_Contribs.Count(); ++i )
+	{
+		free( contribs.m_Contribs[i].m_pAmount );
+	}
+	contribs.m_Contribs.Purge();
+	free( contribs.m_pLightContrib );
+	contribs.m_pLightContrib = NULL;
+	free( contribs.m_pHasSample );
+	contribs.m_pHasSample = NULL;
+}
+
+static float *FindOrAllocateLightContrib( SSE_SampleInfo_t const& info, FaceLightContribs_t& contribs, 
+										 directlight_t *dl, int lightStyleIndex )
+{
+	int iContrib = contribs.m_pLightContrib[dl->index];
+	if ( iContrib < 0 )
+	{
+		iContrib = contribs.m_Contribs.AddToTail();
+		contribs.m_pLightContrib[dl->index] = iContrib;
+
+		LightContrib_t &contrib = contribs.m_Contribs[iContrib];
+		contrib.m_pLight = dl;
+		contrib.m_nStyleIndex = lightStyleIndex;
+		contrib.m_pAmount = (float *)calloc( info.m_LightmapSize * contribs.m_nStride, sizeof(float) );
+	}
+	return contribs.m_Contribs[iContrib].m_pAmount;
+}
+
 //-----------------------------------------------------------------------------
 // Iterates over all lights and computes lighting at up to 4 sample points
 //-----------------------------------------------------------------------------
-static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples, FaceLightContribs_t *pContribs )
 {
 	SSE_sampleLightOutput_t out;
 
@@ -2561,15 +2626,31 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
 			}
 		}
+
+		// Remember what this light added to each luxel for supersampling
+		if ( pContribs )
+		{
+			float *pAmount = FindOrAllocateLightContrib( info, *pContribs, dl, lightStyleIndex );
+			for ( int i = 0; i < numSamples; i++ )
+			{
+				sample_t &sample = info.m_pFaceLight->sample[sampleIdx + i];
+				float *pLuxel = pAmount + ( sample.s + sample.t * info.m_LightmapWidth ) * pContribs->m_nStride;
+				for( int n = 0; n < info.m_NormalCount; ++n )
+				{
+					pLuxel[n] = SubFloat( fxdot[n], i );
+				}
+				pLuxel[info.m_NormalCount] = SubFloat( out.m_flSunAmount, i );
+			}
+		}
 	}
 }
 
 
 
 //-----------------------------------------------------------------------------
-// Iterates over all lights and computes lighting at a sample point
+// Iterates over the given lights and computes lighting at 4 sample points
 //-----------------------------------------------------------------------------
-static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex, int flags, LightingValue_t pLightmap[4][NUM_BUMP_VECTS+1] )
+static void ResampleLightAt4Points( SSE_SampleInfo_t& info, directlight_t **ppLights, int nLights, LightingValue_t pLightmap[4][NUM_BUMP_VECTS+1] )
 {
 	SSE_sampleLightOutput_t out;
 
@@ -2582,20 +2663,10 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 		}
 	}
 
-	// Iterate over all direct lights and add them to the particular sample
-	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
+	// The caller has already picked out the lights for this lightstyle
+	for ( int iLight = 0; iLight < nLights; ++iLight )
 	{
-		if ((flags & AMBIENT_ONLY) && (dl->light.type != emit_skyambient))
-			continue;
-
-		if ((flags & NON_AMBIENT_ONLY) && (dl->light.type == emit_skyambient))
-			continue;
-
-		// Only add contributions that match the lightstyle 
-		Assert( lightStyleIndex <= MAXLIGHTMAPS );
-		Assert( info.m_pFace->styles[lightStyleIndex] != 255 );
-		if (dl->light.style != info.m_pFace->styles[lightStyleIndex])
-			continue;
+		directlight_t *dl = ppLights[iLight];
 
 		// is this lights cluster visible?
 		fltx4 dotMask = Four_Zeros;
@@ -2680,8 +2751,8 @@ bool PointsInWinding ( FourVectors const & point, winding_t *w, int &invalidBits
 //-----------------------------------------------------------------------------
 // Perform supersampling at a particular point
 //-----------------------------------------------------------------------------
-static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info, 
-									int sampleIndex, int lightStyleIndex, LightingValue_t *pLight, int flags )
+static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info, int sampleIndex, 
+									directlight_t **ppLights, int nLights, LightingValue_t *pLight, int flags )
 {
 	sample_t& sample = info.m_pFaceLight->sample[sampleIndex];
 
@@ -2738,7 +2809,7 @@ static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info,
 
 			// Resample the non-ambient light at this point...
 			LightingValue_t result[4][NUM_BUMP_VECTS+1];
-			ResampleLightAt4Points( info, lightStyleIndex, NON_AMBIENT_ONLY, result );
+			ResampleLightAt4Points( info, ppLights, nLights, result );
 
 			// Got more subsamples
 			for ( int i = 0; i < 4; i++ )
@@ -2771,7 +2842,7 @@ static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info,
 		ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
 
 		LightingValue_t result[4][NUM_BUMP_VECTS+1];
-		ResampleLightAt4Points( info, lightStyleIndex, AMBIENT_ONLY, result );
+		ResampleLightAt4Points( info, ppLights, nLights, result );
 
 		// Got more subsamples
 		for ( int i = 0; i < 4; i++ )
@@ -2862,13 +2933,73 @@ static void ComputeSampleIntensities( SSE_SampleInfo_t& info, LightingValue_t **
 	}
 }
 
+// Luxels whose perceived intensity changes more than this against a neighbor get supersampled
+#define SUPERSAMPLE_GRADIENT	0.0625f
+
+//-----------------------------------------------------------------------------
+// Does this light change enough around a luxel to need supersampling? A light
+// that was occluded at the luxel and all its neighbors, or that reached all of
+// them and only fell off smoothly, keeps its base sample.
+//-----------------------------------------------------------------------------
+static bool IsEdgeLight( SSE_SampleInfo_t& info, FaceLightContribs_t const& contribs, 
+						 LightContrib_t const& contrib, sample_t const& sample )
+{
+	float flMin[NUM_BUMP_VECTS+1];
+	float flMax[NUM_BUMP_VECTS+1];
+	for ( int n = 0; n < info.m_NormalCount; ++n )
+	{
+		flMin[n] = FLT_MAX;
+		flMax[n] = 0.0f;
+	}
+
+	int w = info.m_LightmapWidth;
+	int h = info.m_LightmapHeight;
+	for ( int t = max( sample.t - 1, 0 ); t <= min( sample.t + 1, h - 1 ); ++t )
+	{
+		for ( int s = max( sample.s - 1, 0 ); s <= min( sample.s + 1, w - 1 ); ++s )
+		{
+			// Nothing was gathered there, so it would read as unlit and make every border an edge
+			if ( !contribs.m_pHasSample[s + t * w] )
+				continue;
+
+			const float *pLuxel = contrib.m_pAmount + ( s + t * w ) * contribs.m_nStride;
+			for ( int n = 0; n < info.m_NormalCount; ++n )
+			{
+				flMin[n] = min( flMin[n], pLuxel[n] );
+				flMax[n] = max( flMax[n], pLuxel[n] );
+			}
+		}
+	}
+
+	// Same measure as ComputeLuxelIntensity, for this light on its own
+	Vector const &color = contrib.m_pLight->light.intensity;
+	float flScale = fabs( color.x + color.y + color.z ) / 256.0f;
+	for ( int n = 0; n < info.m_NormalCount; ++n )
+	{
+		if ( flMax[n] <= 0.0f )
+			continue;
+
+		float flGradient = pow( flMax[n] * flScale, 1.0f / 2.2f ) - pow( max( flMin[n], 0.0f ) * flScale, 1.0f / 2.2f );
+		if ( flGradient >= SUPERSAMPLE_GRADIENT )
+			return true;
+	}
+	return false;
+}
+
 //-----------------------------------------------------------------------------
 // Perform supersampling on a particular lightstyle
 //-----------------------------------------------------------------------------
-static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info, int lightstyleIndex )
+static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info, int lightstyleIndex, 
+										FaceLightContribs_t const& contribs )
 {
 	LightingValue_t pAmbientLight[NUM_BUMP_VECTS+1];
 	LightingValue_t pDirectLight[NUM_BUMP_VECTS+1];
+	LightingValue_t pKeptLight[NUM_BUMP_VECTS+1];
+
+	// The lights that cause the edge at the luxel being supersampled
+	int nContribs = contribs.m_Contribs.Count();
+	directlight_t **ppAmbientLights = (directlight_t **)stackalloc( nContribs * sizeof(directlight_t *) );
+	directlight_t **ppDirectLights = (directlight_t **)stackalloc( nContribs * sizeof(directlight_t *) );
 
 	// This is used to make sure we don't supersample a light sample more than once
 	int processedSampleSize = info.m_LightmapSize * sizeof(bool);
@@ -2917,7 +3048,7 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 				continue;
 
 			// Don't supersample if the lighting is pretty uniform near the sample
-			if (pGradient[i] < 0.0625)
+			if (pGradient[i] < SUPERSAMPLE_GRADIENT)
 				continue;
 
 			// Joy! We're supersampling now, and we therefore must do another pass
@@ -2934,28 +3065,67 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 				pVisualizePass[i][2] = (pass & 4) * 64;
 			}
 
+			// Split the lights into the ones causing the edge, which get resampled,
+			// and the rest, which keep what the base sample gathered
+			sample_t& sample = info.m_pFaceLight->sample[i];
+			int nAmbientLights = 0;
+			int nDirectLights = 0;
+			for ( int n = 0; n < info.m_NormalCount; ++n )
+				pKeptLight[n].Zero();
+
+			for ( int c = 0; c < nContribs; ++c )
+			{
+				LightContrib_t const &contrib = contribs.m_Contribs[c];
+				if ( contrib.m_nStyleIndex != lightstyleIndex )
+					continue;
+
+				directlight_t *dl = contrib.m_pLight;
+				if ( IsEdgeLight( info, contribs, contrib, sample ) )
+				{
+					if ( dl->light.type == emit_skyambient )
+						ppAmbientLights[nAmbientLights++] = dl;
+					else
+						ppDirectLights[nDirectLights++] = dl;
+					continue;
+				}
+
+				const float *pLuxelAmount = contrib.m_pAmount + ( sample.s + sample.t * info.m_LightmapWidth ) * contribs.m_nStride;
+				for ( int n = 0; n < info.m_NormalCount; ++n )
+					pKeptLight[n].AddLight( pLuxelAmount[n], dl->light.intensity, pLuxelAmount[info.m_NormalCount] );
+			}
+
+			// The luxel is on an edge of the total, but no single light changes much
+			if ( nAmbientLights == 0 && nDirectLights == 0 )
+				continue;
+
 			// Supersample the ambient light for each bump direction vector
-			int ambientSupersampleCount = SupersampleLightAtPoint( l, info, i, lightstyleIndex, pAmbientLight, AMBIENT_ONLY );
+			int ambientSupersampleCount = 0;
+			if ( nAmbientLights > 0 )
+				ambientSupersampleCount = SupersampleLightAtPoint( l, info, i, ppAmbientLights, nAmbientLights, pAmbientLight, AMBIENT_ONLY );
 
 			// Supersample the non-ambient light for each bump direction vector
-			int directSupersampleCount = SupersampleLightAtPoint( l, info, i, lightstyleIndex, pDirectLight, NON_AMBIENT_ONLY );
+			int directSupersampleCount = 0;
+			if ( nDirectLights > 0 )
+				directSupersampleCount = SupersampleLightAtPoint( l, info, i, ppDirectLights, nDirectLights, pDirectLight, NON_AMBIENT_ONLY );
 
 			// Because of sampling problems, small area triangles may have no samples.
 			// In this case, just use what we already have
-			if ( ambientSupersampleCount > 0 && directSupersampleCount > 0 )
+			if ( ( nAmbientLights > 0 && ambientSupersampleCount == 0 ) || ( nDirectLights > 0 && directSupersampleCount == 0 ) )
+				continue;
+
+			// Add the kept + resampled terms together, stick it back into the lightmap
+			for (int n = 0; n < info.m_NormalCount; ++n)
 			{
-				// Add the ambient + directional terms together, stick it back into the lightmap
-				for (int n = 0; n < info.m_NormalCount; ++n)
-				{
-					ppLightSamples[n][i].Zero();
-					ppLightSamples[n][i].AddWeighted( pDirectLight[n],1.0f / directSupersampleCount );
+				ppLightSamples[n][i] = pKeptLight[n];
+				if ( directSupersampleCount > 0 )
+					ppLightSamples[n][i].AddWeighted( pDirectLight[n], 1.0f / directSupersampleCount );
+				if ( ambientSupersampleCount > 0 )
 					ppLightSamples[n][i].AddWeighted( pAmbientLight[n], 1.0f / ambientSupersampleCount );
-				}
-
-				// Recompute the luxel intensity based on the supersampling
-				ComputeLuxelIntensity( info, i, ppLightSamples, pSampleIntensity );
 			}
 
+			// Recompute the luxel intensity based on the supersampling
+			ComputeLuxelIntensity( info, i, ppLightSamples, pSampleIntensity );
+
 		}
 
 		// We've finished another pass
@@ -3113,6 +3283,15 @@ void BuildFacelights (int iThread, int facenum)
 	f->styles[0] = 0;
 	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
+	// Supersampling wants to know what each light added to each luxel. Incremental
+	// lighting returns before the supersampling pass, so it doesn't collect them.
+	bool bSupersample = do_extra && !sampleInfo.m_IsDispFace && !g_pIncremental;
+	FaceLightContribs_t contribs;
+	if ( bSupersample )
+	{
+		InitFaceLightContribs( sampleInfo, contribs );
+	}
+
 	// sample the lights at each sample location
 	for ( int grp = 0; grp < numGroups; ++grp )
 	{
@@ -3142,7 +3321,7 @@ void BuildFacelights (int iThread, int facenum)
 		}
 
 		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples, bSupersample ? &contribs : NULL );
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3340,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (bSupersample)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -3170,14 +3349,16 @@ void BuildFacelights (int iThread, int facenum)
 			if (f->styles[i] == 255)
 				break;
 
-			BuildSupersampleFaceLights( l, sampleInfo, i );
+			BuildSupersampleFaceLights( l, sampleInfo, i, contribs );
 		}
+
+		FreeFaceLightContribs( contribs );
 	}
 
-	if (!g_bUseMPI) 
+	if (!g_bUseMPI && !LocalDist_IsWorker()) 
 	{
 		//
-		// This is done on the master node when MPI is used
+		// This is done on the master node when MPI or -dist is used
 		//
 		BuildPatchLights( facenum );
 	}
@@ -3419,6 +3600,54 @@ void PrecompLightmapOffsets()
 	pdlightdata->SetSize( lightdatasize );
 }
 
+
+//-----------------------------------------------------------------------------
+// Estimate how full lightmap pages would come out, once in face order and once
+// in the best sort order. Only an estimate: the engine packs the pages itself
+// when it loads the map, and nothing here changes its layout.
+//-----------------------------------------------------------------------------
+#define LIGHTMAP_PAGE_WIDTH		512
+#define LIGHTMAP_PAGE_HEIGHT	256
+
+void ReportLightmapPackEstimate()
+{
+	CUtlVector<ImagePackerBlock_t> blocks;
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		dface_t *f = &g_pFaces[facenum];
+		if ( f->lightofs == -1 || ( texinfo[f->texinfo].flags & TEX_SPECIAL ) )
+			continue;
+
+		// Bumped faces keep all their lightmaps side by side
+		ImagePackerBlock_t &block = blocks[ blocks.AddToTail() ];
+		block.m_nWidth = f->m_LightmapTextureSizeInLuxels[0] + 1;
+		block.m_nHeight = f->m_LightmapTextureSizeInLuxels[1] + 1;
+		if ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT )
+		{
+			block.m_nWidth *= NUM_BUMP_VECTS + 1;
+		}
+	}
+
+	if ( !blocks.Count() )
+		return;
+
+	ImagePackerStats_t faceOrder, best;
+	PackImageBlocks( blocks, LIGHTMAP_PAGE_WIDTH, LIGHTMAP_PAGE_HEIGHT, IMAGEPACKER_SORT_NONE, &faceOrder );
+	if ( !PackImageBlocksBestOrder( blocks, LIGHTMAP_PAGE_WIDTH, LIGHTMAP_PAGE_HEIGHT, true, &best ) )
+	{
+		Warning( "Some face lightmaps are bigger than a %dx%d lightmap page\n", LIGHTMAP_PAGE_WIDTH, LIGHTMAP_PAGE_HEIGHT );
+	}
+
+	Msg( "Lightmap packing estimate (%dx%d pages): %d in face order, %.1f%% full; %d sorted by %s, %.1f%% full\n",
+		LIGHTMAP_PAGE_WIDTH, LIGHTMAP_PAGE_HEIGHT,
+		faceOrder.m_nPages, faceOrder.m_nPageArea ? 100.0f * faceOrder.m_nBlockArea / faceOrder.m_nPageArea : 0.0f,
+		best.m_nPages, best.m_nSortOrder == IMAGEPACKER_SORT_NONE ? "nothing" : 
+			( best.m_nSortOrder == IMAGEPACKER_SORT_HEIGHT ? "height" : 
+			( best.m_nSortOrder == IMAGEPACKER_SORT_AREA ? "area" : 
+			( best.m_nSortOrder == IMAGEPACKER_SORT_MAX_SIDE ? "longest side" : "width" ) ) ),
+		best.m_nPageArea ? 100.0f * best.m_nBlockArea / best.m_nPageArea : 0.0f );
+}
+
 // Clamp the three values for bumped lighting such that we trade off directionality for brightness.
 static void ColorClampBumped( Vector& color1, Vector& color2, Vector& color3 )
 {
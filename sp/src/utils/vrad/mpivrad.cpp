@@ -294,8 +294,10 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		patch->numtransfers = numtransfers;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			transfer_t *transfers = new transfer_t[numtransfers];
+			pBuf->read(transfers, numtransfers * sizeof(transfer_t));
+			g_TransferMatrix.SetRow( patchnum, transfers, numtransfers );
+			delete[] transfers;
 		}
 		
 		total_transfer += numtransfers;
@@ -330,7 +332,8 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		// MakeScales left this patch's scaled transfers in the thread's buffer
+		pData->m_pVisLeafsMB->write( pData->m_pBuildVisLeafsTransfers, patch->numtransfers * sizeof(transfer_t) );
 	}
 }
 
@@ -0,0 +1,158 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Sidecar cache that lets vrad relight only what changed since the
+//			last compile of a map.
+//
+//			Runs with -vradcache or -relight write <mapname>.vradcache next to
+//			the map with the lights it used, a coarse hash of the shadow
+//			casting geometry, the final lightmap of every face, the bounced
+//			light each luxel got and the per-leaf ambient samples, which makes
+//			it about twice the size of the lighting lump. With -relight the
+//			cache is diffed against the current map: lights that were added,
+//			removed or edited and cells of geometry that moved mark the faces
+//			and leaves they can reach, and only those are lit again.
+//			Everything else is copied from the cache, and relit faces reuse
+//			their cached bounced light, so the bounce is skipped entirely.
+//
+//=============================================================================//
+
+#ifndef RELIGHTCACHE_H
+#define RELIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "checksum_md5.h"
+#include "mathlib/mathlib.h"
+#include "leaf_ambient_lighting.h"
+
+
+struct RelightLight_t;
+struct RelightCell_t;
+struct RelightFace_t;
+struct RelightLeaf_t;
+
+
+class CRelightCache
+{
+public:
+	CRelightCache();
+	~CRelightCache();
+
+	// Hash the options that change the lighting. Options that only change how vrad runs
+	// (-threads, -v, -mpi...) are left out.
+	void SetCommandLine( int argc, char **argv );
+
+	// Turn the cache on. pMapBase is the map name without an extension.
+	void Init( const char *pMapBase );
+
+	// Hash the triangles added to g_RtEnv into coarse cells. Call before the acceleration
+	// structure is built, since that overwrites the triangle vertices.
+	void HashShadowCasters();
+
+	// Remember the lights of this run and get ready to capture face lighting. Call before
+	// ExportDirectLightsToWorldLights frees the lights.
+	void BeginLighting();
+
+	// Load the previous run's cache and work out which faces and leaves have to be lit again.
+	// Returns false if the cache is missing, stale or the change is too big, in which case
+	// the whole map has to be lit.
+	bool BeginRelight();
+	bool IsRelighting() const			{ return m_bRelighting; }
+
+	// Faces to run BuildFacelights on: the relit faces and their neighbors.
+	void GetFacesToSample( CUtlVector<byte> &faces );
+
+	// After BuildFacelights: put back the styles of faces whose lightmaps come from the cache.
+	void RestoreFaceStyles();
+
+	// FinalLightFace: copy a face's lightmap from the cache. Returns false if it has to be lit.
+	bool RestoreFaceLighting( int iFace );
+
+	// Bounced light of a face's luxels for style 0, bump samples interleaved per luxel.
+	// Returns NULL if there's none with the right size.
+	const ColorRGBExp32 *GetFaceIndirect( int iFace, int nSamples ) const;
+	bool WantsFaceIndirect() const		{ return m_bEnabled && !m_bRelighting; }
+	ColorRGBExp32 *AllocFaceIndirect( int iFace, int nSamples );
+
+	// Leaf ambient: copy a leaf's samples from the cache. Returns false if it has to be computed.
+	bool RestoreLeafAmbient( int iLeaf, CUtlVector<ambientsample_t> &samples ) const;
+
+	// Call once all faces have been through FinalLightFace.
+	void SetFaceLightingDone()			{ m_bFaceLightingDone = true; }
+
+	// Write the cache for the next run. Does nothing unless face lighting was done.
+	void Save();
+
+private:
+	enum FaceState_t
+	{
+		FACE_CACHED = 0,	// lightmap comes from the cache
+		FACE_SAMPLED,		// direct light is sampled for the neighbors' filtering, lightmap comes from the cache
+		FACE_RELIT,			// lit again
+	};
+
+	struct Region_t
+	{
+		Vector m_Mins;
+		Vector m_Maxs;
+	};
+
+	struct DispPair_t
+	{
+		int m_iFace;
+		int m_iOther;
+	};
+
+	void ComputeFaceHashes();
+	bool LoadCache();
+	void FreeCache();
+	int DiffLights( CUtlVector<Region_t> &regions );
+	void DiffShadowCasters( CUtlVector<Region_t> &changes );
+	void AddGeometryChangeRegions( const CUtlVector<Region_t> &changes, CUtlVector<Region_t> &regions, CUtlVector<Region_t> &sunChanges );
+	bool MatchFaces();
+	void MarkRelitFaces( const CUtlVector<Region_t> &regions, const CUtlVector<Region_t> &sunChanges );
+	void FindDispNeighbors( CUtlVector<DispPair_t> &pairs );
+	void MarkRelitLeafs( const CUtlVector<Region_t> &regions );
+
+	bool m_bEnabled;
+	bool m_bRelighting;
+	bool m_bFaceLightingDone;
+	char m_szFileName[MAX_PATH];
+	MD5Value_t m_SettingsHash;
+
+	// this run
+	CUtlVector<RelightLight_t> m_Lights;
+	bool m_bHasSun;
+	bool m_bHasSkyAmbient;
+	Vector m_vecSunDir;
+	CUtlVector<RelightCell_t> m_Cells;
+	CUtlVector<MD5Value_t> m_FaceHashes;
+	CUtlVector<Vector> m_FaceMins;
+	CUtlVector<Vector> m_FaceMaxs;
+	CUtlVector< CUtlVector<ColorRGBExp32> > m_FaceIndirect;
+
+	// the previous run, while relighting
+	CUtlVector<byte> m_CacheFile;
+	int m_nCachedLights;
+	int m_nCachedCells;
+	int m_nCachedFaces;
+	int m_nCachedLeafs;
+	const RelightLight_t *m_pCachedLights;
+	const RelightCell_t *m_pCachedCells;
+	const RelightFace_t *m_pCachedFaces;
+	const byte *m_pCachedFaceData;
+	const RelightLeaf_t *m_pCachedLeafs;
+	const ambientsample_t *m_pCachedLeafSamples;
+
+	CUtlVector<byte> m_FaceState;
+	CUtlVector<int> m_FaceCacheIndex;
+	CUtlVector<bool> m_LeafRelit;
+};
+
+
+extern CRelightCache g_RelightCache;
+
+
+#endif // RELIGHTCACHE_H
@@ -8,6 +8,8 @@
 
 #include "vrad.h"
 #include "vmpi.h"
+#include "localdist.h"
+#include "distvrad.h"
 #ifdef MPI
 #include "messbuf.h"
 static MessageBuffer mb;
@@ -471,6 +473,10 @@ void BuildVisMatrix (void)
 	{
 		RunMPIBuildVisLeafs();
 	}
+	else if ( LocalDist_IsMaster() || LocalDist_IsWorker() )
+	{
+		RunDistBuildVisLeafs();
+	}
 	else 
 	{
 		RunThreadsOn (dvis->numclusters, true, BuildVisLeafs);
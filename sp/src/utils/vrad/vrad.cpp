@@ -19,6 +19,10 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transfermatrix.h"
+#include "relightcache.h"
+#include "localdist.h"
+#include "distvrad.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +61,13 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bUseRtCache = false;
+bool		g_bLightmapPackEstimate = false;
+bool		g_bUseVradCache = false;
+bool		g_bRelight = false;
+int			g_nRtBenchmarkPackets = 0;
+int			g_nTransferMemoryMB = 0;			// 0 = keep all transfers in memory
+float		g_flBounceTolerance = 0.0f;			// 0 = bounce until -bounce or the absolute cutoff
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -1202,14 +1213,14 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
 		return;
 	CPatch *patch = &g_Patches.Element( ndxPatch );
 
-	// copy the transfers out
+	// scale the transfers and store them compressed
 	if (patch->numtransfers)
 	{
 		if (patch->numtransfers > max_transfer)
@@ -1218,17 +1229,13 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		}
 
 
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
-		t2 = all_transfers;
+		t = all_transfers;
 
 		// overflow check!
-		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
 		{
-			total += t2->transfer;
+			total += t->transfer;
 		}
 
 		// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
@@ -1237,13 +1244,15 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		t = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			t->transfer *= total;
 		}
+		// -dist workers send the scaled transfers to the master instead.
+		if ( !LocalDist_IsWorker() )
+			g_TransferMatrix.SetRow( ndxPatch, all_transfers, patch->numtransfers );
+
 		if (patch->numtransfers > max_transfer)
 		{
 			max_transfer = patch->numtransfers;
@@ -1531,14 +1540,101 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+//-----------------------------------------------------------------------------
+// Structure of arrays copies of the per patch data GatherLight reads, so that
+// gathering a row of transfers touches a few floats per transfer instead of
+// two CPatch structs and an emitlight entry.
+//-----------------------------------------------------------------------------
+struct BounceSoA_t
+{
+	CUtlVector<float> m_Origin[3];
+	CUtlVector<float> m_Reflectivity[3];
+	CUtlVector<float> m_Radiosity[3];		// emitlight * reflectivity, refreshed every bounce
+};
+
+static BounceSoA_t s_Bounce;
+
+static void InitBounceSoA( void )
+{
+	int nPatches = g_Patches.Count();
+	for ( int c = 0; c < 3; c++ )
+	{
+		s_Bounce.m_Origin[c].SetCount( nPatches );
+		s_Bounce.m_Reflectivity[c].SetCount( nPatches );
+		s_Bounce.m_Radiosity[c].SetCount( nPatches );
+	}
+
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		for ( int c = 0; c < 3; c++ )
+		{
+			s_Bounce.m_Origin[c][i] = g_Patches[i].origin[c];
+			s_Bounce.m_Reflectivity[c][i] = g_Patches[i].reflectivity[c];
+		}
+	}
+}
+
+static void UpdateBounceRadiosity( void )
+{
+	int nPatches = g_Patches.Count();
+	for ( int c = 0; c < 3; c++ )
+	{
+		float *pRadiosity = s_Bounce.m_Radiosity[c].Base();
+		const float *pReflectivity = s_Bounce.m_Reflectivity[c].Base();
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			pRadiosity[i] = emitlight[i][c] * pReflectivity[i];
+		}
+	}
+}
+
+static void FreeBounceSoA( void )
+{
+	for ( int c = 0; c < 3; c++ )
+	{
+		s_Bounce.m_Origin[c].Purge();
+		s_Bounce.m_Reflectivity[c].Purge();
+		s_Bounce.m_Radiosity[c].Purge();
+	}
+}
+
+// load 4 entries of a SoA array, picked by patch index
+static FORCEINLINE fltx4 GatherSIMD( const float *pArray, const int *pIndices )
+{
+	fltx4 result;
+	SubFloat( result, 0 ) = pArray[pIndices[0]];
+	SubFloat( result, 1 ) = pArray[pIndices[1]];
+	SubFloat( result, 2 ) = pArray[pIndices[2]];
+	SubFloat( result, 3 ) = pArray[pIndices[3]];
+	return result;
+}
+
+static FORCEINLINE void GatherRadiosity( const int *pIndices, FourVectors &radiosity )
+{
+	radiosity.x = GatherSIMD( s_Bounce.m_Radiosity[0].Base(), pIndices );
+	radiosity.y = GatherSIMD( s_Bounce.m_Radiosity[1].Base(), pIndices );
+	radiosity.z = GatherSIMD( s_Bounce.m_Radiosity[2].Base(), pIndices );
+}
+
+static FORCEINLINE Vector SumFourVectors( const FourVectors &v )
+{
+	return v.Vec( 0 ) + v.Vec( 1 ) + v.Vec( 2 ) + v.Vec( 3 );
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
-	transfer_t	*trans;
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
 
+	// rows are decoded out of g_TransferMatrix into here
+	int nRowSize = max( max_transfer, 1 );
+	int *pRowPatches = (int *)malloc( nRowSize * sizeof( int ) );
+	float *pRowTransfers = (float *)malloc( nRowSize * sizeof( float ) );
+	if ( !pRowPatches || !pRowTransfers )
+		Error( "Memory allocation failure" );
+
 	while (1)
 	{
 		j = GetThreadWork ();
@@ -1547,8 +1643,8 @@ void GatherLight (int threadnum, void *pUserData)
 
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
+		num = g_TransferMatrix.GetRow( threadnum, j, pRowPatches, pRowTransfers );
+		int num4 = num & ~3;
 		if ( patch->needsBumpmap )
 		{
 			Vector delta;
@@ -1582,27 +1678,63 @@ void GatherLight (int threadnum, void *pUserData)
 			// FIXME: why does the patch not use the phong normal?
 			normals[0] = patch->normal;
 
+			// 4 transfers at a time
+			FourVectors origin4, normals4[NUM_BUMP_VECTS+1], bumpSum4[NUM_BUMP_VECTS+1];
+			origin4.DuplicateVector( patch->origin );
+			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+			{
+				normals4[i].DuplicateVector( normals[i] );
+				bumpSum4[i].DuplicateVector( vec3_origin );
+			}
+
+			for ( k = 0; k < num4; k += 4 )
+			{
+				const int *pIndices = pRowPatches + k;
+
+				// get vector to other patch
+				FourVectors delta4;
+				delta4.x = SubSIMD( GatherSIMD( s_Bounce.m_Origin[0].Base(), pIndices ), origin4.x );
+				delta4.y = SubSIMD( GatherSIMD( s_Bounce.m_Origin[1].Base(), pIndices ), origin4.y );
+				delta4.z = SubSIMD( GatherSIMD( s_Bounce.m_Origin[2].Base(), pIndices ), origin4.z );
+				delta4.VectorNormalize();
+
+				// find light emitted from other patch, and remove normal already factored into
+				// transfer steradian
+				FourVectors v4;
+				GatherRadiosity( pIndices, v4 );
+				fltx4 scale = DivSIMD( LoadUnalignedSIMD( pRowTransfers + k ), delta4 * normals4[0] );
+				v4 *= scale;
+
+				// a bump vector facing away from the other patch gets nothing
+				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+				{
+					fltx4 dot = MaxSIMD( delta4 * normals4[i], Four_Zeros );
+					FourVectors bumpTransfer = v4;
+					bumpTransfer *= dot;
+					bumpSum4[i] += bumpTransfer;
+				}
+			}
+
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 			{
-				VectorFill( bumpSum[i], 0 );
+				bumpSum[i] = SumFourVectors( bumpSum4[i] );
 			}
 
 			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+			for ( ; k<num ; k++ )
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+				int ndxPatch2 = pRowPatches[k];
 
 				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					delta[i] = s_Bounce.m_Origin[i][ndxPatch2] - patch->origin[i];
+					v[i] = s_Bounce.m_Radiosity[i][ndxPatch2];
 				}
+				VectorNormalize (delta);
 				// remove normal already factored into transfer steradian
 				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
+				VectorScale( v, pRowTransfers[k] * scale, v );
 				
 				Vector bumpTransfer;
 				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1624,19 +1756,33 @@ void GatherLight (int threadnum, void *pUserData)
 		}
 		else
 		{
-			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			FourVectors sum4;
+			sum4.DuplicateVector( vec3_origin );
+			for ( k = 0; k < num4; k += 4 )
 			{
+				FourVectors v4;
+				GatherRadiosity( pRowPatches + k, v4 );
+				v4 *= LoadUnalignedSIMD( pRowTransfers + k );
+				sum4 += v4;
+			}
+
+			sum = SumFourVectors( sum4 );
+			for ( ; k<num ; k++ )
+			{
+				int ndxPatch2 = pRowPatches[k];
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					v[i] = s_Bounce.m_Radiosity[i][ndxPatch2];
 				}
-				VectorScale( v, trans->transfer, v );
+				VectorScale( v, pRowTransfers[k], v );
 				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
 		}
 	}
+
+	free( pRowPatches );
+	free( pRowTransfers );
 }
 
 #ifdef _WIN32
@@ -1699,23 +1845,44 @@ void BounceLight (void)
 	}
 #endif
 
+	InitBounceSoA();
+
+	Vector bounced;
+	VectorFill( bounced, 0 );
+
 	i = 0;
 	while ( bouncing )
 	{
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
+		UpdateBounceRadiosity();
 		unsigned int uiPatchCount = g_Patches.Size();
 		RunThreadsOn (uiPatchCount, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
 		CollectLight( added );
+		VectorAdd( bounced, added, bounced );
 
-		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		// how much this bounce changed the bounced light, relative to all of it so far
+		float flChange = 0.0f;
+		for ( int c = 0; c < 3; c++ )
+		{
+			if ( bounced[c] > 0.0f )
+				flChange = max( flChange, added[c] / bounced[c] );
+		}
+
+		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f), %.4f%% change\n", i+1, added[0], added[1], added[2], flChange * 100.0f );
 
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
 
+		if ( bouncing && g_flBounceTolerance > 0.0f && flChange < g_flBounceTolerance )
+		{
+			qprintf ("\tConverged after %i bounces (change below -bouncetol %g)\n", i+1, g_flBounceTolerance );
+			bouncing = false;
+		}
+
 		i++;
 		if ( g_bDumpPatches && !bouncing && i != 1)
 		{
@@ -1723,6 +1890,8 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	FreeBounceSoA();
 }
 
 
@@ -1923,16 +2092,31 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	char spillfilebase[MAX_PATH];
+	Q_StripExtension( source, spillfilebase, sizeof( spillfilebase ) );
+	g_TransferMatrix.Init( g_Patches.Count(), (int64)g_nTransferMemoryMB * 1024 * 1024, spillfilebase );
+
 	// determine visibility between patches
 	BuildVisMatrix ();
+
+	// -dist workers are done once the master has the transfers.
+	if ( LocalDist_IsWorker() )
+		LocalDist_WorkerExit();
+	if ( verbose )
+		g_RtEnv.PrintRayStreamStats();
 	
 	// release visibility matrix
 	FreeVisMatrix ();
 
+	// lay the transfer lists out in patch order for BounceLight
+	g_TransferMatrix.Finalize();
+
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	qprintf ("transfer lists: %5.1f megs (%5.1f megs uncompressed, %5.1f megs spilled to disk)\n"
+		, (float)g_TransferMatrix.GetCompressedSize() / (1024*1024)
+		, (float)g_TransferMatrix.GetNumTransfers() * sizeof(transfer_t) / (1024*1024)
+		, (float)g_TransferMatrix.GetSpilledSize() / (1024*1024));
 }
 
 
@@ -2003,6 +2187,14 @@ bool RadWorld_Go()
 
 	InitMacroTexture( source );
 
+	g_RelightCache.BeginLighting();
+
+	bool bRelight = false;
+	if ( g_bRelight && !g_pIncremental )
+	{
+		bRelight = g_RelightCache.BeginRelight();
+	}
+
 	if( g_pIncremental )
 	{
 		g_pIncremental->PrepareForLighting();
@@ -2010,6 +2202,12 @@ bool RadWorld_Go()
 		// Cull out faces that aren't visible to any of the lights that we're updating with.
 		BuildFacesVisibleToLights( false );
 	}
+	else if ( bRelight )
+	{
+		// Only light the faces the changes can reach, and their neighbors so the luxel
+		// filtering at the edge of the relit area has samples to work with.
+		g_RelightCache.GetFacesToSample( g_FacesVisibleToLights );
+	}
 	else
 	{
 		// Mark all faces visible.. when not doing incremental lighting, it's highly
@@ -2024,6 +2222,14 @@ bool RadWorld_Go()
 		// RunThreadsOnIndividual (numfaces, true, BuildFacelights);
 		RunMPIBuildFacelights();
 	}
+	else if ( LocalDist_IsMaster() || LocalDist_IsWorker() )
+	{
+		RunDistBuildFacelights();
+
+		// Without a bounce there's nothing else for the workers to do.
+		if ( LocalDist_IsWorker() && numbounce == 0 )
+			LocalDist_WorkerExit();
+	}
 	else 
 	{
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
@@ -2033,6 +2239,12 @@ bool RadWorld_Go()
 	if( g_pIncremental && (g_iCurFace != numfaces) )
 		return false;
 
+	// Faces that aren't relit get the lightmap layout of their cached lighting back.
+	if ( bRelight )
+	{
+		g_RelightCache.RestoreFaceStyles();
+	}
+
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
 	
@@ -2043,6 +2255,11 @@ bool RadWorld_Go()
 	}
 	else
 	{
+		if ( g_bLightmapPackEstimate && ( !g_bUseMPI || g_bMPIMaster ) && !LocalDist_IsWorker() )
+		{
+			ReportLightmapPackEstimate();
+		}
+
 		// free up the direct lights now that we have facelights
 		ExportDirectLightsToWorldLights();
 
@@ -2056,7 +2273,8 @@ bool RadWorld_Go()
 			}
 		}
 
-		if (numbounce > 0)
+		// When relighting, FinalLightFace uses the bounced light of the last full compile.
+		if (numbounce > 0 && !bRelight)
 		{
 			// allocate memory for emitlight/addlight
 			emitlight.SetSize( g_Patches.Size() );
@@ -2068,6 +2286,9 @@ bool RadWorld_Go()
 
 			// spread light around
 			BounceLight ();
+
+			// the transfers aren't needed after the last bounce
+			g_TransferMatrix.Shutdown();
 		}
 
 		//
@@ -2081,7 +2302,10 @@ bool RadWorld_Go()
 		// blend bounced light into direct light and save
 		VMPI_SetCurrentStage( "FinalLightFace" );
 		if ( !g_bUseMPI || g_bMPIMaster )
+		{
 			RunThreadsOnIndividual (numfaces, true, FinalLightFace);
+			g_RelightCache.SetFaceLightingDone();
+		}
 		
 		// Distribute the lighting data to workers.
 		VMPI_DistributeLightData();
@@ -2123,6 +2347,7 @@ void InitDumpPatchesFiles()
 void VRAD_LoadBSP( char const *pFilename )
 {
 	ThreadSetDefault ();
+	g_nLumpThreads = numthreads;
 
 	g_flStartTime = Plat_FloatTime();
 
@@ -2141,7 +2366,7 @@ void VRAD_LoadBSP( char const *pFilename )
 	// so we prepend qdir here.
 	strcpy( source, ExpandPath( source ) );
 
-	if ( !g_bUseMPI )
+	if ( !g_bUseMPI && !LocalDist_IsWorker() )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -2250,21 +2475,51 @@ void VRAD_LoadBSP( char const *pFilename )
 	StaticDispMgr()->AddPolysForRayTrace();
 	StaticPropMgr()->AddPolysForRayTrace();
 
+	// The relight cache hashes the triangles before the acceleration structure reformats them.
+	if ( g_bUseVradCache && ( !g_bUseMPI || g_bMPIMaster ) && !LocalDist_IsWorker() )
+	{
+		char cachebase[MAX_PATH];
+		Q_StripExtension( source, cachebase, sizeof( cachebase ) );
+		g_RelightCache.Init( cachebase );
+		g_RelightCache.HashShadowCasters();
+	}
+
 	// Dump raytracer for glview
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
-	// Build acceleration structure
+	// Build acceleration structure. VMPI workers don't have a writable map directory, and
+	// -dist workers would race the master writing the cache.
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	g_RtEnv.m_nBuildThreads = numthreads;
+	bool bCacheHit = false;
+	if ( g_bUseRtCache && ( !g_bUseMPI || g_bMPIMaster ) && !LocalDist_IsWorker() )
+	{
+		char rtcachefile[MAX_PATH];
+		Q_StripExtension( source, rtcachefile, sizeof( rtcachefile ) );
+		Q_strncat( rtcachefile, ".rtcache", sizeof( rtcachefile ), COPY_ALL_CHARACTERS );
+		bCacheHit = g_RtEnv.SetupAccelerationStructure( rtcachefile );
+	}
+	else
+	{
+		g_RtEnv.SetupAccelerationStructure();
+	}
 	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+	printf ( "Done (%.2f seconds%s)\n", end-start, bCacheHit ? ", cached" : "" );
+	if ( verbose )
+		g_RtEnv.PrintAccelerationStructureStats();
 
 #if 0  // To test only k-d build
 	exit(0);
 #endif
 
+	if ( g_nRtBenchmarkPackets )
+	{
+		RunRayTraceBenchmark( g_nRtBenchmarkPackets );
+		exit(0);
+	}
+
 	RadWorld_Start();
 
 	// Setup incremental lighting.
@@ -2281,6 +2536,8 @@ void VRAD_LoadBSP( char const *pFilename )
 
 void VRAD_ComputeOtherLighting()
 {
+	BuildFaceRadianceCache();
+
 	// Compute lighting for the bsp file
 	if ( !g_bNoDetailLighting )
 	{
@@ -2289,6 +2546,8 @@ void VRAD_ComputeOtherLighting()
 
 	ComputePerLeafAmbientLighting();
 
+	FreeFaceRadianceCache();
+
 	// bake the static props high quality vertex lighting into the bsp
 	if ( !do_fast && g_bStaticPropLighting )
 	{
@@ -2308,6 +2567,8 @@ void VRAD_Finish()
 		PrintBSPFileSizes();
 	}
 
+	g_RelightCache.Save();
+
 	Msg( "Writing %s\n", platformPath );
 	VMPI_SetCurrentStage( "WriteBSPFile" );
 	WriteBSPFile(platformPath);
@@ -2400,6 +2661,118 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-lightmappackestimate" ) )
+		{
+			g_bLightmapPackEstimate = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtcache" ) )
+		{
+			g_bUseRtCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-vradcache" ) )
+		{
+			g_bUseVradCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-relight" ) )
+		{
+			g_bRelight = true;
+			g_bUseVradCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-dist" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nLocalDistWorkers = atoi( argv[i] );
+				if ( g_nLocalDistWorkers < 0 )
+				{
+					Warning( "Error: expected non-negative value after '-dist'\n" );
+					return 1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a worker count after '-dist'\n" );
+				return 1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-distport" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nLocalDistPort = atoi( argv[i] );
+			}
+			else
+			{
+				Warning( "Error: expected a port after '-distport'\n" );
+				return 1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-distlisten" ) )
+		{
+			g_bLocalDistListen = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-disttoken" ) )
+		{
+			if ( ++i < argc )
+			{
+				Q_strncpy( g_szLocalDistToken, argv[i], sizeof( g_szLocalDistToken ) );
+			}
+			else
+			{
+				Warning( "Error: expected a token after '-disttoken'\n" );
+				return 1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-distworker" ) )
+		{
+			if ( ++i < argc )
+			{
+				Q_strncpy( g_szLocalDistMaster, argv[i], sizeof( g_szLocalDistMaster ) );
+			}
+			else
+			{
+				Warning( "Error: expected <host:port> after '-distworker'\n" );
+				return 1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_nRtBenchmarkPackets = 1 << 17;
+		}
+		else if ( !Q_stricmp( argv[i], "-bouncetol" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_flBounceTolerance = (float)atof( argv[i] );
+				if ( g_flBounceTolerance < 0.0f )
+				{
+					Warning( "Error: expected non-negative value after '-bouncetol'\n" );
+					return 1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-bouncetol'\n" );
+				return 1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-transfermem" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nTransferMemoryMB = atoi( argv[i] );
+				if ( g_nTransferMemoryMB < 0 )
+				{
+					Warning( "Error: expected non-negative value after '-transfermem'\n" );
+					return 1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-transfermem'\n" );
+				return 1;
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2775,12 +3148,16 @@ void PrintUsage( int argc, char **argv )
 		"\n"
 		"  -v (or -verbose): Turn on verbose output (also shows more command\n"
 		"  -bounce #       : Set max number of bounces (default: 100).\n"
+		"  -bouncetol #    : Stop bouncing once a bounce adds less than this fraction\n"
+		"                    of the light bounced so far (e.g. 0.001).\n"
 		"  -fast           : Quick and dirty lighting.\n"
 		"  -fastambient    : Per-leaf ambient sampling is lower quality to save compute time.\n"
 		"  -final          : High quality processing. equivalent to -extrasky 16.\n"
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
 		"  -low            : Run as an idle-priority process.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
+		"  -dist #         : Start # worker processes on this machine and split\n"
+		"                    BuildFacelights and BuildVisLeafs with them over TCP.\n"
 		"  -rederror       : Show errors in red.\n"
 		"\n"
 		"  -vproject <directory> : Override the VPROJECT environment variable.\n"
@@ -2791,6 +3168,33 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -lightmappackestimate : Estimate how many 512x256 lightmap pages the face\n"
+		"                    lightmaps fill in face order and in the best sort order.\n"
+		"                    The engine packs its own pages when it loads the map, so\n"
+		"                    this does not change the BSP.\n"
+		"  -rtcache        : Cache the ray-trace acceleration structure in\n"
+		"                    <mapname>.rtcache and reuse it while the geometry is\n"
+		"                    unchanged, instead of rebuilding it on every compile.\n"
+		"  -vradcache      : Write <mapname>.vradcache, which -relight uses to relight\n"
+		"                    only what changed since the last compile. It holds every\n"
+		"                    lightmap and the bounced light of every luxel, so it is\n"
+		"                    about twice the size of the map's lighting lump.\n"
+		"  -relight        : Only relight the faces and leaves that lights or geometry\n"
+		"                    changed since the last -vradcache or -relight compile can\n"
+		"                    reach, reusing the rest and the bounced light from\n"
+		"                    <mapname>.vradcache. Implies -vradcache.\n"
+		"  -rtbench        : Measure rays/sec of the scalar, 4-wide and 8-wide ray\n"
+		"                    tracers on the loaded map, then exit.\n"
+		"  -distport #     : Port the -dist master listens on (default: any free one).\n"
+		"  -distlisten     : Let workers on other machines join a -dist master. Needs\n"
+		"                    -disttoken.\n"
+		"  -disttoken <secret> : Shared secret workers send the -dist master. Workers\n"
+		"                    without it are turned away.\n"
+		"  -distworker <host:port> : Work for the -dist master at host:port. Run with\n"
+		"                    the master's options and a path to the same map.\n"
+		"  -transfermem #  : Keep at most # megabytes of patch transfers in memory and\n"
+		"                    spill the rest to a temp file next to the map (default: 0,\n"
+		"                    no limit).\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
@@ -2882,6 +3286,24 @@ int RunVRAD( int argc, char **argv )
 		CmdLib_Exit( 1 );
 	}
 
+	if ( g_bUseMPI && LocalDist_IsRequested() )
+	{
+		Warning( "-dist can't be used with -mpi, ignoring it.\n" );
+		g_nLocalDistWorkers = 0;
+		g_bLocalDistListen = false;
+		g_szLocalDistMaster[0] = 0;
+	}
+
+	if ( g_bRelight && ( g_bUseMPI || LocalDist_IsRequested() ) )
+	{
+		Warning( "-relight can't be used with -mpi or -dist, lighting the whole map.\n" );
+		g_bRelight = false;
+	}
+	g_RelightCache.SetCommandLine( i, argv );
+
+	// Workers are started before loading so they load the map alongside us.
+	LocalDist_Start( argc, argv, source );
+
 	VRAD_LoadBSP( argv[i] );
 
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
@@ -2889,6 +3311,10 @@ int RunVRAD( int argc, char **argv )
 		RadWorld_Go();
 	}
 
+	// The rest isn't distributed, and only the master writes the map.
+	if ( LocalDist_IsWorker() )
+		LocalDist_WorkerExit();
+
 	VRAD_ComputeOtherLighting();
 
 	VRAD_Finish();
@@ -97,14 +97,18 @@ public:
 
 private:
 	// VMPI stuff.
-	static void VMPI_ProcessStaticProp_Static( int iThread, uint64 iStaticProp, MessageBuffer *pBuf );
-	static void VMPI_ReceiveStaticPropResults_Static( uint64 iStaticProp, MessageBuffer *pBuf, int iWorker );
-	void VMPI_ProcessStaticProp( int iThread, int iStaticProp, MessageBuffer *pBuf );
-	void VMPI_ReceiveStaticPropResults( int iStaticProp, MessageBuffer *pBuf, int iWorker );
+	static void VMPI_ProcessStaticProp_Static( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf );
+	static void VMPI_ReceiveStaticPropResults_Static( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker );
+	void VMPI_ProcessStaticProp( int iThread, int iGroup, MessageBuffer *pBuf );
+	void VMPI_ReceiveStaticPropResults( int iGroup, MessageBuffer *pBuf, int iWorker );
 	
 	// local thread version
 	static void ThreadComputeStaticPropLighting( int iThread, void *pUserData );
-	void ComputeLightingForProp( int iThread, int iStaticProp );
+	void ComputeLightingForInstanceGroup( int iThread, int iGroup );
+	void ApplyLightingToInstanceGroup( int iGroup, const CComputeStaticPropLightingResults *pResults );
+
+	// Sorts the props into groups that light the same
+	void GroupIdenticalInstances();
 
 	// Methods associated with unserializing static props
 	void UnserializeModelDict( CUtlBuffer& buf );
@@ -162,6 +166,13 @@ private:
 
 	bool m_bIgnoreStaticPropTrace;
 
+	// Props with the same model, transform and flags get the same lighting, so they're
+	// lit once per group, through the group's first prop. m_InstanceOrder has the props
+	// with each group together, m_InstanceGroupStart where each group starts in it plus
+	// a last entry for the end.
+	CUtlVector<int>	m_InstanceOrder;
+	CUtlVector<int>	m_InstanceGroupStart;
+
 	void ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults );
 	void ApplyLightingToStaticProp( CStaticProp &prop, const CComputeStaticPropLightingResults *pResults );
 
@@ -672,6 +683,31 @@ public:
 		return tex.pAlphaTexels[v * tex.width + u];
 	}
 
+	// SampleMaterial for the 4 lanes of a ray packet that hit the same triangle. Lanes not
+	// in hitMask come back 0.
+	fltx4 SampleMaterial4( int materialIndex, const fltx4 &b0, const fltx4 &b1, const fltx4 &b2, int hitMask )
+	{
+		const materialentry_t &mat = m_MaterialEntries[materialIndex];
+		const alphatexture_t &tex = m_Textures.Element(m_MaterialEntries[materialIndex].textureIndex);
+		fltx4 u4 = AddSIMD( AddSIMD( MulSIMD( b0, ReplicateX4( mat.uv[0].x ) ), MulSIMD( b1, ReplicateX4( mat.uv[1].x ) ) ), MulSIMD( b2, ReplicateX4( mat.uv[2].x ) ) );
+		fltx4 v4 = AddSIMD( AddSIMD( MulSIMD( b0, ReplicateX4( mat.uv[0].y ) ), MulSIMD( b1, ReplicateX4( mat.uv[1].y ) ) ), MulSIMD( b2, ReplicateX4( mat.uv[2].y ) ) );
+		u4 = MulSIMD( u4, ReplicateX4( tex.width ) );
+		v4 = MulSIMD( v4, ReplicateX4( tex.height ) );
+
+		fltx4 alpha = Four_Zeros;
+		for ( int s = 0; s < 4; s++ )
+		{
+			if ( ( hitMask >> s ) & 0x1 )
+			{
+				// always wrap, as above
+				int u = RoundFloatToInt( SubFloat( u4, s ) ) & (tex.width-1);
+				int v = RoundFloatToInt( SubFloat( v4, s ) ) & (tex.height-1);
+				SubFloat( alpha, s ) = tex.pAlphaTexels[v * tex.width + u];
+			}
+		}
+		return alpha;
+	}
+
 	struct alphatexture_t 
 	{
 		short width;
@@ -720,6 +756,12 @@ float ComputeCoverageFromTexture( float b0, float b1, float b2, int32 hitID )
 	return alphaScale * g_ShadowTextureList.SampleMaterial( g_RtEnv.GetTriangleMaterial(hitID), coords, false );
 }
 
+fltx4 ComputeCoverageFromTexture4( const fltx4 &b0, const fltx4 &b1, const fltx4 &b2, int hitMask, int32 hitID )
+{
+	fltx4 alpha = g_ShadowTextureList.SampleMaterial4( g_RtEnv.GetTriangleMaterial(hitID), b0, b1, b2, hitMask );
+	return MulSIMD( alpha, ReplicateX4( 1.0f / 255.0f ) );
+}
+
 // this is here to strip models/ or .mdl or whatnot
 void CleanModelName( const char *pModelName, char *pOutput, int outLen )
 {
@@ -965,17 +1007,37 @@ bool PositionInSolid( Vector &position )
 }
 
 //-----------------------------------------------------------------------------
-// Trace from a vertex to each direct light source, accumulating its contribution.
+// Trace from up to 4 vertexes to each direct light source, accumulating their
+// contributions. Each light traces all of them as one ray packet. Lanes past
+// nPoints repeat the last vertex and are thrown away.
 //-----------------------------------------------------------------------------
-void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
-								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+void ComputeDirectLightingAt4Points( const Vector *pPositions, const Vector *pNormals, int nPoints, Vector *pOutColors,
+									 int iThread, int static_prop_id_to_skip=-1, int nLFlags = 0 )
 {
 	SSE_sampleLightOutput_t	sampleOutput;
 
-	outColor.Init();
+	Assert( nPoints >= 1 && nPoints <= 4 );
+
+	Vector positions[4];
+	Vector normals[4];
+	int clusters[4];
+	for ( int i = 0; i < 4; i++ )
+	{
+		int nPoint = ( i < nPoints ) ? i : nPoints - 1;
+		positions[i] = pPositions[nPoint];
+		normals[i] = pNormals[nPoint];
+		clusters[i] = ( i < nPoints ) ? ClusterFromPoint( positions[i] ) : clusters[nPoints - 1];
+	}
+
+	for ( int i = 0; i < nPoints; i++ )
+	{
+		pOutColors[i].Init();
+	}
+
+	FourVectors normal4;
+	normal4.LoadAndSwizzle( normals[0], normals[1], normals[2], normals[3] );
 
 	// Iterate over all direct lights and accumulate their contribution
-	int cluster = ClusterFromPoint( position );
 	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
 	{
 		if ( dl->light.style )
@@ -985,46 +1047,70 @@ void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &out
 		}
 
 		// is this lights cluster visible?
-		if ( !PVSCheck( dl->pvs, cluster ) )
+		bool bVisible[4];
+		bool bAnyVisible = false;
+		for ( int i = 0; i < nPoints; i++ )
+		{
+			bVisible[i] = PVSCheck( dl->pvs, clusters[i] );
+			bAnyVisible = bAnyVisible || bVisible[i];
+		}
+		if ( !bAnyVisible )
 			continue;
 
-		// push the vertex towards the light to avoid surface acne
-		Vector adjusted_pos = position;
+		// push the vertexes towards the light to avoid surface acne
+		Vector adjusted_pos[4];
 		float flEpsilon = 0.0;
 
-		if  (dl->light.type != emit_skyambient)
+		for ( int i = 0; i < 4; i++ )
 		{
-			// push towards the light
-			Vector fudge;
-			if ( dl->light.type == emit_skylight )
-				fudge = -( dl->light.normal);
-			else
+			adjusted_pos[i] = positions[i];
+			if  (dl->light.type != emit_skyambient)
 			{
-				fudge = dl->light.origin-position;
-				VectorNormalize( fudge );
+				// push towards the light
+				Vector fudge;
+				if ( dl->light.type == emit_skylight )
+					fudge = -( dl->light.normal);
+				else
+				{
+					fudge = dl->light.origin-positions[i];
+					VectorNormalize( fudge );
+				}
+				fudge *= 4.0;
+				adjusted_pos[i] += fudge;
+			}
+			else 
+			{
+				// push out along normal
+				adjusted_pos[i] += 4.0 * normals[i];
+//				flEpsilon = 1.0;
 			}
-			fudge *= 4.0;
-			adjusted_pos += fudge;
-		}
-		else 
-		{
-			// push out along normal
-			adjusted_pos += 4.0 * normal;
-//			flEpsilon = 1.0;
 		}
 
 		FourVectors adjusted_pos4;
-		FourVectors normal4;
-		adjusted_pos4.DuplicateVector( adjusted_pos );
-		normal4.DuplicateVector( normal );
+		adjusted_pos4.LoadAndSwizzle( adjusted_pos[0], adjusted_pos[1], adjusted_pos[2], adjusted_pos[3] );
 
 		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
 		                      static_prop_id_to_skip, flEpsilon );
-		
-		VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
+
+		for ( int i = 0; i < nPoints; i++ )
+		{
+			if ( bVisible[i] )
+			{
+				VectorMA( pOutColors[i], SubFloat( sampleOutput.m_flFalloff, i ) * SubFloat( sampleOutput.m_flDot[0], i ), dl->light.intensity, pOutColors[i] );
+			}
+		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Trace from a vertex to each direct light source, accumulating its contribution.
+//-----------------------------------------------------------------------------
+void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
+								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+{
+	ComputeDirectLightingAt4Points( &position, &normal, 1, &outColor, iThread, static_prop_id_to_skip, nLFlags );
+}
+
 //-----------------------------------------------------------------------------
 // Takes the results from a ComputeLighting call and applies it to the static prop in question.
 //-----------------------------------------------------------------------------
@@ -1104,6 +1190,20 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 		return;
 
 	VMPI_SetCurrentStage( "ComputeLighting" );
+
+	// transforms into the world coordinate system
+	matrix3x4_t	matrix;
+	matrix3x4_t	normalMatrix;
+	AngleMatrix( prop.m_Angles, prop.m_Origin, matrix );
+	AngleMatrix( prop.m_Angles, normalMatrix );
+
+	int skip_prop = -1;
+	if ( g_bDisablePropSelfShadowing || ( prop.m_Flags & STATIC_PROP_NO_SELF_SHADOWING ) )
+	{
+		skip_prop = prop_index;
+	}
+
+	int nFlags = ( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS ) ? GATHERLFLAGS_IGNORE_NORMALS : 0;
 	
 	for ( int bodyID = 0; bodyID < pStudioHdr->numbodyparts; ++bodyID )
 	{
@@ -1121,6 +1221,12 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 			colorVerts.EnsureCount( pStudioModel->numvertices );
 			memset( colorVerts.Base(), 0, colorVerts.Count() * sizeof(colorVertex_t) );
 
+			CUtlVector<Vector> samplePositions;
+			CUtlVector<Vector> sampleNormals;
+			CUtlVector<int> litVerts;
+			samplePositions.EnsureCount( pStudioModel->numvertices );
+			sampleNormals.EnsureCount( pStudioModel->numvertices );
+
 			int numVertexes = 0;
 			for ( int meshID = 0; meshID < pStudioModel->nummeshes; ++meshID )
 			{
@@ -1129,14 +1235,11 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 				Assert( vertData ); // This can only return NULL on X360 for now
 				for ( int vertexID = 0; vertexID < pStudioMesh->numvertices; ++vertexID )
 				{
-					Vector sampleNormal;
-					Vector samplePosition;
 					// transform position and normal into world coordinate system
-					matrix3x4_t	matrix;
-					AngleMatrix( prop.m_Angles, prop.m_Origin, matrix );
+					Vector &samplePosition = samplePositions[numVertexes];
+					Vector &sampleNormal = sampleNormals[numVertexes];
 					VectorTransform( *vertData->Position( vertexID ), matrix, samplePosition );
-					AngleMatrix( prop.m_Angles, matrix );
-					VectorTransform( *vertData->Normal( vertexID ), matrix, sampleNormal );
+					VectorTransform( *vertData->Normal( vertexID ), normalMatrix, sampleNormal );
 
 					if ( PositionInSolid( samplePosition ) )
 					{
@@ -1149,42 +1252,54 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 					}
 					else
 					{
-						Vector direct_pos=samplePosition;
-						int skip_prop = -1;
-						if ( g_bDisablePropSelfShadowing || ( prop.m_Flags & STATIC_PROP_NO_SELF_SHADOWING ) )
-						{
-							skip_prop = prop_index;
-						}
-							
-						int nFlags = ( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS ) ? GATHERLFLAGS_IGNORE_NORMALS : 0;
+						litVerts.AddToTail( numVertexes );
+					}
+					
+					numVertexes++;
+				}
+			}
 
-						Vector directColor(0,0,0);
-						ComputeDirectLightingAtPoint( direct_pos,
-													  sampleNormal, directColor, iThread,
-													  skip_prop, nFlags );
-						Vector indirectColor(0,0,0);
+			// light the good vertexes 4 at a time, neighbors in the mesh make coherent ray packets
+			for ( int nLitVertex = 0; nLitVertex < litVerts.Count(); nLitVertex += 4 )
+			{
+				Vector positions[4];
+				Vector normals[4];
+				Vector directColors[4];
+				int nPoints = MIN( 4, litVerts.Count() - nLitVertex );
+				for ( int i = 0; i < nPoints; i++ )
+				{
+					positions[i] = samplePositions[litVerts[nLitVertex + i]];
+					normals[i] = sampleNormals[litVerts[nLitVertex + i]];
+				}
 
-						if (g_bShowStaticPropNormals)
-						{
-							directColor= sampleNormal;
-							directColor += Vector(1.0,1.0,1.0);
-							directColor *= 50.0;
-						}
-						else
-						{
-							if (numbounce >= 1)
-								ComputeIndirectLightingAtPoint( 
-									samplePosition, sampleNormal, 
-									indirectColor, iThread, true,
-									( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
-						}
-						
-						colorVerts[numVertexes].m_bValid = true;
-						colorVerts[numVertexes].m_Position = samplePosition;
-						VectorAdd( directColor, indirectColor, colorVerts[numVertexes].m_Color );
+				ComputeDirectLightingAt4Points( positions, normals, nPoints, directColors, iThread, skip_prop, nFlags );
+
+				for ( int i = 0; i < nPoints; i++ )
+				{
+					int nVertex = litVerts[nLitVertex + i];
+					Vector &samplePosition = samplePositions[nVertex];
+					Vector &sampleNormal = sampleNormals[nVertex];
+					Vector &directColor = directColors[i];
+					Vector indirectColor(0,0,0);
+
+					if (g_bShowStaticPropNormals)
+					{
+						directColor= sampleNormal;
+						directColor += Vector(1.0,1.0,1.0);
+						directColor *= 50.0;
+					}
+					else
+					{
+						if (numbounce >= 1)
+							ComputeIndirectLightingAtPoint( 
+								samplePosition, sampleNormal, 
+								indirectColor, iThread, true,
+								( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
 					}
 					
-					numVertexes++;
+					colorVerts[nVertex].m_bValid = true;
+					colorVerts[nVertex].m_Position = samplePosition;
+					VectorAdd( directColor, indirectColor, colorVerts[nVertex].m_Color );
 				}
 			}
 			
@@ -1373,9 +1488,10 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults_Static( uint64 iStaticPro
 // Called on workers to do the computation for a static prop and send
 // it to the master.
 //-----------------------------------------------------------------------------
-void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iStaticProp, MessageBuffer *pBuf )
+void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iGroup, MessageBuffer *pBuf )
 {
 	// Compute the lighting.
+	int iStaticProp = m_InstanceOrder[m_InstanceGroupStart[iGroup]];
 	CComputeStaticPropLightingResults results;
 	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
 
@@ -1397,7 +1513,7 @@ void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iStaticProp, M
 //-----------------------------------------------------------------------------
 // Called on the master when a worker finishes processing a static prop.
 //-----------------------------------------------------------------------------
-void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, MessageBuffer *pBuf, int iWorker )
+void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iGroup, MessageBuffer *pBuf, int iWorker )
 {
 	// Read in the results.
 	CComputeStaticPropLightingResults results;
@@ -1417,16 +1533,87 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, Message
 	}
 	
 	// Apply the results.
-	ApplyLightingToStaticProp( m_StaticProps[iStaticProp], &results );
+	ApplyLightingToInstanceGroup( iGroup, &results );
 }
 
 
-void CVradStaticPropMgr::ComputeLightingForProp( int iThread, int iStaticProp )
+void CVradStaticPropMgr::ApplyLightingToInstanceGroup( int iGroup, const CComputeStaticPropLightingResults *pResults )
+{
+	for ( int i = m_InstanceGroupStart[iGroup]; i < m_InstanceGroupStart[iGroup+1]; i++ )
+	{
+		ApplyLightingToStaticProp( m_StaticProps[m_InstanceOrder[i]], pResults );
+	}
+}
+
+void CVradStaticPropMgr::ComputeLightingForInstanceGroup( int iThread, int iGroup )
 {
 	// Compute the lighting.
+	int iStaticProp = m_InstanceOrder[m_InstanceGroupStart[iGroup]];
 	CComputeStaticPropLightingResults results;
 	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
-	ApplyLightingToStaticProp( m_StaticProps[iStaticProp], &results );
+	ApplyLightingToInstanceGroup( iGroup, &results );
+}
+
+//-----------------------------------------------------------------------------
+// Everything about a prop its lighting depends on. Compared as bytes: props
+// that only match up to -0 or the like just get lit separately.
+//-----------------------------------------------------------------------------
+struct PropInstanceKey_t
+{
+	int		m_ModelIdx;
+	int		m_Flags;
+	Vector	m_Origin;
+	QAngle	m_Angles;
+	Vector	m_LightingOrigin;		// zero if not valid
+	int		m_bLightingOriginValid;
+	int		m_nProp;				// not part of the key, sorts each group by prop
+};
+
+static int ComparePropInstanceKeys( const void *p1, const void *p2 )
+{
+	const PropInstanceKey_t *pKey1 = (const PropInstanceKey_t *)p1;
+	const PropInstanceKey_t *pKey2 = (const PropInstanceKey_t *)p2;
+	int nCompare = memcmp( pKey1, pKey2, offsetof( PropInstanceKey_t, m_nProp ) );
+	if ( nCompare )
+		return nCompare;
+	return pKey1->m_nProp - pKey2->m_nProp;
+}
+
+void CVradStaticPropMgr::GroupIdenticalInstances()
+{
+	int count = m_StaticProps.Count();
+
+	CUtlVector<PropInstanceKey_t> keys;
+	keys.SetCount( count );
+	memset( keys.Base(), 0, count * sizeof( PropInstanceKey_t ) );
+	for ( int i = 0; i < count; i++ )
+	{
+		const CStaticProp &prop = m_StaticProps[i];
+		PropInstanceKey_t &key = keys[i];
+		key.m_ModelIdx = prop.m_ModelIdx;
+		key.m_Flags = prop.m_Flags;
+		key.m_Origin = prop.m_Origin;
+		key.m_Angles = prop.m_Angles;
+		if ( prop.m_bLightingOriginValid )
+		{
+			key.m_LightingOrigin = prop.m_LightingOrigin;
+			key.m_bLightingOriginValid = 1;
+		}
+		key.m_nProp = i;
+	}
+	qsort( keys.Base(), count, sizeof( PropInstanceKey_t ), ComparePropInstanceKeys );
+
+	m_InstanceOrder.SetCount( count );
+	m_InstanceGroupStart.RemoveAll();
+	for ( int i = 0; i < count; i++ )
+	{
+		if ( !i || memcmp( &keys[i-1], &keys[i], offsetof( PropInstanceKey_t, m_nProp ) ) )
+		{
+			m_InstanceGroupStart.AddToTail( i );
+		}
+		m_InstanceOrder[i] = keys[i].m_nProp;
+	}
+	m_InstanceGroupStart.AddToTail( count );
 }
 
 void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUserData )
@@ -1436,8 +1623,7 @@ void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUs
 		int j = GetThreadWork ();
 		if (j == -1)
 			break;
-		CComputeStaticPropLightingResults results;
-		g_StaticPropMgr.ComputeLightingForProp( iThread, j );
+		g_StaticPropMgr.ComputeLightingForInstanceGroup( iThread, j );
 	}
 }
 
@@ -1455,6 +1641,14 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 		return;
 	}
 
+	// identical props are lit once
+	GroupIdenticalInstances();
+	int nGroups = m_InstanceGroupStart.Count() - 1;
+	if ( nGroups != count )
+	{
+		qprintf( "%d static props, %d lit (the rest are identical to one of those)\n", count, nGroups );
+	}
+
 	StartPacifier( "Computing static prop lighting : " );
 
 	// ensure any traces against us are ignored because we have no inherit lighting contribution
@@ -1466,14 +1660,14 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 		VMPI_SetCurrentStage( "CVradStaticPropMgr::ComputeLighting" );
 		
 		DistributeWork( 
-			count, 
+			nGroups, 
 			VMPI_DISTRIBUTEWORK_PACKETID,
 			&CVradStaticPropMgr::VMPI_ProcessStaticProp_Static, 
 			&CVradStaticPropMgr::VMPI_ReceiveStaticPropResults_Static );
 	}
 	else
 	{
-		RunThreadsOn(count, true, ThreadComputeStaticPropLighting);
+		RunThreadsOn(nGroups, true, ThreadComputeStaticPropLighting);
 	}
 
 	// restore default
@@ -7,6 +7,8 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#include <emmintrin.h>
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -29,19 +31,92 @@ int g_TraceClusterStop = -1;
   void CalcMightSee (leaf_t *leaf, 
 */
 
+static inline int CountBits32 (unsigned int v)
+{
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
 int CountBits (byte *bits, int numbits)
 {
 	int		i;
 	int		c;
+	int		numwords;
 
 	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	numwords = numbits >> 5;
+	for (i=0 ; i<numwords ; i++)
+		c += CountBits32 (((unsigned int *)bits)[i]);
+	for (i=numwords<<5 ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
 	return c;
 }
 
+/*
+==============
+MightSeeFlow
+
+might = prevmight & test, for portalbytes bytes.
+Returns true if might has any bit that isn't set in vis yet.
+==============
+*/
+static inline bool MightSeeFlow (const byte *prevmight, const byte *test, const byte *vis, byte *might)
+{
+	int		i;
+	int		numvecs;
+
+	// portalbytes is only a multiple of 8, so finish 8 bytes at a time
+	numvecs = portalbytes >> 4;
+
+	__m128i more = _mm_setzero_si128();
+	for (i=0 ; i<numvecs ; i++)
+	{
+		__m128i m = _mm_and_si128( _mm_loadu_si128( (const __m128i *)prevmight + i ), _mm_loadu_si128( (const __m128i *)test + i ) );
+		_mm_storeu_si128( (__m128i *)might + i, m );
+		more = _mm_or_si128( more, _mm_andnot_si128( _mm_loadu_si128( (const __m128i *)vis + i ), m ) );
+	}
+
+	int64 tail = 0;
+	for (i=numvecs*2 ; i<portalbytes/8 ; i++)
+	{
+		((int64 *)might)[i] = ((const int64 *)prevmight)[i] & ((const int64 *)test)[i];
+		tail |= ((int64 *)might)[i] & ~((const int64 *)vis)[i];
+	}
+
+	return tail != 0 || _mm_movemask_epi8( _mm_cmpeq_epi8( more, _mm_setzero_si128() ) ) != 0xFFFF;
+}
+
+/*
+==============
+EstimatePortalFlowCost
+
+RecursiveLeafFlow can go through every portal in the flood, and from each of
+them through everything that one might see, so the sum of those is a much
+better guess at how long PortalFlow will take than nummightsee alone.
+==============
+*/
+int64 EstimatePortalFlowCost (portal_t *p)
+{
+	int		i, j;
+	int64	cost;
+
+	cost = p->nummightsee;
+	for (i=0 ; i<portalbytes/4 ; i++)
+	{
+		unsigned int bits = ((unsigned int *)p->portalflood)[i];
+		for (j=0 ; bits ; j++, bits >>= 1)
+		{
+			if (bits & 1)
+				cost += portals[i*32+j].nummightsee;
+		}
+	}
+
+	return cost;
+}
+
 int		c_fullskip;
 int		c_portalskip, c_leafskip;
 int		c_vistest, c_mighttest;
@@ -218,6 +293,117 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 #pragma warning (default:4701)
 #endif
 
+/*
+==============
+SeperatingPlane
+
+Tries the plane through edge i of source and vertex j of pass. Returns false if
+it doesn't seperate the two.
+==============
+*/
+static bool SeperatingPlane (winding_t *source, winding_t *pass, int i, int j, bool flipclip, plane_t &plane)
+{
+	int			k, l;
+	Vector		v1, v2;
+	float		d;
+	vec_t		length;
+	int			counts[3];
+	bool		fliptest;
+
+	l = (i+1)%source->numpoints;
+	VectorSubtract (source->points[l] , source->points[i], v1);
+	VectorSubtract (pass->points[j], source->points[i], v2);
+
+	plane.normal[0] = v1[1]*v2[2] - v1[2]*v2[1];
+	plane.normal[1] = v1[2]*v2[0] - v1[0]*v2[2];
+	plane.normal[2] = v1[0]*v2[1] - v1[1]*v2[0];
+	
+// if points don't make a valid plane, skip it
+
+	length = plane.normal[0] * plane.normal[0]
+	+ plane.normal[1] * plane.normal[1]
+	+ plane.normal[2] * plane.normal[2];
+	
+	if (length < ON_VIS_EPSILON)
+		return false;
+
+	length = 1/sqrt(length);
+	
+	plane.normal[0] *= length;
+	plane.normal[1] *= length;
+	plane.normal[2] *= length;
+
+	plane.dist = DotProduct (pass->points[j], plane.normal);
+
+//
+// find out which side of the generated seperating plane has the
+// source portal
+//
+	fliptest = false;
+	for (k=0 ; k<source->numpoints ; k++)
+	{
+		if (k == i || k == l)
+			continue;
+		d = DotProduct (source->points[k], plane.normal) - plane.dist;
+		if (d < -ON_VIS_EPSILON)
+		{	// source is on the negative side, so we want all
+			// pass and target on the positive side
+			fliptest = false;
+			break;
+		}
+		else if (d > ON_VIS_EPSILON)
+		{	// source is on the positive side, so we want all
+			// pass and target on the negative side
+			fliptest = true;
+			break;
+		}
+	}
+	if (k == source->numpoints)
+		return false;		// planar with source portal
+//
+// flip the normal if the source portal is backwards
+//
+	if (fliptest)
+	{
+		VectorSubtract (vec3_origin, plane.normal, plane.normal);
+		plane.dist = -plane.dist;
+	}
+
+//
+// if all of the pass portal points are now on the positive side,
+// this is the seperating plane
+//
+	counts[0] = counts[1] = counts[2] = 0;
+	for (k=0 ; k<pass->numpoints ; k++)
+	{
+		if (k==j)
+			continue;
+		d = DotProduct (pass->points[k], plane.normal) - plane.dist;
+		if (d < -ON_VIS_EPSILON)
+			break;
+		else if (d > ON_VIS_EPSILON)
+			counts[0]++;
+		else
+			counts[2]++;
+	}
+	if (k != pass->numpoints)
+		return false;	// points on negative side, not a seperating plane
+		
+	if (!counts[0])
+		return false;	// planar with seperating plane
+
+//
+// flip the normal if we want the back side
+//
+	if (flipclip)
+	{
+		VectorSubtract (vec3_origin, plane.normal, plane.normal);
+		plane.dist = -plane.dist;
+	}
+
+	return true;
+}
+
 /*
 ==============
 ClipToSeperators
@@ -236,126 +422,19 @@ flipclip should be set.
 */
 winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
 {
-	int			i, j, k, l;
+	int			i, j;
 	plane_t		plane;
-	Vector		v1, v2;
-	float		d;
-	vec_t		length;
-	int			counts[3];
-	bool		fliptest;
 
 // check all combinations	
 	for (i=0 ; i<source->numpoints ; i++)
 	{
-		l = (i+1)%source->numpoints;
-		VectorSubtract (source->points[l] , source->points[i], v1);
-
 	// fing a vertex of pass that makes a plane that puts all of the
 	// vertexes of pass on the front side and all of the vertexes of
 	// source on the back side
 		for (j=0 ; j<pass->numpoints ; j++)
 		{
-			VectorSubtract (pass->points[j], source->points[i], v2);
-
-			plane.normal[0] = v1[1]*v2[2] - v1[2]*v2[1];
-			plane.normal[1] = v1[2]*v2[0] - v1[0]*v2[2];
-			plane.normal[2] = v1[0]*v2[1] - v1[1]*v2[0];
-			
-		// if points don't make a valid plane, skip it
-
-			length = plane.normal[0] * plane.normal[0]
-			+ plane.normal[1] * plane.normal[1]
-			+ plane.normal[2] * plane.normal[2];
-			
-			if (length < ON_VIS_EPSILON)
-				continue;
-
-			length = 1/sqrt(length);
-			
-			plane.normal[0] *= length;
-			plane.normal[1] *= length;
-			plane.normal[2] *= length;
-
-			plane.dist = DotProduct (pass->points[j], plane.normal);
-
-		//
-		// find out which side of the generated seperating plane has the
-		// source portal
-		//
-#if 1
-			fliptest = false;
-			for (k=0 ; k<source->numpoints ; k++)
-			{
-				if (k == i || k == l)
-					continue;
-				d = DotProduct (source->points[k], plane.normal) - plane.dist;
-				if (d < -ON_VIS_EPSILON)
-				{	// source is on the negative side, so we want all
-					// pass and target on the positive side
-					fliptest = false;
-					break;
-				}
-				else if (d > ON_VIS_EPSILON)
-				{	// source is on the positive side, so we want all
-					// pass and target on the negative side
-					fliptest = true;
-					break;
-				}
-			}
-			if (k == source->numpoints)
-				continue;		// planar with source portal
-#else
-			fliptest = flipclip;
-#endif
-		//
-		// flip the normal if the source portal is backwards
-		//
-			if (fliptest)
-			{
-				VectorSubtract (vec3_origin, plane.normal, plane.normal);
-				plane.dist = -plane.dist;
-			}
-#if 1
-		//
-		// if all of the pass portal points are now on the positive side,
-		// this is the seperating plane
-		//
-			counts[0] = counts[1] = counts[2] = 0;
-			for (k=0 ; k<pass->numpoints ; k++)
-			{
-				if (k==j)
-					continue;
-				d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-				if (d < -ON_VIS_EPSILON)
-					break;
-				else if (d > ON_VIS_EPSILON)
-					counts[0]++;
-				else
-					counts[2]++;
-			}
-			if (k != pass->numpoints)
-				continue;	// points on negative side, not a seperating plane
-				
-			if (!counts[0])
-				continue;	// planar with seperating plane
-#else
-			k = (j+1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-			if (d < -ON_VIS_EPSILON)
+			if (!SeperatingPlane (source, pass, i, j, flipclip, plane))
 				continue;
-			k = (j+pass->numpoints-1)%pass->numpoints;
-			d = DotProduct (pass->points[k], plane.normal) - plane.dist;
-			if (d < -ON_VIS_EPSILON)
-				continue;			
-#endif
-		//
-		// flip the normal if we want the back side
-		//
-			if (flipclip)
-			{
-				VectorSubtract (vec3_origin, plane.normal, plane.normal);
-				plane.dist = -plane.dist;
-			}
 			
 		//
 		// clip target by the seperating plane
@@ -373,6 +452,105 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 }
 
 
+/*
+==============
+Seperator cache
+
+While the source and pass windings are still the unchopped portal windings,
+the seperating planes between them only depend on which portal is the pass,
+so each thread keeps the ones it found for its current base portal. The
+planes are applied in the order ClipToSeperators finds them, so the clipped
+windings come out exactly the same.
+==============
+*/
+struct sepcacheentry_t
+{
+	int			generation;
+	int			first[2];	// [flipclip]
+	int			count[2];
+};
+
+struct sepcache_t
+{
+	int							generation;
+	CUtlVector<sepcacheentry_t>	entries;	// [g_numportals*2]
+	CUtlVector<plane_t>			planes;
+};
+
+static sepcache_t	*g_pSepCaches[MAX_TOOL_THREADS+1];
+
+static sepcache_t *BeginSeperatorCache (int iThread)
+{
+	sepcache_t	*cache;
+
+	if (iThread < 0 || iThread > MAX_TOOL_THREADS)
+		return NULL;
+
+	cache = g_pSepCaches[iThread];
+	if (!cache)
+	{
+		cache = new sepcache_t;
+		cache->generation = 0;
+		g_pSepCaches[iThread] = cache;
+	}
+
+	if (cache->entries.Count() != g_numportals*2)
+	{
+		cache->entries.SetCount (g_numportals*2);
+		memset (cache->entries.Base(), 0, cache->entries.Count() * sizeof(sepcacheentry_t));
+		cache->generation = 0;
+	}
+
+	cache->generation++;
+	cache->planes.RemoveAll();
+	return cache;
+}
+
+/*
+==============
+ClipToCachedSeperators
+
+Same as ClipToSeperators for the unchopped windings of the base portal and
+portal passnum.
+==============
+*/
+static winding_t *ClipToCachedSeperators (sepcache_t *cache, int passnum, winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
+{
+	int					i, j;
+	plane_t				plane;
+	sepcacheentry_t		&entry = cache->entries[passnum];
+
+	if (entry.generation != cache->generation)
+	{
+		entry.generation = cache->generation;
+		entry.count[0] = entry.count[1] = -1;
+	}
+
+	if (entry.count[flipclip] < 0)
+	{
+		entry.first[flipclip] = cache->planes.Count();
+		for (i=0 ; i<source->numpoints ; i++)
+		{
+			for (j=0 ; j<pass->numpoints ; j++)
+			{
+				if (SeperatingPlane (source, pass, i, j, flipclip, plane))
+					cache->planes.AddToTail (plane);
+			}
+		}
+		entry.count[flipclip] = cache->planes.Count() - entry.first[flipclip];
+	}
+
+	for (i=0 ; i<entry.count[flipclip] ; i++)
+	{
+		target = ChopWinding (target, stack, &cache->planes[entry.first[flipclip] + i]);
+		if (!target)
+			return NULL;		// target is not visible
+	}
+
+	return target;
+}
+
+
 class CPortalTrace
 {
 public:
@@ -481,8 +659,9 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
+	bool		more;
 	int			pnum;
 
 	// Early-out if we're a VMPI worker that's told to exit. If we don't do this here, then the
@@ -506,9 +685,6 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.leaf = leaf;
 	stack.portal = NULL;
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
-	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
 	{
@@ -524,19 +700,14 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
+		more = MightSeeFlow (prevstack->mightsee, test, thread->base->portalvis, stack.mightsee);
 		
 		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
@@ -600,13 +771,28 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			continue;
 		}
 
-		stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, &stack);
-		if (!stack.pass)
-			continue;
-		
-		stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, &stack);
-		if (!stack.pass)
-			continue;
+		if (thread->sepcache && stack.source == thread->base->winding && prevstack->pass == prevstack->portal->winding)
+		{
+			int passnum = prevstack->portal - portals;
+
+			stack.pass = ClipToCachedSeperators (thread->sepcache, passnum, stack.source, prevstack->pass, stack.pass, false, &stack);
+			if (!stack.pass)
+				continue;
+
+			stack.pass = ClipToCachedSeperators (thread->sepcache, passnum, prevstack->pass, stack.source, stack.pass, true, &stack);
+			if (!stack.pass)
+				continue;
+		}
+		else
+		{
+			stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, &stack);
+			if (!stack.pass)
+				continue;
+			
+			stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, &stack);
+			if (!stack.pass)
+				continue;
+		}
 
 		// mark the portal as visible
 		SetBit( thread->base->portalvis, pnum );
@@ -638,6 +824,7 @@ void PortalFlow (int iThread, int portalnum)
 
 	memset (&data, 0, sizeof(data));
 	data.base = p;
+	data.sepcache = BeginSeperatorCache (iThread);
 	
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
@@ -825,8 +1012,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
 	byte		newmight[MAX_PORTALS/8];
 
@@ -843,15 +1029,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if (!MightSeeFlow (mightsee, p->portalflood, cansee, newmight))
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
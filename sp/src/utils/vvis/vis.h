@@ -56,6 +56,7 @@ struct portal_t
 	byte		*portalvis;		// [portals], final
 
 	int			nummightsee;	// bit count on portalflood for sort
+	int64		estimatedcost;	// sum of nummightsee over portalflood, for sort
 };
 
 struct leaf_t
@@ -79,11 +80,14 @@ struct pstack_t
 	plane_t		portalplane;
 };
 
+struct sepcache_t;
+
 struct threaddata_t
 {
 	portal_t	*base;
 	int			c_chains;
 	pstack_t	pstack_head;
+	sepcache_t	*sepcache;	// seperating planes from base to the unchopped pass portals
 };
 
 extern	int			g_numportals;
@@ -119,6 +123,7 @@ extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
 extern int g_TraceClusterStart, g_TraceClusterStop;
 
 int CountBits (byte *bits, int numbits);
+int64 EstimatePortalFlowCost (portal_t *p);
 
 #define CheckBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] & ( 1 << ( (bitNumber) & 7 ) ) )
 #define SetBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] |= ( 1 << ( (bitNumber) & 7 ) ) )